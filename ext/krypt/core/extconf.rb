@@ -70,10 +70,40 @@ have_header("ruby/io.h")
 have_func("rb_big_pack")
 have_func("rb_enumeratorize")
 have_func("rb_str_encode")
+have_header("ruby/fiber/scheduler.h")
+have_func("rb_io_wait", "ruby/io.h")
+have_func("rb_io_descriptor", "ruby/io.h")
+have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
 
 message "=== Checking platform features ===\n"
 
 have_func("gmtime_r")
+have_header("sys/uio.h")
+have_func("writev", "sys/uio.h")
+have_header("unistd.h")
+
+message "=== Checking threading support ===\n"
+
+if have_header("pthread.h") && have_header("ruby/thread.h")
+  have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+end
+
+message "=== Checking SIMD support ===\n"
+
+if have_header("cpuid.h") && have_header("immintrin.h")
+  checking_for("function attribute target") do
+    if try_compile(<<-SRC)
+#include <immintrin.h>
+__attribute__((target("avx2"))) int f(void) { return _mm256_movemask_epi8(_mm256_setzero_si256()); }
+int main(void) { return 0; }
+    SRC
+      $defs << "-DHAVE_FUNC_ATTRIBUTE_TARGET"
+      true
+    else
+      false
+    end
+  end
+end
 
 create_header
 create_makefile("kryptcore")
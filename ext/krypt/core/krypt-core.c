@@ -102,6 +102,8 @@ Init_kryptcore(void)
     sKrypt_ID_SORT_BANG = rb_intern("sort!");
     sKrypt_ID_SORT = rb_intern("sort");
 
+    krypt_cpu_detect();
+
     /* Init components */
     Init_krypt_helper();
     Init_krypt_io();
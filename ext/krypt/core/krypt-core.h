@@ -63,6 +63,8 @@ extern ID sKrypt_ID_SORT;
 /** krypt-core headers **/
 #include "krypt_error.h"
 #include "krypt_missing.h"
+#include "krypt_cpu.h"
+#include "krypt_thread.h"
 #include "krypt_io.h"
 #include "krypt_asn1.h"
 #include "krypt_asn1_template.h"
@@ -304,6 +304,7 @@ krypt_asn1_object_new(krypt_asn1_header *header)
     obj->header = header;
     obj->bytes = NULL;
     obj->bytes_len = 0;
+    obj->bytes_shared = 0;
 
     return obj;
 }
@@ -311,7 +312,7 @@ krypt_asn1_object_new(krypt_asn1_header *header)
 
 /**
  * Frees a krypt_asn1_object by freeing the header and the
- * value bytes if present.
+ * value bytes if present and not shared.
  *
  * @param object	The krypt_asn1_object to be freed
  */
@@ -321,7 +322,7 @@ krypt_asn1_object_free(krypt_asn1_object *object)
     if (!object) return;
 
     krypt_asn1_header_free(object->header);
-    if (object->bytes)
+    if (object->bytes && !object->bytes_shared)
 	xfree(object->bytes);
     xfree(object);
 }
@@ -385,6 +386,139 @@ error:
     return KRYPT_ERR;
 }
 
+/*
+ * Determines the header and value length of the encoding at +p+, of which
+ * +avail+ bytes are available. Indefinite lengths are rejected. If +der+
+ * is set, tags and lengths that are not encoded in the minimal number of
+ * octets are rejected as well.
+ */
+static int
+int_check_der_header(const uint8_t *p, size_t avail, size_t *hlen, size_t *vlen, int *constructed, int der)
+{
+    krypt_asn1_header header;
+    size_t i;
+
+    if (krypt_asn1_header_peek(p, avail, &header) == KRYPT_ERR) return KRYPT_ERR;
+    if (header.is_infinite) return KRYPT_ERR;
+    i = header.tag_len + header.length_len;
+    if (header.length > avail - i) return KRYPT_ERR;
+
+    if (der) {
+	/* high tag numbers only for tags that do not fit in the first octet */
+	if (header.tag_len == 2 && header.tag < 31) return KRYPT_ERR;
+	/* the long form only for lengths that do not fit the short one, without leading zeros */
+	if (header.length_len > 1 &&
+	    (header.length_bytes[1] == 0 || header.length < INFINITE_LENGTH_MASK))
+	    return KRYPT_ERR;
+    }
+
+    *constructed = header.is_constructed;
+    *hlen = i;
+    *vlen = header.length;
+    return KRYPT_OK;
+}
+
+/*
+ * Determines the header and value length of the value at +bytes+ without
+ * allocating anything. Fails for indefinite lengths and for values that
+ * exceed the +avail+ bytes.
+ */
+int
+krypt_asn1_value_bounds(const uint8_t *bytes, size_t avail, size_t *header_len, size_t *value_len)
+{
+    int constructed;
+    return int_check_der_header(bytes, avail, header_len, value_len, &constructed, 0);
+}
+
+/*
+ * Decodes the header at +bytes+ into +out+ without allocating anything,
+ * its tag and length bytes point into +bytes+. Indefinite lengths are
+ * accepted and definite lengths are not checked against +avail+.
+ */
+int
+krypt_asn1_header_peek(const uint8_t *bytes, size_t avail, krypt_asn1_header *out)
+{
+    size_t i = 1, n, len = 0;
+    int tag = 0;
+    uint8_t b;
+
+    if (avail < 2) return KRYPT_ERR;
+    b = bytes[0];
+    out->is_constructed = (b & CONSTRUCTED_MASK) == CONSTRUCTED_MASK;
+    out->tag_class = b & TAG_CLASS_PRIVATE;
+    out->tag = b & COMPLEX_TAG_MASK;
+
+    if (out->tag == COMPLEX_TAG_MASK) {
+	if (bytes[i] == INFINITE_LENGTH_MASK) return KRYPT_ERR;
+	do {
+	    if (i >= avail || tag > KRYPT_ASN1_TAG_LIMIT) return KRYPT_ERR;
+	    b = bytes[i++];
+	    tag = (tag << CHAR_BIT_MINUS_ONE) | (b & 0x7f);
+	} while ((b & INFINITE_LENGTH_MASK) == INFINITE_LENGTH_MASK);
+	out->tag = tag;
+    }
+    out->tag_bytes = (uint8_t *) bytes;
+    out->tag_len = i;
+
+    if (i >= avail) return KRYPT_ERR;
+    b = bytes[i++];
+    out->is_infinite = b == INFINITE_LENGTH_MASK;
+    if (b == 0xff) return KRYPT_ERR;
+    if (!out->is_infinite && (b & INFINITE_LENGTH_MASK) == INFINITE_LENGTH_MASK) {
+	n = b & 0x7f;
+	if (n > sizeof(size_t) || n > avail - i) return KRYPT_ERR;
+	while (n-- > 0)
+	    len = (len << CHAR_BIT) | bytes[i++];
+    }
+    else if (!out->is_infinite) {
+	len = b;
+    }
+    out->length = len;
+    out->length_bytes = (uint8_t *) bytes + out->tag_len;
+    out->length_len = i - out->tag_len;
+    return KRYPT_OK;
+}
+
+/*
+ * Checks that +bytes+ hold exactly one value with minimally encoded,
+ * definite lengths that nest consistently, descending into constructed values up to
+ * KRYPT_ASN1_DEPTH_LIMIT levels deep. The contents of primitive values
+ * are not inspected. Nothing is allocated and no errors are added, so
+ * this may be called without holding the GVL.
+ */
+int
+krypt_asn1_check_der(const uint8_t *bytes, size_t len)
+{
+    size_t ends[KRYPT_ASN1_DEPTH_LIMIT];
+    size_t off = 0, hlen, vlen;
+    int depth = 0, constructed;
+
+    if (int_check_der_header(bytes, len, &hlen, &vlen, &constructed, 1) == KRYPT_ERR)
+	return KRYPT_ERR;
+    if (hlen + vlen != len) return KRYPT_ERR;
+    if (!constructed) return KRYPT_OK;
+
+    ends[0] = len;
+    off = hlen;
+    while (1) {
+	if (off == ends[depth]) {
+	    if (depth == 0) return KRYPT_OK;
+	    depth--;
+	    continue;
+	}
+	if (int_check_der_header(bytes + off, ends[depth] - off, &hlen, &vlen, &constructed, 1) == KRYPT_ERR)
+	    return KRYPT_ERR;
+	if (constructed) {
+	    if (depth + 1 == KRYPT_ASN1_DEPTH_LIMIT) return KRYPT_ERR;
+	    ends[++depth] = off + hlen + vlen;
+	    off += hlen;
+	}
+	else {
+	    off += hlen + vlen;
+	}
+    }
+}
+
 static int
 int_parse_tag(uint8_t b, binyo_instream *in, krypt_asn1_header *out)
 {
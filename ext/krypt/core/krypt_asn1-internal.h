@@ -35,6 +35,8 @@
 #define COMPLEX_TAG_MASK     0x1f
 #define INFINITE_LENGTH_MASK 0x80
 
+#define KRYPT_ASN1_DEPTH_LIMIT 64
+
 #define TAG_CLASS_UNIVERSAL  	   0x00
 #define TAG_CLASS_APPLICATION 	   0x40
 #define TAG_CLASS_CONTEXT_SPECIFIC 0x80
@@ -80,6 +82,7 @@ typedef struct krypt_asn1_object_st {
     krypt_asn1_header *header;
     uint8_t *bytes;
     size_t bytes_len;
+    int bytes_shared; /* bytes point into a buffer owned elsewhere */
 } krypt_asn1_object;
 
 typedef int (*krypt_asn1_decoder)(VALUE self, uint8_t *bytes, size_t len, VALUE *out);
@@ -110,6 +113,13 @@ binyo_instream *krypt_asn1_get_value_stream(binyo_instream *in, krypt_asn1_heade
 
 int krypt_asn1_header_encode(binyo_outstream *out, krypt_asn1_header *header);
 int krypt_asn1_object_encode(binyo_outstream *out, krypt_asn1_object *object);
+int krypt_asn1_data_encode(binyo_outstream *out, VALUE data);
+
+int krypt_asn1_ber_to_der(binyo_instream *in, binyo_outstream *out, size_t max_memory);
+
+int krypt_asn1_check_der(const uint8_t *bytes, size_t len);
+int krypt_asn1_value_bounds(const uint8_t *bytes, size_t avail, size_t *header_len, size_t *value_len);
+int krypt_asn1_header_peek(const uint8_t *bytes, size_t avail, krypt_asn1_header *out);
 
 int krypt_asn1_cmp_set_of(uint8_t *s1, size_t len1, uint8_t *s2, size_t len2, int *result);
 
@@ -929,6 +929,19 @@ int_asn1_make_explicit(VALUE value, int default_tag, VALUE *out)
     return KRYPT_OK;
 }
 
+/*
+ * Like krypt_asn1_object_encode, but the value bytes may be referenced
+ * instead of copied by gathering outstreams since they stay valid for as
+ * long as +self+ is alive.
+ */
+static int
+int_asn1_object_encode_ref(binyo_outstream *out, krypt_asn1_object *object, VALUE self)
+{
+    if (krypt_asn1_header_encode(out, object->header) == KRYPT_ERR) return KRYPT_ERR;
+    if (!object->bytes || object->bytes_len == 0) return KRYPT_OK;
+    return krypt_outstream_write_ref(out, object->bytes, object->bytes_len, self);
+}
+
 static int
 int_asn1_encode_to(binyo_outstream *out, krypt_asn1_data *data, VALUE self)
 {
@@ -945,12 +958,52 @@ int_asn1_encode_to(binyo_outstream *out, krypt_asn1_data *data, VALUE self)
 	return int_asn1_data_encode_to(self, out, value, data);
     }
     else {
-	if (krypt_asn1_object_encode(out, object) == KRYPT_ERR)
-            return KRYPT_ERR;
-        return KRYPT_OK;
+	return int_asn1_object_encode_ref(out, object, self);
     }
 }
 
+/*
+ * Writes the encoding of the ASN1Data +self+ to +out+. Cached encodings
+ * are written as they are, no intermediate String is created.
+ */
+int
+krypt_asn1_data_encode(binyo_outstream *out, VALUE self)
+{
+    krypt_asn1_data *data;
+
+    int_asn1_data_get(self, data);
+    return int_asn1_encode_to(out, data, self);
+}
+
+struct int_encode_to_args {
+    binyo_outstream *out;
+    krypt_asn1_data *data;
+    VALUE self;
+    int gather;
+    int result;
+};
+
+static VALUE
+int_asn1_data_encode_to_run(VALUE arg)
+{
+    struct int_encode_to_args *args = (struct int_encode_to_args *) arg;
+
+    args->result = int_asn1_encode_to(args->out, args->data, args->self);
+    if (args->result == KRYPT_OK && args->gather)
+	args->result = krypt_outstream_gather_flush(args->out);
+    return Qnil;
+}
+
+/* IO#write may raise, the stream owns pending buffers that must be freed anyway */
+static VALUE
+int_asn1_data_encode_to_ensure(VALUE arg)
+{
+    struct int_encode_to_args *args = (struct int_encode_to_args *) arg;
+
+    binyo_outstream_free(args->out);
+    return Qnil;
+}
+
 /*
  * call-seq:
  *    asn1.encode_to(io) -> self
@@ -963,20 +1016,26 @@ int_asn1_encode_to(binyo_outstream *out, krypt_asn1_data *data, VALUE self)
  * infinite length encodings. If a value with BER encoding was parsed and
  * is not modified, the BER encoding will be preserved when encoding it
  * again.
+ * The encoding is gathered and written out in large batches rather than
+ * element by element.
  */
 static VALUE
 krypt_asn1_data_encode_to(VALUE self, VALUE io)
 {
-    binyo_outstream *out;
-    krypt_asn1_data *data;
-    int result;
-
-    int_asn1_data_get(self, data);
-
-    out = binyo_outstream_new_value(io);
-    result = int_asn1_encode_to(out, data, self);
-    binyo_outstream_free(out);
-    if (result == KRYPT_ERR)
+    struct int_encode_to_args args;
+    VALUE owners = rb_ary_new();
+
+    int_asn1_data_get(self, args.data);
+    args.self = self;
+    args.result = KRYPT_ERR;
+    args.gather = 1;
+    if (!(args.out = krypt_outstream_new_gather(io, owners))) {
+	args.out = binyo_outstream_new_value(io);
+	args.gather = 0;
+    }
+    rb_ensure(int_asn1_data_encode_to_run, (VALUE) &args, int_asn1_data_encode_to_ensure, (VALUE) &args);
+    RB_GC_GUARD(owners);
+    if (args.result == KRYPT_ERR)
 	krypt_error_raise(eKryptASN1Error, "Error while encoding value");
     return self;
 }
@@ -1362,7 +1421,8 @@ int_asn1_cons_encode_update(binyo_outstream *out, VALUE ary, krypt_asn1_data *da
     header->length = len;
     if (krypt_asn1_header_encode(out, header) == KRYPT_ERR) goto error;
     if (header->length > 0) {
-	if (binyo_outstream_write(out, bytes, len) == BINYO_ERR) goto error;
+	/* hand over the sub encodings, a gathering stream need not copy them */
+	return krypt_outstream_write_owned(out, bytes, len);
     }
 
     xfree(bytes);
@@ -1431,7 +1491,7 @@ int_asn1_prim_encode_to(VALUE self, binyo_outstream *out, VALUE value, krypt_asn
     if (data->codec->validator(self, value) == KRYPT_ERR) return KRYPT_ERR;
     if (data->codec->encoder(self, value, &object->bytes, &object->bytes_len) == KRYPT_ERR) return KRYPT_ERR;
     object->header->length = object->bytes_len;
-    if (krypt_asn1_object_encode(out, object) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_asn1_object_encode_ref(out, object, self) == KRYPT_ERR) return KRYPT_ERR;
 
     return KRYPT_OK;
 }
@@ -1603,6 +1663,82 @@ krypt_asn1_decode_pem(VALUE self, VALUE obj)
     return ret;
 }
 
+#define KRYPT_BER_TO_DER_DEFAULT_MEMORY	(16 * 1024 * 1024)
+
+struct int_ber_to_der_m_args {
+    binyo_instream *in;
+    binyo_outstream *out;
+    size_t max_memory;
+    int result;
+};
+
+static VALUE
+int_asn1_ber_to_der_run(VALUE arg)
+{
+    struct int_ber_to_der_m_args *args = (struct int_ber_to_der_m_args *) arg;
+
+    args->result = krypt_asn1_ber_to_der(args->in, args->out, args->max_memory);
+    if (args->result == KRYPT_OK)
+	args->result = krypt_outstream_gather_flush(args->out);
+    return Qnil;
+}
+
+static VALUE
+int_asn1_ber_to_der_ensure(VALUE arg)
+{
+    struct int_ber_to_der_m_args *args = (struct int_ber_to_der_m_args *) arg;
+
+    binyo_instream_free(args->in);
+    binyo_outstream_free(args->out);
+    return Qnil;
+}
+
+/**
+ * call-seq:
+ *    ASN1.ber_to_der(in, out, [max_memory]) -> out
+ *
+ * * +in+: May either be a +String+ containing BER-encoded values, an
+ *         IO-like object supporting IO#read or any arbitrary object that
+ *         supports a +to_der+ method.
+ * * +out+: An IO-like object supporting IO#write
+ * * +max_memory+: The number of bytes that may be buffered in memory,
+ *                 16 MiB by default
+ *
+ * Converts the BER encoding of all values read from +in+ into the
+ * corresponding DER encoding and writes it to +out+ without creating
+ * ASN1Data instances. Infinite length values and constructed strings are
+ * turned into their definite length respectively primitive equivalents
+ * and all lengths are encoded minimally. The contents of constructed
+ * values need to be buffered until their length is known, once more than
+ * +max_memory+ bytes are buffered the remainder is buffered in temporary
+ * files.
+ */
+static VALUE
+krypt_asn1_ber_to_der_m(int argc, VALUE *argv, VALUE self)
+{
+    VALUE vin, vout, vmax;
+    struct int_ber_to_der_m_args args;
+    VALUE owners = rb_ary_new();
+
+    rb_scan_args(argc, argv, "21", &vin, &vout, &vmax);
+    args.max_memory = KRYPT_BER_TO_DER_DEFAULT_MEMORY;
+    if (!NIL_P(vmax))
+	args.max_memory = NUM2SIZET(vmax);
+
+    args.in = krypt_instream_new_value_der(vin);
+    if (!(args.out = krypt_outstream_new_gather(vout, owners))) {
+	binyo_instream_free(args.in);
+	rb_raise(rb_eArgError, "Output must respond to write");
+    }
+    args.result = KRYPT_ERR;
+
+    rb_ensure(int_asn1_ber_to_der_run, (VALUE) &args, int_asn1_ber_to_der_ensure, (VALUE) &args);
+    RB_GC_GUARD(owners);
+    if (args.result != KRYPT_OK)
+	krypt_error_raise(eKryptASN1Error, "Error while converting BER to DER");
+    return vout;
+}
+
 /**
  * Returns an ID representing the Symbol that stands for the corresponding
  * tag class.
@@ -1855,6 +1991,7 @@ Init_krypt_asn1(void)
     rb_define_module_function(mKryptASN1, "decode", krypt_asn1_decode, 1);
     rb_define_module_function(mKryptASN1, "decode_der", krypt_asn1_decode_der, 1);
     rb_define_module_function(mKryptASN1, "decode_pem", krypt_asn1_decode_pem, 1);
+    rb_define_module_function(mKryptASN1, "ber_to_der", krypt_asn1_ber_to_der_m, -1);
 
     /* Document-class: Krypt::ASN1::ASN1Data
      *
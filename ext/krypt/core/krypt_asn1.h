@@ -62,6 +62,7 @@ extern VALUE eKryptASN1SerializeError;
 
 extern VALUE mKryptPEM;
 extern VALUE eKryptPEMError;
+extern VALUE cKryptPEMWriter;
 
 extern ID sKrypt_TC_UNIVERSAL;
 extern ID sKrypt_TC_APPLICATION;
@@ -0,0 +1,681 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+
+/*
+ * Streaming conversion of BER into DER. Primitive values are copied
+ * through as they are read, only their headers are re-encoded with
+ * minimal tag and length octets. Constructed values need their final
+ * length before their contents may be written. The converted contents of
+ * a top-level value are therefore collected once in a content spill,
+ * while the headers of constructed values are recorded as marks that are
+ * patched with the final length once the value has been read. Finally
+ * the marks and the content are merged into the output in a single pass.
+ * Spill buffers share a common memory budget, once it is exhausted they
+ * continue in a temporary file. Constructed string encodings are
+ * flattened into their primitive form.
+ * The order of SET elements is left as is.
+ */
+
+#define KRYPT_BER_MAX_DEPTH 	1024
+
+typedef struct krypt_ber_budget_st {
+    size_t max;
+    size_t used;
+} krypt_ber_budget;
+
+typedef struct krypt_outstream_spill_st {
+    binyo_outstream_interface *methods;
+    krypt_ber_budget *budget;
+    uint8_t *bytes;
+    size_t len;
+    size_t cap;
+    FILE *file;
+    size_t total;
+    size_t pos;
+} krypt_outstream_spill;
+
+/* a header whose length is only known once its contents have been read */
+typedef struct krypt_ber_mark_st {
+    size_t off;
+    size_t length;
+    int tag;
+    int tag_class;
+    int is_constructed;
+    int unused_bits;
+} krypt_ber_mark;
+
+typedef struct krypt_ber_ctx_st {
+    krypt_ber_budget budget;
+    krypt_outstream_spill *content;
+    krypt_outstream_spill *marks;
+    size_t headers;
+} krypt_ber_ctx;
+
+#define int_safe_cast(out, in)		binyo_safe_cast_outstream((out), (in), KRYPT_OUTSTREAM_TYPE_SPILL, krypt_outstream_spill)
+
+static ssize_t int_spill_write(binyo_outstream *out, uint8_t *buf, size_t len);
+static void int_spill_free(binyo_outstream *out);
+
+static binyo_outstream_interface krypt_interface_spill = {
+    KRYPT_OUTSTREAM_TYPE_SPILL,
+    int_spill_write,
+    NULL,
+    NULL,
+    int_spill_free
+};
+
+static krypt_outstream_spill *
+int_spill_new(krypt_ber_budget *budget)
+{
+    krypt_outstream_spill *ret;
+
+    ret = ALLOC(krypt_outstream_spill);
+    memset(ret, 0, sizeof(krypt_outstream_spill));
+    ret->methods = &krypt_interface_spill;
+    ret->budget = budget;
+    return ret;
+}
+
+static int
+int_spill_to_file(krypt_outstream_spill *out)
+{
+    if (!(out->file = tmpfile())) {
+	krypt_error_add("Could not create temporary file: %s", strerror(errno));
+	return KRYPT_ERR;
+    }
+    if (out->len > 0 && fwrite(out->bytes, 1, out->len, out->file) != out->len) {
+	krypt_error_add("Could not write to temporary file");
+	return KRYPT_ERR;
+    }
+    if (out->bytes) {
+	xfree(out->bytes);
+	out->bytes = NULL;
+    }
+    out->budget->used -= out->cap;
+    out->len = out->cap = 0;
+    return KRYPT_OK;
+}
+
+static ssize_t
+int_spill_write(binyo_outstream *outstream, uint8_t *buf, size_t len)
+{
+    krypt_outstream_spill *out;
+    krypt_ber_budget *budget;
+
+    int_safe_cast(out, outstream);
+    budget = out->budget;
+
+    if (len > SSIZE_MAX || out->total > SIZE_MAX - len) {
+	krypt_error_add("Value too large");
+	return BINYO_ERR;
+    }
+
+    if (!out->file && out->len + len > out->cap) {
+	size_t cap = out->cap ? out->cap : 256;
+	while (cap < out->len + len)
+	    cap *= 2;
+	if (cap - out->cap > budget->max - budget->used) {
+	    if (int_spill_to_file(out) == KRYPT_ERR) return BINYO_ERR;
+	}
+	else {
+	    REALLOC_N(out->bytes, uint8_t, cap);
+	    budget->used += cap - out->cap;
+	    out->cap = cap;
+	}
+    }
+
+    if (out->file) {
+	if (fwrite(buf, 1, len, out->file) != len) {
+	    krypt_error_add("Could not write to temporary file");
+	    return BINYO_ERR;
+	}
+    }
+    else {
+	memcpy(out->bytes + out->len, buf, len);
+	out->len += len;
+    }
+    out->total += len;
+    return (ssize_t) len;
+}
+
+/* overwrites bytes that have already been written at offset +at+ */
+static int
+int_spill_patch(krypt_outstream_spill *spill, size_t at, void *buf, size_t len)
+{
+    if (!spill->file) {
+	memcpy(spill->bytes + at, buf, len);
+	return KRYPT_OK;
+    }
+    if (fseek(spill->file, (long) at, SEEK_SET) != 0 ||
+	fwrite(buf, 1, len, spill->file) != len ||
+	fseek(spill->file, 0, SEEK_END) != 0) {
+	krypt_error_add("Could not write to temporary file");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_spill_rewind(krypt_outstream_spill *spill)
+{
+    spill->pos = 0;
+    if (spill->file && (fflush(spill->file) != 0 || fseek(spill->file, 0, SEEK_SET) != 0)) {
+	krypt_error_add("Could not read temporary file");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_spill_read(krypt_outstream_spill *spill, void *buf, size_t len)
+{
+    if (len > spill->total - spill->pos) {
+	krypt_error_add("Could not read temporary file");
+	return KRYPT_ERR;
+    }
+    if (spill->file) {
+	if (fread(buf, 1, len, spill->file) != len) {
+	    krypt_error_add("Could not read temporary file");
+	    return KRYPT_ERR;
+	}
+    }
+    else {
+	memcpy(buf, spill->bytes + spill->pos, len);
+    }
+    spill->pos += len;
+    return KRYPT_OK;
+}
+
+static int
+int_spill_copy_to(krypt_outstream_spill *spill, size_t len, binyo_outstream *out)
+{
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    size_t n;
+
+    if (!spill->file) {
+	if (len == 0) return KRYPT_OK;
+	if (len > spill->total - spill->pos) return KRYPT_ERR;
+	if (binyo_outstream_write(out, spill->bytes + spill->pos, len) == BINYO_ERR) return KRYPT_ERR;
+	spill->pos += len;
+	return KRYPT_OK;
+    }
+
+    while (len > 0) {
+	n = len < BINYO_IO_BUF_SIZE ? len : BINYO_IO_BUF_SIZE;
+	if (int_spill_read(spill, buf, n) == KRYPT_ERR) return KRYPT_ERR;
+	if (binyo_outstream_write(out, buf, n) == BINYO_ERR) return KRYPT_ERR;
+	len -= n;
+    }
+    return KRYPT_OK;
+}
+
+static void
+int_spill_free(binyo_outstream *outstream)
+{
+    krypt_outstream_spill *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    if (out->bytes) {
+	xfree(out->bytes);
+	out->budget->used -= out->cap;
+    }
+    if (out->file)
+	fclose(out->file);
+}
+
+static int int_convert(krypt_ber_ctx *ctx, binyo_instream *in, krypt_asn1_header *header, int depth);
+
+static int
+int_copy_value(binyo_instream *in, size_t len, binyo_outstream *out)
+{
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    ssize_t r;
+
+    while (len > 0) {
+	r = binyo_instream_read(in, buf, len < BINYO_IO_BUF_SIZE ? len : BINYO_IO_BUF_SIZE);
+	if (r == BINYO_ERR) return KRYPT_ERR;
+	if (r == BINYO_IO_EOF) {
+	    krypt_error_add("Premature end of value detected");
+	    return KRYPT_ERR;
+	}
+	if (binyo_outstream_write(out, buf, r) == BINYO_ERR) return KRYPT_ERR;
+	len -= r;
+    }
+    return KRYPT_OK;
+}
+
+/*
+ * Re-encodes the header with the given length. Tag and length octets
+ * are recomputed from scratch so that non-minimal encodings vanish.
+ */
+static int
+int_write_der_header(binyo_outstream *out, krypt_asn1_header *header, int is_constructed, size_t length)
+{
+    if (header->tag_bytes) {
+	xfree(header->tag_bytes);
+	header->tag_bytes = NULL;
+    }
+    if (header->length_bytes) {
+	xfree(header->length_bytes);
+	header->length_bytes = NULL;
+    }
+    header->is_constructed = is_constructed;
+    header->is_infinite = 0;
+    header->length = length;
+    return krypt_asn1_header_encode(out, header);
+}
+
+/* the number of octets int_write_der_header will produce */
+static size_t
+int_der_header_len(int tag, size_t length)
+{
+    size_t ret = 2;
+
+    if (tag >= 31) {
+	for (; tag > 0; tag >>= CHAR_BIT_MINUS_ONE)
+	    ret++;
+    }
+    if (length > 127) {
+	for (; length > 0; length >>= CHAR_BIT)
+	    ret++;
+    }
+    return ret;
+}
+
+/*
+ * Records a header whose length is not yet known at the current position
+ * of the content. Its index is returned in *index.
+ */
+static int
+int_mark_open(krypt_ber_ctx *ctx, krypt_asn1_header *header, int is_constructed, krypt_ber_mark *mark, size_t *index)
+{
+    mark->off = ctx->content->total;
+    mark->length = 0;
+    mark->tag = header->tag;
+    mark->tag_class = header->tag_class;
+    mark->is_constructed = is_constructed;
+    mark->unused_bits = -1;
+    *index = ctx->marks->total;
+    if (binyo_outstream_write((binyo_outstream *) ctx->marks, (uint8_t *) mark, sizeof(krypt_ber_mark)) == BINYO_ERR) return KRYPT_ERR;
+    return KRYPT_OK;
+}
+
+static int
+int_mark_close(krypt_ber_ctx *ctx, krypt_ber_mark *mark, size_t index)
+{
+    size_t hlen = int_der_header_len(mark->tag, mark->length) + (mark->unused_bits >= 0 ? 1 : 0);
+
+    if (ctx->headers > SIZE_MAX - hlen) {
+	krypt_error_add("Value too large");
+	return KRYPT_ERR;
+    }
+    ctx->headers += hlen;
+    return int_spill_patch(ctx->marks, index, mark, sizeof(krypt_ber_mark));
+}
+
+static int
+int_is_string_type(krypt_asn1_header *header)
+{
+    if (header->tag_class != TAG_CLASS_UNIVERSAL) return 0;
+
+    switch (header->tag) {
+	case TAGS_BIT_STRING:
+	case TAGS_OCTET_STRING:
+	case TAGS_UTF8_STRING:
+	case TAGS_NUMERIC_STRING:
+	case TAGS_PRINTABLE_STRING:
+	case TAGS_T61_STRING:
+	case TAGS_VIDEOTEX_STRING:
+	case TAGS_IA5_STRING:
+	case TAGS_UTC_TIME:
+	case TAGS_GENERALIZED_TIME:
+	case TAGS_GRAPHIC_STRING:
+	case TAGS_ISO64_STRING:
+	case TAGS_GENERAL_STRING:
+	case TAGS_UNIVERSAL_STRING:
+	case TAGS_BMP_STRING:
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+#define int_is_eoc(h)	((h)->tag == TAGS_END_OF_CONTENTS && (h)->tag_class == TAG_CLASS_UNIVERSAL && !(h)->is_constructed)
+
+/*
+ * Iterates over the elements of a constructed value. Returns KRYPT_OK
+ * and sets *next for every element, KRYPT_ASN1_EOF once the value has
+ * been consumed and KRYPT_ERR on errors.
+ */
+static int
+int_next_element(binyo_instream *in, krypt_asn1_header *parent, krypt_asn1_header **next)
+{
+    int ret = krypt_asn1_next_header(in, next);
+
+    if (ret == KRYPT_ERR) return KRYPT_ERR;
+    if (ret == KRYPT_ASN1_EOF) {
+	if (parent->is_infinite) {
+	    krypt_error_add("Missing END OF CONTENTS");
+	    return KRYPT_ERR;
+	}
+	return KRYPT_ASN1_EOF;
+    }
+    if (int_is_eoc(*next)) {
+	int infinite = parent->is_infinite;
+	krypt_asn1_header_free(*next);
+	*next = NULL;
+	if (!infinite) {
+	    krypt_error_add("END OF CONTENTS inside of a definite length value");
+	    return KRYPT_ERR;
+	}
+	return KRYPT_ASN1_EOF;
+    }
+    return KRYPT_OK;
+}
+
+#define int_elements_stream(in, h)	((h)->is_infinite ? (in) : krypt_instream_new_definite((in), (h)->length))
+#define int_elements_stream_free(s, in)	if ((s) != (in)) binyo_instream_free((s))
+
+/*
+ * Collects the payload of all primitive segments of a constructed string.
+ * For BIT STRINGs, the leading unused bits octet of each segment is
+ * stripped and only the last segment may have unused bits.
+ */
+static int
+int_collect_segments(binyo_instream *in, krypt_asn1_header *header, binyo_outstream *out, int bit_string, int *unused_bits, int depth)
+{
+    binyo_instream *elems;
+    krypt_asn1_header *next = NULL;
+    int ret;
+
+    if (depth > KRYPT_BER_MAX_DEPTH) {
+	krypt_error_add("Maximum nesting depth exceeded");
+	return KRYPT_ERR;
+    }
+
+    elems = int_elements_stream(in, header);
+    while ((ret = int_next_element(elems, header, &next)) == KRYPT_OK) {
+	if (next->tag != header->tag || next->tag_class != header->tag_class) {
+	    krypt_error_add("Segment of constructed string has a different tag");
+	    goto error;
+	}
+	if (next->is_constructed) {
+	    if (int_collect_segments(elems, next, out, bit_string, unused_bits, depth + 1) == KRYPT_ERR) goto error;
+	}
+	else if (bit_string) {
+	    uint8_t b;
+	    if (next->length == 0) {
+		krypt_error_add("BIT STRING segment without unused bits octet");
+		goto error;
+	    }
+	    if (*unused_bits != 0) {
+		krypt_error_add("Only the last BIT STRING segment may have unused bits");
+		goto error;
+	    }
+	    if (binyo_instream_read(elems, &b, 1) != 1) {
+		krypt_error_add("Premature end of value detected");
+		goto error;
+	    }
+	    if (b > 7) {
+		krypt_error_add("Invalid number of unused bits: %d", b);
+		goto error;
+	    }
+	    *unused_bits = b;
+	    if (int_copy_value(elems, next->length - 1, out) == KRYPT_ERR) goto error;
+	}
+	else {
+	    if (int_copy_value(elems, next->length, out) == KRYPT_ERR) goto error;
+	}
+	krypt_asn1_header_free(next);
+	next = NULL;
+    }
+    if (ret == KRYPT_ERR) goto error;
+
+    int_elements_stream_free(elems, in);
+    return KRYPT_OK;
+
+error:
+    if (next) krypt_asn1_header_free(next);
+    int_elements_stream_free(elems, in);
+    return KRYPT_ERR;
+}
+
+static int
+int_convert_string(krypt_ber_ctx *ctx, binyo_instream *in, krypt_asn1_header *header, int depth)
+{
+    krypt_ber_mark mark;
+    size_t index;
+    int bit_string = header->tag == TAGS_BIT_STRING;
+    int unused_bits = 0;
+
+    if (int_mark_open(ctx, header, 0, &mark, &index) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_collect_segments(in, header, (binyo_outstream *) ctx->content, bit_string, &unused_bits, depth) == KRYPT_ERR) return KRYPT_ERR;
+
+    mark.length = ctx->content->total - mark.off;
+    if (bit_string) {
+	if (mark.length == SIZE_MAX) return KRYPT_ERR;
+	mark.length++;
+	mark.unused_bits = unused_bits;
+    }
+    return int_mark_close(ctx, &mark, index);
+}
+
+static int
+int_convert_constructed(krypt_ber_ctx *ctx, binyo_instream *in, krypt_asn1_header *header, int depth)
+{
+    krypt_ber_mark mark;
+    size_t index, headers, content;
+    binyo_instream *elems;
+    krypt_asn1_header *next = NULL;
+    int ret;
+
+    if (int_mark_open(ctx, header, 1, &mark, &index) == KRYPT_ERR) return KRYPT_ERR;
+    headers = ctx->headers;
+
+    elems = int_elements_stream(in, header);
+    while ((ret = int_next_element(elems, header, &next)) == KRYPT_OK) {
+	if (int_convert(ctx, elems, next, depth + 1) == KRYPT_ERR) goto error;
+	krypt_asn1_header_free(next);
+	next = NULL;
+    }
+    if (ret == KRYPT_ERR) goto error;
+
+    /* the contents consist of the converted values plus the headers of nested marks */
+    content = ctx->content->total - mark.off;
+    headers = ctx->headers - headers;
+    if (content > SIZE_MAX - headers) {
+	krypt_error_add("Value too large");
+	goto error;
+    }
+    mark.length = content + headers;
+    if (int_mark_close(ctx, &mark, index) == KRYPT_ERR) goto error;
+
+    int_elements_stream_free(elems, in);
+    return KRYPT_OK;
+
+error:
+    if (next) krypt_asn1_header_free(next);
+    int_elements_stream_free(elems, in);
+    return KRYPT_ERR;
+}
+
+static int
+int_convert(krypt_ber_ctx *ctx, binyo_instream *in, krypt_asn1_header *header, int depth)
+{
+    binyo_outstream *out = (binyo_outstream *) ctx->content;
+
+    if (depth > KRYPT_BER_MAX_DEPTH) {
+	krypt_error_add("Maximum nesting depth exceeded");
+	return KRYPT_ERR;
+    }
+
+    if (!header->is_constructed) {
+	if (int_write_der_header(out, header, 0, header->length) == KRYPT_ERR) return KRYPT_ERR;
+	return int_copy_value(in, header->length, out);
+    }
+    if (int_is_string_type(header))
+	return int_convert_string(ctx, in, header, depth);
+    return int_convert_constructed(ctx, in, header, depth);
+}
+
+/*
+ * Merges the recorded marks into the content, both spills are read
+ * exactly once.
+ */
+static int
+int_emit(krypt_ber_ctx *ctx, binyo_outstream *out)
+{
+    krypt_ber_mark mark;
+    krypt_asn1_header *header;
+    size_t pos = 0;
+
+    if (int_spill_rewind(ctx->content) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_spill_rewind(ctx->marks) == KRYPT_ERR) return KRYPT_ERR;
+
+    header = krypt_asn1_header_new();
+    while (ctx->marks->pos < ctx->marks->total) {
+	if (int_spill_read(ctx->marks, &mark, sizeof(krypt_ber_mark)) == KRYPT_ERR) goto error;
+	if (int_spill_copy_to(ctx->content, mark.off - pos, out) == KRYPT_ERR) goto error;
+	pos = mark.off;
+	header->tag = mark.tag;
+	header->tag_class = mark.tag_class;
+	if (int_write_der_header(out, header, mark.is_constructed, mark.length) == KRYPT_ERR) goto error;
+	if (mark.unused_bits >= 0) {
+	    uint8_t b = (uint8_t) mark.unused_bits;
+	    if (binyo_outstream_write(out, &b, 1) == BINYO_ERR) goto error;
+	}
+    }
+    if (int_spill_copy_to(ctx->content, ctx->content->total - pos, out) == KRYPT_ERR) goto error;
+
+    krypt_asn1_header_free(header);
+    return KRYPT_OK;
+
+error:
+    krypt_asn1_header_free(header);
+    return KRYPT_ERR;
+}
+
+static void
+int_ctx_reset(krypt_ber_ctx *ctx)
+{
+    if (ctx->content) {
+	binyo_outstream_free((binyo_outstream *) ctx->content);
+	ctx->content = NULL;
+    }
+    if (ctx->marks) {
+	binyo_outstream_free((binyo_outstream *) ctx->marks);
+	ctx->marks = NULL;
+    }
+    ctx->headers = 0;
+}
+
+static int
+int_convert_value(krypt_ber_ctx *ctx, binyo_instream *in, krypt_asn1_header *header, binyo_outstream *out)
+{
+    int ret;
+
+    /* top-level primitive values need no buffering at all */
+    if (!header->is_constructed) {
+	if (int_write_der_header(out, header, 0, header->length) == KRYPT_ERR) return KRYPT_ERR;
+	return int_copy_value(in, header->length, out);
+    }
+
+    ctx->content = int_spill_new(&ctx->budget);
+    ctx->marks = int_spill_new(&ctx->budget);
+    ret = int_convert(ctx, in, header, 0);
+    if (ret == KRYPT_OK)
+	ret = int_emit(ctx, out);
+    int_ctx_reset(ctx);
+    return ret;
+}
+
+struct int_ber_to_der_args {
+    binyo_instream *in;
+    binyo_outstream *out;
+    krypt_ber_ctx ctx;
+    krypt_asn1_header *header;
+    int result;
+};
+
+static VALUE
+int_ber_to_der_run(VALUE arg)
+{
+    struct int_ber_to_der_args *args = (struct int_ber_to_der_args *) arg;
+    int ret;
+
+    while ((ret = krypt_asn1_next_header(args->in, &args->header)) == KRYPT_OK) {
+	ret = int_convert_value(&args->ctx, args->in, args->header, args->out);
+	krypt_asn1_header_free(args->header);
+	args->header = NULL;
+	if (ret == KRYPT_ERR) break;
+    }
+    args->result = ret == KRYPT_ERR ? KRYPT_ERR : KRYPT_OK;
+    return Qnil;
+}
+
+/* reading from or writing to an IO may raise, spills hold temporary files */
+static VALUE
+int_ber_to_der_ensure(VALUE arg)
+{
+    struct int_ber_to_der_args *args = (struct int_ber_to_der_args *) arg;
+
+    if (args->header) krypt_asn1_header_free(args->header);
+    int_ctx_reset(&args->ctx);
+    return Qnil;
+}
+
+/**
+ * Converts all BER-encoded values read from +in+ into their DER encoding
+ * and writes them to +out+.
+ *
+ * @param in		The binyo_instream providing the BER encoding
+ * @param out		The binyo_outstream receiving the DER encoding
+ * @param max_memory	The maximum number of bytes that may be buffered
+ * 			in memory before resorting to temporary files
+ * @return		KRYPT_OK if successful, KRYPT_ERR otherwise
+ */
+int
+krypt_asn1_ber_to_der(binyo_instream *in, binyo_outstream *out, size_t max_memory)
+{
+    struct int_ber_to_der_args args;
+
+    memset(&args, 0, sizeof(struct int_ber_to_der_args));
+    args.in = in;
+    args.out = out;
+    args.ctx.budget.max = max_memory;
+    args.result = KRYPT_ERR;
+
+    rb_ensure(int_ber_to_der_run, (VALUE) &args, int_ber_to_der_ensure, (VALUE) &args);
+    return args.result;
+}
+
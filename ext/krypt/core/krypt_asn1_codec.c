@@ -223,7 +223,8 @@ int_asn1_encode_bit_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
     size_t l;
     uint8_t *bytes;
 
-    unused_bits = NUM2INT(rb_ivar_get(self, sKrypt_IV_UNUSED_BITS));
+    /* Template values keep their unused bits themselves, nil stands for 0 */
+    unused_bits = NIL_P(self) ? 0 : NUM2INT(rb_ivar_get(self, sKrypt_IV_UNUSED_BITS));
     int_check_unused_bits(unused_bits);
 
     StringValue(value);
@@ -252,7 +253,8 @@ int_asn1_decode_bit_string(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
 	krypt_error_add("Error while decoding BIT STRING");
 	return KRYPT_ERR;
     }
-    rb_ivar_set(self, sKrypt_IV_UNUSED_BITS, INT2NUM(unused_bits));
+    if (!NIL_P(self))
+	rb_ivar_set(self, sKrypt_IV_UNUSED_BITS, INT2NUM(unused_bits));
     return KRYPT_OK;
 }
 
@@ -29,22 +29,45 @@
 #include "krypt-core.h"
 #include "krypt_asn1-internal.h"
 
+/*
+ * Reassembles the value of an infinite length encoding. Instead of
+ * stacking a new stream for every nested level, nesting is tracked on an
+ * explicit stack of frames and all bytes are read directly from the
+ * inner stream, so the cost of a read does not depend on the depth of
+ * the encoding.
+ * If values_only is set, only the payloads of the primitive values are
+ * returned (descending into definite length constructed values as well),
+ * otherwise the complete encoding including all headers and the final
+ * END OF CONTENTS is passed through.
+ */
+
 enum krypt_chunked_state {
     NEW_HEADER = 0,
-    PROCESS_TAG,
-    PROCESS_LENGTH,
+    PROCESS_HEADER,
     PROCESS_VALUE,
     DONE
 };
 
+typedef struct krypt_chunked_frame_st {
+    int is_infinite;
+    size_t end;	/* end of a definite frame, the enclosing limit otherwise */
+} krypt_chunked_frame;
+
+#define KRYPT_CHUNKED_INITIAL_DEPTH 8
+
 typedef struct krypt_instream_chunked {
     binyo_instream_interface *methods;
     binyo_instream *inner;
     int values_only;
     enum krypt_chunked_state state;
     krypt_asn1_header *cur_header;
-    binyo_instream *cur_value_stream;
     size_t header_offset;
+    size_t value_left;
+    size_t pos;
+    int last;
+    krypt_chunked_frame *frames;
+    size_t depth;
+    size_t max_depth;
 } krypt_instream_chunked;
 
 #define int_safe_cast(out, in)		binyo_safe_cast_instream((out), (in), KRYPT_INSTREAM_TYPE_CHUNKED, krypt_instream_chunked)
@@ -65,6 +88,8 @@ static binyo_instream_interface krypt_interface_chunked = {
     int_chunked_free
 };
 
+static void int_push_frame(krypt_instream_chunked *in, int is_infinite, size_t end);
+
 binyo_instream *
 krypt_instream_new_chunked(binyo_instream *original, int values_only)
 {
@@ -74,6 +99,10 @@ krypt_instream_new_chunked(binyo_instream *original, int values_only)
     in->inner = original;
     in->values_only = values_only;
     in->state = NEW_HEADER;
+    in->max_depth = KRYPT_CHUNKED_INITIAL_DEPTH;
+    in->frames = ALLOC_N(krypt_chunked_frame, in->max_depth);
+    /* the header of the outermost value has already been consumed */
+    int_push_frame(in, 1, SIZE_MAX);
     return (binyo_instream *) in;
 }
 
@@ -87,11 +116,44 @@ int_chunked_alloc(void)
     return ret;
 }
 
+static void
+int_push_frame(krypt_instream_chunked *in, int is_infinite, size_t end)
+{
+    krypt_chunked_frame *frame;
+
+    if (in->depth == in->max_depth) {
+	in->max_depth *= 2;
+	REALLOC_N(in->frames, krypt_chunked_frame, in->max_depth);
+    }
+    frame = &in->frames[in->depth++];
+    frame->is_infinite = is_infinite;
+    frame->end = end;
+}
+
+#define int_top_frame(in)	(&(in)->frames[(in)->depth - 1])
+
+static int
+int_check_bounds(krypt_instream_chunked *in, size_t len)
+{
+    size_t end = int_top_frame(in)->end;
+
+    if (in->pos > end || len > end - in->pos) {
+	krypt_error_add("Value exceeds the length of its enclosing value");
+	return BINYO_ERR;
+    }
+    return BINYO_OK;
+}
+
 static int
 int_read_new_header(krypt_instream_chunked *in)
 {
     int ret;
     krypt_asn1_header *next;
+    size_t hlen;
+
+    /* close all definite frames that have been read completely */
+    while (!int_top_frame(in)->is_infinite && in->pos == int_top_frame(in)->end)
+	in->depth--;
 
     ret = krypt_asn1_next_header(in->inner, &next);
     if (ret == KRYPT_ASN1_EOF) {
@@ -106,33 +168,59 @@ int_read_new_header(krypt_instream_chunked *in)
     if (in->cur_header)
 	krypt_asn1_header_free(in->cur_header);
     in->cur_header = next;
-    in->state = PROCESS_TAG;
+    hlen = next->tag_len + next->length_len;
+    if (int_check_bounds(in, hlen) == BINYO_ERR) return BINYO_ERR;
+    in->pos += hlen;
+    in->value_left = 0;
+
+    if (next->tag == TAGS_END_OF_CONTENTS && next->tag_class == TAG_CLASS_UNIVERSAL) {
+	if (!int_top_frame(in)->is_infinite) {
+	    krypt_error_add("END OF CONTENTS inside of a definite length value");
+	    return BINYO_ERR;
+	}
+	in->depth--;
+	in->last = in->depth == 0;
+    }
+    else if (next->is_infinite) {
+	int_push_frame(in, 1, int_top_frame(in)->end);
+    }
+    else {
+	if (int_check_bounds(in, next->length) == BINYO_ERR) return BINYO_ERR;
+	if (next->is_constructed && in->values_only)
+	    int_push_frame(in, 0, in->pos + next->length);
+	else
+	    in->value_left = next->length;
+    }
+
     in->header_offset = 0;
+    in->state = in->values_only ? PROCESS_VALUE : PROCESS_HEADER;
     return BINYO_OK;
 }
 
 static size_t
-int_read_header_bytes(krypt_instream_chunked *in,
-		      uint8_t * bytes, 
-		      size_t bytes_len, 
-		      enum krypt_chunked_state next_state,
-		      uint8_t *buf,
-		      size_t len)
+int_read_header_bytes(krypt_instream_chunked *in, uint8_t *buf, size_t len)
 {
-    size_t to_read;
-    size_t available = bytes_len - in->header_offset;
-        
-    if (len < available) {
-	in->header_offset += len;
+    krypt_asn1_header *header = in->cur_header;
+    size_t hlen = header->tag_len + header->length_len;
+    size_t to_read = hlen - in->header_offset;
+    size_t off = in->header_offset, n;
+
+    if (len < to_read)
 	to_read = len;
+
+    if (off < header->tag_len) {
+	n = header->tag_len - off;
+	if (n > to_read) n = to_read;
+	memcpy(buf, header->tag_bytes + off, n);
+	memcpy(buf + n, header->length_bytes, to_read - n);
     }
     else {
-	in->state = next_state;
-	in->header_offset = 0;
-	to_read = available;
+	memcpy(buf, header->length_bytes + off - header->tag_len, to_read);
     }
-    
-    memcpy(buf, bytes, to_read);
+
+    in->header_offset += to_read;
+    if (in->header_offset == hlen)
+	in->state = PROCESS_VALUE;
     return to_read;
 }
 
@@ -141,107 +229,61 @@ int_read_value(krypt_instream_chunked *in, uint8_t *buf, size_t len)
 {
     ssize_t read;
 
-    if (!in->cur_value_stream)
-	in->cur_value_stream = krypt_asn1_get_value_stream(in->inner, in->cur_header, in->values_only);
+    if (in->value_left == 0) {
+	in->state = in->last ? DONE : NEW_HEADER;
+	return 0;
+    }
 
-    read = binyo_instream_read(in->cur_value_stream, buf, len);
-    if (read == BINYO_ERR) return BINYO_ERR;
+    if (len > in->value_left)
+	len = in->value_left;
+    if (len > SSIZE_MAX)
+	len = SSIZE_MAX;
 
+    read = binyo_instream_read(in->inner, buf, len);
+    if (read == BINYO_ERR) return BINYO_ERR;
     if (read == BINYO_IO_EOF) {
-	if (in->state != DONE)
-	    in->state = NEW_HEADER;
-	binyo_instream_free(in->cur_value_stream);
-	in->cur_value_stream = NULL;
-	read = 0;
+	krypt_error_add("Premature end of value detected");
+	return BINYO_ERR;
     }
 
+    in->value_left -= read;
+    in->pos += read;
     return read;
 }
 
-/* If state is PROCESS_VALUE, this means that the tag bytes
- * have been consumed. As an EOC contains no value, we are
- * done.
- */
-#define int_check_done(in)					\
-do {								\
-    if ((in)->cur_header->tag == TAGS_END_OF_CONTENTS &&	\
-	(in)->cur_header->tag_class == TAG_CLASS_UNIVERSAL &&   \
-	(in)->state == PROCESS_VALUE) {				\
-	(in)->state = DONE;					\
-    }								\
-} while (0)
-
-/* TODO: check overflow */
-static ssize_t
-int_read_single_element(krypt_instream_chunked *in, uint8_t *buf, size_t len)
-{
-    ssize_t read = 0;
-    size_t total = 0;
-
-#define add_header_bytes()			\
-do {						\
-   if (!in->values_only) {			\
-      total += read;				\
-      if (total == len || in->state == DONE)	\
-          return (ssize_t) total;		\
-      if (total > len) return BINYO_ERR;	\
-      buf += read;				\
-   }						\
-} while (0)
-
-    switch (in->state) {
-	case NEW_HEADER:
-	    if (!int_read_new_header(in))
-	       return BINYO_ERR;
-    	    /* fallthrough */
-	case PROCESS_TAG: 
-	    read = int_read_header_bytes(in,
-		    			 in->cur_header->tag_bytes,
-					 in->cur_header->tag_len,
-					 PROCESS_LENGTH, 
-					 buf,
-					 len);
-	    add_header_bytes();
-	    /* fallthrough */
-	case PROCESS_LENGTH:
-	    read = int_read_header_bytes(in,
-		    			 in->cur_header->length_bytes,
-					 in->cur_header->length_len,
-					 PROCESS_VALUE,
-					 buf,
-					 len);
-	    int_check_done(in);
-	    add_header_bytes();
-	    /* fallthrough */
-	case PROCESS_VALUE:
-	    read = int_read_value(in, buf, len);
-	    if (read == BINYO_ERR) return BINYO_ERR;
-	    total += read;
-	    buf += read;
-	    return (ssize_t) total;
-	default:
-	    krypt_error_add("Internal error");
-	    return BINYO_ERR; /* dummy */
-    }
-}
-
 static ssize_t
 int_read(krypt_instream_chunked *in, uint8_t *buf, size_t len)
 {
     ssize_t read = 0;
     size_t total = 0;
 
+    if (len > SSIZE_MAX)
+	len = SSIZE_MAX;
+
     while (total != len && in->state != DONE) {
-	read = int_read_single_element(in, buf, len);
-	if (read == BINYO_ERR) return BINYO_ERR;
-	if (total > (size_t) (SSIZE_MAX - read)) {
-	    krypt_error_add("Stream too large");
-	    return BINYO_ERR;
+	switch (in->state) {
+	    case NEW_HEADER:
+		if (int_read_new_header(in) == BINYO_ERR) return BINYO_ERR;
+		read = 0;
+		break;
+	    case PROCESS_HEADER:
+		read = (ssize_t) int_read_header_bytes(in, buf, len - total);
+		break;
+	    case PROCESS_VALUE:
+		read = int_read_value(in, buf, len - total);
+		if (read == BINYO_ERR) return BINYO_ERR;
+		break;
+	    default:
+		krypt_error_add("Internal error");
+		return BINYO_ERR;
 	}
 	total += read;
 	buf += read;
     }
-    return total;
+
+    if (total == 0 && in->state == DONE)
+	return BINYO_IO_EOF;
+    return (ssize_t) total;
 }
 
 static ssize_t
@@ -288,5 +330,6 @@ int_chunked_free(binyo_instream *instream)
     int_safe_cast(in, instream);
     if (in->cur_header)
 	krypt_asn1_header_free(in->cur_header);
+    xfree(in->frames);
 }
 
@@ -408,6 +408,11 @@ krypt_asn1_header_to_s(VALUE self)
  * * +io+: an IO-like object supporting IO#read and IO#seek
  * Returns a Header if parsing was successful or nil if the end of the stream
  * has been reached. May raise ParseError in case an error occurred.
+ *
+ * Non-blocking IOs (or any IO while a Fiber scheduler is active) are read
+ * with IO#read_nonblock, waiting for readiness through the scheduler, so
+ * parsing a socket only suspends the current fiber instead of blocking
+ * the thread.
  */
 static VALUE
 krypt_asn1_parser_next(VALUE self, VALUE io)
@@ -421,7 +426,7 @@ krypt_asn1_parser_next(VALUE self, VALUE io)
     if (type == T_STRING)
 	rb_raise(rb_eArgError, "Argument for next must respond to read");
 
-    if (!(in = binyo_instream_new_value(io)))
+    if (!(in = krypt_instream_new_value(io)))
 	rb_raise(rb_eArgError, "Argument for next must respond to read");
 
     result = krypt_asn1_next_header(in, &header);
@@ -41,26 +41,124 @@ extern ID sKrypt_IV_VALUE, sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIO
 
 extern ID sKrypt_ID_MERGE;
 
-extern VALUE cKryptASN1TemplateValue;
-
 #define KRYPT_TEMPLATE_PARSED    (1 << 0)
 #define KRYPT_TEMPLATE_DECODED   (1 << 1)
 #define KRYPT_TEMPLATE_MODIFIED  (1 << 2)
 
-typedef struct krypt_asn1_template_st {
+#define KRYPT_CODEC_PRIMITIVE	0
+#define KRYPT_CODEC_SEQUENCE	1
+#define KRYPT_CODEC_SET		2
+#define KRYPT_CODEC_TEMPLATE	3
+#define KRYPT_CODEC_SEQUENCE_OF	4
+#define KRYPT_CODEC_SET_OF	5
+#define KRYPT_CODEC_ANY		6
+#define KRYPT_CODEC_CHOICE	7
+#define KRYPT_CODEC_COUNT	8
+
+#define KRYPT_SCHEMA_OPTIONAL		(1 << 0)
+#define KRYPT_SCHEMA_DEFAULT		(1 << 1)
+#define KRYPT_SCHEMA_HAS_TAG		(1 << 2)
+#define KRYPT_SCHEMA_TAGGED		(1 << 3)
+#define KRYPT_SCHEMA_EXPLICIT		(1 << 4)
+#define KRYPT_SCHEMA_TEMPLATE_TYPE	(1 << 5)
+
+/* single byte tags of all four tag classes */
+#define KRYPT_TAG_INDEX_SIZE		(4 * 31)
+
+/*
+ * Maps the tag of an element to the layout positions of a SEQUENCE, SET
+ * or CHOICE that may match it. Positions whose tag is not known in
+ * advance (ANY, untagged CHOICEs and Templates) or that must be tried
+ * anyway (mandatory fields) are reachable through +next_stop+ instead.
+ */
+typedef struct krypt_asn1_tag_index_st {
+    int first[KRYPT_TAG_INDEX_SIZE]; /* first position with that tag, -1 if none */
+    int *next_same; /* next position with the same tag, -1 if none */
+    int *next_stop; /* first position >= i that cannot be skipped */
+} krypt_asn1_tag_index;
+
+/*
+ * A template definition Hash compiled into native form. A Template class'
+ * definition compiles into a root node whose layout holds one node per
+ * field, so the parser never has to look at the Hashes again. The schema
+ * of a 'type' that is itself a Template is resolved lazily into +child+.
+ */
+typedef struct krypt_asn1_schema_st krypt_asn1_schema;
+
+struct krypt_asn1_schema_st {
+    int codec;
     int flags;
-    krypt_asn1_object *object;
+    ID name;
+    int default_tag;
+    int tag;
+    int tag_class;
+    long min_size;
+    long layout_len;
+    krypt_asn1_schema *layout;
+    krypt_asn1_schema *child;
+    krypt_asn1_schema *root;
+    krypt_asn1_tag_index *index; /* SEQUENCE, SET and CHOICE only */
+    krypt_asn1_template_plan_fn plan; /* set on the root only */
+    VALUE type;
+    VALUE default_value;
     VALUE definition;
     VALUE options;
+    VALUE layout_ary;
+    VALUE self; /* the wrapping Data object, set on the root only */
+};
+
+krypt_asn1_schema *krypt_asn1_schema_get(VALUE klass);
+krypt_asn1_schema *krypt_asn1_schema_get_child(krypt_asn1_schema *schema);
+void krypt_asn1_schema_mark(krypt_asn1_schema *schema);
+long krypt_asn1_schema_next_candidate(krypt_asn1_schema *schema, long from, krypt_asn1_header *header);
+long krypt_asn1_schema_slot_index(krypt_asn1_schema *schema, ID name);
+void krypt_asn1_template_plan_attach(VALUE klass, krypt_asn1_schema *schema);
+
+#define krypt_asn1_schema_is_optional(s)	(((s)->flags & KRYPT_SCHEMA_OPTIONAL) == KRYPT_SCHEMA_OPTIONAL)
+#define krypt_asn1_schema_has_default(s)	(((s)->flags & KRYPT_SCHEMA_DEFAULT) == KRYPT_SCHEMA_DEFAULT)
+#define krypt_asn1_schema_is_tagged(s)		(((s)->flags & KRYPT_SCHEMA_TAGGED) == KRYPT_SCHEMA_TAGGED)
+#define krypt_asn1_schema_is_explicit(s)	(((s)->flags & KRYPT_SCHEMA_EXPLICIT) == KRYPT_SCHEMA_EXPLICIT)
+/* SEQUENCEs and SETs have one slot per field, anything else only @value */
+#define krypt_asn1_schema_slot_count(s)		(((s)->codec == KRYPT_CODEC_SEQUENCE || \
+						  (s)->codec == KRYPT_CODEC_SET) ? (s)->layout_len : 1)
+
+/*
+ * Both a Template instance and the value of each of its fields. The
+ * field values are kept in +slots+, an array owned by the instance and
+ * indexed by krypt_asn1_schema_slot_index. A slot holds a value as long
+ * as any of its flags are set.
+ */
+typedef struct krypt_asn1_template_st krypt_asn1_template;
+
+struct krypt_asn1_template_st {
+    int flags;
+    int unused_bits; /* BIT STRING values only */
+    krypt_asn1_object *object;
+    krypt_asn1_schema *schema;
+    krypt_asn1_schema *field;
     VALUE value;
-} krypt_asn1_template;
+    VALUE source; /* frozen String that shared encoding bytes point into */
+    VALUE projection; /* Hash of the fields to parse, nil for all of them */
+    krypt_asn1_template *slots;
+    long slots_len;
+    krypt_asn1_object **skipped; /* encodings of the fields left out, by layout position */
+    long skipped_len;
+    const uint8_t **pending; /* fields a plan located in +source+, not read yet */
+    const uint8_t *pending_end;
+};
 
-krypt_asn1_template *krypt_asn1_template_new(krypt_asn1_object *object, VALUE definition, VALUE options);
-krypt_asn1_template *krypt_asn1_template_new_from_stream(binyo_instream *in, krypt_asn1_header *header, VALUE definition, VALUE options);
-krypt_asn1_template *krypt_asn1_template_new_value(VALUE value);
+krypt_asn1_template *krypt_asn1_template_new(krypt_asn1_object *object, krypt_asn1_schema *schema, krypt_asn1_schema *field);
 
 void krypt_asn1_template_mark(krypt_asn1_template *t);
 void krypt_asn1_template_free(krypt_asn1_template *t);
+krypt_asn1_template *krypt_asn1_template_slot_init(krypt_asn1_template *t, long i, krypt_asn1_object *object, krypt_asn1_schema *schema, krypt_asn1_schema *field);
+krypt_asn1_template *krypt_asn1_template_slot_value(krypt_asn1_template *t, long i, VALUE value);
+krypt_asn1_object *krypt_asn1_template_get_skipped(krypt_asn1_template *t, long i);
+
+#define krypt_asn1_template_slot_at(t, i)	(((i) >= 0 && (i) < (t)->slots_len && (t)->slots[(i)].flags) ? \
+						 &(t)->slots[(i)] : NULL)
+#define krypt_asn1_template_has_skipped(t, i)	((i) < (t)->skipped_len && \
+						 ((t)->skipped[(i)] || ((t)->pending && (t)->pending[(i)])))
 
 #define krypt_asn1_template_set(klass, obj, t)	 							\
 do { 							    						\
@@ -78,12 +176,21 @@ do { 									\
     } 									\
 } while (0)
 
-#define krypt_asn1_template_get_definition(o)		((o)->definition)
-#define krypt_asn1_template_set_definition(o, v)	((o)->definition = (v))
-#define krypt_asn1_template_get_options(o)		((o)->options)
-#define krypt_asn1_template_set_options(o, v)		((o)->options = (v))
+#define krypt_asn1_template_get_definition(o)		((o)->schema ? (o)->schema->definition : Qnil)
+#define krypt_asn1_template_get_options(o)		((o)->field ? (o)->field->options : Qnil)
+#define krypt_asn1_template_get_schema(o)		((o)->schema)
+#define krypt_asn1_template_get_field(o)		((o)->field)
+#define krypt_asn1_template_set_schema(o, s, f)		\
+do {							\
+    (o)->schema = (s);					\
+    (o)->field = (f);					\
+} while (0)
 #define krypt_asn1_template_get_object(o)		((o)->object)
 #define krypt_asn1_template_set_object(o, v)		((o)->object = (v))
+#define krypt_asn1_template_get_source(o)		((o)->source)
+#define krypt_asn1_template_set_source(o, v)		((o)->source = (v))
+#define krypt_asn1_template_get_projection(o)		((o)->projection)
+#define krypt_asn1_template_set_projection(o, v)	((o)->projection = (v))
 #define krypt_asn1_template_get_value(o)		((o)->value)
 #define krypt_asn1_template_set_value(o, v)		((o)->value = (v))
 #define krypt_asn1_template_is_parsed(o)		(((o)->flags & KRYPT_TEMPLATE_PARSED) == KRYPT_TEMPLATE_PARSED)
@@ -127,24 +234,23 @@ do {						\
 #define krypt_hash_get_layout(d) 	rb_hash_aref((d), ID2SYM(sKrypt_ID_LAYOUT))
 #define krypt_hash_get_min_size(d) 	rb_hash_aref((d), ID2SYM(sKrypt_ID_MIN_SIZE))
 
+/*
+ * The view the parser has of a value: +schema+ describes its structure,
+ * +field+ the node carrying name and tagging options. Both are the same
+ * node except for Template fields, where +schema+ is the Template's own.
+ */
 typedef struct krypt_asn1_definition_st {
-    VALUE definition;
-    VALUE options;
-    VALUE values[8];
-    unsigned short value_read[8];
+    krypt_asn1_schema *schema;
+    krypt_asn1_schema *field;
     long matched_layout; /* this information is only used by CHOICEs */
 } krypt_asn1_definition;
 
-#define KRYPT_DEFINITION_NAME 0
-#define KRYPT_DEFINITION_TYPE 1
-#define KRYPT_DEFINITION_LAYOUT 2
-#define KRYPT_DEFINITION_MIN_SIZE 3
-#define KRYPT_DEFINITION_OPTIONAL 4
-#define KRYPT_DEFINITION_TAG 5
-#define KRYPT_DEFINITION_TAGGING 6
-#define KRYPT_DEFINITION_DEFAULT 7
-
-void krypt_definition_init(krypt_asn1_definition *def, VALUE definition, VALUE options);
+#define krypt_definition_init(def, s, f)		\
+do {							\
+    (def)->schema = (s);				\
+    (def)->field = (f);					\
+    (def)->matched_layout = 0;				\
+} while (0)
 
 #define get_or_raise(dest, v, msg)	\
 do {					\
@@ -156,30 +262,87 @@ do {					\
     (dest) = value;			\
 } while (0)
 
-#define krypt_definition_get_definition(def)		((def)->definition)
-#define krypt_definition_set_definition(def, d)		((def)->definition = (d))
-#define krypt_definition_get_options(def)		((def)->options)
-#define krypt_definition_set_options(def, o)		((def)->options = (o))
+#define krypt_definition_get_schema(def)		((def)->schema)
+#define krypt_definition_get_field(def)			((def)->field)
 #define krypt_definition_get_matched_layout(def)	((def)->matched_layout)
 #define krypt_definition_set_matched_layout(def, i)	((def)->matched_layout = (i))
 
-VALUE krypt_definition_get_name(krypt_asn1_definition *def);
-VALUE krypt_definition_get_type(krypt_asn1_definition *def);
-VALUE krypt_definition_get_layout(krypt_asn1_definition *def);
-VALUE krypt_definition_get_min_size(krypt_asn1_definition *def);
-VALUE krypt_definition_get_optional(krypt_asn1_definition *def);
-VALUE krypt_definition_get_tag(krypt_asn1_definition *def);
-VALUE krypt_definition_get_tagging(krypt_asn1_definition *def);
-VALUE krypt_definition_get_default_value(krypt_asn1_definition *def);
-int krypt_definition_is_optional(krypt_asn1_definition *def);
-int krypt_definition_has_default(krypt_asn1_definition *def);
+#define krypt_definition_get_codec(def)		((def)->schema->codec)
+#define krypt_definition_get_type(def)		((def)->schema->type)
+#define krypt_definition_get_name(def)		((def)->field->name)
+#define krypt_definition_get_tag(def)		(((def)->field->flags & KRYPT_SCHEMA_HAS_TAG) ? \
+	                                         (def)->field->tag : (def)->schema->default_tag)
+#define krypt_definition_get_tag_class(def)	((def)->field->tag_class)
+#define krypt_definition_get_default_value(def)	((def)->field->default_value)
+#define krypt_definition_is_optional(def)	krypt_asn1_schema_is_optional((def)->field)
+#define krypt_definition_has_default(def)	krypt_asn1_schema_has_default((def)->field)
+#define krypt_definition_is_tagged(def)		krypt_asn1_schema_is_tagged((def)->field)
+#define krypt_definition_is_explicit(def)	krypt_asn1_schema_is_explicit((def)->field)
+
+#define KRYPT_TEMPLATE_MATCH		1
+#define KRYPT_TEMPLATE_NO_MATCH		0
+#define KRYPT_TEMPLATE_MATCH_ERR	-1
+#define KRYPT_TEMPLATE_MATCH_DEFAULT	-2
+
+/* why a mandatory value did not match */
+#define KRYPT_TEMPLATE_MISSING			0
+#define KRYPT_TEMPLATE_MISSING_CONSTRUCTED	1
+#define KRYPT_TEMPLATE_NOT_CONSTRUCTED		2
+#define KRYPT_TEMPLATE_MISSING_CHOICE		3
+#define KRYPT_TEMPLATE_CHOICE_TAGGING		4
+
+/*
+ * A value to be matched against a definition: its header, its contents
+ * and what to do when a DEFAULT value applies or a mandatory value does
+ * not match. Either callback may be NULL.
+ */
+typedef struct krypt_asn1_template_matcher_st krypt_asn1_template_matcher;
+
+struct krypt_asn1_template_matcher_st {
+    krypt_asn1_header *header;
+    const uint8_t *content;
+    size_t content_len;
+    VALUE self;
+    void (*apply_default)(krypt_asn1_template_matcher *m, krypt_asn1_definition *def);
+    void (*mismatch)(krypt_asn1_template_matcher *m, krypt_asn1_definition *def, int reason);
+};
+
+int krypt_asn1_template_match(krypt_asn1_template_matcher *m, krypt_asn1_definition *def);
 
 int krypt_asn1_template_error_add(VALUE definition);
 int krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out);
 void krypt_asn1_template_set_cb_value(VALUE self, ID ivname, VALUE value);
 int krypt_asn1_template_encode(VALUE templ, VALUE *out);
+int krypt_asn1_template_encode_to(binyo_outstream *out, VALUE templ);
+int krypt_asn1_template_parse_bytes(VALUE klass, krypt_asn1_schema *schema, VALUE source, uint8_t *bytes, size_t len, VALUE *out);
+
+/*
+ * The value of a parsed SEQUENCE OF or SET OF. Its elements are located
+ * through an index of their offsets and only parsed when accessed.
+ */
+typedef struct krypt_asn1_collection_st {
+    krypt_asn1_schema *field;
+    VALUE source; /* frozen String holding the element encodings */
+    uint8_t *bytes;
+    size_t *offsets; /* count + 1 entries, the last one marks the end */
+    long count;
+    VALUE projection; /* applied to each element if they are Templates */
+    VALUE cache; /* Hash of the elements parsed so far, by index */
+} krypt_asn1_collection;
+
+extern VALUE cKryptASN1TemplateCollection;
+
+#define krypt_asn1_collection_get(obj, c)	Data_Get_Struct((obj), krypt_asn1_collection, (c))
+#define krypt_asn1_collection_cached(c, i)	rb_hash_lookup2((c)->cache, LONG2NUM(i), Qundef)
+
+VALUE krypt_asn1_collection_new(krypt_asn1_schema *field, VALUE source, uint8_t *bytes, size_t len, VALUE projection);
+VALUE krypt_asn1_collection_entry(VALUE self, long i);
 
 void Init_krypt_asn1_template_parser(void);
+void Init_krypt_asn1_template_schema(void);
+void Init_krypt_asn1_template_collection(void);
+void Init_krypt_asn1_template_validator(void);
+void Init_krypt_asn1_template_plan(void);
 
 #endif /*_KRYPT_ASN1_TEMPLATE_INTERNAL_H_ */
 
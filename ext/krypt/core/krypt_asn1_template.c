@@ -43,135 +43,176 @@ ID sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIONS;
 ID sKrypt_ID_MERGE;
 
 VALUE mKryptASN1Template;
-VALUE cKryptASN1TemplateValue;
 
-void
-krypt_definition_init(krypt_asn1_definition *def, VALUE definition, VALUE options)
-{
-    memset(def, 0, sizeof(krypt_asn1_definition));
-    def->definition = definition;
-    def->options = options;
-}
-
-#define DEFINITION_GETTER(getter, idx)					\
-VALUE									\
-krypt_definition_get_##getter(krypt_asn1_definition *def)		\
-{									\
-    if (!def->value_read[(idx)]) {					\
-	def->values[(idx)] = krypt_hash_get_##getter(def->definition);	\
-	def->value_read[(idx)] = 1;					\
-    }									\
-    return def->values[(idx)];						\
-}
-
-#define OPTIONS_GETTER(getter, idx)					\
-VALUE									\
-krypt_definition_get_##getter(krypt_asn1_definition *def)		\
-{									\
-    if (!def->value_read[(idx)]) {					\
-	if (NIL_P(def->options))					\
-	    def->values[(idx)] = Qnil;					\
-	else								\
-	   def->values[(idx)] = krypt_hash_get_##getter(def->options);	\
-	def->value_read[(idx)] = 1;					\
-    }									\
-    return def->values[(idx)];						\
-}
-
-DEFINITION_GETTER(name, KRYPT_DEFINITION_NAME)
-DEFINITION_GETTER(type, KRYPT_DEFINITION_TYPE)
-DEFINITION_GETTER(layout, KRYPT_DEFINITION_LAYOUT)
-DEFINITION_GETTER(min_size, KRYPT_DEFINITION_MIN_SIZE)
-
-OPTIONS_GETTER(optional, KRYPT_DEFINITION_OPTIONAL)
-OPTIONS_GETTER(tag, KRYPT_DEFINITION_TAG)
-OPTIONS_GETTER(tagging, KRYPT_DEFINITION_TAGGING)
-OPTIONS_GETTER(default_value, KRYPT_DEFINITION_DEFAULT)
-
-int 
-krypt_definition_is_optional(krypt_asn1_definition *def)
+static void
+int_template_init(krypt_asn1_template *t, krypt_asn1_object *object, krypt_asn1_schema *schema, krypt_asn1_schema *field)
 {
-    VALUE x = krypt_definition_get_optional(def);
-    int optional = RTEST(x);
-    if (optional) return 1;
-    x = krypt_definition_get_default_value(def);
-    return !NIL_P(x);
+    t->object = object;
+    t->schema = schema;
+    t->field = field;
+    t->value = Qnil;
+    t->source = Qnil;
+    t->projection = Qnil;
+    t->slots = NULL;
+    t->slots_len = 0;
+    t->skipped = NULL;
+    t->skipped_len = 0;
+    t->pending = NULL;
+    t->pending_end = NULL;
+    t->unused_bits = 0;
+    t->flags = 0;
 }
 
-int 
-krypt_definition_has_default(krypt_asn1_definition *def)
+/* releases everything +t+ owns, but not +t+ itself */
+static void
+int_template_clear(krypt_asn1_template *t)
 {
-    return !NIL_P(krypt_definition_get_default_value(def));
+    long i;
+
+    if (t->object)
+	krypt_asn1_object_free(t->object);
+    if (t->slots) {
+	for (i=0; i < t->slots_len; ++i)
+	    int_template_clear(&t->slots[i]);
+	xfree(t->slots);
+    }
+    if (t->skipped) {
+	for (i=0; i < t->skipped_len; ++i) {
+	    if (t->skipped[i])
+		krypt_asn1_object_free(t->skipped[i]);
+	}
+	xfree(t->skipped);
+    }
+    if (t->pending)
+	xfree(t->pending);
 }
 
 krypt_asn1_template *
-krypt_asn1_template_new(krypt_asn1_object *object, VALUE definition, VALUE options)
+krypt_asn1_template_new(krypt_asn1_object *object, krypt_asn1_schema *schema, krypt_asn1_schema *field)
 {
     krypt_asn1_template *ret;
 
     ret = ALLOC(krypt_asn1_template);
-    ret->object = object;
-    ret->definition = definition;
-    ret->options = options;
-    ret->value = Qnil;
-    ret->flags = 0;
+    int_template_init(ret, object, schema, field);
     return ret;
 }
 
+void
+krypt_asn1_template_free(krypt_asn1_template *template)
+{
+    if (!template) return;
+    int_template_clear(template);
+    xfree(template);
+}
+
+/*
+ * Replaces the value in slot +i+ of +t+ by the encoding +object+ of a
+ * value of +field+. The slot is returned with no flags set, so it only
+ * holds a value once the caller sets them.
+ */
 krypt_asn1_template *
-krypt_asn1_template_new_from_stream(binyo_instream *in, krypt_asn1_header *header, VALUE definition, VALUE options)
+krypt_asn1_template_slot_init(krypt_asn1_template *t, long i, krypt_asn1_object *object, krypt_asn1_schema *schema, krypt_asn1_schema *field)
 {
-    krypt_asn1_object *encoding;
-    uint8_t *value = NULL;
-    size_t value_len;
+    krypt_asn1_template *slot;
 
-    if (krypt_asn1_get_value(in, header, &value, &value_len) == KRYPT_ERR) return NULL;
-    if (!(encoding = krypt_asn1_object_new_value(header, value, value_len))) return NULL;
-    return krypt_asn1_template_new(encoding, definition, options);
+    if (!t->slots) {
+	long j, len = krypt_asn1_schema_slot_count(t->schema);
+
+	t->slots = ALLOC_N(krypt_asn1_template, len ? len : 1);
+	for (j=0; j < len; ++j)
+	    int_template_init(&t->slots[j], NULL, NULL, NULL);
+	t->slots_len = len;
+    }
+    slot = &t->slots[i];
+    int_template_clear(slot);
+    int_template_init(slot, object, schema, field);
+    return slot;
 }
 
+/* sets slot +i+ of +t+ to +value+, which needs no further decoding */
 krypt_asn1_template *
-krypt_asn1_template_new_value(VALUE value)
+krypt_asn1_template_slot_value(krypt_asn1_template *t, long i, VALUE value)
 {
-    krypt_asn1_template *ret;
+    krypt_asn1_template *slot = krypt_asn1_template_slot_init(t, i, NULL, NULL, NULL);
 
-    ret = krypt_asn1_template_new(NULL, Qnil, Qnil);
-    ret->value = value;
-    ret->flags = KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED;
-    return ret;
+    slot->value = value;
+    slot->flags = KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED;
+    return slot;
 }
 
-void
-krypt_asn1_template_free(krypt_asn1_template *template)
+/*
+ * Returns the encoding of the field at layout position +i+ that was left
+ * out when parsing, or NULL if there is none. A field that a plan only
+ * located is read here, its value is shared with the source.
+ */
+krypt_asn1_object *
+krypt_asn1_template_get_skipped(krypt_asn1_template *t, long i)
 {
-    if (!template) return;
-    if (template->object)
-	krypt_asn1_object_free(template->object);
-    xfree(template);
+    krypt_asn1_header peek, *header;
+    krypt_asn1_object *object;
+    const uint8_t *p;
+    uint8_t *value;
+
+    if (i >= t->skipped_len) return NULL;
+    if (t->skipped[i] || !t->pending || !(p = t->pending[i])) return t->skipped[i];
+
+    if (krypt_asn1_header_peek(p, t->pending_end - p, &peek) == KRYPT_ERR) {
+	krypt_error_add("Could not read value located by plan");
+	return NULL;
+    }
+    header = krypt_asn1_header_new();
+    header->tag = peek.tag;
+    header->tag_class = peek.tag_class;
+    header->is_constructed = peek.is_constructed;
+    header->length = peek.length;
+    header->tag_len = peek.tag_len;
+    header->tag_bytes = ALLOC_N(uint8_t, peek.tag_len);
+    memcpy(header->tag_bytes, peek.tag_bytes, peek.tag_len);
+    header->length_len = peek.length_len;
+    header->length_bytes = ALLOC_N(uint8_t, peek.length_len);
+    memcpy(header->length_bytes, peek.length_bytes, peek.length_len);
+
+    /* empty values have no bytes, as when they are read */
+    value = peek.length ? (uint8_t *) p + peek.tag_len + peek.length_len : NULL;
+    object = krypt_asn1_object_new_value(header, value, peek.length);
+    object->bytes_shared = 1;
+    t->skipped[i] = object;
+    t->pending[i] = NULL;
+    return object;
 }
 
 void
 krypt_asn1_template_mark(krypt_asn1_template *template)
 {
+    long i;
+
     if (!template) return;
     if (!NIL_P(template->value))
 	rb_gc_mark(template->value);
+    /* pinned, the encoding bytes point into it */
+    if (!NIL_P(template->source))
+	rb_gc_mark(template->source);
+    if (!NIL_P(template->projection))
+	rb_gc_mark(template->projection);
+    krypt_asn1_schema_mark(template->schema);
+    krypt_asn1_schema_mark(template->field);
+    for (i=0; i < template->slots_len; ++i) {
+	if (template->slots[i].flags)
+	    krypt_asn1_template_mark(&template->slots[i]);
+    }
 }
 
 static VALUE
 krypt_asn1_template_initialize(VALUE self)
 {
     krypt_asn1_template *template;
-    VALUE definition, klass;
+    krypt_asn1_schema *schema;
 
     if (DATA_PTR(self))
 	rb_raise(eKryptASN1Error, "Template already initialized");
-    klass = CLASS_OF(self);
-    if (NIL_P((definition = krypt_definition_get(klass)))) {
-        krypt_error_add("%s has no ASN.1 definition", rb_class2name(klass));
+    if (!(schema = krypt_asn1_schema_get(CLASS_OF(self))))
         return Qnil;
-    }
-    template = krypt_asn1_template_new(NULL, definition, krypt_hash_get_options(definition));
+    template = krypt_asn1_template_new(NULL, schema, schema);
     krypt_asn1_template_set_parsed(template, 1);
     krypt_asn1_template_set_decoded(template, 1);
     DATA_PTR(self) = template;
@@ -190,24 +231,21 @@ krypt_asn1_template_alloc(VALUE klass)
 }
 
 static VALUE
-int_traverse_template(VALUE vt, 
+int_traverse_template(krypt_asn1_template *t, 
 		      VALUE name, 
-		      void (*traverse_cb) (VALUE, VALUE, void *), 
+		      void (*traverse_cb) (krypt_asn1_template *, VALUE, void *), 
 		      void *args)
 {
     ID codec;
     VALUE vcodec, definition;
-    krypt_asn1_template *t;
 
-    traverse_cb(vt, name, args);
+    traverse_cb(t, name, args);
 
-    if (NIL_P(vt)) {
+    if (!t) {
 	/* base case 1 */
 	return Qnil;
     }
 
-    krypt_asn1_template_get(vt, t);
-
     definition = krypt_asn1_template_get_definition(t);
     if (NIL_P(definition)) {
 	/* base case 2 */
@@ -225,7 +263,8 @@ int_traverse_template(VALUE vt,
 	codec == sKrypt_ID_SET_OF ||
 	codec == sKrypt_ID_SEQUENCE_OF) {
 	VALUE name = krypt_hash_get_name(definition);
-	VALUE value = rb_ivar_get(vt, sKrypt_IV_VALUE);
+	/* only a CHOICE Template has a value of its own */
+	krypt_asn1_template *value = codec == sKrypt_ID_CHOICE ? krypt_asn1_template_slot_at(t, 0) : NULL;
 	return int_traverse_template(value, name, traverse_cb, args);
     }
     if (codec == sKrypt_ID_SET || codec == sKrypt_ID_SEQUENCE) {
@@ -233,17 +272,19 @@ int_traverse_template(VALUE vt,
 	VALUE dummy = Qnil;
 	VALUE layout = krypt_hash_get_layout(definition);
 	for (i=0; i < RARRAY_LEN(layout); ++i) {
-	    VALUE name, value;
+	    VALUE name;
 	    VALUE cur_def = rb_ary_entry(layout, i);
 
 	    get_or_raise(name, krypt_hash_get_name(cur_def), "SEQ/SET value without name found");
-	    value = rb_ivar_get(vt, SYM2ID(name));
-	    dummy = int_traverse_template(value, name, traverse_cb, args);
+	    dummy = int_traverse_template(krypt_asn1_template_slot_at(t, i), name, traverse_cb, args);
 	}
 	return dummy;
     }
     if (codec == sKrypt_ID_TEMPLATE) {
-	return int_traverse_template(t->value, name, traverse_cb, args);
+	krypt_asn1_template *instance = NULL;
+	if (!NIL_P(t->value))
+	    krypt_asn1_template_get(t->value, instance);
+	return int_traverse_template(instance, name, traverse_cb, args);
     }
 
     rb_raise(eKryptASN1Error, "Unknown codec encountered: %s", rb_id2name(codec));
@@ -303,8 +344,27 @@ krypt_asn1_template_set_callback_choice(VALUE self, VALUE name, VALUE value)
 {
     ID ivname = SYM2ID(name);
 
-    if (ivname == sKrypt_IV_TAG || ivname == sKrypt_IV_TYPE)
+    if (ivname == sKrypt_IV_TAG || ivname == sKrypt_IV_TYPE) {
+	VALUE dummy;
+	krypt_asn1_template *t, *vt;
+
+	/* the value needs to be encoded anew with the changed alternative */
+	if (krypt_asn1_template_get_cb_value(self, sKrypt_IV_VALUE, &dummy) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(ivname));
+	krypt_asn1_template_get(self, t);
+	krypt_asn1_template_set_modified(t, 1);
+	if (t->object) {
+	    krypt_asn1_object_free(t->object);
+	    t->object = NULL;
+	}
+	if ((vt = krypt_asn1_template_slot_at(t, 0))) {
+	    if (vt->object) {
+		krypt_asn1_object_free(vt->object);
+		vt->object = NULL;
+	    }
+	}
 	return rb_ivar_set(self, ivname, value);
+    }
 
     return krypt_asn1_template_set_callback(self, name, value);
 }
@@ -327,9 +387,8 @@ krypt_asn1_template_cmp(VALUE self, VALUE other)
 }
 
 static void
-int_inspect_i(VALUE template_value, VALUE name, void *args)
+int_inspect_i(krypt_asn1_template *t, VALUE name, void *args)
 {
-    krypt_asn1_template *t;
     krypt_asn1_object *object;
     VALUE definition, codec, str;
     ID puts = rb_intern("puts");
@@ -338,14 +397,12 @@ int_inspect_i(VALUE template_value, VALUE name, void *args)
 
     str = rb_str_new2("Name: ");
     rb_str_append(str, rb_funcall(name, to_s, 0));
-    if (NIL_P(template_value)) {
+    if (!t) {
 	rb_str_append(str, rb_str_new2(" @value"));
 	rb_funcall(rb_mKernel, puts, 1, str);
 	return;
     }
 
-    krypt_asn1_template_get(template_value, t);
-
     definition = krypt_asn1_template_get_definition(t);
     codec = NIL_P(definition) ? rb_str_new2("") : krypt_hash_get_codec(definition);
 
@@ -381,7 +438,10 @@ static VALUE
 krypt_asn1_template_inspect(VALUE self)
 {
     VALUE name = rb_str_new2("ROOT");
-    return int_traverse_template(self, name, int_inspect_i, NULL);
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    return int_traverse_template(t, name, int_inspect_i, NULL);
 }
 
 /*
@@ -400,17 +460,6 @@ krypt_asn1_template_to_der(VALUE template)
     return ret;
 }
 
-static VALUE
-krypt_asn1_template_value_to_s(VALUE self)
-{
-    krypt_asn1_template *template;
-
-    krypt_asn1_template_get(self, template);
-    if (NIL_P(template->value))
-	return rb_str_new2("");
-    return rb_funcall(template->value, rb_intern("to_s"), 0);
-}
-
 void
 Init_krypt_asn1_template(void)
 {
@@ -451,9 +500,10 @@ Init_krypt_asn1_template(void)
     rb_define_method(mKryptASN1Template, "<=>", krypt_asn1_template_cmp, 1);
     rb_define_method(mKryptASN1Template, "__inspect__", krypt_asn1_template_inspect, 0);
 
-    cKryptASN1TemplateValue = rb_define_class_under(mKryptASN1Template, "Value", rb_cObject);
-    rb_define_method(cKryptASN1TemplateValue, "to_s", krypt_asn1_template_value_to_s, 0);
-
+    Init_krypt_asn1_template_schema();
     Init_krypt_asn1_template_parser();
+    Init_krypt_asn1_template_collection();
+    Init_krypt_asn1_template_validator();
+    Init_krypt_asn1_template_plan();
 }
 
@@ -47,7 +47,16 @@ extern ID sKrypt_ID_MERGE;
 
 extern VALUE mKryptASN1Template;
 
+/*
+ * Locates the elements of the contents of a SEQUENCE or SET, storing the
+ * layout position of the i-th element in fields[i] and its offset in
+ * offsets[i]. Returns the number of elements or -1 to have the generic
+ * parser handle the contents.
+ */
+typedef long (*krypt_asn1_template_plan_fn)(const uint8_t *bytes, size_t len, long *fields, size_t *offsets);
+
 VALUE krypt_asn1_template_parse_der(VALUE klass, VALUE der);
+int krypt_asn1_template_register_plan(VALUE klass, const char *signature, krypt_asn1_template_plan_fn plan);
 VALUE krypt_asn1_template_to_der(VALUE templ);
 
 void Init_krypt_asn1_template(void);
@@ -0,0 +1,280 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
+
+VALUE cKryptASN1TemplateCollection;
+
+static void
+int_collection_mark(krypt_asn1_collection *c)
+{
+    if (!c) return;
+    /* pinned, the element encodings point into it */
+    rb_gc_mark(c->source);
+    rb_gc_mark(c->projection);
+    rb_gc_mark(c->cache);
+    krypt_asn1_schema_mark(c->field);
+}
+
+static void
+int_collection_free(krypt_asn1_collection *c)
+{
+    if (!c) return;
+    if (c->offsets) xfree(c->offsets);
+    xfree(c);
+}
+
+static int
+int_collection_index(krypt_asn1_collection *c, size_t len)
+{
+    size_t off = 0, header_len, value_len, cap = 16;
+    long n = 0;
+
+    c->offsets = ALLOC_N(size_t, cap);
+    while (off < len) {
+	if (krypt_asn1_value_bounds(c->bytes + off, len - off, &header_len, &value_len) == KRYPT_ERR)
+	    return KRYPT_ERR;
+	if ((size_t) n + 1 == cap) {
+	    cap *= 2;
+	    REALLOC_N(c->offsets, size_t, cap);
+	}
+	c->offsets[n++] = off;
+	off += header_len + value_len;
+    }
+    c->offsets[n] = len;
+    c->count = n;
+    return KRYPT_OK;
+}
+
+/*
+ * Creates the collection for the +len+ bytes of element encodings at
+ * +bytes+, which lie within the frozen String +source+ or are copied if
+ * +source+ is nil. Returns nil if the elements cannot be indexed without
+ * parsing them, that is if they use indefinite length encodings.
+ * Template elements are parsed with +projection+.
+ */
+VALUE
+krypt_asn1_collection_new(krypt_asn1_schema *field, VALUE source, uint8_t *bytes, size_t len, VALUE projection)
+{
+    VALUE obj;
+    krypt_asn1_collection *c;
+
+    if (NIL_P(source)) {
+	source = rb_str_new((const char *) bytes, len);
+	rb_obj_freeze(source);
+	bytes = (uint8_t *) RSTRING_PTR(source);
+    }
+
+    c = ALLOC(krypt_asn1_collection);
+    c->field = field;
+    c->source = source;
+    c->bytes = bytes;
+    c->offsets = NULL;
+    c->count = 0;
+    c->projection = projection;
+    c->cache = rb_hash_new();
+    obj = Data_Wrap_Struct(cKryptASN1TemplateCollection, int_collection_mark, int_collection_free, c);
+
+    if (int_collection_index(c, len) == KRYPT_ERR) return Qnil;
+    return obj;
+}
+
+static int
+int_collection_parse(krypt_asn1_collection *c, long i, VALUE *out)
+{
+    VALUE value;
+    binyo_instream *in;
+    int result;
+    krypt_asn1_schema *field = c->field, *type_schema;
+    uint8_t *p = c->bytes + c->offsets[i];
+    size_t len = c->offsets[i + 1] - c->offsets[i];
+
+    if (field->flags & KRYPT_SCHEMA_TEMPLATE_TYPE) {
+	krypt_asn1_template *t;
+	if (!(type_schema = krypt_asn1_schema_get_child(field))) return KRYPT_ERR;
+	if (krypt_asn1_template_parse_bytes(field->type, type_schema, c->source, p, len, out) == KRYPT_ERR)
+	    return KRYPT_ERR;
+	krypt_asn1_template_get(*out, t);
+	krypt_asn1_template_set_projection(t, c->projection);
+	return KRYPT_OK;
+    }
+
+    in = binyo_instream_new_bytes(p, len);
+    result = krypt_asn1_decode_stream(in, &value);
+    binyo_instream_free(in);
+    if (result != KRYPT_OK) return KRYPT_ERR;
+    if (!rb_obj_is_kind_of(value, field->type)) {
+	krypt_error_add("Expected %s but got %s instead", rb_class2name(field->type), rb_class2name(CLASS_OF(value)));
+	return KRYPT_ERR;
+    }
+    *out = value;
+    return KRYPT_OK;
+}
+
+/*
+ * Returns the element at +i+, parsing it unless it is kept already. If
+ * +keep+ is set, a newly parsed element is kept so that changes to it
+ * are picked up when encoding.
+ */
+static VALUE
+int_collection_element(krypt_asn1_collection *c, long i, int keep)
+{
+    VALUE value;
+
+    if ((value = krypt_asn1_collection_cached(c, i)) != Qundef) return value;
+    if (int_collection_parse(c, i, &value) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not parse element %ld", i);
+    if (keep)
+	rb_hash_aset(c->cache, LONG2NUM(i), value);
+    return value;
+}
+
+/* the element at +i+, kept from now on */
+VALUE
+krypt_asn1_collection_entry(VALUE self, long i)
+{
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(self, c);
+    return int_collection_element(c, i, 1);
+}
+
+/*
+ * call-seq:
+ *    coll.size -> Integer
+ *
+ * Returns the number of elements without parsing any of them.
+ */
+static VALUE
+krypt_asn1_collection_size(VALUE self)
+{
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(self, c);
+    return LONG2NUM(c->count);
+}
+
+/*
+ * call-seq:
+ *    coll[index] -> element or nil
+ *
+ * Returns the element at +index+, parsing only that element. Negative
+ * indices count from the end, nil is returned if +index+ is out of range.
+ * The element is kept by the collection, so changes to it are encoded.
+ */
+static VALUE
+krypt_asn1_collection_aref(VALUE self, VALUE index)
+{
+    long i = NUM2LONG(index);
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(self, c);
+    if (i < 0) i += c->count;
+    if (i < 0 || i >= c->count) return Qnil;
+    return krypt_asn1_collection_entry(self, i);
+}
+
+/*
+ * call-seq:
+ *    coll.each { |element| block } -> coll
+ *
+ * Parses and yields the elements one by one. If no block is given, an
+ * enumerator is returned instead.
+ *
+ * Elements parsed here are not kept by the collection, so iterating over
+ * a large collection does not keep all of its elements alive. Changes to
+ * them are not encoded, use #[] for elements that are to be changed.
+ */
+static VALUE
+krypt_asn1_collection_each(VALUE self)
+{
+    long i;
+    krypt_asn1_collection *c;
+
+    KRYPT_RETURN_ENUMERATOR(self, sKrypt_ID_EACH);
+
+    krypt_asn1_collection_get(self, c);
+    for (i=0; i < c->count; ++i)
+	rb_yield(int_collection_element(c, i, 0));
+    return self;
+}
+
+/*
+ * call-seq:
+ *    coll.each_slice(n) { |elements| block } -> coll
+ *
+ * Yields the elements in Arrays of +n+, parsing one slice at a time. If
+ * no block is given, an enumerator is returned instead. As with #each,
+ * the elements are not kept by the collection.
+ */
+static VALUE
+krypt_asn1_collection_each_slice(VALUE self, VALUE vn)
+{
+    long i, j, n = NUM2LONG(vn);
+    krypt_asn1_collection *c;
+
+    if (n <= 0) rb_raise(rb_eArgError, "invalid slice size");
+    KRYPT_RETURN_ENUMERATOR_ARGS(self, rb_intern("each_slice"), 1, &vn);
+
+    krypt_asn1_collection_get(self, c);
+    for (i=0; i < c->count; i += n) {
+	VALUE slice = rb_ary_new2(n);
+	for (j=i; j < c->count && j < i + n; ++j)
+	    rb_ary_push(slice, int_collection_element(c, j, 0));
+	rb_yield(slice);
+    }
+    return self;
+}
+
+void
+Init_krypt_asn1_template_collection(void)
+{
+#if 0
+    mKrypt = rb_define_module("Krypt"); /* Let RDoc know */
+    mKryptASN1 = rb_define_module_under(mKrypt, "ASN1");
+    mKryptASN1Template = rb_define_module_under(mKryptASN1, "Template");
+#endif
+
+    /*
+     * Document-class: Krypt::ASN1::Template::Collection
+     *
+     * The value of a parsed SEQUENCE OF or SET OF field. Elements are parsed
+     * only when they are accessed, so looking up a few elements of a large
+     * collection does not create objects for all the others.
+     */
+    cKryptASN1TemplateCollection = rb_define_class_under(mKryptASN1Template, "Collection", rb_cObject);
+    rb_include_module(cKryptASN1TemplateCollection, rb_mEnumerable);
+    rb_undef_alloc_func(cKryptASN1TemplateCollection);
+    rb_define_method(cKryptASN1TemplateCollection, "size", krypt_asn1_collection_size, 0);
+    rb_define_alias(cKryptASN1TemplateCollection, "length", "size");
+    rb_define_method(cKryptASN1TemplateCollection, "[]", krypt_asn1_collection_aref, 1);
+    rb_define_method(cKryptASN1TemplateCollection, "each", krypt_asn1_collection_each, 0);
+    rb_define_method(cKryptASN1TemplateCollection, "each_slice", krypt_asn1_collection_each_slice, 1);
+}
@@ -30,13 +30,813 @@
 #include "krypt_asn1-internal.h"
 #include "krypt_asn1_template-internal.h"
 
-int
-int_template_encode_non_cached(VALUE self, krypt_asn1_template *template, VALUE *out)
+/*
+ * Templates that were created from scratch or modified are encoded in three
+ * passes: the values are first turned into a tree of encoding nodes, then
+ * the lengths are computed bottom-up and finally everything is written out
+ * in one go, so that no intermediate encodings need to be created. Values
+ * that still have their parsed encoding and were not modified since are
+ * spliced in verbatim, so only the modified parts are encoded anew.
+ */
+
+#define int_has_cached_encoding(object) ((object) && ((object)->bytes || (object)->bytes_len == 0) \
+	                                 && (object)->header->tag_bytes && (object)->header->length_bytes)
+
+#define INT_ENC_RAW	0 /* bytes form a complete encoding */
+#define INT_ENC_OBJECT	1 /* a cached krypt_asn1_object */
+#define INT_ENC_PRIM	2 /* header followed by bytes */
+#define INT_ENC_CONS	3 /* header followed by the children */
+
+typedef struct int_enc_node_st {
+    int type;
+    int sort;
+    krypt_asn1_header *header;
+    krypt_asn1_object *object;
+    uint8_t *bytes;
+    size_t len;
+    int shared; /* bytes are not owned by the node */
+    size_t total;
+    long first_child;
+    long last_child;
+    long next;
+} int_enc_node;
+
+typedef struct int_enc_ctx_st {
+    int_enc_node *nodes;
+    long num;
+    long cap;
+} int_enc_ctx;
+
+static int int_same_tagging(krypt_asn1_schema *a, krypt_asn1_schema *b);
+static int int_template_is_clean(VALUE instance);
+static int int_value_is_clean(krypt_asn1_template *vt);
+static int int_enc_def(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE self, krypt_asn1_template *vt, VALUE value, long *out);
+static int int_enc_template(int_enc_ctx *ctx, VALUE instance, krypt_asn1_schema *field, long *out);
+
+static void
+int_enc_ctx_init(int_enc_ctx *ctx)
+{
+    ctx->num = 0;
+    ctx->cap = 16;
+    ctx->nodes = ALLOC_N(int_enc_node, ctx->cap);
+}
+
+static void
+int_enc_ctx_free(int_enc_ctx *ctx)
+{
+    long i;
+
+    if (!ctx->nodes) return;
+    for (i=0; i < ctx->num; ++i) {
+	int_enc_node *node = &ctx->nodes[i];
+	if (node->header) krypt_asn1_header_free(node->header);
+	if (node->bytes && !node->shared) xfree(node->bytes);
+    }
+    xfree(ctx->nodes);
+    ctx->nodes = NULL;
+}
+
+static long
+int_enc_node_new(int_enc_ctx *ctx, int type)
+{
+    int_enc_node *node;
+
+    if (ctx->num == ctx->cap) {
+	ctx->cap *= 2;
+	REALLOC_N(ctx->nodes, int_enc_node, ctx->cap);
+    }
+    node = &ctx->nodes[ctx->num];
+    memset(node, 0, sizeof(int_enc_node));
+    node->type = type;
+    node->first_child = node->last_child = node->next = -1;
+    return ctx->num++;
+}
+
+static long
+int_enc_header_node_new(int_enc_ctx *ctx, int type, int tag, int tag_class)
+{
+    long idx = int_enc_node_new(ctx, type);
+    krypt_asn1_header *header = krypt_asn1_header_new();
+
+    header->tag = tag;
+    header->tag_class = tag_class;
+    header->is_constructed = type == INT_ENC_CONS;
+    ctx->nodes[idx].header = header;
+    return idx;
+}
+
+static void
+int_enc_add_child(int_enc_ctx *ctx, long parent, long child)
+{
+    int_enc_node *p = &ctx->nodes[parent];
+
+    if (p->last_child == -1)
+	p->first_child = child;
+    else
+	ctx->nodes[p->last_child].next = child;
+    p->last_child = child;
+}
+
+static size_t
+int_enc_header_len(krypt_asn1_header *header)
+{
+    size_t n = 1;
+    int tag = header->tag;
+    size_t len = header->length;
+
+    if (tag >= 31) {
+	while (tag > 0) {
+	    n++;
+	    tag >>= CHAR_BIT_MINUS_ONE;
+	}
+    }
+    n++;
+    if (!header->is_infinite && len > 127) {
+	while (len > 0) {
+	    n++;
+	    len >>= CHAR_BIT;
+	}
+    }
+    return n;
+}
+
+/*
+ * Wraps the node +idx+ according to the tagging options of +def+: implicit
+ * tagging replaces the tag in place, explicit tagging adds an outer
+ * constructed value.
+ */
+static int
+int_enc_apply_tagging(int_enc_ctx *ctx, krypt_asn1_definition *def, long idx, long *out)
+{
+    int tag, tag_class;
+    krypt_asn1_header *header;
+
+    if (!krypt_definition_is_tagged(def)) {
+	*out = idx;
+	return KRYPT_OK;
+    }
+    tag = krypt_definition_get_tag(def);
+    tag_class = krypt_definition_get_tag_class(def);
+    if (tag < 0 || tag_class == KRYPT_ERR) {
+	krypt_error_add("Cannot determine tag for value %s", rb_id2name(krypt_definition_get_name(def)));
+	return KRYPT_ERR;
+    }
+
+    if (krypt_definition_is_explicit(def)) {
+	long wrapper = int_enc_header_node_new(ctx, INT_ENC_CONS, tag, tag_class);
+	int_enc_add_child(ctx, wrapper, idx);
+	*out = wrapper;
+	return KRYPT_OK;
+    }
+
+    header = ctx->nodes[idx].header;
+    if (!header) {
+	/* complete encodings (ANY values) already carry their tag */
+	*out = idx;
+	return KRYPT_OK;
+    }
+    header->tag = tag;
+    header->tag_class = tag_class;
+    *out = idx;
+    return KRYPT_OK;
+}
+
+static int
+int_enc_raw_bytes(int_enc_ctx *ctx, uint8_t *bytes, size_t len, long *out)
+{
+    long idx = int_enc_node_new(ctx, INT_ENC_RAW);
+
+    ctx->nodes[idx].bytes = bytes;
+    ctx->nodes[idx].len = len;
+    *out = idx;
+    return KRYPT_OK;
+}
+
+static int
+int_enc_asn1_data(int_enc_ctx *ctx, VALUE value, long *out)
+{
+    uint8_t *bytes;
+    size_t len;
+
+    if (rb_obj_is_kind_of(value, cKryptASN1Data)) {
+	binyo_outstream *bos = binyo_outstream_new_bytes();
+	if (krypt_asn1_data_encode(bos, value) == KRYPT_ERR) {
+	    binyo_outstream_free(bos);
+	    return KRYPT_ERR;
+	}
+	len = binyo_outstream_bytes_get_bytes_free(bos, &bytes);
+    } else {
+	VALUE der = krypt_to_der(value);
+	len = RSTRING_LEN(der);
+	bytes = ALLOC_N(uint8_t, len ? len : 1);
+	memcpy(bytes, RSTRING_PTR(der), len);
+    }
+    return int_enc_raw_bytes(ctx, bytes, len, out);
+}
+
+static int
+int_enc_object(int_enc_ctx *ctx, krypt_asn1_object *object, long *out)
+{
+    long idx = int_enc_node_new(ctx, INT_ENC_OBJECT);
+
+    ctx->nodes[idx].object = object;
+    *out = idx;
+    return KRYPT_OK;
+}
+
+static int
+int_enc_prim(int_enc_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_template *vt, VALUE value, long *out)
 {
+    long idx;
+    uint8_t *bytes = NULL;
+    size_t len = 0;
+    int default_tag = krypt_definition_get_schema(def)->default_tag;
+    krypt_asn1_codec *codec = &krypt_asn1_codecs[default_tag];
+
+    if (!codec->encoder) {
+        krypt_error_add("No codec available for default tag %d", default_tag);
+	return KRYPT_ERR;
+    }
+    if (codec->validator(Qnil, value) == KRYPT_ERR) goto error;
+    if (codec->encoder(Qnil, value, &bytes, &len) == KRYPT_ERR) goto error;
+    /* a parsed BIT STRING keeps its unused bits */
+    if (default_tag == TAGS_BIT_STRING && vt)
+	bytes[0] = vt->unused_bits & 0xff;
+
+    idx = int_enc_header_node_new(ctx, INT_ENC_PRIM, default_tag, TAG_CLASS_UNIVERSAL);
+    ctx->nodes[idx].bytes = bytes;
+    ctx->nodes[idx].len = len;
+    return int_enc_apply_tagging(ctx, def, idx, out);
+
+error:
+    krypt_error_add("Error while encoding value %s", rb_id2name(krypt_definition_get_name(def)));
     return KRYPT_ERR;
 }
 
-int
+/*
+ * Encodes the field +field+ whose value is held by the slot +vt+. Nothing
+ * is added if the value is absent or equals its DEFAULT.
+ */
+static int
+int_enc_field(int_enc_ctx *ctx, krypt_asn1_schema *field, krypt_asn1_template *vt, long *out)
+{
+    VALUE value;
+    krypt_asn1_definition def;
+
+    *out = -1;
+    if (!vt) return KRYPT_OK;
+
+    if (int_has_cached_encoding(vt->object) && int_value_is_clean(vt))
+	return int_enc_object(ctx, vt->object, out);
+
+    value = krypt_asn1_template_get_value(vt);
+    if (NIL_P(value)) return KRYPT_OK;
+    if (krypt_asn1_schema_has_default(field) && rb_equal(value, field->default_value))
+	return KRYPT_OK;
+
+    krypt_definition_init(&def, field, field);
+    return int_enc_def(ctx, &def, Qnil, vt, value, out);
+}
+
+static int
+int_enc_cons(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE self, long *out)
+{
+    long i, idx;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def);
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    idx = int_enc_header_node_new(ctx, INT_ENC_CONS, schema->default_tag, TAG_CLASS_UNIVERSAL);
+    ctx->nodes[idx].sort = schema->codec == KRYPT_CODEC_SET;
+
+    for (i=0; i < schema->layout_len; ++i) {
+	long child;
+	krypt_asn1_schema *cur = &schema->layout[i];
+
+	/* fields left out by a projection or a plan are emitted as they were read */
+	if (krypt_asn1_template_has_skipped(t, i)) {
+	    krypt_asn1_object *skipped = krypt_asn1_template_get_skipped(t, i);
+	    if (!skipped) return KRYPT_ERR;
+	    int_enc_object(ctx, skipped, &child);
+	} else if (int_enc_field(ctx, cur, krypt_asn1_template_slot_at(t, i), &child) == KRYPT_ERR) {
+	    return KRYPT_ERR;
+	}
+	if (child == -1) {
+	    if (!krypt_asn1_schema_is_optional(cur)) {
+		krypt_error_add("Mandatory value %s is missing", rb_id2name(cur->name));
+		return KRYPT_ERR;
+	    }
+	    continue;
+	}
+	int_enc_add_child(ctx, idx, child);
+    }
+    return int_enc_apply_tagging(ctx, def, idx, out);
+}
+
+static int
+int_enc_element(int_enc_ctx *ctx, krypt_asn1_schema *type_schema, VALUE cur, long *out)
+{
+    if (type_schema)
+	return int_enc_template(ctx, cur, type_schema, out);
+    return int_enc_asn1_data(ctx, cur, out);
+}
+
+/*
+ * Elements of a Collection that were never accessed are emitted from
+ * their original encoding.
+ */
+static int
+int_enc_collection(int_enc_ctx *ctx, krypt_asn1_schema *type_schema, VALUE value, long parent)
+{
+    long i, child;
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(value, c);
+    for (i=0; i < c->count; ++i) {
+	VALUE cur = krypt_asn1_collection_cached(c, i);
+
+	if (cur == Qundef) {
+	    child = int_enc_node_new(ctx, INT_ENC_RAW);
+	    ctx->nodes[child].bytes = c->bytes + c->offsets[i];
+	    ctx->nodes[child].len = c->offsets[i + 1] - c->offsets[i];
+	    ctx->nodes[child].shared = 1;
+	} else if (int_enc_element(ctx, type_schema, cur, &child) == KRYPT_ERR) {
+	    return KRYPT_ERR;
+	}
+	int_enc_add_child(ctx, parent, child);
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_enc_cons_of(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE value, long *out)
+{
+    long i, idx;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def), *type_schema = NULL;
+    int is_collection = rb_obj_is_kind_of(value, cKryptASN1TemplateCollection);
+
+    if (!is_collection && TYPE(value) != T_ARRAY) {
+	krypt_error_add("Value %s must be an Array", rb_id2name(krypt_definition_get_name(def)));
+	return KRYPT_ERR;
+    }
+    if (schema->flags & KRYPT_SCHEMA_TEMPLATE_TYPE) {
+	if (!(type_schema = krypt_asn1_schema_get_child(schema))) return KRYPT_ERR;
+    }
+
+    idx = int_enc_header_node_new(ctx, INT_ENC_CONS, schema->default_tag, TAG_CLASS_UNIVERSAL);
+    ctx->nodes[idx].sort = schema->codec == KRYPT_CODEC_SET_OF;
+
+    if (is_collection) {
+	if (int_enc_collection(ctx, type_schema, value, idx) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    for (i=0; !is_collection && i < RARRAY_LEN(value); ++i) {
+	long child;
+
+	if (int_enc_element(ctx, type_schema, rb_ary_entry(value, i), &child) == KRYPT_ERR) return KRYPT_ERR;
+	int_enc_add_child(ctx, idx, child);
+    }
+    return int_enc_apply_tagging(ctx, def, idx, out);
+}
+
+static int
+int_enc_any(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE value, long *out)
+{
+    long idx;
+
+    if (int_enc_asn1_data(ctx, value, &idx) == KRYPT_ERR) return KRYPT_ERR;
+    return int_enc_apply_tagging(ctx, def, idx, out);
+}
+
+/*
+ * Determines the CHOICE alternative a value belongs to. A parsed value
+ * still knows it, otherwise the alternative is selected by @type and,
+ * where that is ambiguous, by @tag.
+ */
+static krypt_asn1_schema *
+int_enc_choice_alternative(krypt_asn1_schema *schema, VALUE self, krypt_asn1_template *vt)
+{
+    long i;
+    VALUE type = rb_ivar_get(self, sKrypt_IV_TYPE);
+    VALUE vtag = rb_ivar_get(self, sKrypt_IV_TAG);
+    krypt_asn1_schema *first = NULL, *cur = vt->schema;
+
+    if (cur && cur >= schema->layout && cur < schema->layout + schema->layout_len &&
+	(NIL_P(type) || cur->type == type))
+	return cur;
+
+    for (i=0; i < schema->layout_len; ++i) {
+	cur = &schema->layout[i];
+	if (!rb_equal(cur->type, type)) continue;
+	if (NIL_P(vtag) || !(cur->flags & KRYPT_SCHEMA_HAS_TAG) || cur->tag == NUM2INT(vtag))
+	    return cur;
+	if (!first) first = cur;
+    }
+    return first;
+}
+
+static int
+int_enc_choice(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE self, long *out)
+{
+    long idx;
+    krypt_asn1_template *t, *vt;
+    krypt_asn1_schema *alt;
+
+    if (krypt_definition_is_tagged(def) && !krypt_definition_is_explicit(def)) {
+        krypt_error_add("Only explicit tagging is allowed for CHOICEs");
+        return KRYPT_ERR;
+    }
+    krypt_asn1_template_get(self, t);
+    if (!(vt = krypt_asn1_template_slot_at(t, 0))) {
+	krypt_error_add("CHOICE value is missing");
+	return KRYPT_ERR;
+    }
+    if (!(alt = int_enc_choice_alternative(krypt_definition_get_schema(def), self, vt))) {
+	krypt_error_add("No CHOICE alternative matches the value");
+	return KRYPT_ERR;
+    }
+
+    if (int_enc_field(ctx, alt, vt, &idx) == KRYPT_ERR) return KRYPT_ERR;
+    if (idx == -1) {
+	krypt_error_add("CHOICE value is missing");
+	return KRYPT_ERR;
+    }
+    return int_enc_apply_tagging(ctx, def, idx, out);
+}
+
+/*
+ * SEQUENCEs, SETs and CHOICEs are encoded from the fields of the Template
+ * +self+, anything else from +value+, which is held by the slot +vt+.
+ */
+static int
+int_enc_def(int_enc_ctx *ctx, krypt_asn1_definition *def, VALUE self, krypt_asn1_template *vt, VALUE value, long *out)
+{
+    switch (krypt_definition_get_codec(def)) {
+	case KRYPT_CODEC_PRIMITIVE:
+	    return int_enc_prim(ctx, def, vt, value, out);
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	    return int_enc_cons(ctx, def, self, out);
+	case KRYPT_CODEC_TEMPLATE:
+	    return int_enc_template(ctx, value, krypt_definition_get_field(def), out);
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    return int_enc_cons_of(ctx, def, value, out);
+	case KRYPT_CODEC_ANY:
+	    return int_enc_any(ctx, def, value, out);
+	case KRYPT_CODEC_CHOICE:
+	    return int_enc_choice(ctx, def, self, out);
+	default:
+	    krypt_error_add("Unknown codec");
+	    return KRYPT_ERR;
+    }
+}
+
+/*
+ * Re-tags a cached encoding that was parsed with the tagging of +from+ so
+ * that it matches the tagging of +def+ instead.
+ */
+static int
+int_enc_retag_object(int_enc_ctx *ctx, krypt_asn1_object *object, krypt_asn1_schema *from, krypt_asn1_definition *def, long *out)
+{
+    long idx;
+    krypt_asn1_header *header = object->header;
+    uint8_t *p = object->bytes;
+    size_t len = object->bytes_len;
+    int tag = header->tag, tag_class = header->tag_class;
+
+    if (krypt_asn1_schema_is_explicit(from)) {
+	binyo_instream *in = binyo_instream_new_bytes(p, len);
+	krypt_asn1_header *inner;
+	int result = krypt_asn1_next_header(in, &inner);
+
+	binyo_instream_free(in);
+	if (result != KRYPT_OK) return KRYPT_ERR;
+	tag = inner->tag;
+	tag_class = inner->tag_class;
+	p += inner->tag_len + inner->length_len;
+	len -= inner->tag_len + inner->length_len;
+	krypt_asn1_header_free(inner);
+    } else if (krypt_asn1_schema_is_tagged(from)) {
+	tag = krypt_definition_get_schema(def)->default_tag;
+	tag_class = TAG_CLASS_UNIVERSAL;
+    }
+
+    idx = int_enc_header_node_new(ctx, header->is_constructed ? INT_ENC_CONS : INT_ENC_PRIM, tag, tag_class);
+    ctx->nodes[idx].type = INT_ENC_PRIM; /* the value bytes are kept as they are */
+    ctx->nodes[idx].header->is_infinite = header->is_infinite;
+    ctx->nodes[idx].bytes = ALLOC_N(uint8_t, len ? len : 1);
+    memcpy(ctx->nodes[idx].bytes, p, len);
+    ctx->nodes[idx].len = len;
+    return int_enc_apply_tagging(ctx, def, idx, out);
+}
+
+static int
+int_same_tagging(krypt_asn1_schema *a, krypt_asn1_schema *b)
+{
+    int mask = KRYPT_SCHEMA_TAGGED | KRYPT_SCHEMA_EXPLICIT | KRYPT_SCHEMA_HAS_TAG;
+
+    if (a == b) return 1;
+    if ((a->flags & mask) != (b->flags & mask)) return 0;
+    if (!krypt_asn1_schema_is_tagged(a)) return 1;
+    return a->tag == b->tag && a->tag_class == b->tag_class;
+}
+
+/*
+ * Encodes the Template +instance+ as the value of +field+, whose tagging
+ * options apply.
+ */
+static int
+int_enc_template(int_enc_ctx *ctx, VALUE instance, krypt_asn1_schema *field, long *out)
+{
+    krypt_asn1_template *t;
+    krypt_asn1_definition def;
+
+    if (!rb_obj_is_kind_of(instance, mKryptASN1Template)) {
+	krypt_error_add("Value %s is not a Template", rb_id2name(field->name));
+	return KRYPT_ERR;
+    }
+    krypt_asn1_template_get(instance, t);
+    krypt_definition_init(&def, t->schema, field);
+
+    if (int_template_is_clean(instance)) {
+	if (!t->field || int_same_tagging(t->field, field))
+	    return int_enc_object(ctx, t->object, out);
+	return int_enc_retag_object(ctx, t->object, t->field, &def, out);
+    }
+    return int_enc_def(ctx, &def, instance, NULL, Qnil, out);
+}
+
+/*
+ * A parsed Template may be emitted verbatim unless one of its values was
+ * set in the meantime. Setters drop the cached encoding of the Template
+ * they are called on, but not that of its ancestors, so nested Templates
+ * are checked here instead. Values that were never parsed cannot have
+ * been modified and are not visited.
+ */
+static int
+int_template_is_clean(VALUE instance)
+{
+    long i;
+    krypt_asn1_template *t;
+    krypt_asn1_schema *schema;
+
+    krypt_asn1_template_get(instance, t);
+    if (!int_has_cached_encoding(t->object) || krypt_asn1_template_is_modified(t)) return 0;
+    if (!krypt_asn1_template_is_parsed(t)) return 1;
+
+    schema = t->schema;
+    switch (schema->codec) {
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	    for (i=0; i < schema->layout_len; ++i) {
+		if (!int_value_is_clean(krypt_asn1_template_slot_at(t, i))) return 0;
+	    }
+	    return 1;
+	case KRYPT_CODEC_CHOICE:
+	    return int_value_is_clean(krypt_asn1_template_slot_at(t, 0));
+	default:
+	    return 1;
+    }
+}
+
+static int
+int_collection_is_clean_i(VALUE index, VALUE element, VALUE arg)
+{
+    if (int_template_is_clean(element)) return ST_CONTINUE;
+    *((int *) arg) = 0;
+    return ST_STOP;
+}
+
+/* only the elements that were handed out can have been changed */
+static int
+int_collection_is_clean(VALUE value)
+{
+    int clean = 1;
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(value, c);
+    rb_hash_foreach(c->cache, int_collection_is_clean_i, (VALUE) &clean);
+    return clean;
+}
+
+static int
+int_value_is_clean(krypt_asn1_template *vt)
+{
+    VALUE value;
+    krypt_asn1_schema *field;
+
+    if (!vt) return 1;
+    if (krypt_asn1_template_is_modified(vt) || !(field = vt->field)) return 0;
+
+    value = krypt_asn1_template_get_value(vt);
+    switch (field->codec) {
+	case KRYPT_CODEC_TEMPLATE:
+	    return int_template_is_clean(value);
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    if (!int_has_cached_encoding(vt->object)) return 0;
+	    if (!krypt_asn1_template_is_decoded(vt)) return 1;
+	    /*
+	     * Changes to ASN1Data elements and to the Arrays decoded from
+	     * indefinite length encodings cannot be told apart from the
+	     * original, so these are always encoded anew.
+	     */
+	    if (!(field->flags & KRYPT_SCHEMA_TEMPLATE_TYPE) ||
+		!rb_obj_is_kind_of(value, cKryptASN1TemplateCollection))
+		return 0;
+	    return int_collection_is_clean(value);
+	default:
+	    return int_has_cached_encoding(vt->object);
+    }
+}
+
+/* a Template parsed as a tagged field is encoded standalone without that tag */
+static int
+int_has_own_encoding(VALUE self, krypt_asn1_template *t)
+{
+    if (t->field && !int_same_tagging(t->field, t->schema)) return 0;
+    return int_template_is_clean(self);
+}
+
+static size_t
+int_enc_compute_length(int_enc_ctx *ctx, long idx)
+{
+    int_enc_node *node = &ctx->nodes[idx];
+    krypt_asn1_header *header;
+    size_t content = 0;
+    long child;
+
+    switch (node->type) {
+	case INT_ENC_RAW:
+	    node->total = node->len;
+	    return node->total;
+	case INT_ENC_OBJECT:
+	    header = node->object->header;
+	    node->total = header->tag_len + header->length_len + node->object->bytes_len;
+	    return node->total;
+	case INT_ENC_PRIM:
+	    content = node->len;
+	    break;
+	default:
+	    for (child = node->first_child; child != -1; child = ctx->nodes[child].next)
+		content += int_enc_compute_length(ctx, child);
+	    node = &ctx->nodes[idx];
+	    break;
+    }
+
+    header = node->header;
+    header->length = content;
+    node->total = int_enc_header_len(header) + content;
+    return node->total;
+}
+
+static int int_enc_write(int_enc_ctx *ctx, binyo_outstream *out, long idx);
+
+static int
+int_enc_write_sorted(int_enc_ctx *ctx, binyo_outstream *out, long idx)
+{
+    long n = 0, i, j, child;
+    uint8_t **bufs;
+    size_t *lens;
+    int ret = KRYPT_ERR;
+
+    for (child = ctx->nodes[idx].first_child; child != -1; child = ctx->nodes[child].next)
+	n++;
+    if (n == 0) return KRYPT_OK;
+
+    bufs = ALLOC_N(uint8_t *, n);
+    lens = ALLOC_N(size_t, n);
+    memset(bufs, 0, n * sizeof(uint8_t *));
+
+    for (i=0, child = ctx->nodes[idx].first_child; child != -1; child = ctx->nodes[child].next, ++i) {
+	binyo_outstream *bos;
+	int result;
+
+	lens[i] = ctx->nodes[child].total;
+	bufs[i] = ALLOC_N(uint8_t, lens[i] ? lens[i] : 1);
+	bos = binyo_outstream_new_bytes_prealloc(bufs[i], lens[i]);
+	result = int_enc_write(ctx, bos, child);
+	binyo_outstream_free(bos);
+	if (result == KRYPT_ERR) goto cleanup;
+    }
+
+    /* insertion sort, SETs are usually small */
+    for (i=1; i < n; ++i) {
+	uint8_t *b = bufs[i];
+	size_t l = lens[i];
+	for (j=i; j > 0; --j) {
+	    int cmp;
+	    if (krypt_asn1_cmp_set_of(bufs[j-1], lens[j-1], b, l, &cmp) == KRYPT_ERR) goto cleanup;
+	    if (cmp <= 0) break;
+	    bufs[j] = bufs[j-1];
+	    lens[j] = lens[j-1];
+	}
+	bufs[j] = b;
+	lens[j] = l;
+    }
+
+    for (i=0; i < n; ++i) {
+	if (binyo_outstream_write(out, bufs[i], lens[i]) == BINYO_ERR) goto cleanup;
+    }
+    ret = KRYPT_OK;
+
+cleanup:
+    for (i=0; i < n; ++i) {
+	if (bufs[i]) xfree(bufs[i]);
+    }
+    xfree(bufs);
+    xfree(lens);
+    return ret;
+}
+
+static int
+int_enc_write(int_enc_ctx *ctx, binyo_outstream *out, long idx)
+{
+    int_enc_node *node = &ctx->nodes[idx];
+    long child;
+
+    switch (node->type) {
+	case INT_ENC_RAW:
+	    if (node->len && binyo_outstream_write(out, node->bytes, node->len) == BINYO_ERR) return KRYPT_ERR;
+	    return KRYPT_OK;
+	case INT_ENC_OBJECT:
+	    return krypt_asn1_object_encode(out, node->object);
+	case INT_ENC_PRIM:
+	    if (krypt_asn1_header_encode(out, node->header) == KRYPT_ERR) return KRYPT_ERR;
+	    if (node->len && binyo_outstream_write(out, node->bytes, node->len) == BINYO_ERR) return KRYPT_ERR;
+	    return KRYPT_OK;
+	default:
+	    if (krypt_asn1_header_encode(out, node->header) == KRYPT_ERR) return KRYPT_ERR;
+	    if (node->sort)
+		return int_enc_write_sorted(ctx, out, idx);
+	    for (child = node->first_child; child != -1; child = ctx->nodes[child].next) {
+		if (int_enc_write(ctx, out, child) == KRYPT_ERR) return KRYPT_ERR;
+	    }
+	    return KRYPT_OK;
+    }
+}
+
+struct int_enc_args_st {
+    int_enc_ctx ctx;
+    VALUE self;
+    binyo_outstream *out;
+    VALUE der;
+};
+
+static VALUE
+int_template_encode_body(VALUE arg)
+{
+    struct int_enc_args_st *args = (struct int_enc_args_st *) arg;
+    krypt_asn1_template *t;
+    binyo_outstream *out;
+    size_t total;
+    long root;
+    int result;
+
+    krypt_asn1_template_get(args->self, t);
+    if (!t->schema) {
+	krypt_error_add("Template has no ASN.1 definition");
+	return Qfalse;
+    }
+    if (int_enc_template(&args->ctx, args->self, t->schema, &root) == KRYPT_ERR)
+	return Qfalse;
+    total = int_enc_compute_length(&args->ctx, root);
+
+    if (args->out)
+	return int_enc_write(&args->ctx, args->out, root) == KRYPT_OK ? Qtrue : Qfalse;
+
+    args->der = rb_str_new(NULL, total);
+    out = binyo_outstream_new_bytes_prealloc((uint8_t *) RSTRING_PTR(args->der), total);
+    result = int_enc_write(&args->ctx, out, root);
+    binyo_outstream_free(out);
+    return result == KRYPT_OK ? Qtrue : Qfalse;
+}
+
+static VALUE
+int_template_encode_cleanup(VALUE arg)
+{
+    struct int_enc_args_st *args = (struct int_enc_args_st *) arg;
+    int_enc_ctx_free(&args->ctx);
+    return Qnil;
+}
+
+static int
+int_template_encode_non_cached(VALUE self, binyo_outstream *out, VALUE *der)
+{
+    struct int_enc_args_st args;
+    VALUE result;
+
+    int_enc_ctx_init(&args.ctx);
+    args.self = self;
+    args.out = out;
+    args.der = Qnil;
+    result = rb_ensure(int_template_encode_body, (VALUE) &args, int_template_encode_cleanup, (VALUE) &args);
+    if (!RTEST(result)) return KRYPT_ERR;
+    if (der) *der = args.der;
+    return KRYPT_OK;
+}
+
+static int
 int_template_encode_cached(krypt_asn1_object *object, VALUE *value)
 {
     binyo_outstream *out;
@@ -60,17 +860,32 @@ krypt_asn1_template_encode(VALUE self, VALUE *out)
 {
     krypt_asn1_template *template;
     krypt_asn1_object *object;
-    int has_cached_encoding;
 
     krypt_asn1_template_get(self, template);
     object = template->object;
 
-    has_cached_encoding = object && (object->bytes || object->bytes_len == 0)
-                                 && object->header->tag_bytes && object->header->length_bytes;
-    
-    if (has_cached_encoding)
+    if (int_has_own_encoding(self, template))
 	return int_template_encode_cached(object, out);
     else
-	return int_template_encode_non_cached(self, template, out);
+	return int_template_encode_non_cached(self, NULL, out);
 }
 
+
+/*
+ * Writes the encoding of the template +self+ to +out+. A cached encoding
+ * is written directly, without creating an intermediate String.
+ */
+int
+krypt_asn1_template_encode_to(binyo_outstream *out, VALUE self)
+{
+    krypt_asn1_template *template;
+    krypt_asn1_object *object;
+
+    krypt_asn1_template_get(self, template);
+    object = template->object;
+
+    if (int_has_own_encoding(self, template))
+	return krypt_asn1_object_encode(out, object);
+
+    return int_template_encode_non_cached(self, out, NULL);
+}
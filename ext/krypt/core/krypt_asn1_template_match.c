@@ -0,0 +1,208 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
+
+/*
+ * Decides whether a value matches a definition, looking at nothing but
+ * its header and, for explicitly tagged CHOICEs, the header of the value
+ * within. The parser and the validator share these rules, so that
+ * Template.valid_der? accepts exactly what the parser accepts. Everything
+ * else the parser does on a match or a mismatch, setting DEFAULT values
+ * and reporting errors, is left to the callbacks of the matcher.
+ */
+
+static int
+int_tag_and_class(krypt_asn1_header *header, krypt_asn1_definition *def)
+{
+    return header->tag == krypt_definition_get_tag(def) &&
+	   header->tag_class == krypt_definition_get_tag_class(def);
+}
+
+static int
+int_mismatch(krypt_asn1_template_matcher *m, krypt_asn1_definition *def, int reason)
+{
+    if (m->mismatch)
+	m->mismatch(m, def, reason);
+    return KRYPT_TEMPLATE_MATCH_ERR;
+}
+
+static int
+int_optional_or_default(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    if (!krypt_definition_is_optional(def))
+	return int_mismatch(m, def, KRYPT_TEMPLATE_MISSING);
+    if (krypt_definition_has_default(def)) {
+	if (m->apply_default)
+	    m->apply_default(m, def);
+	return KRYPT_TEMPLATE_MATCH_DEFAULT;
+    }
+    return KRYPT_TEMPLATE_NO_MATCH;
+}
+
+static int
+int_match_cons(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    krypt_asn1_header *header = m->header;
+
+    if (header->is_constructed && int_tag_and_class(header, def)) return KRYPT_TEMPLATE_MATCH;
+    if (!header->is_constructed && !krypt_definition_is_optional(def))
+	return int_mismatch(m, def, KRYPT_TEMPLATE_NOT_CONSTRUCTED);
+
+    switch (krypt_definition_get_codec(def)) {
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    return int_optional_or_default(m, def);
+	default:
+	    if (!krypt_definition_is_optional(def))
+		return int_mismatch(m, def, KRYPT_TEMPLATE_MISSING_CONSTRUCTED);
+	    return KRYPT_TEMPLATE_NO_MATCH;
+    }
+}
+
+static int
+int_match_template(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    krypt_asn1_schema *type_schema;
+    krypt_asn1_definition new_def;
+    int match;
+
+    if (!(type_schema = krypt_asn1_schema_get_child(krypt_definition_get_schema(def))))
+	return KRYPT_TEMPLATE_MATCH_ERR;
+    krypt_definition_init(&new_def, type_schema, krypt_definition_get_field(def));
+    match = krypt_asn1_template_match(m, &new_def);
+    if (match == KRYPT_TEMPLATE_NO_MATCH && krypt_definition_has_default(def)) {
+	if (m->apply_default)
+	    m->apply_default(m, def);
+	return KRYPT_TEMPLATE_MATCH_DEFAULT;
+    }
+    return match;
+}
+
+static int
+int_match_any(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    /* only OPTIONAL values with a tag can be told apart from the next field */
+    if (!krypt_definition_is_optional(def) ||
+	!(krypt_definition_get_field(def)->flags & KRYPT_SCHEMA_HAS_TAG) ||
+	int_tag_and_class(m->header, def))
+	return KRYPT_TEMPLATE_MATCH;
+    return int_optional_or_default(m, def);
+}
+
+static int
+int_match_choice(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def);
+    krypt_asn1_template_matcher alt = *m;
+    krypt_asn1_header inner;
+    long i, first_any = -1;
+
+    if (krypt_definition_is_tagged(def) && !krypt_definition_is_explicit(def))
+	return int_mismatch(m, def, KRYPT_TEMPLATE_CHOICE_TAGGING);
+    if (krypt_definition_get_field(def)->flags & KRYPT_SCHEMA_HAS_TAG &&
+	!int_tag_and_class(m->header, def))
+	return int_optional_or_default(m, def);
+    /* the alternatives are matched against the value within the explicit tagging */
+    if (krypt_definition_is_tagged(def)) {
+	size_t hlen;
+	if (krypt_asn1_header_peek(m->content, m->content_len, &inner) == KRYPT_ERR)
+	    return KRYPT_TEMPLATE_NO_MATCH;
+	hlen = inner.tag_len + inner.length_len;
+	alt.header = &inner;
+	alt.content = m->content + hlen;
+	alt.content_len = m->content_len - hlen;
+    }
+    /* failing alternatives are no errors as long as another one matches */
+    alt.mismatch = NULL;
+
+    for (i = krypt_asn1_schema_next_candidate(schema, 0, alt.header);
+	 i < schema->layout_len;
+	 i = krypt_asn1_schema_next_candidate(schema, i + 1, alt.header)) {
+	int result;
+	krypt_asn1_definition inner_def;
+	krypt_asn1_schema *cur = &schema->layout[i];
+
+	if (cur->codec == KRYPT_CODEC_ANY && first_any == -1)
+	    first_any = i;
+	krypt_definition_init(&inner_def, cur, cur);
+	if ((result = krypt_asn1_template_match(&alt, &inner_def)) == KRYPT_TEMPLATE_MATCH) {
+	    krypt_definition_set_matched_layout(def, i);
+	    return KRYPT_TEMPLATE_MATCH;
+	}
+	if (result == KRYPT_TEMPLATE_MATCH_DEFAULT)
+	    return KRYPT_TEMPLATE_MATCH_DEFAULT;
+    }
+
+    /* the first ANY value matches if no other does */
+    if (first_any != -1) {
+	krypt_definition_set_matched_layout(def, first_any);
+	return KRYPT_TEMPLATE_MATCH;
+    }
+    if (!krypt_definition_is_optional(def))
+	return int_mismatch(m, def, KRYPT_TEMPLATE_MISSING_CHOICE);
+    return KRYPT_TEMPLATE_NO_MATCH;
+}
+
+/**
+ * Matches the value described by +m+ against +def+.
+ *
+ * @param m	The value's header and contents and the callbacks
+ * @param def	The definition to match against. The alternative a CHOICE
+ * 		matched is stored in it.
+ * @return	KRYPT_TEMPLATE_MATCH, KRYPT_TEMPLATE_NO_MATCH if an
+ * 		OPTIONAL value is absent, KRYPT_TEMPLATE_MATCH_DEFAULT if
+ * 		its DEFAULT value applies instead and
+ * 		KRYPT_TEMPLATE_MATCH_ERR if a mandatory value is missing
+ */
+int
+krypt_asn1_template_match(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
+{
+    switch (krypt_definition_get_codec(def)) {
+	case KRYPT_CODEC_PRIMITIVE:
+	    if (int_tag_and_class(m->header, def)) return KRYPT_TEMPLATE_MATCH;
+	    return int_optional_or_default(m, def);
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    return int_match_cons(m, def);
+	case KRYPT_CODEC_TEMPLATE:
+	    return int_match_template(m, def);
+	case KRYPT_CODEC_ANY:
+	    return int_match_any(m, def);
+	case KRYPT_CODEC_CHOICE:
+	    return int_match_choice(m, def);
+	default:
+	    return KRYPT_TEMPLATE_MATCH_ERR;
+    }
+}
+
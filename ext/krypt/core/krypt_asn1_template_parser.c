@@ -30,193 +30,100 @@
 #include "krypt_asn1-internal.h"
 #include "krypt_asn1_template-internal.h"
 
-struct krypt_asn1_template_match_ctx {
-    krypt_asn1_object *object;
-    krypt_asn1_header *header;
-    int free_header;
+static ID sKrypt_ID_ONLY, sKrypt_ID_THREADS, sKrypt_ID_VALIDATE;
+
+/*
+ * Reads the values encoded one after the other in +in+. If +source+ is
+ * set, +base+ is the start of +in+'s bytes within the frozen String
+ * +source+, and values are referenced in place instead of being copied.
+ */
+struct krypt_asn1_template_cursor {
+    binyo_instream *in;
+    uint8_t *base;
+    size_t off;
+    size_t len;
+    VALUE source;
 };
 
 struct krypt_asn1_template_parse_ctx {
-    int (*match)(VALUE recv, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
     int (*parse)(VALUE recv, krypt_asn1_object *obj, krypt_asn1_definition *def, int *dont_free);
-    int (*decode)(VALUE recv, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+    int (*decode)(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
 };
 
-static int int_match_prim(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_assign(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
-static int int_decode_prim(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_prim(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
 
-static int int_match_sequence(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_match_set(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 
-static int int_match_template(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_template(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 
-static int int_match_seq_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_match_set_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_decode_cons_of(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_cons_of(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
 
-static int int_match_any(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_decode_any(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_any(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
 
-static int int_match_choice(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 
-static int krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, VALUE *out);
+static int krypt_asn1_template_parse_stream(struct krypt_asn1_template_cursor *cursor, VALUE klass, krypt_asn1_schema *schema, VALUE *out);
 
 static struct krypt_asn1_template_parse_ctx krypt_template_primitive_ctx= {
-    int_match_prim,
     int_parse_assign,
     int_decode_prim
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_sequence_ctx= {
-    int_match_sequence,
     int_parse_cons,
     NULL
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_set_ctx= {
-    int_match_set,
     int_parse_cons,
     NULL
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_template_ctx= {
-    int_match_template,
     int_parse_template,
     NULL
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_seq_of_ctx= {
-    int_match_seq_of,
     int_parse_assign,
     int_decode_cons_of
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_set_of_ctx= {
-    int_match_set_of,
     int_parse_assign,
     int_decode_cons_of
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_any_ctx= {
-    int_match_any,
     int_parse_assign,
     int_decode_any
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_choice_ctx= {
-    int_match_choice,
     int_parse_choice,
     NULL
 };
 
-static struct krypt_asn1_template_parse_ctx *
-int_get_parse_ctx_for_codec(ID codec) {
-    if (codec == sKrypt_ID_PRIMITIVE)
-	return &krypt_template_primitive_ctx;
-    else if (codec == sKrypt_ID_SEQUENCE)
-	return &krypt_template_sequence_ctx;
-    else if (codec == sKrypt_ID_TEMPLATE)
-	return &krypt_template_template_ctx;
-    else if (codec == sKrypt_ID_SET)
-	return &krypt_template_set_ctx;
-    else if (codec == sKrypt_ID_SEQUENCE_OF)
-	return &krypt_template_seq_of_ctx;
-    else if (codec == sKrypt_ID_SET_OF)
-	return &krypt_template_set_of_ctx;
-    else if (codec == sKrypt_ID_ANY)
-	return &krypt_template_any_ctx;
-    else if (codec == sKrypt_ID_CHOICE)
-	return &krypt_template_choice_ctx;
-    else {
-	krypt_error_add("Unknown codec: %s", rb_id2name(codec));
-	return NULL;
-    }
-}
-
-#define INT_KRYPT_MATCH 1
-#define INT_KRYPT_NO_MATCH 0 
-#define INT_KRYPT_MATCH_ERR -1
-#define INT_KRYPT_MATCH_DEFAULT_APPLIED -2
-
-static void
-int_match_ctx_init(struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_object *object)
-{
-    ctx->object = object;
-    ctx->header = object->header;
-    ctx->free_header = 0;
-}
-
-static int
-int_match_ctx_skip_header(struct krypt_asn1_template_match_ctx *ctx)
-{
-    krypt_asn1_header *next;
-    binyo_instream *in = binyo_instream_new_bytes(ctx->object->bytes, ctx->object->bytes_len);
-    if (krypt_asn1_next_header(in, &next) != KRYPT_OK) {
-	binyo_instream_free(in);
-	return KRYPT_ERR;
-    }
-    ctx->header = next;
-    ctx->free_header = 1;
-    binyo_instream_free(in);
+/* indexed by the KRYPT_CODEC_* constants a schema was compiled to */
+static struct krypt_asn1_template_parse_ctx *krypt_template_parse_ctxs[KRYPT_CODEC_COUNT] = {
+    &krypt_template_primitive_ctx,
+    &krypt_template_sequence_ctx,
+    &krypt_template_set_ctx,
+    &krypt_template_template_ctx,
+    &krypt_template_seq_of_ctx,
+    &krypt_template_set_of_ctx,
+    &krypt_template_any_ctx,
+    &krypt_template_choice_ctx
+};
 
-    return KRYPT_OK;
-}
+#define int_get_parse_ctx_for_codec(codec)	(krypt_template_parse_ctxs[(codec)])
 
 static void
-int_match_ctx_cleanup(struct krypt_asn1_template_match_ctx *ctx)
-{
-    if (ctx->free_header)
-	xfree(ctx->header);
-}
-
-static int
-int_expected_tag(VALUE tag, int default_tag)
-{
-    if (NIL_P(tag)) 
-	return default_tag;
-    else
-        return NUM2INT(tag);
-}
-
-static int
-int_expected_tag_class(VALUE tag_class)
-{
-    if (NIL_P(tag_class))
-	return TAG_CLASS_UNIVERSAL;
-    else
-	return krypt_asn1_tag_class_for_id(SYM2ID(tag_class));
-}
-
-static int
-int_match_tag(krypt_asn1_header *header, VALUE tag, int default_tag)
-{
-    if (header->tag == int_expected_tag(tag, default_tag))
-	return INT_KRYPT_MATCH;
-    else
-	return INT_KRYPT_NO_MATCH;
-}
-
-static int
-int_match_class(krypt_asn1_header *header, VALUE tag_class)
-{
-    int expected_tc;
-    
-    if ((expected_tc = int_expected_tag_class(tag_class)) == KRYPT_ERR) return INT_KRYPT_NO_MATCH;
-    if (header->tag_class == expected_tc)
-	return INT_KRYPT_MATCH;
-    else
-	return INT_KRYPT_NO_MATCH;
-}
-
-static int
-int_tag_and_class_mismatch(krypt_asn1_header *header, VALUE tag, VALUE tagging, int default_tag, const char *name)
+int_tag_and_class_mismatch(krypt_asn1_header *header, krypt_asn1_definition *def, const char *name)
 {
-    int expected_tag = int_expected_tag(tag, default_tag);
-    int expected_tag_class = int_expected_tag_class(tagging);
+    int expected_tag = krypt_definition_get_tag(def);
+    int expected_tag_class = krypt_definition_get_tag_class(def);
     
     if (name)
 	krypt_error_add("Could not parse %s", name);
@@ -227,15 +134,6 @@ int_tag_and_class_mismatch(krypt_asn1_header *header, VALUE tag, VALUE tagging,
 	ID got = krypt_asn1_tag_class_for_int(header->tag_class);
 	krypt_error_add("Tag class mismatch. Expected: %s Got: %s", rb_id2name(expected), rb_id2name(got));
     }
-    return INT_KRYPT_MATCH_ERR;
-}
-
-static int
-int_match_tag_and_class(krypt_asn1_header *header, VALUE tag, VALUE tagging, int default_tag)
-{
-    if (int_match_tag(header, tag, default_tag) == INT_KRYPT_NO_MATCH) return INT_KRYPT_NO_MATCH;
-    if (int_match_class(header, tagging) == INT_KRYPT_NO_MATCH) return INT_KRYPT_NO_MATCH;
-    return INT_KRYPT_MATCH;
 }
 
 static krypt_asn1_header *
@@ -253,10 +151,10 @@ int_parse_explicit_header(krypt_asn1_object *object)
 }
 
 static krypt_asn1_header *
-int_unpack_explicit(VALUE tagging, krypt_asn1_object *object, uint8_t **pp, size_t *len, int *free_header)
+int_unpack_explicit(krypt_asn1_definition *def, krypt_asn1_object *object, uint8_t **pp, size_t *len, int *free_header)
 {
     
-    if (NIL_P(tagging) || SYM2ID(tagging) != sKrypt_TC_EXPLICIT) {
+    if (!krypt_definition_is_explicit(def)) {
 	*pp = object->bytes;
 	*len = object->bytes_len;
 	*free_header = 0;
@@ -278,21 +176,121 @@ int_unpack_explicit(VALUE tagging, krypt_asn1_object *object, uint8_t **pp, size
     }
 }
 
+static VALUE
+int_template_source(VALUE self)
+{
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    return krypt_asn1_template_get_source(t);
+}
+
+/*
+ * A Template parsed with a projection only parses the fields named in
+ * it. The projection maps their names to true, or to the projection that
+ * applies to the field's own fields. The remaining fields are matched but
+ * their encodings are merely kept, to be parsed on first access.
+ */
+static VALUE
+int_template_projection(VALUE self)
+{
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    return krypt_asn1_template_get_projection(t);
+}
+
+static VALUE
+int_field_projection(VALUE self, ID name)
+{
+    VALUE projection = int_template_projection(self);
+
+    if (NIL_P(projection)) return Qnil;
+    projection = rb_hash_lookup2(projection, ID2SYM(name), Qnil);
+    return TYPE(projection) == T_HASH ? projection : Qnil;
+}
+
+#define int_projection_includes(p, name)	(NIL_P(p) || rb_hash_lookup2((p), ID2SYM(name), Qundef) != Qundef)
+
+static krypt_asn1_template *
+int_template_skipped_init(VALUE self, krypt_asn1_schema *schema)
+{
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    if (!t->skipped) {
+	t->skipped_len = schema->layout_len;
+	t->skipped = ALLOC_N(krypt_asn1_object *, t->skipped_len);
+	memset(t->skipped, 0, t->skipped_len * sizeof(krypt_asn1_object *));
+    }
+    return t;
+}
+
+static void
+int_template_skip(VALUE self, krypt_asn1_schema *schema, long i, krypt_asn1_object *object)
+{
+    krypt_asn1_template *t = int_template_skipped_init(self, schema);
+    t->skipped[i] = object;
+}
+
+/* the encoding of field +i+ starts at +p+ in the source, and is read on first access */
+static void
+int_template_skip_planned(VALUE self, krypt_asn1_schema *schema, long i, const uint8_t *p, const uint8_t *end)
+{
+    krypt_asn1_template *t = int_template_skipped_init(self, schema);
+
+    if (!t->pending) {
+	t->pending = ALLOC_N(const uint8_t *, t->skipped_len);
+	memset(t->pending, 0, t->skipped_len * sizeof(const uint8_t *));
+    }
+    t->pending[i] = p;
+    t->pending_end = end;
+}
+
+/*
+ * Sets up a cursor over +len+ bytes at +p+, which lie within the encoding
+ * of +object+. The values may only be shared with +source+ if +object+'s
+ * are.
+ */
+static void
+int_cursor_init(struct krypt_asn1_template_cursor *cursor, VALUE source, krypt_asn1_object *object, uint8_t *p, size_t len)
+{
+    cursor->in = binyo_instream_new_bytes(p, len);
+    cursor->off = 0;
+    cursor->len = len;
+    cursor->source = source;
+    cursor->base = (object->bytes_shared && !NIL_P(cursor->source)) ? p : NULL;
+}
+
 static int
-int_next_object(binyo_instream *in, krypt_asn1_object **out)
+int_next_object(struct krypt_asn1_template_cursor *cursor, krypt_asn1_object **out)
 {
     krypt_asn1_header *next = NULL;
     krypt_asn1_object *next_object = NULL;
     int result;
-    size_t value_len;
+    size_t value_len, header_len;
     uint8_t *value = NULL;
 
-    result = krypt_asn1_next_header(in, &next);
+    result = krypt_asn1_next_header(cursor->in, &next);
     if (result == KRYPT_ASN1_EOF) return KRYPT_ASN1_EOF;
     if (result == KRYPT_ERR) goto error;
-
-    if (krypt_asn1_get_value(in, next, &value, &value_len) == KRYPT_ERR) goto error;
-    if (!(next_object = krypt_asn1_object_new_value(next, value, value_len))) goto error;
+    header_len = next->tag_len + next->length_len;
+
+    if (cursor->base && !next->is_infinite &&
+	next->length <= cursor->len - cursor->off - header_len) {
+	if (krypt_asn1_skip_value(cursor->in, next) == KRYPT_ERR) goto error;
+	/* empty values have no bytes, as when they are read, the codecs rely on it */
+	if (next->length)
+	    value = cursor->base + cursor->off + header_len;
+	if (!(next_object = krypt_asn1_object_new_value(next, value, next->length))) goto error;
+	next_object->bytes_shared = 1;
+	cursor->off += header_len + next->length;
+    } else {
+	/* the end of indefinite length values is unknown, copy from here on */
+	cursor->base = NULL;
+	if (krypt_asn1_get_value(cursor->in, next, &value, &value_len) == KRYPT_ERR) goto error;
+	if (!(next_object = krypt_asn1_object_new_value(next, value, value_len))) goto error;
+    }
 
     *out = next_object;
     return KRYPT_OK;
@@ -335,209 +333,203 @@ int_ensure_stream_is_consumed(binyo_instream *in)
     return KRYPT_OK;
 }
 
-static int
-int_try_match_cons(struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+/* the slot of field +name+ of the Template +self+, -1 with an error if there is none */
+static long
+int_field_slot(VALUE self, ID name, krypt_asn1_template **t)
 {
-    krypt_asn1_header *header = ctx->header;
-    VALUE tag = krypt_definition_get_tag(def);
-    VALUE tagging = krypt_definition_get_tagging(def);
-
-    if (header->is_constructed && 
-	int_match_tag_and_class(header, tag, tagging, default_tag) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
+    long i;
 
-    if (!header->is_constructed && !krypt_definition_is_optional(def)) {
-	krypt_error_add("Constructive bit not set");
-	return INT_KRYPT_MATCH_ERR;
-    }
-    return INT_KRYPT_NO_MATCH;
-}
-
-static ID
-int_determine_name(VALUE name)
-{
-    if (NIL_P(name))
-        return sKrypt_IV_VALUE; /* CHOICE values have no name */
-    else
-        return SYM2ID(name);
+    krypt_asn1_template_get(self, *t);
+    if ((i = krypt_asn1_schema_slot_index((*t)->schema, name)) == -1)
+	krypt_error_add("Unknown field %s", rb_id2name(name));
+    return i;
 }
 
 static void
 int_set_default_value(VALUE self, krypt_asn1_definition *def)
 {
-    ID name;
-    VALUE obj, def_value; 
-    krypt_asn1_template *template;
+    long i;
+    krypt_asn1_template *t;
 
-    name = int_determine_name(krypt_definition_get_name(def));
     /* set the default value, no more decoding needed */
-    def_value = krypt_definition_get_default_value(def);
-    template = krypt_asn1_template_new_value(def_value); 
-    krypt_asn1_template_set(cKryptASN1TemplateValue, obj, template);
-    rb_ivar_set(self, name, obj);
+    if ((i = int_field_slot(self, krypt_definition_get_name(def), &t)) == -1) return;
+    krypt_asn1_template_slot_value(t, i, krypt_definition_get_default_value(def));
 }
 
-static int
-int_check_optional_or_default(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+static void
+int_apply_default(krypt_asn1_template_matcher *m, krypt_asn1_definition *def)
 {
-    krypt_asn1_header *header = ctx->header;
-    VALUE tag = krypt_definition_get_tag(def);
-    VALUE tagging = krypt_definition_get_tagging(def);
-
-    if (!krypt_definition_is_optional(def)) { 
-	const char *str;
-	ID name = int_determine_name(krypt_definition_get_name(def));
-        str = rb_id2name(name);
-        krypt_error_add("Mandatory value %s is missing", str);
-	return int_tag_and_class_mismatch(header, tag, tagging, default_tag, str);
-    }
+    int_set_default_value(m->self, def);
+}
 
-    if (krypt_definition_has_default(def)) {
-	int_set_default_value(self, def);
-	return INT_KRYPT_MATCH_DEFAULT_APPLIED;
+static void
+int_report_mismatch(krypt_asn1_template_matcher *m, krypt_asn1_definition *def, int reason)
+{
+    const char *name;
+
+    switch (reason) {
+	case KRYPT_TEMPLATE_MISSING:
+	    name = rb_id2name(krypt_definition_get_name(def));
+	    krypt_error_add("Mandatory value %s is missing", name);
+	    int_tag_and_class_mismatch(m->header, def, name);
+	    break;
+	case KRYPT_TEMPLATE_MISSING_CONSTRUCTED:
+	    krypt_error_add("Mandatory sequence value not found");
+	    int_tag_and_class_mismatch(m->header, def, "Constructed");
+	    break;
+	case KRYPT_TEMPLATE_NOT_CONSTRUCTED:
+	    krypt_error_add("Constructive bit not set");
+	    break;
+	case KRYPT_TEMPLATE_MISSING_CHOICE:
+	    krypt_error_add("Mandatory CHOICE value not found");
+	    break;
+	case KRYPT_TEMPLATE_CHOICE_TAGGING:
+	    krypt_error_add("Only explicit tagging is allowed for CHOICEs");
+	    break;
     }
-
-    return INT_KRYPT_NO_MATCH;
 }
 
-static int
-int_match_prim(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+static void
+int_matcher_init(krypt_asn1_template_matcher *m, VALUE self, krypt_asn1_object *object)
 {
-    VALUE tag, tagging, vdef_tag;
-    krypt_asn1_header *header = ctx->header;
-    int default_tag;
-
-    get_or_raise(vdef_tag, krypt_definition_get_type(def), "'type is missing in ASN.1 definition");
-    default_tag = NUM2INT(vdef_tag);
-    tag = krypt_definition_get_tag(def);
-    tagging = krypt_definition_get_tagging(def);
-
-    if (int_match_tag_and_class(header, tag, tagging, default_tag) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
-
-    return int_check_optional_or_default(self, ctx, def, default_tag);
+    m->header = object->header;
+    m->content = object->bytes;
+    m->content_len = object->bytes_len;
+    m->self = self;
+    m->apply_default = int_apply_default;
+    m->mismatch = int_report_mismatch;
 }
 
 static int
 int_parse_assign(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
 {
     ID name;
-    VALUE instance;
-    krypt_asn1_template *t;
-
-    name = int_determine_name(krypt_definition_get_name(def));
-    t = krypt_asn1_template_new(object, krypt_definition_get_definition(def), krypt_definition_get_options(def));
-    krypt_asn1_template_set(cKryptASN1TemplateValue, instance, t);
-    rb_ivar_set(self, name, instance);
-    krypt_asn1_template_set_parsed(t, 1);
+    long i;
+    krypt_asn1_template *t, *slot;
+
+    name = krypt_definition_get_name(def);
+    if ((i = int_field_slot(self, name, &t)) == -1) return KRYPT_ERR;
+    slot = krypt_asn1_template_slot_init(t, i, object, krypt_definition_get_schema(def), krypt_definition_get_field(def));
+    krypt_asn1_template_set_source(slot, krypt_asn1_template_get_source(t));
+    krypt_asn1_template_set_projection(slot, int_field_projection(self, name));
+    krypt_asn1_template_set_parsed(slot, 1);
     *dont_free = 1;
     return KRYPT_OK;
 }
 
 /* TODO */
 static int
-int_decode_prim_inf(VALUE tvalue, krypt_asn1_object *obj, krypt_asn1_definition *def, VALUE *out)
+int_decode_prim_inf(krypt_asn1_template *vt, krypt_asn1_object *obj, krypt_asn1_definition *def, VALUE *out)
 {
     rb_raise(rb_eNotImpError, "Not implemented yet");
 }
 
 static int
-int_decode_prim(VALUE tvalue, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_decode_prim(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
 {
-    VALUE value, vtype, tagging;
+    VALUE value;
     krypt_asn1_header *header = object->header;
     int free_header = 0, default_tag;
     uint8_t *p;
     size_t len;
 
     if (header->is_infinite)
-	return int_decode_prim_inf(tvalue, object, def, out);
+	return int_decode_prim_inf(vt, object, def, out);
 
-    get_or_raise(vtype, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    tagging = krypt_definition_get_tagging(def);
-    default_tag = NUM2INT(vtype);
+    default_tag = krypt_definition_get_schema(def)->default_tag;
 
-    if (!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
     if (header->is_constructed) {
 	krypt_error_add("Constructed bit set");
 	goto error;
     }
 
     if (!krypt_asn1_codecs[default_tag].decoder) {
-	int default_tag = NUM2INT(vtype);
         krypt_error_add("No codec available for default tag %d", default_tag);
 	goto error;
     }
-    if (krypt_asn1_codecs[default_tag].decoder(tvalue, p, len, &value) == KRYPT_ERR) {
+    /* the value has no object of its own to hold the unused bits of a BIT STRING */
+    if (krypt_asn1_codecs[default_tag].decoder(Qnil, p, len, &value) == KRYPT_ERR) {
 	goto error;
     }
+    if (default_tag == TAGS_BIT_STRING)
+	vt->unused_bits = p[0];
 
     if (free_header) krypt_asn1_header_free(header);
     *out = value;
     return KRYPT_OK;
 
-error: {
-    ID name = int_determine_name(krypt_definition_get_name(def));
-    krypt_error_add("Error while decoding value %s", rb_id2name(name));
+error:
+    krypt_error_add("Error while decoding value %s", rb_id2name(krypt_definition_get_name(def)));
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_ERR;
-       }
 }
 
 static int
-int_match_cons(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+int_ensure_rest_is_optional(VALUE self, krypt_asn1_schema *schema, long index)
 {
-    int match = int_try_match_cons(ctx, def, default_tag);
+    long i;
 
-    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
+    for (i=index; i < schema->layout_len; ++i) {
+	krypt_asn1_definition def;
+	krypt_asn1_schema *cur = &schema->layout[i];
 
-    if (!krypt_definition_is_optional(def)) {
-	VALUE tag = krypt_definition_get_tag(def);
-	VALUE tagging = krypt_definition_get_tagging(def);
-	krypt_error_add("Mandatory sequence value not found");
-	return int_tag_and_class_mismatch(ctx->header, tag, tagging, default_tag, "Constructed");
+	krypt_definition_init(&def, cur, cur);
+	if (!krypt_definition_is_optional(&def)) {
+	    krypt_error_add("Mandatory value %s not found", rb_id2name(krypt_definition_get_name(&def)));
+	    return KRYPT_ERR;
+	}
+	if (krypt_definition_has_default(&def)) {
+	    int_set_default_value(self, &def);
+	}
     }
-    return INT_KRYPT_NO_MATCH;
-}
-
-static int
-int_match_sequence(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    return int_match_cons(self, ctx, def, TAGS_SEQUENCE);
-}
-
-static int
-int_match_set(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    return int_match_cons(self, ctx, def, TAGS_SET);
+    return KRYPT_OK;
 }
 
+/*
+ * Lets the plan of +schema+ locate the fields in the contents at +p+,
+ * which are shared with the source. The fields are not read at all
+ * until they are first accessed, only the DEFAULT values of the missing
+ * ones are set. Returns 0 if the plan does not accept the contents, the
+ * generic loop then parses them instead and reports the error if there
+ * is one.
+ */
 static int
-int_ensure_rest_is_optional(VALUE self, VALUE layout, long index)
+int_parse_cons_planned(VALUE self, krypt_asn1_schema *schema, uint8_t *p, size_t len)
 {
-    long i, size;
+    long *fields, num, i, k;
+    size_t *offsets;
+
+    fields = ALLOCA_N(long, schema->layout_len + 1);
+    offsets = ALLOCA_N(size_t, schema->layout_len + 1);
+    num = schema->plan(p, len, fields, offsets);
+    if (num < schema->min_size || num > schema->layout_len) return 0;
+    for (k=0; k < num; ++k) {
+	if (fields[k] < (k ? fields[k - 1] + 1 : 0) || fields[k] >= schema->layout_len) return 0;
+	if (offsets[k] >= len) return 0;
+    }
 
-    size = RARRAY_LEN(layout);
-    for (i=index; i < size; ++i) {
-	krypt_asn1_definition def;
-	VALUE cur_def = rb_ary_entry(layout, i);
+    for (i=0, k=0; i < schema->layout_len; ++i) {
+	krypt_asn1_schema *cur = &schema->layout[i];
 
-	krypt_definition_init(&def, cur_def, krypt_hash_get_options(cur_def));
-	if (!krypt_definition_is_optional(&def)) {
-	    ID name = int_determine_name(krypt_definition_get_name(&def));
-	    krypt_error_add("Mandatory value %s not found", rb_id2name(name));
-	    return KRYPT_ERR;
-	}
-	if (krypt_definition_has_default(&def)) {
+	if (k < num && fields[k] == i) {
+	    int_template_skip_planned(self, schema, i, p + offsets[k], p + len);
+	    k++;
+	} else if (krypt_asn1_schema_has_default(cur)) {
+	    krypt_asn1_definition def;
+	    krypt_definition_init(&def, cur, cur);
 	    int_set_default_value(self, &def);
 	}
     }
-    return KRYPT_OK;
+    return 1;
 }
 
 static int
 int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
 {
-    binyo_instream *in;
-    VALUE layout, vmin_size, tagging;
+    struct krypt_asn1_template_cursor cursor;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def);
+    VALUE projection = int_template_projection(self);
     long num_parsed = 0, layout_size, min_size, i;
     krypt_asn1_header *header = object->header;
     krypt_asn1_object *cur_object = NULL;
@@ -545,49 +537,70 @@ int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def
     uint8_t *p;
     size_t len;
 
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    get_or_raise(vmin_size, krypt_definition_get_min_size(def), "'min_size' is missing in ASN.1 definition");
-    min_size = NUM2LONG(vmin_size);
-    tagging = krypt_definition_get_tagging(def);
-    layout_size = RARRAY_LEN(layout);
+    min_size = schema->min_size;
+    layout_size = schema->layout_len;
 
-    if(!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if(!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
     if (!header->is_constructed) {
 	krypt_error_add("Constructed bit not set");
 	return KRYPT_ERR;
     }
 
-    in = binyo_instream_new_bytes(p, len);
-    if (int_next_object(in, &cur_object) != KRYPT_OK) goto error;
+    if (schema->plan && schema == schema->root && !header->is_infinite &&
+	object->bytes_shared && !NIL_P(int_template_source(self)) &&
+	int_parse_cons_planned(self, schema, p, len)) {
+	if (free_header) krypt_asn1_header_free(header);
+	*dont_free = 0;
+	return KRYPT_OK;
+    }
+
+    int_cursor_init(&cursor, int_template_source(self), object, p, len);
+    if (int_next_object(&cursor, &cur_object) != KRYPT_OK) goto error;
 
     for (i=0; i < layout_size; ++i) {
-	ID codec;
 	int result;
+	long next;
 	krypt_asn1_definition inner_def;
 	struct krypt_asn1_template_parse_ctx *parser;
-	struct krypt_asn1_template_match_ctx ctx;
-	VALUE cur_def = rb_ary_entry(layout, i);
+	krypt_asn1_template_matcher m;
+	krypt_asn1_schema *cur;
+
+	/* skip the OPTIONAL values that cannot match the current element */
+	next = krypt_asn1_schema_next_candidate(schema, i, cur_object->header);
+	for (; i < next; ++i) {
+	    cur = &schema->layout[i];
+	    if (krypt_asn1_schema_has_default(cur)) {
+		krypt_definition_init(&inner_def, cur, cur);
+		int_set_default_value(self, &inner_def);
+	    }
+	}
+	if (i == layout_size) break;
+	cur = &schema->layout[i];
 
 	krypt_error_clear();
-	krypt_definition_init(&inner_def, cur_def, krypt_hash_get_options(cur_def));
-	codec = SYM2ID(krypt_hash_get_codec(cur_def));
-	parser = int_get_parse_ctx_for_codec(codec);
-	int_match_ctx_init(&ctx, cur_object);
+	krypt_definition_init(&inner_def, cur, cur);
+	parser = int_get_parse_ctx_for_codec(cur->codec);
+	int_matcher_init(&m, self, cur_object);
 
-	if ((result = parser->match(self, &ctx, &inner_def)) != INT_KRYPT_MATCH_ERR) {
-	    if (result == INT_KRYPT_MATCH) {
+	if ((result = krypt_asn1_template_match(&m, &inner_def)) != KRYPT_TEMPLATE_MATCH_ERR) {
+	    if (result == KRYPT_TEMPLATE_MATCH) {
 		int inner_dont_free;
-		if (parser->parse(self, cur_object, &inner_def, &inner_dont_free) == KRYPT_ERR) goto error;
-		if (!inner_dont_free) krypt_asn1_object_free(cur_object);
+		if (!int_projection_includes(projection, krypt_definition_get_name(&inner_def))) {
+		    int_template_skip(self, schema, i, cur_object);
+		} else {
+		    if (parser->parse(self, cur_object, &inner_def, &inner_dont_free) == KRYPT_ERR) goto error;
+		    if (!inner_dont_free) krypt_asn1_object_free(cur_object);
+		}
 		object_consumed = 1;
 		num_parsed++;
 		if (i < layout_size - 1) {
-		    int has_more = int_next_object(in, &cur_object); 
+		    int has_more = int_next_object(&cursor, &cur_object); 
 		    if (has_more == KRYPT_ERR) goto error;
 		    if (has_more == KRYPT_ASN1_EOF) {
-		       	if (int_ensure_rest_is_optional(self, layout, i+1) == KRYPT_ERR) goto error;
+		       	if (int_ensure_rest_is_optional(self, schema, i+1) == KRYPT_ERR) goto error;
 			break; /* EOF reached */
 		    }
+		    object_consumed = 0;
 		}
 	    } /* else -> didn't match or default value was set */
 	} else {
@@ -599,111 +612,67 @@ int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def
 	krypt_error_add("Expected %d..%d values. Got: %d", min_size, layout_size, num_parsed);
 	goto error;
     }
+    if (!object_consumed) {
+	krypt_error_add("No field matches the value with tag %d", cur_object->header->tag);
+	goto error;
+    }
     if (header->is_infinite) {
-	if(int_parse_eoc(in) == KRYPT_ERR) {
+	if(int_parse_eoc(cursor.in) == KRYPT_ERR) {
 	    krypt_error_add("No closing END OF CONTENTS found for constructive value");
 	    goto error;
 	}
     }
-    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
+    if (int_ensure_stream_is_consumed(cursor.in) == KRYPT_ERR) goto error;
 
-    binyo_instream_free(in);
+    binyo_instream_free(cursor.in);
     if (free_header) krypt_asn1_header_free(header);
     *dont_free = 0;
     return KRYPT_OK;
 
 error:
-    binyo_instream_free(in);
+    binyo_instream_free(cursor.in);
     if (cur_object && !object_consumed) krypt_asn1_object_free(cur_object);
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_ERR;
 } 
 
-static int
-int_match_template(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    ID codec;
-    VALUE type, type_def;
-    krypt_asn1_definition new_def;
-    struct krypt_asn1_template_parse_ctx *parser;
-    int match;
-    
-    get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    if (NIL_P((type_def = krypt_definition_get(type)))) {
-	krypt_error_add("Type %s has no ASN.1 definition", rb_class2name(type));
-	return INT_KRYPT_MATCH_ERR;
-    }
-    krypt_definition_init(&new_def, type_def, krypt_definition_get_options(def));
-    codec = SYM2ID(krypt_hash_get_codec(type_def));
-    parser = int_get_parse_ctx_for_codec(codec);
-    match = parser->match(self, ctx, &new_def);
-    if (match == INT_KRYPT_NO_MATCH) {
-	if (krypt_definition_has_default(def)) {
-	    int_set_default_value(self, def);
-	    return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-	}   
-    }
-    return match;
-}
-
 static int
 int_parse_template(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
 {
     ID name;
-    VALUE container, instance;
-    VALUE type, type_def, options;
-    krypt_asn1_template *container_template, *value_template;
-
-    get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    name = int_determine_name(krypt_definition_get_name(def));
-    if (NIL_P((type_def = krypt_definition_get(type)))) {
-	krypt_error_add("Type %s has no ASN.1 definition", rb_class2name(type));
-	return KRYPT_ERR;
-    }
-
-    options = krypt_definition_get_options(def);
-    value_template = krypt_asn1_template_new(object, type_def, options);
-    krypt_asn1_template_set(type, instance, value_template);
-
-    container_template = krypt_asn1_template_new_value(instance);
-    krypt_asn1_template_set_definition(container_template, krypt_definition_get_definition(def));
-    krypt_asn1_template_set_options(container_template, options);
-    krypt_asn1_template_set(cKryptASN1TemplateValue, container, container_template);
-
-    rb_ivar_set(self, name, container);
+    long i;
+    VALUE instance;
+    krypt_asn1_schema *schema, *field, *type_schema;
+    krypt_asn1_template *t, *slot, *value_template;
+
+    schema = krypt_definition_get_schema(def);
+    field = krypt_definition_get_field(def);
+    name = krypt_definition_get_name(def);
+    if (!(type_schema = krypt_asn1_schema_get_child(schema))) return KRYPT_ERR;
+    if ((i = int_field_slot(self, name, &t)) == -1) return KRYPT_ERR;
+
+    value_template = krypt_asn1_template_new(object, type_schema, field);
+    krypt_asn1_template_set_source(value_template, krypt_asn1_template_get_source(t));
+    krypt_asn1_template_set_projection(value_template, int_field_projection(self, name));
+    krypt_asn1_template_set(schema->type, instance, value_template);
+
+    slot = krypt_asn1_template_slot_value(t, i, instance);
+    krypt_asn1_template_set_schema(slot, schema, field);
     *dont_free = 1;
     return KRYPT_OK;
 }
 
 static int
-int_match_cons_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
-{
-    int match = int_try_match_cons(ctx, def, default_tag);
-
-    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
-    return int_check_optional_or_default(self, ctx, def, default_tag);
-}
-
-static int
-int_match_seq_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    return int_match_cons_of(self, ctx, def, TAGS_SEQUENCE);
-}
-
-static int
-int_match_set_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    return int_match_cons_of(self, ctx, def, TAGS_SET);
-}
-
-static int
-int_decode_cons_of_templates(binyo_instream *in, VALUE type, VALUE *out)
+int_decode_cons_of_templates(struct krypt_asn1_template_cursor *cursor, VALUE type, krypt_asn1_schema *schema, VALUE projection, VALUE *out)
 {
     VALUE cur;
     VALUE ary = rb_ary_new();
     int result;
 
-    while ((result = krypt_asn1_template_parse_stream(in, type, &cur)) == KRYPT_OK) {
+    while ((result = krypt_asn1_template_parse_stream(cursor, type, schema, &cur)) == KRYPT_OK) {
+	krypt_asn1_template *t;
+	krypt_asn1_template_get(cur, t);
+	krypt_asn1_template_set_projection(t, projection);
 	rb_ary_push(ary, cur);
     }
     if (result == KRYPT_ERR) return KRYPT_ERR;
@@ -731,34 +700,50 @@ int_decode_cons_of_prim(binyo_instream *in, VALUE type, VALUE *out)
 }
 
 static int
-int_decode_cons_of(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_decode_cons_of(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
 {
     ID name;
-    binyo_instream *in;
-    VALUE type, tagging, val_ary, mod_p;
+    struct krypt_asn1_template_cursor cursor;
+    VALUE type, val_ary;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def);
     uint8_t *p;
     size_t len;
     int free_header = 0;
     krypt_asn1_header *header = object->header;
 
-    get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    name = int_determine_name(krypt_definition_get_name(def));
-    tagging = krypt_definition_get_tagging(def);
+    type = schema->type;
+    name = krypt_definition_get_name(def);
 
-    if (!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
     if (!header->is_constructed) {
 	krypt_error_add("Constructed bit not set");
 	return KRYPT_ERR;
     }
 
-    in = binyo_instream_new_bytes(p, len);
+    /* definite length encodings are parsed lazily, element by element */
+    if (!header->is_infinite) {
+	VALUE source = object->bytes_shared ? krypt_asn1_template_get_source(vt) : Qnil;
+	VALUE coll = krypt_asn1_collection_new(schema, source, p, len, krypt_asn1_template_get_projection(vt));
+	if (!NIL_P(coll)) {
+	    if (free_header) krypt_asn1_header_free(header);
+	    if (len == 0 && !krypt_definition_is_optional(def)) {
+		krypt_error_add("Mandatory value %s could not be parsed. Sequence is empty", rb_id2name(name));
+		return KRYPT_ERR;
+	    }
+	    *out = coll;
+	    return KRYPT_OK;
+	}
+    }
+
+    int_cursor_init(&cursor, krypt_asn1_template_get_source(vt), object, p, len);
 
-    mod_p = rb_funcall(type, rb_intern("include?"), 1, mKryptASN1Template);
-    if (RTEST(mod_p)) {
-	if (int_decode_cons_of_templates(in, type, &val_ary) == KRYPT_ERR) return KRYPT_ERR;
+    if (schema->flags & KRYPT_SCHEMA_TEMPLATE_TYPE) {
+	krypt_asn1_schema *type_schema;
+	if (!(type_schema = krypt_asn1_schema_get_child(schema))) return KRYPT_ERR;
+	if (int_decode_cons_of_templates(&cursor, type, type_schema, krypt_asn1_template_get_projection(vt), &val_ary) == KRYPT_ERR) return KRYPT_ERR;
     }
     else {
-	if (int_decode_cons_of_prim(in, type, &val_ary) == KRYPT_ERR) return KRYPT_ERR;
+	if (int_decode_cons_of_prim(cursor.in, type, &val_ary) == KRYPT_ERR) return KRYPT_ERR;
     }
 
     if (RARRAY_LEN(val_ary) == 0 && !krypt_definition_is_optional(def)) {
@@ -767,63 +752,35 @@ int_decode_cons_of(VALUE self, krypt_asn1_object *object, krypt_asn1_definition
     }
 
     if (header->is_infinite) {
-	if(int_parse_eoc(in) == KRYPT_ERR) {
+	if(int_parse_eoc(cursor.in) == KRYPT_ERR) {
 	    krypt_error_add("No closing END OF CONTENTS found for %s", rb_id2name(name));
 	    goto error;
 	}
     }
-    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
+    if (int_ensure_stream_is_consumed(cursor.in) == KRYPT_ERR) goto error;
 
     *out = val_ary;
-    binyo_instream_free(in);
+    binyo_instream_free(cursor.in);
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_OK;
 
 error:
-    binyo_instream_free(in);
+    binyo_instream_free(cursor.in);
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_ERR;
 }
 
 static int
-int_match_any(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    if (krypt_definition_is_optional(def)) {
-	VALUE tagging;
-	krypt_asn1_header *header;
-	int pseudo_default;
-	VALUE tag = krypt_definition_get_tag(def);
-
-	if (NIL_P(tag)) {
-	    return INT_KRYPT_MATCH;
-	}
-	tagging = krypt_definition_get_tagging(def);
-	header = ctx->header;
-	pseudo_default = NUM2INT(tag);
-	if (!int_match_tag_and_class(header, tag, tagging, pseudo_default)) {
-	    if (krypt_definition_has_default(def)) {
-		int_set_default_value(self, def);
-		return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-	    }
-	    return INT_KRYPT_NO_MATCH;
-	}
-    }
-    return INT_KRYPT_MATCH;
-}
-
-static int
-int_decode_any(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_decode_any(krypt_asn1_template *vt, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
 {
-    VALUE value, tagging;
+    VALUE value;
     binyo_instream *in, *seq_a, *seq_b, *seq_c;
     krypt_asn1_header *header = object->header;
     int free_header = 0;
     uint8_t *p;
     size_t len;
 
-    tagging = krypt_definition_get_tagging(def);
-
-    if(!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if(!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
 
     seq_a = binyo_instream_new_bytes(header->tag_bytes, header->tag_len);
     seq_b = binyo_instream_new_bytes(header->length_bytes, header->length_len);
@@ -836,105 +793,42 @@ int_decode_any(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def
     *out = value;
     return KRYPT_OK;
 
-error: {
-    ID name = int_determine_name(krypt_definition_get_name(def));
+error:
     binyo_instream_free(in);
-    krypt_error_add("Error while decoding value %s", rb_id2name(name));
+    krypt_error_add("Error while decoding value %s", rb_id2name(krypt_definition_get_name(def)));
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_ERR;
-       }
 }
 
 static int
-int_enforce_explicit_tagging(krypt_asn1_definition *def, VALUE *tagging)
+int_enforce_explicit_tagging(krypt_asn1_definition *def)
 {
-    VALUE tc = krypt_definition_get_tagging(def);
-    if (!(NIL_P(tc) || SYM2ID(tc) == sKrypt_TC_EXPLICIT)) {
+    if (krypt_definition_is_tagged(def) && !krypt_definition_is_explicit(def)) {
         krypt_error_add("Only explicit tagging is allowed for CHOICEs");
         return KRYPT_ERR;
     }
-    *tagging = tc;
     return KRYPT_OK;
 }
 
-static int
-int_match_choice(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
-{
-    VALUE layout, tagging;
-    long i, layout_size, first_any = -1;
-    struct krypt_asn1_template_match_ctx inner_ctx;
-    
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    if (int_enforce_explicit_tagging(def, &tagging) == KRYPT_ERR) return INT_KRYPT_MATCH_ERR;
-    int_match_ctx_init(&inner_ctx, ctx->object);
-    /* No match if tagging was explicit but we can't skip the header */
-    if (!(NIL_P(tagging) || int_match_ctx_skip_header(&inner_ctx) == KRYPT_OK)) 
-	return INT_KRYPT_NO_MATCH; 
-    
-    layout_size = RARRAY_LEN(layout);
-    for (i=0; i < layout_size; ++i) {
-	ID codec;
-	int result;
-	krypt_asn1_definition inner_def;
-	struct krypt_asn1_template_parse_ctx *parser;
-	VALUE options;
-	VALUE cur_def = rb_ary_entry(layout, i);
-
-	krypt_error_clear();
-        options = krypt_hash_get_options(cur_def);
-	krypt_definition_init(&inner_def, cur_def, options);
-	codec = SYM2ID(krypt_hash_get_codec(cur_def));
-	parser = int_get_parse_ctx_for_codec(codec);
-	if (codec == sKrypt_ID_ANY && first_any == -1) {
-	    first_any = i;
-	}
-	
-	if ((result = parser->match(self, &inner_ctx, &inner_def)) == INT_KRYPT_MATCH) {
-            int_match_ctx_cleanup(&inner_ctx);
-	    krypt_definition_set_matched_layout(def, i);
-	    return INT_KRYPT_MATCH;
-	}
-	
-        if (result == INT_KRYPT_MATCH_DEFAULT_APPLIED) {
-            int_match_ctx_cleanup(&inner_ctx);
-            return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-        }
-	/* else -> didn't match */
-    }
-
-    int_match_ctx_cleanup(&inner_ctx);
-    
-    if (first_any != -1) {
-        krypt_definition_set_matched_layout(def, first_any); /*the first ANY value matches if no other will */
-        return INT_KRYPT_MATCH;
-    }
-
-    if (!krypt_definition_is_optional(def)) {
-	krypt_error_add("Mandatory CHOICE value not found");
-	return INT_KRYPT_MATCH_ERR;
-    }
-    return INT_KRYPT_NO_MATCH;
-}
-
 static krypt_asn1_object *
-int_skip_explicit_choice_header(VALUE tagging, krypt_asn1_object *object, int *new_object)
+int_skip_explicit_choice_header(VALUE self, krypt_asn1_definition *def, krypt_asn1_object *object, int *new_object)
 {
-    binyo_instream *in;
+    struct krypt_asn1_template_cursor cursor;
     krypt_asn1_object *next_object = NULL;
 
-    if (NIL_P(tagging)) {
+    if (!krypt_definition_is_tagged(def)) {
 	*new_object = 0;
 	return object;
     }
 
-    in = binyo_instream_new_bytes(object->bytes, object->bytes_len);
-    if (int_next_object(in, &next_object) != KRYPT_OK) {
-	binyo_instream_free(in);
+    int_cursor_init(&cursor, int_template_source(self), object, object->bytes, object->bytes_len);
+    if (int_next_object(&cursor, &next_object) != KRYPT_OK) {
+	binyo_instream_free(cursor.in);
 	krypt_error_add("Error while trying to read next value");
 	return NULL;
     }
 
-    binyo_instream_free(in);
+    binyo_instream_free(cursor.in);
     *new_object = 1;
     return next_object;
 }
@@ -942,36 +836,31 @@ int_skip_explicit_choice_header(VALUE tagging, krypt_asn1_object *object, int *n
 static int
 int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
 {
-    ID codec;
     struct krypt_asn1_template_parse_ctx *parser;
-    struct krypt_asn1_template_match_ctx ctx;
-    VALUE layout, matched_def, matched_opts, tagging, type;
+    krypt_asn1_template_matcher m;
+    VALUE type;
+    krypt_asn1_schema *matched;
     krypt_asn1_object *unpacked;
     krypt_asn1_definition inner_def;
-    long matched_index;
     int new_object, inner_dont_free;
     
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    if (int_enforce_explicit_tagging(def, &tagging) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_enforce_explicit_tagging(def) == KRYPT_ERR) return KRYPT_ERR;
     
     /* determine the matching index */
-    int_match_ctx_init(&ctx, object);
-    if (int_match_choice(self, &ctx, def) != INT_KRYPT_MATCH) {
+    int_matcher_init(&m, self, object);
+    if (krypt_asn1_template_match(&m, def) != KRYPT_TEMPLATE_MATCH) {
         krypt_error_add("Matching value not found");
         return KRYPT_ERR;
     }
-    matched_index = krypt_definition_get_matched_layout(def);
-    matched_def = rb_ary_entry(layout, matched_index);
-    matched_opts = krypt_hash_get_options(matched_def);
+    matched = &krypt_definition_get_schema(def)->layout[krypt_definition_get_matched_layout(def)];
     
     /* Set up a temporary inner definition for actual parsing, using the matching definition */
-    krypt_definition_init(&inner_def, matched_def, matched_opts);
+    krypt_definition_init(&inner_def, matched, matched);
     get_or_raise(type, krypt_definition_get_type(&inner_def), "'type' missing in inner choice definition");
 
-    if (!(unpacked = int_skip_explicit_choice_header(tagging, object, &new_object))) return KRYPT_ERR;
+    if (!(unpacked = int_skip_explicit_choice_header(self, def, object, &new_object))) return KRYPT_ERR;
     
-    codec = SYM2ID(krypt_hash_get_codec(matched_def));
-    parser = int_get_parse_ctx_for_codec(codec);
+    parser = int_get_parse_ctx_for_codec(matched->codec);
     if (parser->parse(self, unpacked, &inner_def, &inner_dont_free) == KRYPT_ERR) return KRYPT_ERR;
 
     rb_ivar_set(self, sKrypt_IV_TYPE, type);
@@ -995,53 +884,77 @@ int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *d
 static int
 int_template_parse(VALUE self, krypt_asn1_template *t)
 {
-    ID codec;
-    VALUE definition;
     krypt_asn1_definition def;
     struct krypt_asn1_template_parse_ctx *parser;
     int dont_free = 0;
 
-    definition = krypt_asn1_template_get_definition(t);
-    krypt_definition_init(&def, definition, krypt_asn1_template_get_options(t));
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
+    krypt_definition_init(&def, krypt_asn1_template_get_schema(t), krypt_asn1_template_get_field(t));
+    parser = int_get_parse_ctx_for_codec(krypt_definition_get_codec(&def));
 
     if (parser->parse(self, t->object, &def, &dont_free) == KRYPT_ERR) return KRYPT_ERR;
     krypt_asn1_template_set_parsed(t, 1);
     krypt_asn1_template_set_decoded(t, 1);
 
-    /* Invalidate the cached template encoding */
-    /* If dont_free is 0 this means that the encoding bytes were copied and
-     * processed further inside -> we can free the template's object */
-    if (!dont_free) {
-        krypt_asn1_object_free(t->object);
+    /* The encoding is kept so that it can be spliced in verbatim as long as
+     * nothing is modified. If dont_free is 1 the object was handed on to
+     * an inner value, which owns it from now on. */
+    if (dont_free) {
+        t->object = NULL;
     }
-    t->object = NULL;
     return KRYPT_OK;
 }
 
 static int
-int_value_decode(VALUE self, krypt_asn1_template *t)
+int_value_decode(krypt_asn1_template *t)
 {
-    ID codec;
-    VALUE definition, value;
+    VALUE value;
     krypt_asn1_definition def;
     struct krypt_asn1_template_parse_ctx *parser;
     
-    definition = krypt_asn1_template_get_definition(t);
-    krypt_definition_init(&def, definition, krypt_asn1_template_get_options(t));
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
+    krypt_definition_init(&def, krypt_asn1_template_get_schema(t), krypt_asn1_template_get_field(t));
+    parser = int_get_parse_ctx_for_codec(krypt_definition_get_codec(&def));
     if (!parser->decode) return KRYPT_OK;
-    if (parser->decode(self, t->object, &def, &value) == KRYPT_ERR) return KRYPT_ERR;
+    if (parser->decode(t, t->object, &def, &value) == KRYPT_ERR) return KRYPT_ERR;
     krypt_asn1_template_set_decoded(t, 1);
     krypt_asn1_template_set_value(t, value);
     return KRYPT_OK;
 }
 
+/* parses the field +ivname+ that was left out by the projection or a plan */
+static int
+int_parse_skipped(VALUE self, krypt_asn1_template *t, ID ivname)
+{
+    long i;
+    int dont_free = 0;
+    krypt_asn1_definition def;
+    krypt_asn1_template_matcher m;
+    struct krypt_asn1_template_parse_ctx *parser;
+    krypt_asn1_object *object;
+    krypt_asn1_schema *cur;
+
+    for (i=0; i < t->skipped_len; ++i) {
+	if (krypt_asn1_template_has_skipped(t, i) && t->schema->layout[i].name == ivname) break;
+    }
+    if (i == t->skipped_len) return KRYPT_OK;
+
+    if (!(object = krypt_asn1_template_get_skipped(t, i))) return KRYPT_ERR;
+    cur = &t->schema->layout[i];
+    krypt_definition_init(&def, cur, cur);
+    parser = int_get_parse_ctx_for_codec(cur->codec);
+    int_matcher_init(&m, self, object);
+    /* matched before, but CHOICEs need to find their alternative again */
+    if (krypt_asn1_template_match(&m, &def) != KRYPT_TEMPLATE_MATCH) return KRYPT_ERR;
+    if (parser->parse(self, object, &def, &dont_free) == KRYPT_ERR) return KRYPT_ERR;
+    t->skipped[i] = NULL;
+    if (!dont_free) krypt_asn1_object_free(object);
+    return KRYPT_OK;
+}
+
+/* the slot holding field +ivname+ of the Template +self+, NULL if it has no value */
 static int
-int_get_inner_value(VALUE self, ID ivname, VALUE *out)
+int_get_inner_value(VALUE self, ID ivname, krypt_asn1_template **out)
 {
+    long i;
     krypt_asn1_template *template;
 
     krypt_asn1_template_get(self, template);
@@ -1049,7 +962,12 @@ int_get_inner_value(VALUE self, ID ivname, VALUE *out)
 	if (int_template_parse(self, template) == KRYPT_ERR) return KRYPT_ERR;
     }
 
-    *out = rb_ivar_get(self, ivname);
+    i = krypt_asn1_schema_slot_index(template->schema, ivname);
+    *out = krypt_asn1_template_slot_at(template, i);
+    if (!*out && template->skipped) {
+	if (int_parse_skipped(self, template, ivname) == KRYPT_ERR) return KRYPT_ERR;
+	*out = krypt_asn1_template_slot_at(template, i);
+    }
     return KRYPT_OK;
 }
 
@@ -1057,18 +975,15 @@ int
 krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out)
 {
     krypt_asn1_template *value_template;
-    VALUE value = Qnil;
     
-    if (int_get_inner_value(self, ivname, &value) == KRYPT_ERR) return KRYPT_ERR;
-    if (NIL_P(value)) {
+    if (int_get_inner_value(self, ivname, &value_template) == KRYPT_ERR) return KRYPT_ERR;
+    if (!value_template) {
 	*out = Qnil;
 	return KRYPT_OK;
     }
     
-    krypt_asn1_template_get(value, value_template);
-
     if (!krypt_asn1_template_is_decoded(value_template)) {
-	if (int_value_decode(value, value_template) == KRYPT_ERR) return KRYPT_ERR;
+	if (int_value_decode(value_template) == KRYPT_ERR) return KRYPT_ERR;
     }
 
     *out = krypt_asn1_template_get_value(value_template);
@@ -1078,99 +993,504 @@ krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out)
 void
 krypt_asn1_template_set_cb_value(VALUE self, ID ivname, VALUE value)
 {
-    VALUE container;
+    long i;
     krypt_asn1_template *template, *value_template;
 
-    container = rb_ivar_get(self, ivname);
     krypt_asn1_template_get(self, template);
+    if ((i = krypt_asn1_schema_slot_index(template->schema, ivname)) == -1)
+	rb_raise(eKryptASN1Error, "Unknown field %s", rb_id2name(ivname));
+    /* the remaining fields must be available when encoding again */
+    if (int_get_inner_value(self, ivname, &value_template) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(ivname));
+    /* Invalidate the cached template encoding */
+    if (template->object) {
+	krypt_asn1_object_free(template->object);
+	template->object = NULL;
+    }
 
-    if (NIL_P(container)) {
-	VALUE obj;
-	value_template = krypt_asn1_template_new_value(value);
-	krypt_asn1_template_set(cKryptASN1TemplateValue, obj, value_template);
-	rb_ivar_set(self, ivname, obj); 
+    if (!value_template) {
+	value_template = krypt_asn1_template_slot_value(template, i, value);
     } else {
-	krypt_asn1_template_get(container, value_template);
+	/* Invalidate the cached encoding of the value */
+	if (value_template->object) {
+	    krypt_asn1_object_free(value_template->object);
+	    value_template->object = NULL;
+	}
+	krypt_asn1_template_set_parsed(value_template, 1);
+	krypt_asn1_template_set_decoded(value_template, 1);
+	/* the unused bits belonged to the old BIT STRING value */
+	value_template->unused_bits = 0;
     }
 
+    krypt_asn1_template_set_modified(value_template, 1);
     krypt_asn1_template_set_modified(template, 1);
     krypt_asn1_template_set_value(value_template, value);
 }
 
 static VALUE
-int_rb_template_new_initial(VALUE klass, binyo_instream *in, krypt_asn1_header *header)
+int_rb_template_new_initial(VALUE klass, krypt_asn1_schema *schema, krypt_asn1_object *object, VALUE source)
 {
-    ID codec;
     VALUE obj;
-    VALUE definition;
     krypt_asn1_template *template;
     krypt_asn1_definition def;
-    struct krypt_asn1_template_match_ctx ctx;
-    struct krypt_asn1_template_parse_ctx *parser; 
-
-    if (NIL_P((definition = krypt_definition_get(klass)))) {
-        krypt_error_add("%s has no ASN.1 definition", rb_class2name(klass));
-        return Qnil;
-    }
+    krypt_asn1_template_matcher m;
 
-    if (!(template = krypt_asn1_template_new_from_stream(in, header, definition, krypt_hash_get_options(definition)))) {
-        krypt_error_add("Error while reading data");
-        return Qnil;
-    }
+    template = krypt_asn1_template_new(object, schema, schema);
+    krypt_asn1_template_set_source(template, source);
 
     /* ensure it matches */
-    krypt_definition_init(&def, definition, Qnil); /* top-level definition has no options */
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
-    int_match_ctx_init(&ctx, template->object);
+    krypt_definition_init(&def, schema, schema);
     obj = rb_obj_alloc(klass);
-    if (parser->match(obj, &ctx, &def) != INT_KRYPT_MATCH) {
+    krypt_asn1_template_set(klass, obj, template);
+    int_matcher_init(&m, obj, template->object);
+    if (krypt_asn1_template_match(&m, &def) != KRYPT_TEMPLATE_MATCH) {
 	krypt_error_add("Type mismatch");
 	return Qnil;
     }
 
-    krypt_asn1_template_set(klass, obj, template);
     return obj;
 }
 
 static int
-krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, VALUE *out)
+krypt_asn1_template_parse_stream(struct krypt_asn1_template_cursor *cursor, VALUE klass, krypt_asn1_schema *schema, VALUE *out)
 {
-    krypt_asn1_header *header;
+    krypt_asn1_object *object;
     VALUE ret;
     int result;
 
-    result = krypt_asn1_next_header(in, &header);
+    result = int_next_object(cursor, &object);
     if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
 
-    ret = int_rb_template_new_initial(klass, in, header);
-    if (NIL_P(ret)) {
-	krypt_asn1_header_free(header);
-	return KRYPT_ERR;
-    }
+    ret = int_rb_template_new_initial(klass, schema, object, object->bytes_shared ? cursor->source : Qnil);
+    if (NIL_P(ret)) return KRYPT_ERR;
     *out = ret;
     return KRYPT_OK;
 }
 
-VALUE
-krypt_asn1_template_parse_der(VALUE klass, VALUE der)
+/*
+ * Parses the single value of +len+ bytes at +bytes+ as an instance of
+ * +klass+. The bytes lie within the frozen String +source+ and are
+ * referenced instead of copied.
+ */
+int
+krypt_asn1_template_parse_bytes(VALUE klass, krypt_asn1_schema *schema, VALUE source, uint8_t *bytes, size_t len, VALUE *out)
+{
+    struct krypt_asn1_template_cursor cursor;
+    int result;
+
+    cursor.in = binyo_instream_new_bytes(bytes, len);
+    cursor.base = bytes;
+    cursor.off = 0;
+    cursor.len = len;
+    cursor.source = source;
+    result = krypt_asn1_template_parse_stream(&cursor, klass, schema, out);
+    binyo_instream_free(cursor.in);
+    return result == KRYPT_OK ? KRYPT_OK : KRYPT_ERR;
+}
+
+static VALUE int_projection_new(krypt_asn1_schema *schema, VALUE spec);
+
+struct int_projection_args {
+    VALUE projection;
+    krypt_asn1_schema *schema;
+};
+
+static krypt_asn1_schema *
+int_projection_field(krypt_asn1_schema *schema, VALUE name)
+{
+    long i;
+    ID ivname;
+    VALUE str;
+
+    Check_Type(name, T_SYMBOL);
+    str = rb_str_new2("@");
+    rb_str_cat2(str, rb_id2name(SYM2ID(name)));
+    ivname = rb_intern_str(str);
+    for (i=0; i < schema->layout_len; ++i) {
+	if (schema->layout[i].name == ivname) return &schema->layout[i];
+    }
+    rb_raise(rb_eArgError, "Unknown field %s", rb_id2name(SYM2ID(name)));
+    return NULL; /* dummy */
+}
+
+static void
+int_projection_add(VALUE projection, krypt_asn1_schema *schema, VALUE spec);
+
+static int
+int_projection_add_i(VALUE name, VALUE spec, VALUE vargs)
+{
+    VALUE key, cur;
+    krypt_asn1_schema *field, *child = NULL;
+    struct int_projection_args *args = (struct int_projection_args *) vargs;
+
+    field = int_projection_field(args->schema, name);
+    key = ID2SYM(field->name);
+    if (spec == Qtrue || NIL_P(spec)) {
+	rb_hash_aset(args->projection, key, Qtrue);
+	return ST_CONTINUE;
+    }
+    if (field->codec == KRYPT_CODEC_TEMPLATE || (field->flags & KRYPT_SCHEMA_TEMPLATE_TYPE))
+	child = krypt_asn1_schema_get_child(field);
+    if (!child)
+	rb_raise(rb_eArgError, "Field %s has no fields to select", rb_id2name(SYM2ID(name)));
+
+    cur = rb_hash_lookup2(args->projection, key, Qundef);
+    if (cur == Qundef)
+	rb_hash_aset(args->projection, key, int_projection_new(child, spec));
+    else if (cur != Qtrue)
+	int_projection_add(cur, child, spec);
+    return ST_CONTINUE;
+}
+
+/*
+ * +spec+ is a field name, a Hash mapping field names to the fields to
+ * select within them, or an Array of these.
+ */
+static void
+int_projection_add(VALUE projection, krypt_asn1_schema *schema, VALUE spec)
+{
+    long i;
+    struct int_projection_args args;
+
+    switch (TYPE(spec)) {
+	case T_SYMBOL:
+	    rb_hash_aset(projection, ID2SYM(int_projection_field(schema, spec)->name), Qtrue);
+	    break;
+	case T_ARRAY:
+	    for (i=0; i < RARRAY_LEN(spec); ++i)
+		int_projection_add(projection, schema, rb_ary_entry(spec, i));
+	    break;
+	case T_HASH:
+	    args.projection = projection;
+	    args.schema = schema;
+	    rb_hash_foreach(spec, int_projection_add_i, (VALUE) &args);
+	    break;
+	default:
+	    rb_raise(rb_eTypeError, "Fields must be given as Symbols, Arrays or Hashes");
+    }
+}
+
+static VALUE
+int_projection_new(krypt_asn1_schema *schema, VALUE spec)
+{
+    VALUE projection;
+
+    if (schema->codec != KRYPT_CODEC_SEQUENCE && schema->codec != KRYPT_CODEC_SET)
+	rb_raise(rb_eArgError, "Fields can only be selected from a SEQUENCE or SET");
+    projection = rb_hash_new();
+    int_projection_add(projection, schema, spec);
+    return projection;
+}
+
+static VALUE
+int_template_parse_der(VALUE klass, VALUE der, VALUE projection)
 {
     VALUE ret = Qnil;
     int result;
-    binyo_instream *in = krypt_instream_new_value_der(der);
+    struct krypt_asn1_template_cursor cursor;
+    krypt_asn1_schema *schema;
 
-    result = krypt_asn1_template_parse_stream(in, klass, &ret);
-    binyo_instream_free(in);
+    if (!(schema = krypt_asn1_schema_get(klass)))
+	krypt_error_raise(eKryptASN1Error, "Parsing the value failed"); 
+    if (!NIL_P(projection))
+	projection = int_projection_new(schema, projection);
+
+    if ((cursor.in = krypt_instream_new_value(der))) {
+	cursor.base = NULL;
+	cursor.source = Qnil;
+    } else {
+	der = krypt_to_der_if_possible(der);
+	StringValue(der);
+	cursor.source = rb_str_new_frozen(der);
+	cursor.base = (uint8_t *) RSTRING_PTR(cursor.source);
+	cursor.len = RSTRING_LEN(cursor.source);
+	cursor.off = 0;
+	cursor.in = binyo_instream_new_bytes(cursor.base, cursor.len);
+    }
+    result = krypt_asn1_template_parse_stream(&cursor, klass, schema, &ret);
+    binyo_instream_free(cursor.in);
+    RB_GC_GUARD(cursor.source);
     if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR)
 	krypt_error_raise(eKryptASN1Error, "Parsing the value failed"); 
+    if (!NIL_P(projection)) {
+	krypt_asn1_template *t;
+	krypt_asn1_template_get(ret, t);
+	krypt_asn1_template_set_projection(t, projection);
+    }
     return ret;
 }
 
+VALUE
+krypt_asn1_template_parse_der(VALUE klass, VALUE der)
+{
+    return int_template_parse_der(klass, der, Qnil);
+}
+
+/*
+ * call-seq:
+ *    Template.parse_der(der) -> Template
+ *    Template.parse_der(der, only: fields) -> Template
+ *
+ * Parses +der+ lazily into an instance of the Template. If +der+ is a
+ * String, the parsed values refer to a frozen copy of it instead of
+ * copying their encodings; the copy shares the String's buffer.
+ *
+ * With +only+, just the given fields are parsed, the others are matched
+ * by their header and parsed on first access. +fields+ is a field name,
+ * a Hash mapping field names to the fields to select within them, or an
+ * Array of these, e.g.
+ *
+ *   Certificate.parse_der(der, only: [{ tbs_certificate: [:subject] }, :signature_value])
+ *
+ * Fields that were left out are encoded again exactly as they were read.
+ */
+static VALUE
+krypt_asn1_template_rb_parse_der(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE der, opts, only = Qnil;
+
+    rb_scan_args(argc, argv, "11", &der, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+	only = rb_hash_aref(opts, ID2SYM(sKrypt_ID_ONLY));
+    }
+    return int_template_parse_der(klass, der, only);
+}
+
+/* the structural checks are only spread across threads for larger batches */
+#define KRYPT_TEMPLATE_BATCH_BYTES_PER_THREAD	(64 * 1024)
+
+typedef struct krypt_asn1_template_blob_st {
+    VALUE source; /* frozen String the encoding lies in */
+    uint8_t *bytes;
+    size_t len;
+    int invalid;
+} krypt_asn1_template_blob;
+
+typedef struct krypt_asn1_template_batch_st {
+    VALUE klass;
+    krypt_asn1_schema *schema;
+    VALUE ders;
+    VALUE projection;
+    VALUE holder; /* keeps the sources of the blobs in place */
+    krypt_asn1_template_blob *blobs;
+    size_t num;
+    int nthreads;
+    int validate;
+} krypt_asn1_template_batch;
+
+static void
+int_batch_mark(krypt_asn1_template_batch *batch)
+{
+    size_t i;
+
+    if (!batch) return;
+    /* pinned, the blobs point into them */
+    for (i=0; i < batch->num; i++)
+	rb_gc_mark(batch->blobs[i].source);
+}
+
+static void
+int_batch_add_string(krypt_asn1_template_batch *batch, VALUE der)
+{
+    krypt_asn1_template_blob *blob = &batch->blobs[batch->num];
+
+    der = krypt_to_der_if_possible(der);
+    StringValue(der);
+    blob->source = rb_str_new_frozen(der);
+    blob->bytes = (uint8_t *) RSTRING_PTR(blob->source);
+    blob->len = RSTRING_LEN(blob->source);
+    blob->invalid = 0;
+    batch->num++;
+}
+
+/* locates the values encoded one after the other in +source+ */
+static void
+int_batch_split(krypt_asn1_template_batch *batch, VALUE source)
+{
+    uint8_t *p = (uint8_t *) RSTRING_PTR(source);
+    size_t off = 0, len = RSTRING_LEN(source), header_len, value_len, cap = 16;
+
+    batch->blobs = ALLOC_N(krypt_asn1_template_blob, cap);
+    while (off < len) {
+	if (krypt_asn1_value_bounds(p + off, len - off, &header_len, &value_len) == KRYPT_ERR)
+	    rb_raise(eKryptASN1Error, "Could not locate value %ld", (long) batch->num);
+	if (batch->num == cap) {
+	    cap *= 2;
+	    REALLOC_N(batch->blobs, krypt_asn1_template_blob, cap);
+	}
+	batch->blobs[batch->num].source = source;
+	batch->blobs[batch->num].bytes = p + off;
+	batch->blobs[batch->num].len = header_len + value_len;
+	batch->blobs[batch->num].invalid = 0;
+	batch->num++;
+	off += header_len + value_len;
+    }
+}
+
+static VALUE
+int_batch_read_all(binyo_instream *in)
+{
+    uint8_t *bytes;
+    size_t len;
+    VALUE ret;
+
+    if (krypt_instream_read_all(in, &bytes, &len) == KRYPT_ERR)
+	return Qnil;
+    ret = rb_str_new((const char *) bytes, len);
+    xfree(bytes);
+    return rb_obj_freeze(ret);
+}
+
+static void
+int_batch_check(size_t i, void *arg)
+{
+    krypt_asn1_template_batch *batch = (krypt_asn1_template_batch *) arg;
+    krypt_asn1_template_blob *blob = &batch->blobs[i];
+
+    if (krypt_asn1_check_der(blob->bytes, blob->len) == KRYPT_ERR)
+	blob->invalid = 1;
+}
+
+static VALUE
+int_batch_run(VALUE arg)
+{
+    krypt_asn1_template_batch *batch = (krypt_asn1_template_batch *) arg;
+    binyo_instream *in;
+    size_t i, total = 0;
+    VALUE ary, source;
+
+    if (TYPE(batch->ders) == T_ARRAY) {
+	/* a copy, the conversions to DER could change the Array otherwise */
+	VALUE ders = rb_ary_dup(batch->ders);
+	size_t len = RARRAY_LEN(ders);
+
+	batch->blobs = ALLOC_N(krypt_asn1_template_blob, len ? len : 1);
+	for (i=0; i < len; i++)
+	    int_batch_add_string(batch, rb_ary_entry(ders, i));
+	RB_GC_GUARD(ders);
+    }
+    else {
+	if ((in = krypt_instream_new_value(batch->ders))) {
+	    source = int_batch_read_all(in);
+	    if (NIL_P(source))
+		krypt_error_raise(eKryptASN1Error, "Error while reading values");
+	}
+	else {
+	    source = krypt_to_der_if_possible(batch->ders);
+	    StringValue(source);
+	    source = rb_str_new_frozen(source);
+	}
+	int_batch_split(batch, source);
+    }
+
+    if (batch->validate) {
+	for (i=0; i < batch->num; i++)
+	    total += batch->blobs[i].len;
+	if ((size_t) batch->nthreads > total / KRYPT_TEMPLATE_BATCH_BYTES_PER_THREAD + 1)
+	    batch->nthreads = (int) (total / KRYPT_TEMPLATE_BATCH_BYTES_PER_THREAD + 1);
+	krypt_parallel_for(batch->num, batch->nthreads, int_batch_check, batch);
+	for (i=0; i < batch->num; i++) {
+	    if (batch->blobs[i].invalid)
+		rb_raise(eKryptASN1Error, "Value %ld is not a valid DER encoding", (long) i);
+	}
+    }
+
+    ary = rb_ary_new2(batch->num);
+    for (i=0; i < batch->num; i++) {
+	VALUE cur;
+	krypt_asn1_template_blob *blob = &batch->blobs[i];
+
+	if (krypt_asn1_template_parse_bytes(batch->klass, batch->schema, blob->source, blob->bytes, blob->len, &cur) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Could not parse value %ld", (long) i);
+	if (!NIL_P(batch->projection)) {
+	    krypt_asn1_template *t;
+	    krypt_asn1_template_get(cur, t);
+	    krypt_asn1_template_set_projection(t, batch->projection);
+	}
+	rb_ary_push(ary, cur);
+    }
+    return ary;
+}
+
+static VALUE
+int_batch_ensure(VALUE arg)
+{
+    krypt_asn1_template_batch *batch = (krypt_asn1_template_batch *) arg;
+
+    DATA_PTR(batch->holder) = NULL;
+    if (batch->blobs)
+	xfree(batch->blobs);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    Template.parse_der_many(ders, [only: fields, threads: n, validate: bool]) -> Array
+ *
+ * Parses many encodings of the Template at once and returns the instances
+ * in input order. +ders+ is either an Array of DER-encoded Strings or an
+ * IO or String holding the encodings one after the other. The schema is
+ * looked up once for the whole batch, and the instances are parsed
+ * lazily as with Template.parse_der. +only+ applies to every instance.
+ *
+ * If +validate+ is true, every encoding is first checked to be a single,
+ * well-formed DER value. These checks run concurrently on up to +threads+
+ * native threads (by default one per processor) without holding the GVL,
+ * and an ASN1Error is raised for the first malformed value before any
+ * instance is created.
+ *
+ * === Example: Parsing a certificate inventory
+ *
+ *   certs = Certificate.parse_der_many(File.open("certs.der", "rb"), validate: true)
+ */
+static VALUE
+krypt_asn1_template_parse_der_many(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE ders, opts = Qnil, threads, ary;
+    krypt_asn1_template_batch batch;
+
+    rb_scan_args(argc, argv, "11", &ders, &opts);
+
+    memset(&batch, 0, sizeof(krypt_asn1_template_batch));
+    batch.klass = klass;
+    batch.ders = ders;
+    batch.projection = Qnil;
+    batch.nthreads = krypt_thread_count_default();
+    if (!(batch.schema = krypt_asn1_schema_get(klass)))
+	krypt_error_raise(eKryptASN1Error, "Parsing the values failed");
+    if (!NIL_P(opts)) {
+	VALUE only;
+	Check_Type(opts, T_HASH);
+	only = rb_hash_aref(opts, ID2SYM(sKrypt_ID_ONLY));
+	if (!NIL_P(only))
+	    batch.projection = int_projection_new(batch.schema, only);
+	threads = rb_hash_aref(opts, ID2SYM(sKrypt_ID_THREADS));
+	if (!NIL_P(threads))
+	    batch.nthreads = NUM2INT(threads);
+	if (batch.nthreads < 1)
+	    rb_raise(rb_eArgError, "threads must be positive");
+	batch.validate = RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_VALIDATE)));
+    }
+
+    /* hidden, it must not outlive this call with a pointer to the stack */
+    batch.holder = Data_Wrap_Struct(0, int_batch_mark, 0, &batch);
+    ary = rb_ensure(int_batch_run, (VALUE) &batch, int_batch_ensure, (VALUE) &batch);
+    RB_GC_GUARD(batch.ders);
+    RB_GC_GUARD(batch.holder);
+    RB_GC_GUARD(batch.projection);
+    return ary;
+}
+
 void
 Init_krypt_asn1_template_parser(void)
 {
     VALUE mParser = rb_define_module_under(mKryptASN1Template, "Parser");
-    rb_define_method(mParser, "parse_der", krypt_asn1_template_parse_der, 1);
+    sKrypt_ID_ONLY = rb_intern("only");
+    sKrypt_ID_THREADS = rb_intern("threads");
+    sKrypt_ID_VALIDATE = rb_intern("validate");
+
+    rb_define_method(mParser, "parse_der", krypt_asn1_template_rb_parse_der, -1);
     rb_define_alias(mParser, "decode_der", "parse_der");
+    rb_define_method(mParser, "parse_der_many", krypt_asn1_template_parse_der_many, -1);
 }
-
@@ -0,0 +1,246 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
+
+/*
+ * Plans are functions generated ahead of time by
+ * Krypt::ASN1::Template::Compiler. Given the contents of a SEQUENCE or
+ * SET they locate the elements belonging to each field in straight-line
+ * code, so the parser no longer has to match the fields one by one. A
+ * plan is generated from the signature of a schema, which describes how
+ * each field is matched, and is only used as long as the schema it is
+ * registered for still has that very signature.
+ */
+#define KRYPT_TEMPLATE_PLAN_VERSION 1
+
+typedef struct krypt_asn1_template_plan_st {
+    krypt_asn1_template_plan_fn fn;
+    char *signature;
+} krypt_asn1_template_plan;
+
+static ID sKrypt_IV_PLAN;
+
+static void
+int_plan_free(krypt_asn1_template_plan *plan)
+{
+    if (!plan) return;
+    xfree(plan->signature);
+    xfree(plan);
+}
+
+static int
+int_plan_id(VALUE str, char kind, int tag, int tag_class)
+{
+    if (tag < 0 || tag > 30) return KRYPT_ERR;
+    if (tag_class < 0 || (tag_class & ~TAG_CLASS_PRIVATE)) return KRYPT_ERR;
+    rb_str_catf(str, "%c%02x", kind, tag_class | tag);
+    return KRYPT_OK;
+}
+
+/*
+ * Matchers of values that are recognized by their tag alone: 'p' ignores
+ * the constructed bit, 'c' requires it to be set.
+ */
+static int
+int_plan_single(VALUE str, krypt_asn1_schema *node)
+{
+    krypt_asn1_schema *type = node;
+    int tag;
+
+    if (node->codec == KRYPT_CODEC_TEMPLATE && !(type = krypt_asn1_schema_get_child(node)))
+	return KRYPT_ERR;
+    tag = (node->flags & KRYPT_SCHEMA_HAS_TAG) ? node->tag : type->default_tag;
+
+    switch (type->codec) {
+	case KRYPT_CODEC_PRIMITIVE:
+	    return int_plan_id(str, 'p', tag, node->tag_class);
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    return int_plan_id(str, 'c', tag, node->tag_class);
+	default:
+	    return KRYPT_ERR;
+    }
+}
+
+/*
+ * CHOICEs are matched by the tags of their alternatives, preceded by the
+ * tag of the explicit tagging if there is one. Alternatives that need
+ * more than their tag to match are not described.
+ */
+static int
+int_plan_choice(VALUE str, krypt_asn1_schema *node, krypt_asn1_schema *choice)
+{
+    long i;
+
+    if (krypt_asn1_schema_is_tagged(node)) {
+	if (!krypt_asn1_schema_is_explicit(node) || !(node->flags & KRYPT_SCHEMA_HAS_TAG)) return KRYPT_ERR;
+	if (int_plan_id(str, 'p', node->tag, node->tag_class) == KRYPT_ERR) return KRYPT_ERR;
+	rb_str_cat2(str, ">");
+    } else if (node->flags & KRYPT_SCHEMA_HAS_TAG) {
+	return KRYPT_ERR;
+    }
+    if (choice->layout_len == 0) return KRYPT_ERR;
+
+    for (i=0; i < choice->layout_len; ++i) {
+	krypt_asn1_schema *alt = &choice->layout[i];
+
+	if (krypt_asn1_schema_is_optional(alt)) return KRYPT_ERR;
+	if (i > 0) rb_str_cat2(str, "|");
+	if (int_plan_single(str, alt) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_plan_matcher(VALUE str, krypt_asn1_schema *node)
+{
+    krypt_asn1_schema *type = node;
+
+    if (node->codec == KRYPT_CODEC_TEMPLATE && !(type = krypt_asn1_schema_get_child(node)))
+	return KRYPT_ERR;
+
+    switch (type->codec) {
+	case KRYPT_CODEC_ANY:
+	    /* only OPTIONAL ANY values look at the tag at all */
+	    if (krypt_asn1_schema_is_optional(node) && (node->flags & KRYPT_SCHEMA_HAS_TAG))
+		return int_plan_id(str, 'p', node->tag, node->tag_class);
+	    rb_str_cat2(str, "a");
+	    return KRYPT_OK;
+	case KRYPT_CODEC_CHOICE:
+	    return int_plan_choice(str, node, type);
+	default:
+	    return int_plan_single(str, node);
+    }
+}
+
+/*
+ * Returns the signature of a SEQUENCE or SET +schema+: the plan version
+ * followed by one entry 'name,o|m,matcher' per field, separated by ';'.
+ * Fields whose matcher cannot be described are marked with 'x', plans
+ * fall back to the generic parser when they reach one. Returns Qnil for
+ * other schemas.
+ */
+static VALUE
+int_plan_signature(krypt_asn1_schema *schema)
+{
+    long i;
+    VALUE str;
+
+    if (schema->codec != KRYPT_CODEC_SEQUENCE && schema->codec != KRYPT_CODEC_SET) return Qnil;
+
+    str = rb_sprintf("%d", KRYPT_TEMPLATE_PLAN_VERSION);
+    for (i=0; i < schema->layout_len; ++i) {
+	krypt_asn1_schema *cur = &schema->layout[i];
+	VALUE matcher = rb_str_new2("");
+
+	if (int_plan_matcher(matcher, cur) == KRYPT_ERR) {
+	    krypt_error_clear();
+	    matcher = rb_str_new2("x");
+	}
+	rb_str_catf(str, ";%s,%c,", rb_id2name(cur->name), krypt_asn1_schema_is_optional(cur) ? 'o' : 'm');
+	rb_str_append(str, matcher);
+    }
+    return str;
+}
+
+/*
+ * Uses the plan registered for +klass+, if any, to parse instances
+ * described by its freshly compiled +schema+.
+ */
+void
+krypt_asn1_template_plan_attach(VALUE klass, krypt_asn1_schema *schema)
+{
+    VALUE wrapper, signature;
+    krypt_asn1_template_plan *plan;
+
+    schema->plan = NULL;
+    if (!rb_ivar_defined(klass, sKrypt_IV_PLAN)) return;
+    wrapper = rb_ivar_get(klass, sKrypt_IV_PLAN);
+    Data_Get_Struct(wrapper, krypt_asn1_template_plan, plan);
+
+    signature = int_plan_signature(schema);
+    if (NIL_P(signature) || strcmp(plan->signature, StringValueCStr(signature)) != 0) return;
+    schema->plan = plan->fn;
+}
+
+/*
+ * Registers the generated +plan+ for Template class +klass+. Returns
+ * KRYPT_ERR if +signature+ does not match the current definition of
+ * +klass+, the plan is then only used should the definition ever change
+ * back to the one it was generated from.
+ */
+int
+krypt_asn1_template_register_plan(VALUE klass, const char *signature, krypt_asn1_template_plan_fn fn)
+{
+    krypt_asn1_template_plan *plan;
+    krypt_asn1_schema *schema;
+    VALUE wrapper;
+
+    plan = ALLOC(krypt_asn1_template_plan);
+    plan->fn = fn;
+    plan->signature = ALLOC_N(char, strlen(signature) + 1);
+    strcpy(plan->signature, signature);
+    wrapper = Data_Wrap_Struct(0, 0, int_plan_free, plan);
+    rb_ivar_set(klass, sKrypt_IV_PLAN, wrapper);
+
+    if (!(schema = krypt_asn1_schema_get(klass))) return KRYPT_ERR;
+    krypt_asn1_template_plan_attach(klass, schema);
+    return schema->plan ? KRYPT_OK : KRYPT_ERR;
+}
+
+/*
+ * call-seq:
+ *    Template.plan_signature -> String or nil
+ *
+ * Describes how the fields of a SEQUENCE or SET Template are matched.
+ * Krypt::ASN1::Template::Compiler generates plans from it, and a plan is
+ * only used while the signature of its Template stays the same. Returns
+ * nil for other Templates.
+ */
+static VALUE
+krypt_asn1_template_plan_signature(VALUE klass)
+{
+    krypt_asn1_schema *schema;
+
+    if (!(schema = krypt_asn1_schema_get(klass)))
+	krypt_error_raise(eKryptASN1Error, "Not a Template");
+    return int_plan_signature(schema);
+}
+
+void
+Init_krypt_asn1_template_plan(void)
+{
+    VALUE mParser = rb_define_module_under(mKryptASN1Template, "Parser");
+    sKrypt_IV_PLAN = rb_intern("__krypt_plan__");
+    rb_define_method(mParser, "plan_signature", krypt_asn1_template_plan_signature, 0);
+}
@@ -0,0 +1,464 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
+
+static ID sKrypt_IV_SCHEMA;
+static ID sKrypt_ID_INCLUDE_P;
+
+static int
+int_codec_for_id(ID codec)
+{
+    if (codec == sKrypt_ID_PRIMITIVE)
+	return KRYPT_CODEC_PRIMITIVE;
+    else if (codec == sKrypt_ID_SEQUENCE)
+	return KRYPT_CODEC_SEQUENCE;
+    else if (codec == sKrypt_ID_TEMPLATE)
+	return KRYPT_CODEC_TEMPLATE;
+    else if (codec == sKrypt_ID_SET)
+	return KRYPT_CODEC_SET;
+    else if (codec == sKrypt_ID_SEQUENCE_OF)
+	return KRYPT_CODEC_SEQUENCE_OF;
+    else if (codec == sKrypt_ID_SET_OF)
+	return KRYPT_CODEC_SET_OF;
+    else if (codec == sKrypt_ID_ANY)
+	return KRYPT_CODEC_ANY;
+    else if (codec == sKrypt_ID_CHOICE)
+	return KRYPT_CODEC_CHOICE;
+    else {
+	krypt_error_add("Unknown codec: %s", rb_id2name(codec));
+	return KRYPT_ERR;
+    }
+}
+
+static void
+int_schema_mark_node(krypt_asn1_schema *schema)
+{
+    long i;
+
+    rb_gc_mark(schema->type);
+    rb_gc_mark(schema->default_value);
+    rb_gc_mark(schema->definition);
+    rb_gc_mark(schema->options);
+    rb_gc_mark(schema->layout_ary);
+    if (schema->child)
+	rb_gc_mark(schema->child->self);
+    for (i=0; i < schema->layout_len; ++i)
+	int_schema_mark_node(&schema->layout[i]);
+}
+
+static void
+int_schema_free_index(krypt_asn1_tag_index *index)
+{
+    if (!index) return;
+    xfree(index->next_same);
+    xfree(index->next_stop);
+    xfree(index);
+}
+
+static void
+int_schema_free_node(krypt_asn1_schema *schema)
+{
+    long i;
+
+    int_schema_free_index(schema->index);
+    if (!schema->layout) return;
+    for (i=0; i < schema->layout_len; ++i)
+	int_schema_free_node(&schema->layout[i]);
+    xfree(schema->layout);
+}
+
+static void
+int_schema_mark(krypt_asn1_schema *schema)
+{
+    if (!schema) return;
+    int_schema_mark_node(schema);
+}
+
+static void
+int_schema_free(krypt_asn1_schema *schema)
+{
+    if (!schema) return;
+    int_schema_free_node(schema);
+    xfree(schema);
+}
+
+static void
+int_schema_init_node(krypt_asn1_schema *schema, krypt_asn1_schema *root)
+{
+    memset(schema, 0, sizeof(krypt_asn1_schema));
+    schema->root = root;
+    schema->name = sKrypt_IV_VALUE; /* CHOICE values have no name */
+    schema->default_tag = -1;
+    schema->tag_class = TAG_CLASS_UNIVERSAL;
+    schema->type = Qnil;
+    schema->default_value = Qnil;
+    schema->definition = Qnil;
+    schema->options = Qnil;
+    schema->layout_ary = Qnil;
+    schema->self = Qnil;
+}
+
+static int
+int_schema_compile_options(krypt_asn1_schema *schema, VALUE options)
+{
+    VALUE tag, tagging;
+
+    schema->options = options;
+    if (NIL_P(options)) return KRYPT_OK;
+    if (TYPE(options) != T_HASH) {
+	krypt_error_add("Options must be a Hash");
+	return KRYPT_ERR;
+    }
+
+    schema->default_value = krypt_hash_get_default_value(options);
+    if (!NIL_P(schema->default_value))
+	schema->flags |= KRYPT_SCHEMA_DEFAULT | KRYPT_SCHEMA_OPTIONAL;
+    if (RTEST(krypt_hash_get_optional(options)))
+	schema->flags |= KRYPT_SCHEMA_OPTIONAL;
+
+    tag = krypt_hash_get_tag(options);
+    if (!NIL_P(tag)) {
+	schema->tag = NUM2INT(tag);
+	schema->flags |= KRYPT_SCHEMA_HAS_TAG;
+    }
+
+    tagging = krypt_hash_get_tagging(options);
+    if (!NIL_P(tagging)) {
+	ID tc = SYM2ID(tagging);
+	schema->flags |= KRYPT_SCHEMA_TAGGED;
+	if (tc == sKrypt_TC_EXPLICIT)
+	    schema->flags |= KRYPT_SCHEMA_EXPLICIT;
+	/* an unknown tag class yields KRYPT_ERR, which simply never matches */
+	schema->tag_class = krypt_asn1_tag_class_for_id(tc);
+    }
+    return KRYPT_OK;
+}
+
+static int int_schema_compile_node(krypt_asn1_schema *schema, krypt_asn1_schema *root, VALUE definition);
+
+static int
+int_tag_key(int tag, int tag_class)
+{
+    if (tag < 0 || tag > 30) return -1;
+    if (tag_class < 0 || (tag_class & ~TAG_CLASS_PRIVATE)) return -1;
+    return (tag_class >> 6) * 31 + tag;
+}
+
+/*
+ * The tag an element must have in order to match +node+, or -1 if that
+ * is not known before actually trying to match it.
+ */
+static int
+int_schema_node_key(krypt_asn1_schema *node)
+{
+    int has_tag = node->flags & KRYPT_SCHEMA_HAS_TAG;
+
+    switch (node->codec) {
+	case KRYPT_CODEC_ANY:
+	    return -1;
+	case KRYPT_CODEC_TEMPLATE:
+	case KRYPT_CODEC_CHOICE:
+	    if (!has_tag) return -1;
+	    /* fall through */
+	default:
+	    return int_tag_key(has_tag ? node->tag : node->default_tag, node->tag_class);
+    }
+}
+
+static void
+int_schema_compile_index(krypt_asn1_schema *schema)
+{
+    long i, len = schema->layout_len;
+    int *keys;
+    krypt_asn1_tag_index *index;
+
+    if (len == 0) return;
+    index = ALLOC(krypt_asn1_tag_index);
+    index->next_same = ALLOC_N(int, len);
+    index->next_stop = ALLOC_N(int, len + 1);
+    keys = ALLOCA_N(int, len);
+    for (i=0; i < KRYPT_TAG_INDEX_SIZE; ++i)
+	index->first[i] = -1;
+
+    index->next_stop[len] = (int) len;
+    for (i=len - 1; i >= 0; --i) {
+	krypt_asn1_schema *cur = &schema->layout[i];
+	int stop;
+
+	keys[i] = int_schema_node_key(cur);
+	if (schema->codec == KRYPT_CODEC_CHOICE)
+	    stop = keys[i] == -1 || krypt_asn1_schema_has_default(cur);
+	else
+	    stop = keys[i] == -1 || !krypt_asn1_schema_is_optional(cur);
+	index->next_stop[i] = stop ? (int) i : index->next_stop[i + 1];
+
+	if (keys[i] != -1) {
+	    index->next_same[i] = index->first[keys[i]];
+	    index->first[keys[i]] = (int) i;
+	} else {
+	    index->next_same[i] = -1;
+	}
+    }
+    schema->index = index;
+}
+
+static int
+int_schema_compile_layout(krypt_asn1_schema *schema, int needs_min_size)
+{
+    long i, len;
+    VALUE layout = krypt_hash_get_layout(schema->definition);
+
+    if (NIL_P(layout)) {
+	krypt_error_add("'layout' missing in ASN.1 definition");
+	return KRYPT_ERR;
+    }
+    Check_Type(layout, T_ARRAY);
+    if (needs_min_size) {
+	VALUE min_size = krypt_hash_get_min_size(schema->definition);
+	if (NIL_P(min_size)) {
+	    krypt_error_add("'min_size' is missing in ASN.1 definition");
+	    return KRYPT_ERR;
+	}
+	schema->min_size = NUM2LONG(min_size);
+    }
+
+    len = RARRAY_LEN(layout);
+    schema->layout_ary = layout;
+    schema->layout = ALLOC_N(krypt_asn1_schema, len ? len : 1);
+    for (i=0; i < len; ++i)
+	int_schema_init_node(&schema->layout[i], schema->root);
+    schema->layout_len = len;
+
+    for (i=0; i < len; ++i) {
+	if (int_schema_compile_node(&schema->layout[i], schema->root, rb_ary_entry(layout, i)) == KRYPT_ERR)
+	    return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_schema_require_type(krypt_asn1_schema *schema)
+{
+    if (NIL_P(schema->type)) {
+	krypt_error_add("'type' missing in ASN.1 definition");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_schema_compile_node(krypt_asn1_schema *schema, krypt_asn1_schema *root, VALUE definition)
+{
+    VALUE codec, name;
+
+    if (TYPE(definition) != T_HASH) {
+	krypt_error_add("ASN.1 definition must be a Hash");
+	return KRYPT_ERR;
+    }
+    schema->definition = definition;
+
+    if (NIL_P((codec = krypt_hash_get_codec(definition)))) {
+	krypt_error_add("No codec found in definition");
+	return KRYPT_ERR;
+    }
+    if ((schema->codec = int_codec_for_id(SYM2ID(codec))) == KRYPT_ERR) return KRYPT_ERR;
+    if (!NIL_P((name = krypt_hash_get_name(definition))))
+	schema->name = SYM2ID(name);
+    schema->type = krypt_hash_get_type(definition);
+
+    switch (schema->codec) {
+	case KRYPT_CODEC_PRIMITIVE:
+	    if (int_schema_require_type(schema) == KRYPT_ERR) return KRYPT_ERR;
+	    schema->default_tag = NUM2INT(schema->type);
+	    if (schema->default_tag < 0 || schema->default_tag > 30) {
+		krypt_error_add("No codec available for default tag %d", schema->default_tag);
+		return KRYPT_ERR;
+	    }
+	    break;
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	    schema->default_tag = schema->codec == KRYPT_CODEC_SEQUENCE ? TAGS_SEQUENCE : TAGS_SET;
+	    if (int_schema_compile_layout(schema, 1) == KRYPT_ERR) return KRYPT_ERR;
+	    int_schema_compile_index(schema);
+	    break;
+	case KRYPT_CODEC_CHOICE:
+	    if (int_schema_compile_layout(schema, 0) == KRYPT_ERR) return KRYPT_ERR;
+	    int_schema_compile_index(schema);
+	    break;
+	case KRYPT_CODEC_TEMPLATE:
+	    if (int_schema_require_type(schema) == KRYPT_ERR) return KRYPT_ERR;
+	    break;
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    if (int_schema_require_type(schema) == KRYPT_ERR) return KRYPT_ERR;
+	    schema->default_tag = schema->codec == KRYPT_CODEC_SEQUENCE_OF ? TAGS_SEQUENCE : TAGS_SET;
+	    if (TYPE(schema->type) == T_CLASS &&
+		RTEST(rb_funcall(schema->type, sKrypt_ID_INCLUDE_P, 1, mKryptASN1Template)))
+		schema->flags |= KRYPT_SCHEMA_TEMPLATE_TYPE;
+	    break;
+	default:
+	    break;
+    }
+
+    return int_schema_compile_options(schema, krypt_hash_get_options(definition));
+}
+
+/*
+ * A compiled schema stays valid as long as the class keeps the very same
+ * definition Hash and no fields were appended to its layout since.
+ */
+static int
+int_schema_is_current(krypt_asn1_schema *schema, VALUE definition)
+{
+    if (schema->definition != definition) return 0;
+    if (NIL_P(schema->layout_ary)) return 1;
+    return RARRAY_LEN(schema->layout_ary) == schema->layout_len;
+}
+
+static krypt_asn1_schema *
+int_schema_compile(VALUE klass, VALUE definition)
+{
+    VALUE wrapper;
+    krypt_asn1_schema *schema;
+
+    schema = ALLOC(krypt_asn1_schema);
+    int_schema_init_node(schema, schema);
+    /* wrap first so that the schema is collected if compiling raises */
+    wrapper = Data_Wrap_Struct(0, int_schema_mark, int_schema_free, schema);
+    schema->self = wrapper;
+
+    if (int_schema_compile_node(schema, schema, definition) == KRYPT_ERR) {
+	krypt_error_add("Could not compile ASN.1 definition of %s", rb_class2name(klass));
+	return NULL;
+    }
+    rb_ivar_set(klass, sKrypt_IV_SCHEMA, wrapper);
+    krypt_asn1_template_plan_attach(klass, schema);
+    return schema;
+}
+
+/*
+ * Returns the compiled schema for Template class +klass+, compiling its
+ * definition on first use or when the definition has changed since.
+ */
+krypt_asn1_schema *
+krypt_asn1_schema_get(VALUE klass)
+{
+    VALUE definition, wrapper;
+    krypt_asn1_schema *schema;
+
+    if (NIL_P((definition = krypt_definition_get(klass)))) {
+	krypt_error_add("%s has no ASN.1 definition", rb_class2name(klass));
+	return NULL;
+    }
+
+    wrapper = rb_ivar_get(klass, sKrypt_IV_SCHEMA);
+    if (!NIL_P(wrapper)) {
+	Data_Get_Struct(wrapper, krypt_asn1_schema, schema);
+	if (int_schema_is_current(schema, definition)) return schema;
+    }
+    return int_schema_compile(klass, definition);
+}
+
+/*
+ * Returns the schema of the Template class referenced by +schema+'s type.
+ */
+krypt_asn1_schema *
+krypt_asn1_schema_get_child(krypt_asn1_schema *schema)
+{
+    krypt_asn1_schema *child = schema->child;
+
+    if (child && int_schema_is_current(child, krypt_definition_get(schema->type)))
+	return child;
+    if (!(child = krypt_asn1_schema_get(schema->type))) return NULL;
+    schema->child = child;
+    return child;
+}
+
+/*
+ * Keeps the schema that +schema+ belongs to alive, called from the mark
+ * functions of objects that refer to it.
+ */
+void
+krypt_asn1_schema_mark(krypt_asn1_schema *schema)
+{
+    if (!schema) return;
+    rb_gc_mark(schema->root->self);
+}
+
+/*
+ * Returns the first layout position >= +from+ of the SEQUENCE, SET or
+ * CHOICE +schema+ that could match an element with +header+. All values
+ * in between are OPTIONAL and cannot match, returns layout_len if no
+ * further value could.
+ */
+long
+krypt_asn1_schema_next_candidate(krypt_asn1_schema *schema, long from, krypt_asn1_header *header)
+{
+    long next, same;
+    int key;
+    krypt_asn1_tag_index *index = schema->index;
+
+    if (!index || from >= schema->layout_len) return from;
+    next = index->next_stop[from];
+    if ((key = int_tag_key(header->tag, header->tag_class)) == -1) return next;
+
+    same = index->first[key];
+    while (same != -1 && same < from)
+	same = index->next_same[same];
+    if (same != -1 && same < next) next = same;
+    return next;
+}
+
+/*
+ * Returns the slot holding the value of field +name+ in instances of
+ * +schema+, or -1 if there is no such field. All alternatives of a
+ * CHOICE share its single slot.
+ */
+long
+krypt_asn1_schema_slot_index(krypt_asn1_schema *schema, ID name)
+{
+    long i;
+    int shared = schema->codec != KRYPT_CODEC_SEQUENCE && schema->codec != KRYPT_CODEC_SET;
+
+    if (shared && name == sKrypt_IV_VALUE) return 0;
+    for (i=0; i < schema->layout_len; ++i) {
+	if (schema->layout[i].name == name)
+	    return shared ? 0 : i;
+    }
+    return -1;
+}
+
+void
+Init_krypt_asn1_template_schema(void)
+{
+    sKrypt_IV_SCHEMA = rb_intern("__krypt_schema__");
+    sKrypt_ID_INCLUDE_P = rb_intern("include?");
+}
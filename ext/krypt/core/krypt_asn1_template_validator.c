@@ -0,0 +1,358 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
+
+/*
+ * Checks an encoding against a Template's schema the way the parser
+ * matches it, without creating any Ruby objects. Headers are decoded in
+ * place and values are only located, so primitive contents are not
+ * decoded. The first mismatch is recorded by its offset in the input.
+ */
+struct int_valid_ctx {
+    const uint8_t *base;
+    size_t mismatch;
+    int depth;
+};
+
+/* an element of the input, with the end of its contents and of itself */
+struct int_valid_elem {
+    krypt_asn1_header header;
+    size_t off;
+    size_t content;
+    size_t content_end;
+    size_t end;
+};
+
+static int int_valid_value(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem);
+
+static int
+int_valid_fail(struct int_valid_ctx *ctx, size_t off)
+{
+    ctx->mismatch = off;
+    return KRYPT_ERR;
+}
+
+static int
+int_valid_locate(struct int_valid_ctx *ctx, size_t off, size_t limit, struct int_valid_elem *out)
+{
+    size_t pos;
+    krypt_asn1_header *h = &out->header;
+
+    if (krypt_asn1_header_peek(ctx->base + off, limit - off, h) == KRYPT_ERR)
+	return int_valid_fail(ctx, off);
+    out->off = off;
+    out->content = off + h->tag_len + h->length_len;
+
+    if (!h->is_infinite) {
+	if (h->length > limit - out->content) return int_valid_fail(ctx, off);
+	out->content_end = out->end = out->content + h->length;
+	return KRYPT_OK;
+    }
+
+    /* the end of indefinite length values is found by skipping to their END OF CONTENTS */
+    if (!h->is_constructed || ctx->depth == KRYPT_ASN1_DEPTH_LIMIT) return int_valid_fail(ctx, off);
+    ctx->depth++;
+    pos = out->content;
+    while (limit - pos < 2 || ctx->base[pos] != 0 || ctx->base[pos + 1] != 0) {
+	struct int_valid_elem inner;
+	if (pos == limit) return int_valid_fail(ctx, pos);
+	if (int_valid_locate(ctx, pos, limit, &inner) == KRYPT_ERR) return KRYPT_ERR;
+	pos = inner.end;
+    }
+    ctx->depth--;
+    out->content_end = pos;
+    out->end = pos + 2;
+    return KRYPT_OK;
+}
+
+static int
+int_valid_next(struct int_valid_ctx *ctx, size_t *pos, size_t end, struct int_valid_elem *out)
+{
+    if (*pos == end) return KRYPT_ASN1_EOF;
+    if (int_valid_locate(ctx, *pos, end, out) == KRYPT_ERR) return KRYPT_ERR;
+    *pos = out->end;
+    return KRYPT_OK;
+}
+
+/* the single value within the contents of an explicitly tagged +elem+ */
+static int
+int_valid_unpack_explicit(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem, struct int_valid_elem *out)
+{
+    size_t pos = elem->content;
+
+    if (!krypt_definition_is_explicit(def)) {
+	*out = *elem;
+	return KRYPT_OK;
+    }
+    if (!elem->header.is_constructed) return int_valid_fail(ctx, elem->off);
+    if (int_valid_next(ctx, &pos, elem->content_end, out) != KRYPT_OK) return int_valid_fail(ctx, elem->content);
+    if (pos != elem->content_end) return int_valid_fail(ctx, pos);
+    return KRYPT_OK;
+}
+
+/* matches +elem+ by the rules of the parser, see krypt_asn1_template_match */
+static int
+int_valid_match(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem)
+{
+    krypt_asn1_template_matcher m;
+
+    m.header = &elem->header;
+    m.content = ctx->base + elem->content;
+    m.content_len = elem->content_end - elem->content;
+    m.self = Qnil;
+    m.apply_default = NULL;
+    m.mismatch = NULL;
+    return krypt_asn1_template_match(&m, def);
+}
+
+static int
+int_valid_rest_is_optional(krypt_asn1_schema *schema, long index)
+{
+    long i;
+
+    for (i=index; i < schema->layout_len; ++i) {
+	if (!krypt_asn1_schema_is_optional(&schema->layout[i])) return 0;
+    }
+    return 1;
+}
+
+static int
+int_valid_cons(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem)
+{
+    long i, num_parsed = 0;
+    size_t pos;
+    int has_more, consumed = 0;
+    struct int_valid_elem unpacked, cur_elem;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def);
+
+    if (int_valid_unpack_explicit(ctx, def, elem, &unpacked) == KRYPT_ERR) return KRYPT_ERR;
+    if (!unpacked.header.is_constructed) return int_valid_fail(ctx, unpacked.off);
+
+    pos = unpacked.content;
+    if (int_valid_next(ctx, &pos, unpacked.content_end, &cur_elem) != KRYPT_OK)
+	return int_valid_fail(ctx, unpacked.content);
+
+    for (i=0; i < schema->layout_len; ++i) {
+	int result;
+	krypt_asn1_definition inner_def;
+	krypt_asn1_schema *cur;
+
+	/* only the values that can match the current element are tried */
+	if ((i = krypt_asn1_schema_next_candidate(schema, i, &cur_elem.header)) == schema->layout_len) break;
+	cur = &schema->layout[i];
+	krypt_definition_init(&inner_def, cur, cur);
+
+	if ((result = int_valid_match(ctx, &inner_def, &cur_elem)) == KRYPT_TEMPLATE_MATCH_ERR)
+	    return int_valid_fail(ctx, cur_elem.off);
+	/* a DEFAULT applying leaves nothing to check */
+	if (result != KRYPT_TEMPLATE_MATCH) continue;
+
+	if (int_valid_value(ctx, &inner_def, &cur_elem) == KRYPT_ERR) return KRYPT_ERR;
+	num_parsed++;
+	consumed = 1;
+	if (i < schema->layout_len - 1) {
+	    if ((has_more = int_valid_next(ctx, &pos, unpacked.content_end, &cur_elem)) == KRYPT_ERR)
+		return KRYPT_ERR;
+	    consumed = has_more == KRYPT_ASN1_EOF;
+	    if (has_more == KRYPT_ASN1_EOF) {
+		if (!int_valid_rest_is_optional(schema, i + 1)) return int_valid_fail(ctx, pos);
+		break;
+	    }
+	}
+    }
+
+    if (num_parsed < schema->min_size) return int_valid_fail(ctx, unpacked.off);
+    /* a value that no field could take */
+    if (!consumed) return int_valid_fail(ctx, cur_elem.off);
+    if (pos != unpacked.content_end) return int_valid_fail(ctx, pos);
+    return KRYPT_OK;
+}
+
+static int
+int_valid_cons_of(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem)
+{
+    int result;
+    long count = 0;
+    size_t pos;
+    struct int_valid_elem unpacked, cur_elem;
+    krypt_asn1_definition type_def;
+    krypt_asn1_schema *schema = krypt_definition_get_schema(def), *type_schema = NULL;
+
+    if (int_valid_unpack_explicit(ctx, def, elem, &unpacked) == KRYPT_ERR) return KRYPT_ERR;
+    if (!unpacked.header.is_constructed) return int_valid_fail(ctx, unpacked.off);
+    if (schema->flags & KRYPT_SCHEMA_TEMPLATE_TYPE) {
+	if (!(type_schema = krypt_asn1_schema_get_child(schema))) return int_valid_fail(ctx, unpacked.off);
+	krypt_definition_init(&type_def, type_schema, type_schema);
+    }
+
+    pos = unpacked.content;
+    while ((result = int_valid_next(ctx, &pos, unpacked.content_end, &cur_elem)) == KRYPT_OK) {
+	count++;
+	/* other elements are decoded into ASN1Data on access, they only need to be well-formed */
+	if (!type_schema) continue;
+	if (int_valid_match(ctx, &type_def, &cur_elem) != KRYPT_TEMPLATE_MATCH)
+	    return int_valid_fail(ctx, cur_elem.off);
+	if (int_valid_value(ctx, &type_def, &cur_elem) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    if (result == KRYPT_ERR) return KRYPT_ERR;
+    if (count == 0 && !krypt_definition_is_optional(def)) return int_valid_fail(ctx, unpacked.off);
+    return KRYPT_OK;
+}
+
+static int
+int_valid_choice(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem)
+{
+    krypt_asn1_definition inner_def;
+    krypt_asn1_schema *matched;
+    struct int_valid_elem unpacked;
+    size_t pos = elem->content;
+
+    if (int_valid_match(ctx, def, elem) != KRYPT_TEMPLATE_MATCH) return int_valid_fail(ctx, elem->off);
+    matched = &krypt_definition_get_schema(def)->layout[krypt_definition_get_matched_layout(def)];
+    krypt_definition_init(&inner_def, matched, matched);
+
+    if (!krypt_definition_is_tagged(def)) return int_valid_value(ctx, &inner_def, elem);
+    if (int_valid_next(ctx, &pos, elem->content_end, &unpacked) != KRYPT_OK) return int_valid_fail(ctx, elem->content);
+    if (pos != elem->content_end) return int_valid_fail(ctx, pos);
+    return int_valid_value(ctx, &inner_def, &unpacked);
+}
+
+/* checks the contents of +elem+, which matched +def+ already */
+static int
+int_valid_value(struct int_valid_ctx *ctx, krypt_asn1_definition *def, struct int_valid_elem *elem)
+{
+    struct int_valid_elem unpacked;
+
+    switch (krypt_definition_get_codec(def)) {
+	case KRYPT_CODEC_PRIMITIVE:
+	    if (elem->header.is_infinite) return int_valid_fail(ctx, elem->off);
+	    if (int_valid_unpack_explicit(ctx, def, elem, &unpacked) == KRYPT_ERR) return KRYPT_ERR;
+	    if (unpacked.header.is_constructed) return int_valid_fail(ctx, unpacked.off);
+	    return KRYPT_OK;
+	case KRYPT_CODEC_SEQUENCE:
+	case KRYPT_CODEC_SET:
+	    return int_valid_cons(ctx, def, elem);
+	case KRYPT_CODEC_TEMPLATE: {
+	    krypt_asn1_definition new_def;
+	    krypt_asn1_schema *type_schema;
+
+	    if (!(type_schema = krypt_asn1_schema_get_child(krypt_definition_get_schema(def))))
+		return int_valid_fail(ctx, elem->off);
+	    krypt_definition_init(&new_def, type_schema, krypt_definition_get_field(def));
+	    return int_valid_value(ctx, &new_def, elem);
+	}
+	case KRYPT_CODEC_SEQUENCE_OF:
+	case KRYPT_CODEC_SET_OF:
+	    return int_valid_cons_of(ctx, def, elem);
+	case KRYPT_CODEC_ANY:
+	    return int_valid_unpack_explicit(ctx, def, elem, &unpacked);
+	case KRYPT_CODEC_CHOICE:
+	    return int_valid_choice(ctx, def, elem);
+	default:
+	    return int_valid_fail(ctx, elem->off);
+    }
+}
+
+static int
+int_valid_top(struct int_valid_ctx *ctx, krypt_asn1_definition *def, size_t len)
+{
+    struct int_valid_elem elem;
+
+    if (int_valid_locate(ctx, 0, len, &elem) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_valid_match(ctx, def, &elem) != KRYPT_TEMPLATE_MATCH) return int_valid_fail(ctx, 0);
+    if (int_valid_value(ctx, def, &elem) == KRYPT_ERR) return KRYPT_ERR;
+    if (elem.end != len) return int_valid_fail(ctx, elem.end);
+    return KRYPT_OK;
+}
+
+/*
+ * Returns the offset of the first mismatch of +der+ against the Template
+ * +klass+, or -1 if it matches.
+ */
+static long
+int_valid_der(VALUE klass, VALUE der)
+{
+    struct int_valid_ctx ctx;
+    krypt_asn1_definition def;
+    krypt_asn1_schema *schema;
+    long ret;
+
+    if (!(schema = krypt_asn1_schema_get(klass)))
+	krypt_error_raise(eKryptASN1Error, "Not a Template");
+    der = krypt_to_der_if_possible(der);
+    StringValue(der);
+    ctx.base = (const uint8_t *) RSTRING_PTR(der);
+    ctx.mismatch = 0;
+    ctx.depth = 0;
+
+    krypt_definition_init(&def, schema, schema);
+    ret = int_valid_top(&ctx, &def, RSTRING_LEN(der)) == KRYPT_OK ? -1 : (long) ctx.mismatch;
+    RB_GC_GUARD(der);
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    Template.valid_der?(der) -> true or false
+ *
+ * Checks whether +der+ can be parsed as an instance of the Template,
+ * descending into all of its values, without creating any objects. Only
+ * the structure is checked, the contents of primitive values are not
+ * decoded.
+ */
+static VALUE
+krypt_asn1_template_valid_der_p(VALUE klass, VALUE der)
+{
+    return int_valid_der(klass, der) == -1 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    Template.der_mismatch_offset(der) -> Integer or nil
+ *
+ * Performs the same checks as Template.valid_der? and returns the offset
+ * in +der+ where it first fails to match the Template, or nil if it
+ * matches.
+ */
+static VALUE
+krypt_asn1_template_der_mismatch_offset(VALUE klass, VALUE der)
+{
+    long offset = int_valid_der(klass, der);
+    return offset == -1 ? Qnil : LONG2NUM(offset);
+}
+
+void
+Init_krypt_asn1_template_validator(void)
+{
+    VALUE mParser = rb_define_module_under(mKryptASN1Template, "Parser");
+    rb_define_method(mParser, "valid_der?", krypt_asn1_template_valid_der_p, 1);
+    rb_define_method(mParser, "der_mismatch_offset", krypt_asn1_template_der_mismatch_offset, 1);
+}
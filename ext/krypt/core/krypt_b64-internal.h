@@ -34,5 +34,15 @@ int krypt_base64_buffer_encode_to(binyo_outstream *out, uint8_t *bytes, size_t o
 int krypt_base64_decode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen);
 int krypt_base64_buffer_decode_to(binyo_outstream *out, uint8_t *bytes, size_t off, size_t len);
 
+/* reentrant variants writing to caller-owned memory, safe without the GVL */
+int krypt_base64_encode_len(size_t len, int cols, size_t *outlen);
+int krypt_base64_encode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, int cols, size_t *written);
+#define krypt_base64_decode_max(len)	(((len) / 4 + 1) * 3)
+int krypt_base64_decode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written);
+
+krypt_codec *krypt_base64_encoder_new(int cols);
+krypt_codec *krypt_base64_encoder_new_pem(void);
+krypt_codec *krypt_base64_decoder_new(void);
+
 #endif /* _KRYPT_B64_INTERNAL_H_ */
 
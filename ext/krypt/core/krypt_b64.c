@@ -28,6 +28,10 @@
 
 #include "krypt-core.h"
 
+#if defined(KRYPT_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 VALUE mKryptBase64;
 VALUE cKryptBase64Encoder;
 VALUE cKryptBase64Decoder;
@@ -42,9 +46,7 @@ static const char krypt_b64_table_inv[] = {
 -1,-1,-1,-1,-1,-1,
 26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51};
 static uint8_t krypt_b64_separator[] = { '\r', '\n' };
-
-static uint8_t krypt_b64_out_buf[4];
-static uint8_t krypt_b64_in_buf[3];
+static uint8_t krypt_b64_separator_pem[] = { '\n' };
 
 #define KRYPT_BASE64_INV_MAX 123
 #define KRYPT_BASE64_DECODE 0
@@ -55,247 +57,846 @@ do {									\
     (res) = ((b)[(i)] << 16) | ((b)[(i)+1] << 8) | ((b)[(i)+2]);	\
 } while(0)
 
-static inline void
-int_encode_int(int n)
+/*
+ * Encoding converts complete 3 byte quanta in bulk, the kernels write
+ * straight into the destination. Line separators are inserted between
+ * the runs of quanta that make up one line.
+ */
+
+typedef struct krypt_b64_encode_state_st {
+    size_t line;	/* quanta per line, 0 if no lines are to be formed */
+    size_t linepos;	/* quanta written to the current line */
+    uint8_t *sep;	/* line separator */
+    size_t sep_len;
+    int final_sep;	/* when to terminate the output with a separator */
+} krypt_b64_encode_state;
+
+#define KRYPT_B64_FINAL_SEP_NEVER	0
+#define KRYPT_B64_FINAL_SEP_ALWAYS	1
+#define KRYPT_B64_FINAL_SEP_OPEN	2	/* only if the last line is incomplete */
+
+/* Encodes +nquanta+ groups of 3 bytes into 4 characters each */
+typedef void (*krypt_b64_encode_fn)(uint8_t *dst, const uint8_t *src, size_t nquanta);
+
+static krypt_b64_encode_fn int_encode_quanta;
+
+static void
+int_encode_quanta_scalar(uint8_t *dst, const uint8_t *src, size_t nquanta)
+{
+    size_t i;
+    int n;
+
+    for (i=0; i < nquanta; i++) {
+	int_compute_int(n, src, 0);
+	dst[0] = krypt_b64_table[(n >> 18) & 0x3f];
+	dst[1] = krypt_b64_table[(n >> 12) & 0x3f];
+	dst[2] = krypt_b64_table[(n >> 6) & 0x3f];
+	dst[3] = krypt_b64_table[n & 0x3f];
+	src += 3;
+	dst += 4;
+    }
+}
+
+#if defined(KRYPT_X86_SIMD)
+/*
+ * Splitting into 6 bit indices and their translation follow the approach
+ * by W. Mula and D. Lemire.
+ */
+#define KRYPT_B64_ENC_SPLIT	10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+#define KRYPT_B64_ENC_SHIFT	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+				'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, \
+				'/' - 63, 'A', 0, 0
+
+KRYPT_TARGET("ssse3") static inline __m128i
+int_encode_block_ssse3(__m128i in)
 {
-    krypt_b64_out_buf[0] = krypt_b64_table[(n >> 18) & 0x3f];
-    krypt_b64_out_buf[1] = krypt_b64_table[(n >> 12) & 0x3f];
-    krypt_b64_out_buf[2] = krypt_b64_table[(n >> 6) & 0x3f];
-    krypt_b64_out_buf[3] = krypt_b64_table[n & 0x3f];
+    __m128i t0, t1, t2, t3, indices, result, less;
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(KRYPT_B64_ENC_SPLIT));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    indices = _mm_or_si128(t1, t3);
+
+    result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result = _mm_shuffle_epi8(_mm_setr_epi8(KRYPT_B64_ENC_SHIFT), result);
+    return _mm_add_epi8(result, indices);
 }
 
-static int
-int_write_int(binyo_outstream *out, int n)
+KRYPT_TARGET("ssse3") static void
+int_encode_quanta_ssse3(uint8_t *dst, const uint8_t *src, size_t nquanta)
 {
-    int_encode_int(n);
-    if (binyo_outstream_write(out, krypt_b64_out_buf, 4) == BINYO_ERR)
-	return KRYPT_ERR;
-    return KRYPT_OK;
+    /* each load reads 16 bytes of which 12 are consumed, stop while the
+     * remaining input still covers the excess */
+    while (nquanta >= 6) {
+	_mm_storeu_si128((__m128i *) dst, int_encode_block_ssse3(_mm_loadu_si128((const __m128i *) src)));
+	src += 12;
+	dst += 16;
+	nquanta -= 4;
+    }
+    int_encode_quanta_scalar(dst, src, nquanta);
 }
 
-static int
-int_write_update(binyo_outstream *out, uint8_t *bytes, size_t off, size_t len)
+KRYPT_TARGET("avx2") static void
+int_encode_quanta_avx2(uint8_t *dst, const uint8_t *src, size_t nquanta)
 {
-    size_t i;
-    int n;
+    const __m256i split = _mm256_set_epi8(KRYPT_B64_ENC_SPLIT, KRYPT_B64_ENC_SPLIT);
+    const __m256i shift = _mm256_setr_epi8(KRYPT_B64_ENC_SHIFT, KRYPT_B64_ENC_SHIFT);
 
-    for (i=0; i < len; i+=3) {
-	int_compute_int(n, bytes, off + i);
-	if (int_write_int(out, n) == KRYPT_ERR) return KRYPT_ERR;
-    }	
-    return KRYPT_OK;
+    /* the two lanes are loaded from src and src + 12, 28 bytes are read */
+    while (nquanta >= 10) {
+	__m256i in, t0, t1, t2, t3, indices, result, less;
+
+	in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) src)),
+				     _mm_loadu_si128((const __m128i *) (src + 12)), 1);
+	in = _mm256_shuffle_epi8(in, split);
+	t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	indices = _mm256_or_si256(t1, t3);
+
+	result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+	result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+	result = _mm256_shuffle_epi8(shift, result);
+	_mm256_storeu_si256((__m256i *) dst, _mm256_add_epi8(result, indices));
+	src += 24;
+	dst += 32;
+	nquanta -= 8;
+    }
+    int_encode_quanta_ssse3(dst, src, nquanta);
 }
+#endif /* KRYPT_X86_SIMD */
 
-static int
-int_write_update_cols(binyo_outstream *out, uint8_t *bytes, size_t off, size_t len, int cols)
+static void
+int_encode_state_init(krypt_b64_encode_state *state, int cols)
 {
-    size_t i;
-    int n, linepos = 0;
-
-    for (i=0; i < len; i+=3) {
-	int_compute_int(n, bytes, off + i);
-	if (int_write_int(out, n) == KRYPT_ERR) return KRYPT_ERR;
-	linepos += 4;
-	if (linepos >= cols) {
-	    if (binyo_outstream_write(out, krypt_b64_separator, 2) == BINYO_ERR)
-		return KRYPT_ERR;
-	    linepos = 0;
+    memset(state, 0, sizeof(krypt_b64_encode_state));
+    /* Lines are formed of whole quanta, a line ends once at least +cols+
+     * characters were written */
+    if (cols >= 0)
+	state->line = cols <= 4 ? 1 : ((size_t) cols + 3) / 4;
+    state->sep = krypt_b64_separator;
+    state->sep_len = 2;
+    state->final_sep = cols > 0 ? KRYPT_B64_FINAL_SEP_ALWAYS : KRYPT_B64_FINAL_SEP_NEVER;
+}
+
+/* RFC 7468: lines of 64 characters, each one terminated by LF */
+static void
+int_encode_state_init_pem(krypt_b64_encode_state *state)
+{
+    memset(state, 0, sizeof(krypt_b64_encode_state));
+    state->line = 16;
+    state->sep = krypt_b64_separator_pem;
+    state->sep_len = 1;
+    state->final_sep = KRYPT_B64_FINAL_SEP_OPEN;
+}
+
+/* The exact number of bytes produced by int_encode_update */
+static size_t
+int_encode_update_len(krypt_b64_encode_state *state, size_t nquanta)
+{
+    size_t ret = nquanta * 4;
+
+    if (state->line)
+	ret += (state->linepos + nquanta) / state->line * state->sep_len;
+    return ret;
+}
+
+static size_t
+int_encode_update(krypt_b64_encode_state *state, uint8_t *dst, const uint8_t *src, size_t nquanta)
+{
+    uint8_t *out = dst;
+    size_t n;
+
+    if (!state->line) {
+	int_encode_quanta(out, src, nquanta);
+	return nquanta * 4;
+    }
+
+    while (nquanta > 0) {
+	n = state->line - state->linepos;
+	if (n > nquanta)
+	    n = nquanta;
+	int_encode_quanta(out, src, n);
+	out += n * 4;
+	src += n * 3;
+	nquanta -= n;
+	state->linepos += n;
+	if (state->linepos == state->line) {
+	    memcpy(out, state->sep, state->sep_len);
+	    out += state->sep_len;
+	    state->linepos = 0;
 	}
     }
-    return KRYPT_OK;
+    return out - dst;
 }
 
-static inline void
-int_encode_final(uint8_t *bytes, int remainder)
+/* Encodes the +remainder+ (0-2) trailing bytes, at most 6 bytes are written */
+static size_t
+int_encode_final(krypt_b64_encode_state *state, uint8_t *dst, const uint8_t *bytes, int remainder)
 {
+    size_t ret = 0;
     int n;
-    
-    n = (bytes[0] << 16) | (remainder == 2 ? bytes[1] << 8 : 0);
-    krypt_b64_out_buf[0] = krypt_b64_table[(n >> 18) & 0x3f];
-    krypt_b64_out_buf[1] = krypt_b64_table[(n >> 12) & 0x3f];
-    krypt_b64_out_buf[2] = remainder == 2 ? krypt_b64_table[(n >> 6) & 0x3f] : '=';
-    krypt_b64_out_buf[3] = '=';
-}
 
-static int
-int_write_final(binyo_outstream *out, uint8_t *bytes, int remainder, int crlf)
-{
     if (remainder) {
-	int_encode_final(bytes, remainder);
-	if (binyo_outstream_write(out, krypt_b64_out_buf, 4) == BINYO_ERR)
-	    return KRYPT_ERR;
+	n = (bytes[0] << 16) | (remainder == 2 ? bytes[1] << 8 : 0);
+	dst[0] = krypt_b64_table[(n >> 18) & 0x3f];
+	dst[1] = krypt_b64_table[(n >> 12) & 0x3f];
+	dst[2] = remainder == 2 ? krypt_b64_table[(n >> 6) & 0x3f] : '=';
+	dst[3] = '=';
+	ret = 4;
     }
-    if (crlf) {
-	if (binyo_outstream_write(out, krypt_b64_separator, 2) == BINYO_ERR)
-	    return KRYPT_ERR;
+    if (state->final_sep == KRYPT_B64_FINAL_SEP_ALWAYS ||
+	(state->final_sep == KRYPT_B64_FINAL_SEP_OPEN && (remainder || state->linepos))) {
+	memcpy(dst + ret, state->sep, state->sep_len);
+	ret += state->sep_len;
     }
-    return 1;
+    state->linepos = 0;
+    return ret;
 }
 
 int
 krypt_base64_buffer_encode_to(binyo_outstream *out, uint8_t *bytes, size_t off, size_t len, int cols)
 {
+    krypt_b64_encode_state state;
+    /* a chunk of full quanta may carry a separator after every quantum */
+    uint8_t buf[BINYO_IO_BUF_SIZE / 3 * 6 + 6];
+    size_t nquanta, chunk, written;
     int remainder;
 
     if (!bytes || !out) return KRYPT_ERR;
 
+    int_encode_state_init(&state, cols);
+    bytes += off;
     remainder = len % 3;
-    if (cols < 0) {
-	if (int_write_update(out, bytes, off, len - remainder) == KRYPT_ERR) return KRYPT_ERR;
-    } else {
-	if (int_write_update_cols(out, bytes, off, len - remainder, cols) == KRYPT_ERR) return KRYPT_ERR;
+    nquanta = len / 3;
+    while (nquanta > 0) {
+	chunk = nquanta < BINYO_IO_BUF_SIZE / 3 ? nquanta : BINYO_IO_BUF_SIZE / 3;
+	written = int_encode_update(&state, buf, bytes, chunk);
+	if (binyo_outstream_write(out, buf, written) == BINYO_ERR) return KRYPT_ERR;
+	bytes += chunk * 3;
+	nquanta -= chunk;
     }
 
-    if (int_write_final(out, bytes + len - remainder, remainder, cols > 0) == KRYPT_ERR) return KRYPT_ERR;
+    written = int_encode_final(&state, buf, bytes, remainder);
+    if (written > 0 && binyo_outstream_write(out, buf, written) == BINYO_ERR) return KRYPT_ERR;
+    return KRYPT_OK;
+}
+
+/*
+ * Computes the exact length of the encoding of +len+ bytes with line
+ * length +cols+, including all line breaks. Fails if the result would
+ * not fit into a size_t.
+ */
+int
+krypt_base64_encode_len(size_t len, int cols, size_t *outlen)
+{
+    krypt_b64_encode_state state;
+    size_t ret;
+
+    if ( (len / 3 + 1) > (SIZE_MAX / 6) - 1 ) return KRYPT_ERR;
+
+    int_encode_state_init(&state, cols);
+    ret = int_encode_update_len(&state, len / 3);
+    if (len % 3)
+	ret += 4;
+    if (state.final_sep == KRYPT_B64_FINAL_SEP_ALWAYS)
+	ret += state.sep_len;
+    *outlen = ret;
+    return KRYPT_OK;
+}
+
+/*
+ * Encodes +len+ bytes of +src+ with line length +cols+ into +dst+, which
+ * holds +dstcap+ bytes and must provide room for krypt_base64_encode_len
+ * bytes. Neither allocates nor adds errors, so it may be called without
+ * holding the GVL.
+ */
+int
+krypt_base64_encode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, int cols, size_t *written)
+{
+    krypt_b64_encode_state state;
+    size_t needed, nquanta;
+    uint8_t *p;
+
+    if (krypt_base64_encode_len(len, cols, &needed) == KRYPT_ERR) return KRYPT_ERR;
+    if (dstcap < needed) return KRYPT_ERR;
+
+    int_encode_state_init(&state, cols);
+    nquanta = len / 3;
+    p = dst + int_encode_update(&state, dst, src, nquanta);
+    p += int_encode_final(&state, p, src + nquanta * 3, len % 3);
+    *written = p - dst;
     return KRYPT_OK;
 }
 
 int
 krypt_base64_encode(uint8_t *bytes, size_t len, int cols, uint8_t **out, size_t *outlen)
 {
-    size_t retlen; 
-    binyo_outstream *outstream;
+    uint8_t *ret;
+    size_t retlen;
 
     if (!bytes) return KRYPT_ERR;
-    if ( (len / 3 + 1) > (SIZE_MAX / 4) ) {
+    if (krypt_base64_encode_len(len, cols, &retlen) == KRYPT_ERR) {
 	krypt_error_add("Buffer too large: %ld", len);
 	return KRYPT_ERR;
     }
 
-    /* this is the maximum value, no exactness needed, we'll resize anyway */
-    retlen = 4 * (len / 3 + 1); 
+    ret = ALLOC_N(uint8_t, retlen);
+    krypt_base64_encode_into(ret, retlen, bytes, len, cols, outlen);
+    *out = ret;
+    return KRYPT_OK;
+}
+
+/*
+ * Decoding works in two steps: the input is first compacted into a stage
+ * buffer that holds only characters of the Base64 alphabet (whitespace,
+ * line breaks and other characters are skipped, decoding stops at the
+ * first '='), then the staged characters are decoded in bulk. Both steps
+ * have vectorized kernels that are chosen according to the CPU features
+ * once the extension is loaded.
+ */
+
+#define KRYPT_BASE64_STAGE_SIZE	1024
+/* compaction kernels may write up to 8 bytes beyond the staged characters */
+#define KRYPT_BASE64_STAGE_SLACK	8
+
+typedef struct krypt_b64_decode_state_st {
+    int n;
+    int remainder;
+    int done;
+} krypt_b64_decode_state;
+
+/* Compacts at most +max+ alphabet characters of +src+ into +stage+. Returns
+ * the number of consumed input bytes, *staged receives the number of
+ * characters written and *eq is set if a '=' was encountered. */
+typedef size_t (*krypt_b64_compact_fn)(uint8_t *stage, size_t max, const uint8_t *src, size_t len, size_t *staged, int *eq);
+/* Decodes +nquads+ groups of four alphabet characters into 3 bytes each */
+typedef void (*krypt_b64_decode_fn)(uint8_t *dst, const uint8_t *src, size_t nquads);
 
-    /* Add the number of new line characters */
-    if (cols > 0) {
-	if ( (len / cols * 2) > SIZE_MAX - retlen ) {
-	    krypt_error_add("Buffer too large: %ld", len);
-	    return KRYPT_ERR;
+static krypt_b64_compact_fn int_compact;
+static krypt_b64_decode_fn int_decode_quads;
+
+#define int_b64_valid(b)	((b) < KRYPT_BASE64_INV_MAX && krypt_b64_table_inv[(b)] >= 0)
+
+static size_t
+int_compact_scalar(uint8_t *stage, size_t max, const uint8_t *src, size_t len, size_t *staged, int *eq)
+{
+    size_t i, k = 0;
+
+    for (i=0; i < len && k < max; i++) {
+	uint8_t b = src[i];
+	if (b == '=') {
+	    *eq = 1;
+	    i++;
+	    break;
 	}
-	retlen += len / cols * 2;
+	if (int_b64_valid(b))
+	    stage[k++] = b;
     }
+    *staged = k;
+    return i;
+}
 
-    outstream = binyo_outstream_new_bytes_size(retlen);
-    if (krypt_base64_buffer_encode_to(outstream, bytes, 0, len, cols) == KRYPT_ERR) {
-	binyo_outstream_free(outstream);
-	return KRYPT_ERR;
+static void
+int_decode_quads_scalar(uint8_t *dst, const uint8_t *src, size_t nquads)
+{
+    size_t i;
+    int n;
+
+    for (i=0; i < nquads; i++) {
+	n = (krypt_b64_table_inv[src[0]] << 18) |
+	    (krypt_b64_table_inv[src[1]] << 12) |
+	    (krypt_b64_table_inv[src[2]] << 6) |
+	     krypt_b64_table_inv[src[3]];
+	dst[0] = (n >> 16) & 0xff;
+	dst[1] = (n >> 8) & 0xff;
+	dst[2] = n & 0xff;
+	src += 4;
+	dst += 3;
+    }
+}
+
+#if defined(KRYPT_X86_SIMD)
+/* shuffle masks selecting the bytes whose bit is set in an 8 bit mask */
+static uint8_t krypt_b64_compact_lut[256][8];
+
+static void
+int_init_compact_lut(void)
+{
+    int m, bit, k;
+
+    for (m=0; m < 256; m++) {
+	k = 0;
+	for (bit=0; bit < 8; bit++) {
+	    if (m & (1 << bit))
+		krypt_b64_compact_lut[m][k++] = (uint8_t) bit;
+	}
+	while (k < 8)
+	    krypt_b64_compact_lut[m][k++] = 0x80;
     }
-    retlen = binyo_outstream_bytes_get_bytes_free(outstream, out);
+}
+
+/*
+ * Classification and translation of the alphabet follow the nibble
+ * lookup approach by W. Mula and D. Lemire: a character is valid iff the
+ * lookups for its low and high nibble have no bit in common.
+ */
+#define KRYPT_B64_LUT_LO	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+				0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define KRYPT_B64_LUT_HI	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+				0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define KRYPT_B64_LUT_ROLL	0, 16, 19, 4, -65, -65, -71, -71, \
+				0, 0, 0, 0, 0, 0, 0, 0
+
+KRYPT_TARGET("ssse3") static inline int
+int_valid_mask_ssse3(__m128i str)
+{
+    const __m128i lut_lo = _mm_setr_epi8(KRYPT_B64_LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(KRYPT_B64_LUT_HI);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+}
+
+KRYPT_TARGET("ssse3") static inline uint8_t *
+int_compact_block_ssse3(uint8_t *stage, __m128i str, int valid)
+{
+    int lo = valid & 0xff, hi = (valid >> 8) & 0xff;
+    __m128i shuf;
 
-    if (retlen > SIZE_MAX) {
-	krypt_error_add("Return value too large");
-	xfree(*out);
-	*out = NULL;
-       	return KRYPT_ERR;
+    if (valid == 0xffff) {
+	_mm_storeu_si128((__m128i *) stage, str);
+	return stage + 16;
     }
-    *outlen = retlen;
-    return KRYPT_OK;
+    shuf = _mm_loadl_epi64((const __m128i *) krypt_b64_compact_lut[lo]);
+    _mm_storel_epi64((__m128i *) stage, _mm_shuffle_epi8(str, shuf));
+    stage += __builtin_popcount(lo);
+    shuf = _mm_add_epi8(_mm_loadl_epi64((const __m128i *) krypt_b64_compact_lut[hi]), _mm_set1_epi8(8));
+    _mm_storel_epi64((__m128i *) stage, _mm_shuffle_epi8(str, shuf));
+    return stage + __builtin_popcount(hi);
 }
 
-static inline void
-int_decode_int(int n)
+KRYPT_TARGET("ssse3") static size_t
+int_compact_ssse3(uint8_t *stage, size_t max, const uint8_t *src, size_t len, size_t *staged, int *eq)
 {
-    krypt_b64_in_buf[0] = (n >> 16) & 0xff;
-    krypt_b64_in_buf[1] = (n >> 8) & 0xff;
-    krypt_b64_in_buf[2] = n & 0xff;
+    const __m128i eq_char = _mm_set1_epi8('=');
+    uint8_t *p = stage;
+    size_t i = 0, rest;
+
+    while (i + 16 <= len && (size_t) (p - stage) + 16 <= max) {
+	__m128i str = _mm_loadu_si128((const __m128i *) (src + i));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(str, eq_char)))
+	    break; /* the scalar code handles the block containing '=' */
+	p = int_compact_block_ssse3(p, str, int_valid_mask_ssse3(str));
+	i += 16;
+    }
+
+    i += int_compact_scalar(p, max - (p - stage), src + i, len - i, &rest, eq);
+    *staged = (p - stage) + rest;
+    return i;
 }
 
-static int
-int_read_int(binyo_outstream *out, int n)
+KRYPT_TARGET("ssse3") static inline __m128i
+int_translate_ssse3(__m128i str)
 {
-    int_decode_int(n);
-    if (binyo_outstream_write(out, krypt_b64_in_buf, 3) == BINYO_ERR)
-	return KRYPT_ERR;
-    return KRYPT_OK;
+    const __m128i lut_roll = _mm_setr_epi8(KRYPT_B64_LUT_ROLL);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    __m128i merged;
+
+    str = _mm_add_epi8(str, roll);
+    /* pack four 6 bit values into 24 bits, then the bytes into 12 */
+    merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+KRYPT_TARGET("ssse3") static void
+int_decode_quads_ssse3(uint8_t *dst, const uint8_t *src, size_t nquads)
+{
+    /* each store writes 16 bytes of which 12 are valid, stop while the
+     * remaining output still covers the excess */
+    while (nquads >= 6) {
+	_mm_storeu_si128((__m128i *) dst, int_translate_ssse3(_mm_loadu_si128((const __m128i *) src)));
+	src += 16;
+	dst += 12;
+	nquads -= 4;
+    }
+    int_decode_quads_scalar(dst, src, nquads);
 }
 
-static inline void
-int_decode_final(int n, int remainder)
+KRYPT_TARGET("avx2") static size_t
+int_compact_avx2(uint8_t *stage, size_t max, const uint8_t *src, size_t len, size_t *staged, int *eq)
 {
-    switch (remainder) {
+    const __m256i lut_lo = _mm256_setr_epi8(KRYPT_B64_LUT_LO, KRYPT_B64_LUT_LO);
+    const __m256i lut_hi = _mm256_setr_epi8(KRYPT_B64_LUT_HI, KRYPT_B64_LUT_HI);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i eq_char = _mm256_set1_epi8('=');
+    uint8_t *p = stage;
+    size_t i = 0, rest;
+
+    while (i + 32 <= len && (size_t) (p - stage) + 32 <= max) {
+	__m256i str = _mm256_loadu_si256((const __m256i *) (src + i));
+	__m256i hi, lo;
+	unsigned int valid;
+
+	if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(str, eq_char)))
+	    break;
+	hi = _mm256_shuffle_epi8(lut_hi, _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f));
+	lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(str, mask_2f));
+	valid = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+
+	if (valid == 0xffffffff) {
+	    _mm256_storeu_si256((__m256i *) p, str);
+	    p += 32;
+	}
+	else {
+	    p = int_compact_block_ssse3(p, _mm256_castsi256_si128(str), valid & 0xffff);
+	    p = int_compact_block_ssse3(p, _mm256_extracti128_si256(str, 1), valid >> 16);
+	}
+	i += 32;
+    }
+
+    i += int_compact_ssse3(p, max - (p - stage), src + i, len - i, &rest, eq);
+    *staged = (p - stage) + rest;
+    return i;
+}
+
+KRYPT_TARGET("avx2") static void
+int_decode_quads_avx2(uint8_t *dst, const uint8_t *src, size_t nquads)
+{
+    const __m256i lut_roll = _mm256_setr_epi8(KRYPT_B64_LUT_ROLL, KRYPT_B64_LUT_ROLL);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+					  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    /* 32 bytes are stored of which 24 are valid */
+    while (nquads >= 11) {
+	__m256i str = _mm256_loadu_si256((const __m256i *) src);
+	__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+	__m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+	__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+	__m256i merged;
+
+	str = _mm256_add_epi8(str, roll);
+	merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+	merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+	merged = _mm256_shuffle_epi8(merged, pack);
+	merged = _mm256_permutevar8x32_epi32(merged, lanes);
+	_mm256_storeu_si256((__m256i *) dst, merged);
+	src += 32;
+	dst += 24;
+	nquads -= 8;
+    }
+    int_decode_quads_ssse3(dst, src, nquads);
+}
+#endif /* KRYPT_X86_SIMD */
+
+static void
+int_decode_state_init(krypt_b64_decode_state *state)
+{
+    memset(state, 0, sizeof(krypt_b64_decode_state));
+}
+
+/*
+ * Decodes +len+ characters of +src+ into +dst+ and returns the number of
+ * bytes written. Up to three characters not forming a complete group are
+ * kept in +state+ for the next call.
+ */
+static size_t
+int_decode_update(krypt_b64_decode_state *state, uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint8_t stage[KRYPT_BASE64_STAGE_SIZE + KRYPT_BASE64_STAGE_SLACK];
+    uint8_t *out = dst;
+    size_t k = 0, i = 0, staged, nquads;
+    int eq = 0;
+
+    if (state->done) return 0;
+
+    /* re-stage the characters left over from the last call */
+    while (k < (size_t) state->remainder) {
+	stage[k] = krypt_b64_table[(state->n >> (6 * (state->remainder - 1 - k))) & 0x3f];
+	k++;
+    }
+    state->n = state->remainder = 0;
+
+    while (1) {
+	i += int_compact(stage + k, KRYPT_BASE64_STAGE_SIZE - k, src + i, len - i, &staged, &eq);
+	k += staged;
+	nquads = k / 4;
+	int_decode_quads(out, stage, nquads);
+	out += nquads * 3;
+	memmove(stage, stage + nquads * 4, k % 4);
+	k %= 4;
+	if (eq || i == len) break;
+    }
+
+    for (i=0; i < k; i++) {
+	state->n = (state->n << 6) | krypt_b64_table_inv[stage[i]];
+	state->remainder++;
+    }
+    state->done = eq;
+    return out - dst;
+}
+
+/*
+ * Decodes the characters remaining in +state+ into at most two bytes.
+ * A single remaining character carries no complete byte and is dropped.
+ */
+static size_t
+int_decode_final(krypt_b64_decode_state *state, uint8_t *dst)
+{
+    int n = state->n;
+    size_t ret = 0;
+
+    switch (state->remainder) {
 	/* 2 of 4 bytes are to be discarded. 
 	 * 2 bytes represent 12 bits of meaningful data -> 1 byte plus 4 bits to be dropped */ 
 	case 2:
-	    krypt_b64_in_buf[0] = (n >> 4) & 0xff;
+	    dst[0] = (n >> 4) & 0xff;
+	    ret = 1;
 	    break;
 	/* 1 of 4 bytes are to be discarded.
 	 * 3 bytes represent 18 bits of meaningful data -> 2 bytes plus 2 bits to be dropped */
 	case 3:
 	    n >>= 2;
-	    krypt_b64_in_buf[0] = (n >> 8) & 0xff;
-	    krypt_b64_in_buf[1] = n & 0xff;
+	    dst[0] = (n >> 8) & 0xff;
+	    dst[1] = n & 0xff;
+	    ret = 2;
 	    break;
     }
-}
-
-static int
-int_read_final(binyo_outstream *out, int n, int remainder)
-{
-    int_decode_final(n, remainder);
-    if (remainder > 1) {
-	if (binyo_outstream_write(out, krypt_b64_in_buf, remainder - 1) == BINYO_ERR) return KRYPT_ERR;
-    }
-    return KRYPT_OK;
+    state->n = state->remainder = 0;
+    return ret;
 }
 
 int
 krypt_base64_buffer_decode_to(binyo_outstream *out, uint8_t *bytes, size_t off, size_t len)
 {
-    size_t i;
-    int n = 0;
-    int remainder = 0;
-    char inv;
+    krypt_b64_decode_state state;
+    uint8_t buf[BINYO_IO_BUF_SIZE / 4 * 3 + 3];
+    size_t chunk, written;
 
     if (len > SIZE_MAX - off) {
 	krypt_error_add("Buffer too large: %ld", len);
 	return KRYPT_ERR;
     }
 
-    for (i=0; i < len; i++) {
-	uint8_t b = bytes[off + i];
-	if (b == '=')
-	   break;
-	if (b > KRYPT_BASE64_INV_MAX)
-	   continue;
-	inv = krypt_b64_table_inv[b];
-	if (inv < 0)
-	    continue;
-	n = (n << 6) | inv;
-	remainder = (remainder + 1) % 4;
-	if (remainder == 0) {
-	    if (int_read_int(out, n) == KRYPT_ERR) return KRYPT_ERR;
-	}
+    int_decode_state_init(&state);
+    bytes += off;
+    while (len > 0 && !state.done) {
+	chunk = len < BINYO_IO_BUF_SIZE ? len : BINYO_IO_BUF_SIZE;
+	written = int_decode_update(&state, buf, bytes, chunk);
+	if (written > 0 && binyo_outstream_write(out, buf, written) == BINYO_ERR) return KRYPT_ERR;
+	bytes += chunk;
+	len -= chunk;
     }
 
-    if (remainder && (int_read_final(out, n, remainder) == KRYPT_ERR)) return KRYPT_ERR;
+    written = int_decode_final(&state, buf);
+    if (written > 0 && binyo_outstream_write(out, buf, written) == BINYO_ERR) return KRYPT_ERR;
     return KRYPT_OK;
 }
 	
+/*
+ * Decodes +len+ characters of +src+ into +dst+, which holds +dstcap+
+ * bytes and must provide room for krypt_base64_decode_max(len) bytes.
+ * Neither allocates nor adds errors, so it may be called without holding
+ * the GVL.
+ */
 int
-krypt_base64_decode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
+krypt_base64_decode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written)
 {
+    krypt_b64_decode_state state;
     size_t retlen;
-    binyo_outstream *outstream;
 
-    if (!bytes) return KRYPT_ERR;
+    if (len / 4 >= SIZE_MAX / 3 - 1 || dstcap < krypt_base64_decode_max(len)) return KRYPT_ERR;
+
+    int_decode_state_init(&state);
+    retlen = int_decode_update(&state, dst, src, len);
+    *written = retlen + int_decode_final(&state, dst + retlen);
+    return KRYPT_OK;
+}
 
-    /* Approximate, will resize anyway */
-    retlen = len / 4 * 3;
+int
+krypt_base64_decode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
+{
+    uint8_t *ret;
+    size_t max;
 
-    outstream = binyo_outstream_new_bytes_size(retlen);
-    if (krypt_base64_buffer_decode_to(outstream, bytes, 0, len) == KRYPT_ERR) {
-	binyo_outstream_free(outstream);
+    if (!bytes) return KRYPT_ERR;
+    if (len / 4 >= SIZE_MAX / 3 - 1) {
+	krypt_error_add("Buffer too large: %ld", len);
 	return KRYPT_ERR;
     }
-    retlen = binyo_outstream_bytes_get_bytes_free(outstream, out);
-    if (retlen > SSIZE_MAX) {
-	xfree(*out);
-	*out = NULL;
-       	return KRYPT_ERR;
-    }
-    *outlen = retlen;
+
+    /* decode straight into a buffer of the maximum possible size */
+    max = krypt_base64_decode_max(len);
+    ret = ALLOC_N(uint8_t, max);
+    krypt_base64_decode_into(ret, max, bytes, len, outlen);
+    *out = ret;
     return KRYPT_OK;
 }
 
+static void
+int_select_kernels(void)
+{
+    int_encode_quanta = int_encode_quanta_scalar;
+    int_compact = int_compact_scalar;
+    int_decode_quads = int_decode_quads_scalar;
+#if defined(KRYPT_X86_SIMD)
+    int_init_compact_lut();
+    if (krypt_cpu_has(KRYPT_CPU_AVX2)) {
+	int_encode_quanta = int_encode_quanta_avx2;
+	int_compact = int_compact_avx2;
+	int_decode_quads = int_decode_quads_avx2;
+    }
+    else if (krypt_cpu_has(KRYPT_CPU_SSSE3)) {
+	int_encode_quanta = int_encode_quanta_ssse3;
+	int_compact = int_compact_ssse3;
+	int_decode_quads = int_decode_quads_ssse3;
+    }
+#endif
+}
+
+/* Base64 codecs for the streaming Encoder and Decoder */
+
+typedef struct krypt_b64_encoder_st {
+    krypt_codec_interface *methods;
+    krypt_b64_encode_state state;
+    uint8_t carry[3];
+    int carry_len;
+} krypt_b64_encoder;
+
+typedef struct krypt_b64_decoder_st {
+    krypt_codec_interface *methods;
+    krypt_b64_decode_state state;
+} krypt_b64_decoder;
+
+static size_t
+int_b64_encoder_max(krypt_codec *codec, size_t len)
+{
+    krypt_b64_encoder *enc = (krypt_b64_encoder *) codec;
+    /* with a separator after every quantum, plus a final quantum */
+    return (len + enc->carry_len) / 3 * 6 + 6;
+}
+
+static ssize_t
+int_b64_encoder_update(krypt_codec *codec, uint8_t *dst, uint8_t *src, size_t len)
+{
+    krypt_b64_encoder *enc = (krypt_b64_encoder *) codec;
+    uint8_t *out = dst;
+    size_t nquanta;
+
+    if (enc->carry_len) {
+	while (enc->carry_len < 3 && len > 0) {
+	    enc->carry[enc->carry_len++] = *src++;
+	    len--;
+	}
+	if (enc->carry_len < 3) return 0;
+	out += int_encode_update(&enc->state, out, enc->carry, 1);
+	enc->carry_len = 0;
+    }
+
+    nquanta = len / 3;
+    out += int_encode_update(&enc->state, out, src, nquanta);
+    enc->carry_len = (int) (len % 3);
+    memcpy(enc->carry, src + nquanta * 3, enc->carry_len);
+    return out - dst;
+}
+
+static ssize_t
+int_b64_encoder_final(krypt_codec *codec, uint8_t *dst)
+{
+    krypt_b64_encoder *enc = (krypt_b64_encoder *) codec;
+    size_t ret;
+
+    ret = int_encode_final(&enc->state, dst, enc->carry, enc->carry_len);
+    enc->carry_len = 0;
+    return (ssize_t) ret;
+}
+
+static size_t
+int_b64_decoder_max(krypt_codec *codec, size_t len)
+{
+    /* the up to three characters held back add at most one more group */
+    return krypt_base64_decode_max(len);
+}
+
+static ssize_t
+int_b64_decoder_update(krypt_codec *codec, uint8_t *dst, uint8_t *src, size_t len)
+{
+    krypt_b64_decoder *dec = (krypt_b64_decoder *) codec;
+    return (ssize_t) int_decode_update(&dec->state, dst, src, len);
+}
+
+static ssize_t
+int_b64_decoder_final(krypt_codec *codec, uint8_t *dst)
+{
+    krypt_b64_decoder *dec = (krypt_b64_decoder *) codec;
+    return (ssize_t) int_decode_final(&dec->state, dst);
+}
+
+static krypt_codec_interface krypt_interface_b64_encoder = {
+    int_b64_encoder_max,
+    int_b64_encoder_update,
+    int_b64_encoder_final,
+    NULL
+};
+
+static krypt_codec_interface krypt_interface_b64_decoder = {
+    int_b64_decoder_max,
+    int_b64_decoder_update,
+    int_b64_decoder_final,
+    NULL
+};
+
+krypt_codec *
+krypt_base64_encoder_new(int cols)
+{
+    krypt_b64_encoder *enc;
+
+    enc = ALLOC(krypt_b64_encoder);
+    memset(enc, 0, sizeof(krypt_b64_encoder));
+    enc->methods = &krypt_interface_b64_encoder;
+    int_encode_state_init(&enc->state, cols);
+    return (krypt_codec *) enc;
+}
+
+/* An encoder producing the body of a PEM element */
+krypt_codec *
+krypt_base64_encoder_new_pem(void)
+{
+    krypt_b64_encoder *enc;
+
+    enc = (krypt_b64_encoder *) krypt_base64_encoder_new(-1);
+    int_encode_state_init_pem(&enc->state);
+    return (krypt_codec *) enc;
+}
+
+krypt_codec *
+krypt_base64_decoder_new(void)
+{
+    krypt_b64_decoder *dec;
+
+    dec = ALLOC(krypt_b64_decoder);
+    memset(dec, 0, sizeof(krypt_b64_decoder));
+    dec->methods = &krypt_interface_b64_decoder;
+    int_decode_state_init(&dec->state);
+    return (krypt_codec *) dec;
+}
+
 /* Krypt::Base64 */
 
 /**
@@ -309,20 +910,20 @@ static VALUE
 krypt_base64_module_decode(VALUE self, VALUE data)
 {
     VALUE ret;
-    size_t len;
-    size_t result_len;
-    uint8_t *bytes;
-    uint8_t *result = NULL;
+    size_t len, max, result_len;
 
     StringValue(data);
     len = (size_t) RSTRING_LEN(data);
-    bytes = (uint8_t *) RSTRING_PTR(data);
-
-    if (krypt_base64_decode(bytes, len, &result, &result_len) == KRYPT_ERR)
-	krypt_error_raise(eKryptBase64Error, "Processing the value failed.");
+    if (len / 4 >= SIZE_MAX / 3 - 1 || krypt_base64_decode_max(len) > LONG_MAX)
+	rb_raise(eKryptBase64Error, "Buffer too large: %ld", (long) len);
 
-    ret = rb_str_new((const char *) result, result_len);
-    xfree(result);
+    /* decode straight into the result */
+    max = krypt_base64_decode_max(len);
+    ret = rb_str_new(0, (long) max);
+    if (krypt_base64_decode_into((uint8_t *) RSTRING_PTR(ret), max, (uint8_t *) RSTRING_PTR(data), len, &result_len) == KRYPT_ERR)
+	rb_raise(eKryptBase64Error, "Processing the value failed.");
+    rb_str_set_len(ret, (long) result_len);
+    RB_GC_GUARD(data);
     return ret;
 }
 
@@ -345,10 +946,7 @@ krypt_base64_module_encode(int argc, VALUE *argv, VALUE self)
     VALUE cols = Qnil;
     VALUE ret;
     int c;
-    size_t len;
-    size_t result_len;
-    uint8_t *bytes;
-    uint8_t *result = NULL;
+    size_t len, result_len;
 
     rb_scan_args(argc, argv, "11", &data, &cols);
 
@@ -361,19 +959,69 @@ krypt_base64_module_encode(int argc, VALUE *argv, VALUE self)
 
     StringValue(data);
     len = (size_t) RSTRING_LEN(data);
-    bytes = (uint8_t *) RSTRING_PTR(data);
+    if (krypt_base64_encode_len(len, c, &result_len) == KRYPT_ERR || result_len > LONG_MAX)
+	rb_raise(eKryptBase64Error, "Buffer too large: %ld", (long) len);
 
-    if (krypt_base64_encode(bytes, len, c, &result, &result_len) == KRYPT_ERR)
-	krypt_error_raise(eKryptBase64Error, "Processing the value failed.");
-
-    ret = rb_str_new((const char *) result, result_len);
-    rb_enc_associate(ret, rb_usascii_encoding());
-    xfree(result);
+    /* encode straight into the result */
+    ret = rb_usascii_str_new(0, (long) result_len);
+    if (krypt_base64_encode_into((uint8_t *) RSTRING_PTR(ret), result_len, (uint8_t *) RSTRING_PTR(data), len, c, &result_len) == KRYPT_ERR)
+	rb_raise(eKryptBase64Error, "Processing the value failed.");
+    RB_GC_GUARD(data);
     return ret;
 }
 
 /* End Krypt::Base64 */
 
+/* Krypt::Base64::Encoder, Krypt::Base64::Decoder */
+
+/**
+ * call-seq:
+ *    Krypt::Base64::Encoder.new(io, [cols=nil]) -> Encoder
+ *
+ * Creates an Encoder on top of +io+. Data written to the Encoder is
+ * written to +io+ in Base64 encoding, reading from the Encoder returns
+ * the Base64 encoding of the data read from +io+. +cols+ has the same
+ * meaning as for Krypt::Base64.encode.
+ */
+static VALUE
+krypt_base64_encoder_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE io;
+    VALUE cols = Qnil;
+
+    rb_scan_args(argc, argv, "11", &io, &cols);
+
+    if (NIL_P(io))
+	rb_raise(eKryptBase64Error, "IO must not be nil");
+
+    krypt_io_filter_init(self,
+	                 io,
+			 krypt_base64_encoder_new(NIL_P(cols) ? -1 : NUM2INT(cols)),
+			 eKryptBase64Error,
+			 rb_usascii_encoding());
+    return self;
+}
+
+/**
+ * call-seq:
+ *    Krypt::Base64::Decoder.new(io) -> Decoder
+ *
+ * Creates a Decoder on top of +io+. Base64 data written to the Decoder is
+ * written to +io+ in decoded form, reading from the Decoder returns the
+ * decoded Base64 data read from +io+.
+ */
+static VALUE
+krypt_base64_decoder_initialize(VALUE self, VALUE io)
+{
+    if (NIL_P(io))
+	rb_raise(eKryptBase64Error, "IO must not be nil");
+
+    krypt_io_filter_init(self, io, krypt_base64_decoder_new(), eKryptBase64Error, rb_ascii8bit_encoding());
+    return self;
+}
+
+/* End Krypt::Base64::Encoder, Krypt::Base64::Decoder */
+
 void
 Init_krypt_base64(void)
 {
@@ -381,11 +1029,54 @@ Init_krypt_base64(void)
     mKrypt = rb_define_module("Krypt"); /* Let RDoc know */
 #endif
 
+    int_select_kernels();
+
     mKryptBase64 = rb_define_module_under(mKrypt, "Base64");
 
     eKryptBase64Error = rb_define_class_under(mKryptBase64, "Base64Error", eKryptError);
 
     rb_define_module_function(mKryptBase64, "decode", krypt_base64_module_decode, 1);
     rb_define_module_function(mKryptBase64, "encode", krypt_base64_module_encode, -1);
+
+    /**
+     * Document-class: Krypt::Base64::Encoder
+     *
+     * Encodes data in Base64 while it is being written to or read from
+     * an underlying IO. Data is processed in chunks, the whole input never
+     * needs to be held in memory. When writing, Encoder#close must be
+     * called to write the final quantum.
+     *
+     * === Example
+     *   File.open("cms.b64", "wb") do |f|
+     *     enc = Krypt::Base64::Encoder.new(f, 76)
+     *     File.open("cms.der", "rb") do |der|
+     *       while chunk = der.read(8192)
+     *         enc << chunk
+     *       end
+     *     end
+     *     enc.close
+     *   end
+     */
+    cKryptBase64Encoder = rb_define_class_under(mKryptBase64, "Encoder", rb_cObject);
+    krypt_io_filter_define(cKryptBase64Encoder);
+    rb_define_method(cKryptBase64Encoder, "initialize", krypt_base64_encoder_initialize, -1);
+
+    /**
+     * Document-class: Krypt::Base64::Decoder
+     *
+     * Decodes Base64 data while it is being written to or read from an
+     * underlying IO, the counterpart of Encoder.
+     *
+     * === Example
+     *   File.open("cms.b64", "rb") do |f|
+     *     dec = Krypt::Base64::Decoder.new(f)
+     *     while chunk = dec.read(8192)
+     *       # process chunk
+     *     end
+     *   end
+     */
+    cKryptBase64Decoder = rb_define_class_under(mKryptBase64, "Decoder", rb_cObject);
+    krypt_io_filter_define(cKryptBase64Decoder);
+    rb_define_method(cKryptBase64Decoder, "initialize", krypt_base64_decoder_initialize, 1);
 }
 
@@ -0,0 +1,79 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+#if defined(KRYPT_X86_SIMD)
+#include <cpuid.h>
+#endif
+
+int krypt_cpu_features = 0;
+
+#if defined(KRYPT_X86_SIMD)
+static unsigned int
+int_xgetbv(unsigned int index)
+{
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+    return eax;
+}
+#endif
+
+/*
+ * Determines the instruction set extensions that may be used. AVX2 also
+ * requires the OS to preserve the YMM registers, which is checked via
+ * XCR0. Setting the environment variable KRYPT_DISABLE_SIMD forces the
+ * portable code paths.
+ */
+void
+krypt_cpu_detect(void)
+{
+#if defined(KRYPT_X86_SIMD)
+    unsigned int eax, ebx, ecx, edx;
+
+    krypt_cpu_features = 0;
+    if (getenv("KRYPT_DISABLE_SIMD"))
+	return;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	return;
+
+    if (ecx & bit_SSSE3)
+	krypt_cpu_features |= KRYPT_CPU_SSSE3;
+
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX) && (int_xgetbv(0) & 0x6) == 0x6) {
+	if (__get_cpuid_max(0, NULL) >= 7) {
+	    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+	    if (ebx & bit_AVX2)
+		krypt_cpu_features |= KRYPT_CPU_AVX2;
+	}
+    }
+#else
+    krypt_cpu_features = 0;
+#endif
+}
+
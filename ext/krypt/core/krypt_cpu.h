@@ -0,0 +1,53 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if !defined(_KRYPT_CPU_H_)
+#define _KRYPT_CPU_H_
+
+/*
+ * Vectorized code paths are compiled with per-function target attributes
+ * and selected at load time according to the features reported by cpuid,
+ * so the extension itself needs no special compiler flags.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H) && defined(HAVE_FUNC_ATTRIBUTE_TARGET)
+#define KRYPT_X86_SIMD 1
+#define KRYPT_TARGET(isa)	__attribute__((target(isa)))
+#endif
+
+#define KRYPT_CPU_SSSE3		(1 << 0)
+#define KRYPT_CPU_AVX2		(1 << 1)
+
+extern int krypt_cpu_features;
+
+#define krypt_cpu_has(feature)	((krypt_cpu_features & (feature)) != 0)
+
+void krypt_cpu_detect(void);
+
+#endif /* _KRYPT_CPU_H_ */
+
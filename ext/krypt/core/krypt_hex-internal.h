@@ -32,5 +32,13 @@
 int krypt_hex_encode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen);
 int krypt_hex_decode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen);
 
+/* reentrant variants writing to caller-owned memory, safe without the GVL */
+#define krypt_hex_encode_len(len)	((len) * 2)
+int krypt_hex_encode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written);
+int krypt_hex_decode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written);
+
+krypt_codec *krypt_hex_encoder_new(void);
+krypt_codec *krypt_hex_decoder_new(void);
+
 #endif /* _KRYPT_HEX_INTERNAL_H_ */
 
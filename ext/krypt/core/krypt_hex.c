@@ -28,6 +28,10 @@
 
 #include "krypt-core.h"
 
+#if defined(KRYPT_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 VALUE mKryptHex;
 VALUE cKryptHexEncoder;
 VALUE cKryptHexDecoder;
@@ -44,11 +48,17 @@ static const char krypt_hex_table_inv[] = {
 };
 
 #define KRYPT_HEX_INV_MAX 102
-#define KRYPT_HEX_DECODE 0
-#define KRYPT_HEX_ENCODE 1
 
-static int
-int_hex_encode(uint8_t *bytes, size_t len, uint8_t *out)
+/* Encodes +len+ bytes into 2 * +len+ characters */
+typedef void (*krypt_hex_encode_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+/* Decodes +len+ (even) characters into +len+ / 2 bytes */
+typedef int (*krypt_hex_decode_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static krypt_hex_encode_fn int_hex_encode;
+static krypt_hex_decode_fn int_hex_decode;
+
+static void
+int_hex_encode_scalar(uint8_t *out, const uint8_t *bytes, size_t len)
 {
     size_t i;
     uint8_t b;
@@ -60,11 +70,10 @@ int_hex_encode(uint8_t *bytes, size_t len, uint8_t *out)
 	out[j] = krypt_hex_table[b >> 4];
 	out[j + 1] = krypt_hex_table[b & 0x0f];
     }
-    return KRYPT_OK;
 }
 
 static int
-int_hex_decode(uint8_t *bytes, size_t len, uint8_t *out)
+int_hex_decode_scalar(uint8_t *out, const uint8_t *bytes, size_t len)
 {
     size_t i;
     char b;
@@ -73,125 +82,339 @@ int_hex_decode(uint8_t *bytes, size_t len, uint8_t *out)
     for (i=0; i < len / 2; i++) {
 	c = (uint8_t) bytes[i*2];
 	d = (uint8_t) bytes[i*2+1];
-	if (c > KRYPT_HEX_INV_MAX || d > KRYPT_HEX_INV_MAX) {
-	    krypt_error_add("Illegal hex character detected: %x or %x", c, d);
+	if (c > KRYPT_HEX_INV_MAX || d > KRYPT_HEX_INV_MAX)
 	    return KRYPT_ERR;
-	}
 	b = krypt_hex_table_inv[c];
-	if (b < 0) {
-	    krypt_error_add("Illegal hex character detected: %x", c);
+	if (b < 0)
 	    return KRYPT_ERR;
-	}
 	out[i] = b << 4;
 	b = krypt_hex_table_inv[d];
-	if (b < 0) {
-	    krypt_error_add("Illegal hex character detected: %x", d);
+	if (b < 0)
 	    return KRYPT_ERR;
-	}
 	out[i] |= b;
     }
     return KRYPT_OK;
 }
 
-#define int_hex_encode_tests(bytes, len, tmp)				\
-do {									\
-    if (!(bytes)) {							\
-	(tmp) = KRYPT_ERR;						\
-    }									\
-    if ((len) > SSIZE_MAX / 2) {					\
-	krypt_error_add("Buffer too large: %ld", (len));		\
-	(tmp) = KRYPT_ERR;						\
-    }									\
-} while (0)
+#if defined(KRYPT_X86_SIMD)
+#define KRYPT_HEX_LUT	'0', '1', '2', '3', '4', '5', '6', '7', \
+			'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+
+KRYPT_TARGET("ssse3") static void
+int_hex_encode_ssse3(uint8_t *out, const uint8_t *bytes, size_t len)
+{
+    const __m128i lut = _mm_setr_epi8(KRYPT_HEX_LUT);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    while (len >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) bytes);
+	__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+	__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+	_mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(hi, lo));
+	bytes += 16;
+	out += 32;
+	len -= 16;
+    }
+    int_hex_encode_scalar(out, bytes, len);
+}
+
+/* Returns the nibble values of 16 characters, *valid receives the mask of
+ * the characters that are hex digits */
+KRYPT_TARGET("ssse3") static inline __m128i
+int_hex_nibbles_ssse3(__m128i v, int *valid)
+{
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+
+    *valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+    return _mm_or_si128(_mm_and_si128(digit, is_digit),
+	                _mm_and_si128(_mm_add_epi8(alpha, _mm_set1_epi8(10)), is_alpha));
+}
+
+KRYPT_TARGET("ssse3") static int
+int_hex_decode_ssse3(uint8_t *out, const uint8_t *bytes, size_t len)
+{
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i nibbles;
+    int valid;
+
+    while (len >= 16) {
+	nibbles = int_hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *) bytes), &valid);
+	if (valid != 0xffff)
+	    break; /* the scalar code reports the offending character */
+	nibbles = _mm_maddubs_epi16(nibbles, weights);
+	_mm_storel_epi64((__m128i *) out, _mm_packus_epi16(nibbles, nibbles));
+	bytes += 16;
+	out += 8;
+	len -= 16;
+    }
+    return int_hex_decode_scalar(out, bytes, len);
+}
+
+KRYPT_TARGET("avx2") static void
+int_hex_encode_avx2(uint8_t *out, const uint8_t *bytes, size_t len)
+{
+    const __m256i lut = _mm256_setr_epi8(KRYPT_HEX_LUT, KRYPT_HEX_LUT);
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    while (len >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) bytes);
+	__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+	__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+	__m256i a = _mm256_unpacklo_epi8(hi, lo);
+	__m256i b = _mm256_unpackhi_epi8(hi, lo);
+	/* unpacking works per lane, reorder into input order */
+	_mm256_storeu_si256((__m256i *) out, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	bytes += 32;
+	out += 64;
+	len -= 32;
+    }
+    int_hex_encode_ssse3(out, bytes, len);
+}
+
+KRYPT_TARGET("avx2") static int
+int_hex_decode_avx2(uint8_t *out, const uint8_t *bytes, size_t len)
+{
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+
+    while (len >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) bytes);
+	__m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	__m256i alpha = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+	__m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+	__m256i nibbles;
+
+	if ((unsigned int) _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != 0xffffffff)
+	    break;
+	nibbles = _mm256_or_si256(_mm256_and_si256(digit, is_digit),
+		                  _mm256_and_si256(_mm256_add_epi8(alpha, _mm256_set1_epi8(10)), is_alpha));
+	nibbles = _mm256_maddubs_epi16(nibbles, weights);
+	nibbles = _mm256_permute4x64_epi64(_mm256_packus_epi16(nibbles, nibbles), 0x08);
+	_mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(nibbles));
+	bytes += 32;
+	out += 16;
+	len -= 32;
+    }
+    return int_hex_decode_ssse3(out, bytes, len);
+}
+#endif /* KRYPT_X86_SIMD */
+
+/*
+ * The kernels report no errors so that they may run without the GVL. Once
+ * decoding failed, this looks up the offending character for the message.
+ */
+static void
+int_hex_error_illegal(const uint8_t *bytes, size_t len)
+{
+    size_t i;
+
+    for (i=0; i < len; i++) {
+	if (bytes[i] > KRYPT_HEX_INV_MAX || krypt_hex_table_inv[bytes[i]] < 0) {
+	    krypt_error_add("Illegal hex character detected: %x", bytes[i]);
+	    return;
+	}
+    }
+}
+
+/*
+ * Encodes +len+ bytes of +src+ into +dst+, which holds +dstcap+ bytes and
+ * must provide room for krypt_hex_encode_len(len) bytes. Neither allocates
+ * nor adds errors, so it may be called without holding the GVL.
+ */
+int
+krypt_hex_encode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written)
+{
+    if (len > SSIZE_MAX / 2 || dstcap < krypt_hex_encode_len(len)) return KRYPT_ERR;
+    int_hex_encode(dst, src, len);
+    *written = krypt_hex_encode_len(len);
+    return KRYPT_OK;
+}
+
+/*
+ * Decodes the +len+ characters of +src+, +len+ being even, into +dst+,
+ * which holds +dstcap+ bytes and must provide room for +len+ / 2 bytes.
+ * Fails on illegal characters. Neither allocates nor adds errors, so it
+ * may be called without holding the GVL.
+ */
+int
+krypt_hex_decode_into(uint8_t *dst, size_t dstcap, const uint8_t *src, size_t len, size_t *written)
+{
+    if (len % 2 || dstcap < len / 2) return KRYPT_ERR;
+    if (int_hex_decode(dst, src, len) == KRYPT_ERR) return KRYPT_ERR;
+    *written = len / 2;
+    return KRYPT_OK;
+}
 
 int
 krypt_hex_encode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
 {
-    size_t ret;
     uint8_t *retval;
-    int tmp = 0;
 
-    int_hex_encode_tests(bytes, len, tmp);
-    if (tmp == KRYPT_ERR) return KRYPT_ERR;
-
-    ret = 2 * len;
-    retval = ALLOC_N(uint8_t, ret);
-    if (int_hex_encode(bytes, len, retval) == KRYPT_ERR) {
-	xfree(retval);
+    if (!bytes) return KRYPT_ERR;
+    if (len > SSIZE_MAX / 2) {
+	krypt_error_add("Buffer too large: %ld", len);
 	return KRYPT_ERR;
     }
 
+    retval = ALLOC_N(uint8_t, krypt_hex_encode_len(len));
+    krypt_hex_encode_into(retval, krypt_hex_encode_len(len), bytes, len, outlen);
     *out = retval;
-    *outlen = ret;
     return KRYPT_OK;
 }
 
-#define int_hex_decode_tests(bytes, len, tmp)				\
-do {									\
-    if (!(bytes)) {							\
-	(tmp) = KRYPT_ERR;						\
-    }									\
-    if ((len) % 2) {							\
-	krypt_error_add("Buffer length must be a multiple of 2");	\
-	(tmp) = KRYPT_ERR;						\
-    }									\
-    if ((len) / 2 > SSIZE_MAX) {					\
-	krypt_error_add("Buffer too large: %ld", (len));		\
-	(tmp) = KRYPT_ERR;						\
-    }									\
-} while (0)
+/* Adds the reason why +bytes+ can not be decoded */
+static void
+int_hex_decode_error(const uint8_t *bytes, size_t len)
+{
+    if (len % 2)
+	krypt_error_add("Buffer length must be a multiple of 2");
+    else
+	int_hex_error_illegal(bytes, len);
+}
 
 int
 krypt_hex_decode(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
 {
-    size_t ret;
     uint8_t *retval;
-    int tmp = 0;
-    
-    int_hex_decode_tests(bytes, len, tmp);
-    if (tmp == KRYPT_ERR) return KRYPT_ERR;
-
-    ret = len / 2;
-    retval = ALLOC_N(uint8_t, ret);
-    if (int_hex_decode(bytes, len, retval) == KRYPT_ERR) {
+
+    if (!bytes) return KRYPT_ERR;
+
+    retval = ALLOC_N(uint8_t, len / 2);
+    if (krypt_hex_decode_into(retval, len / 2, bytes, len, outlen) == KRYPT_ERR) {
+	int_hex_decode_error(bytes, len);
 	xfree(retval);
 	return KRYPT_ERR;
     }
     *out = retval;
-    *outlen = ret;
     return KRYPT_OK;
 }
 
-/* Krypt::Hex */
+/* Hex codecs for the streaming Encoder and Decoder */
+
+typedef struct krypt_hex_decoder_st {
+    krypt_codec_interface *methods;
+    uint8_t carry;
+    int carry_len;
+} krypt_hex_decoder;
+
+static size_t
+int_hex_encoder_max(krypt_codec *codec, size_t len)
+{
+    return len * 2;
+}
+
+static ssize_t
+int_hex_encoder_update(krypt_codec *codec, uint8_t *dst, uint8_t *src, size_t len)
+{
+    size_t written;
+
+    if (krypt_hex_encode_into(dst, krypt_hex_encode_len(len), src, len, &written) == KRYPT_ERR) {
+	krypt_error_add("Buffer too large: %ld", len);
+	return KRYPT_ERR;
+    }
+    return (ssize_t) written;
+}
+
+static ssize_t
+int_hex_encoder_final(krypt_codec *codec, uint8_t *dst)
+{
+    return 0;
+}
+
+static size_t
+int_hex_decoder_max(krypt_codec *codec, size_t len)
+{
+    return (len + 1) / 2;
+}
+
+static ssize_t
+int_hex_decoder_update(krypt_codec *codec, uint8_t *dst, uint8_t *src, size_t len)
+{
+    krypt_hex_decoder *dec = (krypt_hex_decoder *) codec;
+    uint8_t *out = dst;
+    uint8_t pair[2];
+    size_t even, written;
 
-#define int_hex_process(bytes, len, mode, ret)					\
-do {										\
-    ssize_t result_len;								\
-    uint8_t *result;								\
-    int tmp = 0;								\
-    if (!(bytes))								\
-        krypt_error_raise(eKryptHexError, "Bytes null");			\
-    if ((mode) == KRYPT_HEX_DECODE) {						\
-	int_hex_decode_tests((bytes), (len), tmp);				\
-	if (tmp == KRYPT_ERR)							\
-	    krypt_error_raise(eKryptHexError, "Decoding the value failed");	\
-	result_len = (len) / 2;							\
-    	result = ALLOCA_N(uint8_t, result_len);					\
-	tmp = int_hex_decode((bytes), (len), result);				\
-    } else if ((mode) == KRYPT_HEX_ENCODE) {					\
-	int_hex_encode_tests((bytes), (len), tmp);				\
-	if (tmp == KRYPT_ERR)							\
-	    krypt_error_raise(eKryptHexError, "Encoding the value failed");	\
-	result_len = (len) * 2;							\
-	result = ALLOCA_N(uint8_t, result_len);					\
-	tmp = int_hex_encode((bytes), (len), result);				\
-    } else {									\
-	krypt_error_raise(rb_eRuntimeError, "Internal error");			\
-    }										\
-    if (tmp == KRYPT_ERR)							\
-	krypt_error_raise(eKryptHexError, "Processing the hex value failed."); 	\
-    (ret) = rb_str_new((const char *) result, result_len);			\
-} while (0)
+    if (len == 0) return 0;
+
+    if (dec->carry_len) {
+	pair[0] = dec->carry;
+	pair[1] = *src++;
+	len--;
+	dec->carry_len = 0;
+	if (krypt_hex_decode_into(out, 1, pair, 2, &written) == KRYPT_ERR) {
+	    int_hex_error_illegal(pair, 2);
+	    return KRYPT_ERR;
+	}
+	out++;
+    }
+
+    even = len & ~((size_t) 1);
+    if (krypt_hex_decode_into(out, even / 2, src, even, &written) == KRYPT_ERR) {
+	int_hex_error_illegal(src, even);
+	return KRYPT_ERR;
+    }
+    out += written;
+    if (len % 2) {
+	dec->carry = src[len - 1];
+	dec->carry_len = 1;
+    }
+    return out - dst;
+}
+
+static ssize_t
+int_hex_decoder_final(krypt_codec *codec, uint8_t *dst)
+{
+    krypt_hex_decoder *dec = (krypt_hex_decoder *) codec;
+
+    if (dec->carry_len) {
+	krypt_error_add("Buffer length must be a multiple of 2");
+	return KRYPT_ERR;
+    }
+    return 0;
+}
+
+static krypt_codec_interface krypt_interface_hex_encoder = {
+    int_hex_encoder_max,
+    int_hex_encoder_update,
+    int_hex_encoder_final,
+    NULL
+};
+
+static krypt_codec_interface krypt_interface_hex_decoder = {
+    int_hex_decoder_max,
+    int_hex_decoder_update,
+    int_hex_decoder_final,
+    NULL
+};
+
+krypt_codec *
+krypt_hex_encoder_new(void)
+{
+    krypt_codec *enc;
+
+    enc = ALLOC(krypt_codec);
+    enc->methods = &krypt_interface_hex_encoder;
+    return enc;
+}
+
+krypt_codec *
+krypt_hex_decoder_new(void)
+{
+    krypt_hex_decoder *dec;
+
+    dec = ALLOC(krypt_hex_decoder);
+    memset(dec, 0, sizeof(krypt_hex_decoder));
+    dec->methods = &krypt_interface_hex_decoder;
+    return (krypt_codec *) dec;
+}
+
+/* Krypt::Hex */
 
 /**
  * call-seq:
@@ -205,12 +428,19 @@ krypt_hex_module_decode(VALUE self, VALUE data)
 {
     VALUE ret;
     uint8_t *bytes;
-    size_t len;
+    size_t len, written;
 
     StringValue(data);
     len = (size_t) RSTRING_LEN((data));
     bytes = (uint8_t *) RSTRING_PTR((data));
-    int_hex_process(bytes, len, KRYPT_HEX_DECODE, ret);
+
+    /* decode straight into the result */
+    ret = rb_str_new(0, (long) (len / 2));
+    if (krypt_hex_decode_into((uint8_t *) RSTRING_PTR(ret), len / 2, bytes, len, &written) == KRYPT_ERR) {
+	int_hex_decode_error(bytes, len);
+	krypt_error_raise(eKryptHexError, "Processing the hex value failed.");
+    }
+    RB_GC_GUARD(data);
     return ret;
 }
 
@@ -225,19 +455,79 @@ static VALUE
 krypt_hex_module_encode(VALUE self, VALUE data)
 {
     VALUE ret;
-    uint8_t *bytes;
-    size_t len;
+    size_t len, written;
 
     StringValue(data);
     len = (size_t) RSTRING_LEN((data));
-    bytes = (uint8_t *) RSTRING_PTR((data));
-    int_hex_process(bytes, len, KRYPT_HEX_ENCODE, ret);
-    rb_enc_associate(ret, rb_usascii_encoding());
+    if (len > SSIZE_MAX / 2)
+	rb_raise(eKryptHexError, "Buffer too large: %ld", (long) len);
+
+    /* encode straight into the result */
+    ret = rb_usascii_str_new(0, (long) krypt_hex_encode_len(len));
+    krypt_hex_encode_into((uint8_t *) RSTRING_PTR(ret), krypt_hex_encode_len(len), (uint8_t *) RSTRING_PTR(data), len, &written);
+    RB_GC_GUARD(data);
     return ret;
 }
 
 /* End Krypt::Hex */
 
+/* Krypt::Hex::Encoder, Krypt::Hex::Decoder */
+
+/**
+ * call-seq:
+ *    Krypt::Hex::Encoder.new(io) -> Encoder
+ *
+ * Creates an Encoder on top of +io+. Data written to the Encoder is
+ * written to +io+ in hex encoding, reading from the Encoder returns the
+ * hex encoding of the data read from +io+.
+ */
+static VALUE
+krypt_hex_encoder_initialize(VALUE self, VALUE io)
+{
+    if (NIL_P(io))
+	rb_raise(eKryptHexError, "IO must not be nil");
+
+    krypt_io_filter_init(self, io, krypt_hex_encoder_new(), eKryptHexError, rb_usascii_encoding());
+    return self;
+}
+
+/**
+ * call-seq:
+ *    Krypt::Hex::Decoder.new(io) -> Decoder
+ *
+ * Creates a Decoder on top of +io+. Hex data written to the Decoder is
+ * written to +io+ in decoded form, reading from the Decoder returns the
+ * decoded hex data read from +io+.
+ */
+static VALUE
+krypt_hex_decoder_initialize(VALUE self, VALUE io)
+{
+    if (NIL_P(io))
+	rb_raise(eKryptHexError, "IO must not be nil");
+
+    krypt_io_filter_init(self, io, krypt_hex_decoder_new(), eKryptHexError, rb_ascii8bit_encoding());
+    return self;
+}
+
+/* End Krypt::Hex::Encoder, Krypt::Hex::Decoder */
+
+static void
+int_select_kernels(void)
+{
+    int_hex_encode = int_hex_encode_scalar;
+    int_hex_decode = int_hex_decode_scalar;
+#if defined(KRYPT_X86_SIMD)
+    if (krypt_cpu_has(KRYPT_CPU_AVX2)) {
+	int_hex_encode = int_hex_encode_avx2;
+	int_hex_decode = int_hex_decode_avx2;
+    }
+    else if (krypt_cpu_has(KRYPT_CPU_SSSE3)) {
+	int_hex_encode = int_hex_encode_ssse3;
+	int_hex_decode = int_hex_decode_ssse3;
+    }
+#endif
+}
+
 void
 Init_krypt_hex(void)
 {
@@ -245,11 +535,45 @@ Init_krypt_hex(void)
     mKrypt = rb_define_module("Krypt"); /* Let RDoc know */
 #endif
 
+    int_select_kernels();
+
     mKryptHex = rb_define_module_under(mKrypt, "Hex");
 
     eKryptHexError = rb_define_class_under(mKryptHex, "HexError", eKryptError);
 
     rb_define_module_function(mKryptHex, "decode", krypt_hex_module_decode, 1);
     rb_define_module_function(mKryptHex, "encode", krypt_hex_module_encode, 1);
+
+    /**
+     * Document-class: Krypt::Hex::Encoder
+     *
+     * Hex-encodes data while it is being written to or read from an
+     * underlying IO. Data is processed in chunks, so arbitrarily large
+     * payloads can be encoded in constant memory.
+     *
+     * === Example
+     *   File.open("audit.log", "ab") do |log|
+     *     enc = Krypt::Hex::Encoder.new(log)
+     *     File.open("blob.bin", "rb") do |blob|
+     *       while chunk = blob.read(8192)
+     *         enc << chunk
+     *       end
+     *     end
+     *     enc.close
+     *   end
+     */
+    cKryptHexEncoder = rb_define_class_under(mKryptHex, "Encoder", rb_cObject);
+    krypt_io_filter_define(cKryptHexEncoder);
+    rb_define_method(cKryptHexEncoder, "initialize", krypt_hex_encoder_initialize, 1);
+
+    /**
+     * Document-class: Krypt::Hex::Decoder
+     *
+     * Decodes hex data while it is being written to or read from an
+     * underlying IO, the counterpart of Encoder.
+     */
+    cKryptHexDecoder = rb_define_class_under(mKryptHex, "Decoder", rb_cObject);
+    krypt_io_filter_define(cKryptHexDecoder);
+    rb_define_method(cKryptHexDecoder, "initialize", krypt_hex_decoder_initialize, 1);
 }
 
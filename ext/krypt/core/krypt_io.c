@@ -28,12 +28,20 @@
 
 #include "krypt-core.h"
 
+binyo_instream *
+krypt_instream_new_value(VALUE value)
+{
+    if (krypt_io_wait_applicable(value))
+	return krypt_instream_new_io_wait(value);
+    return binyo_instream_new_value(value);
+}
+
 binyo_instream *
 krypt_instream_new_value_der(VALUE value)
 {
     binyo_instream *in;
 
-    if (!(in = binyo_instream_new_value(value))) {
+    if (!(in = krypt_instream_new_value(value))) {
 	value = krypt_to_der_if_possible(value);
 	StringValue(value);
 	in = binyo_instream_new_bytes((uint8_t *)RSTRING_PTR(value), RSTRING_LEN(value));
@@ -47,7 +55,7 @@ krypt_instream_new_value_pem(VALUE value)
 {
     binyo_instream *in;
 
-    if (!(in = binyo_instream_new_value(value))) {
+    if (!(in = krypt_instream_new_value(value))) {
 	value = krypt_to_pem_if_possible(value);
 	StringValue(value);
 	in = binyo_instream_new_bytes((uint8_t *)RSTRING_PTR(value), RSTRING_LEN(value));
@@ -56,10 +64,70 @@ krypt_instream_new_value_pem(VALUE value)
     return in;
 }
 
+struct int_read_all_args {
+    binyo_instream *in;
+    binyo_outstream *out;
+    uint8_t *bytes;
+    size_t len;
+    int result;
+};
+
+static VALUE
+int_read_all_run(VALUE arg)
+{
+    struct int_read_all_args *args = (struct int_read_all_args *) arg;
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    ssize_t read;
+
+    while ((read = binyo_instream_read(args->in, buf, BINYO_IO_BUF_SIZE)) >= 0) {
+	if (binyo_outstream_write(args->out, buf, read) == BINYO_ERR) return Qnil;
+    }
+    if (read == BINYO_ERR) return Qnil;
+    args->len = binyo_outstream_bytes_get_bytes_free(args->out, &args->bytes);
+    args->out = NULL;
+    args->result = KRYPT_OK;
+    return Qnil;
+}
+
+static VALUE
+int_read_all_ensure(VALUE arg)
+{
+    struct int_read_all_args *args = (struct int_read_all_args *) arg;
+
+    if (args->out) binyo_outstream_free(args->out);
+    binyo_instream_free(args->in);
+    return Qnil;
+}
+
+/*
+ * Reads +in+ up to its end into a newly allocated buffer that is to be
+ * freed by the caller. +in+ is freed in any case, also if reading from an
+ * underlying IO raises.
+ */
+int
+krypt_instream_read_all(binyo_instream *in, uint8_t **out, size_t *outlen)
+{
+    struct int_read_all_args args;
+
+    args.in = in;
+    args.out = binyo_outstream_new_bytes_size(BINYO_IO_BUF_SIZE);
+    args.bytes = NULL;
+    args.len = 0;
+    args.result = KRYPT_ERR;
+    rb_ensure(int_read_all_run, (VALUE) &args, int_read_all_ensure, (VALUE) &args);
+    if (args.result == KRYPT_ERR) return KRYPT_ERR;
+    *out = args.bytes;
+    *outlen = args.len;
+    return KRYPT_OK;
+}
+
 void
 Init_krypt_io(void)
 {
+    Init_krypt_io_codec();
     Init_krypt_base64();
     Init_krypt_hex();
+    Init_krypt_io_wait();
+    Init_krypt_io_gather();
 }
 
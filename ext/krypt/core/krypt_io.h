@@ -39,18 +39,66 @@
 #define KRYPT_INSTREAM_TYPE_DEFINITE   	100
 #define KRYPT_INSTREAM_TYPE_CHUNKED    	101
 #define KRYPT_INSTREAM_TYPE_PEM	       	102
+#define KRYPT_INSTREAM_TYPE_IO_WAIT    	103
+#define KRYPT_INSTREAM_TYPE_CODEC      	104
 
+#define KRYPT_OUTSTREAM_TYPE_GATHER    	110
+#define KRYPT_OUTSTREAM_TYPE_SPILL     	111
+#define KRYPT_OUTSTREAM_TYPE_CODEC     	112
+#define KRYPT_OUTSTREAM_TYPE_PEM     	113
+
+typedef struct krypt_codec_interface_st krypt_codec_interface;
+
+/* A stateful transformation of a byte stream, e.g. Base64 encoding */
+typedef struct krypt_codec_st {
+    krypt_codec_interface *methods;
+} krypt_codec;
+
+struct krypt_codec_interface_st {
+    /* upper bound of the output of update for +len+ bytes, final for 0 */
+    size_t (*max)(krypt_codec*, size_t len);
+    ssize_t (*update)(krypt_codec*, uint8_t *dst, uint8_t *src, size_t len);
+    ssize_t (*final)(krypt_codec*, uint8_t *dst);
+    void (*free)(krypt_codec*);
+};
+
+void krypt_codec_free(krypt_codec *codec);
+
+binyo_instream *krypt_instream_new_value(VALUE value);
 binyo_instream *krypt_instream_new_value_der(VALUE value);
 binyo_instream *krypt_instream_new_value_pem(VALUE value);
+int krypt_instream_read_all(binyo_instream *in, uint8_t **out, size_t *outlen);
 binyo_instream *krypt_instream_new_chunked(binyo_instream *in, int values_only);
 binyo_instream *krypt_instream_new_definite(binyo_instream *in, size_t length);
 binyo_instream *krypt_instream_new_pem(binyo_instream *original);
+binyo_instream *krypt_instream_new_io_wait(VALUE io);
+int krypt_io_wait_applicable(VALUE io);
+
+binyo_outstream *krypt_outstream_new_gather(VALUE io, VALUE owners);
+int krypt_outstream_gather_flush(binyo_outstream *out);
+int krypt_outstream_write_ref(binyo_outstream *out, uint8_t *bytes, size_t len, VALUE owner);
+int krypt_outstream_write_owned(binyo_outstream *out, uint8_t *bytes, size_t len);
+binyo_instream *krypt_instream_new_codec(binyo_instream *inner, krypt_codec *codec);
+binyo_outstream *krypt_outstream_new_codec(binyo_outstream *inner, krypt_codec *codec);
+int krypt_outstream_codec_finish(binyo_outstream *out);
+void krypt_io_filter_define(VALUE klass);
+void krypt_io_filter_init(VALUE self, VALUE io, krypt_codec *codec, VALUE error_class, rb_encoding *enc);
 void krypt_instream_pem_free_wrapper(binyo_instream *instream);
+binyo_outstream *krypt_outstream_new_pem(binyo_outstream *inner, const char *label, size_t label_len);
+int krypt_outstream_pem_finish(binyo_outstream *out);
+void krypt_outstream_pem_free_wrapper(binyo_outstream *outstream);
+
+/* returns non-zero if the PEM element labeled +name+ is to be decoded */
+typedef int (*krypt_pem_filter_cb)(const char *name, size_t len, void *arg);
 
 int krypt_pem_get_last_name(binyo_instream *instream, uint8_t **out, size_t *outlen);
+void krypt_pem_set_filter(binyo_instream *instream, krypt_pem_filter_cb filter, void *arg);
 void krypt_pem_continue_stream(binyo_instream *instream);
 
 void Init_krypt_io(void);
+void Init_krypt_io_wait(void);
+void Init_krypt_io_gather(void);
+void Init_krypt_io_codec(void);
 
 #endif /* _KRYPT_IO_H_ */
 
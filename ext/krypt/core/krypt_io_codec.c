@@ -0,0 +1,583 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+/*
+ * Streams that run their data through a krypt_codec (Base64, Hex) while
+ * passing it on to an inner stream. Data is processed in chunks of
+ * BINYO_IO_BUF_SIZE, so memory usage does not depend on the size of the
+ * payload. The streams own both the inner stream and the codec.
+ */
+
+typedef struct krypt_instream_codec_st {
+    binyo_instream_interface *methods;
+    binyo_instream *inner;
+    krypt_codec *codec;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t off;
+    size_t len;
+    int eof;
+} krypt_instream_codec;
+
+typedef struct krypt_outstream_codec_st {
+    binyo_outstream_interface *methods;
+    binyo_outstream *inner;
+    krypt_codec *codec;
+    uint8_t *buf;
+    size_t buf_size;
+    int finished;
+} krypt_outstream_codec;
+
+#define int_safe_cast_in(out, in)	binyo_safe_cast_instream((out), (in), KRYPT_INSTREAM_TYPE_CODEC, krypt_instream_codec)
+#define int_safe_cast_out(out, in)	binyo_safe_cast_outstream((out), (in), KRYPT_OUTSTREAM_TYPE_CODEC, krypt_outstream_codec)
+
+static ssize_t int_codec_read(binyo_instream *in, uint8_t *buf, size_t len);
+static int int_codec_seek(binyo_instream *in, off_t offset, int whence);
+static void int_codec_in_mark(binyo_instream *in);
+static void int_codec_in_free(binyo_instream *in);
+
+static ssize_t int_codec_write(binyo_outstream *out, uint8_t *buf, size_t len);
+static void int_codec_out_mark(binyo_outstream *out);
+static void int_codec_out_free(binyo_outstream *out);
+
+static binyo_instream_interface krypt_interface_codec_in = {
+    KRYPT_INSTREAM_TYPE_CODEC,
+    int_codec_read,
+    NULL,
+    NULL,
+    int_codec_seek,
+    int_codec_in_mark,
+    int_codec_in_free
+};
+
+static binyo_outstream_interface krypt_interface_codec_out = {
+    KRYPT_OUTSTREAM_TYPE_CODEC,
+    int_codec_write,
+    NULL,
+    int_codec_out_mark,
+    int_codec_out_free
+};
+
+void
+krypt_codec_free(krypt_codec *codec)
+{
+    if (!codec) return;
+    if (codec->methods->free)
+	codec->methods->free(codec);
+    xfree(codec);
+}
+
+static void
+int_codec_ensure_buf(uint8_t **buf, size_t *buf_size, size_t needed)
+{
+    if (*buf_size >= needed) return;
+    if (*buf)
+	REALLOC_N(*buf, uint8_t, needed);
+    else
+	*buf = ALLOC_N(uint8_t, needed);
+    *buf_size = needed;
+}
+
+binyo_instream *
+krypt_instream_new_codec(binyo_instream *inner, krypt_codec *codec)
+{
+    krypt_instream_codec *in;
+
+    in = ALLOC(krypt_instream_codec);
+    memset(in, 0, sizeof(krypt_instream_codec));
+    in->methods = &krypt_interface_codec_in;
+    in->inner = inner;
+    in->codec = codec;
+    return (binyo_instream *) in;
+}
+
+static int
+int_codec_fill(krypt_instream_codec *in)
+{
+    uint8_t chunk[BINYO_IO_BUF_SIZE];
+    krypt_codec *codec = in->codec;
+    ssize_t r, w;
+
+    r = binyo_instream_read(in->inner, chunk, BINYO_IO_BUF_SIZE);
+    if (r == BINYO_ERR) return BINYO_ERR;
+
+    if (r == BINYO_IO_EOF) {
+	int_codec_ensure_buf(&in->buf, &in->buf_size, codec->methods->max(codec, 0));
+	w = codec->methods->final(codec, in->buf);
+	in->eof = 1;
+    }
+    else {
+	int_codec_ensure_buf(&in->buf, &in->buf_size, codec->methods->max(codec, (size_t) r));
+	w = codec->methods->update(codec, in->buf, chunk, (size_t) r);
+    }
+    if (w == KRYPT_ERR) return BINYO_ERR;
+
+    in->off = 0;
+    in->len = (size_t) w;
+    return BINYO_OK;
+}
+
+static ssize_t
+int_codec_read(binyo_instream *instream, uint8_t *buf, size_t len)
+{
+    krypt_instream_codec *in;
+    size_t total = 0, toread;
+
+    if (!buf) return BINYO_ERR;
+    int_safe_cast_in(in, instream);
+
+    while (total < len) {
+	if (in->off == in->len) {
+	    if (in->eof) break;
+	    if (int_codec_fill(in) == BINYO_ERR) return BINYO_ERR;
+	    continue;
+	}
+	toread = in->len - in->off;
+	if (toread > len - total)
+	    toread = len - total;
+	memcpy(buf + total, in->buf + in->off, toread);
+	in->off += toread;
+	total += toread;
+    }
+
+    if (total == 0 && len > 0)
+	return BINYO_IO_EOF;
+    if (total > SSIZE_MAX) {
+	krypt_error_add("Return size too large: %ld", total);
+	return BINYO_ERR;
+    }
+    return (ssize_t) total;
+}
+
+static int
+int_codec_seek(binyo_instream *instream, off_t offset, int whence)
+{
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    ssize_t r;
+
+    if (whence != SEEK_CUR || offset < 0) {
+	krypt_error_add("Codec streams can only skip forward");
+	return BINYO_ERR;
+    }
+
+    while (offset > 0) {
+	r = int_codec_read(instream, buf, offset < BINYO_IO_BUF_SIZE ? (size_t) offset : BINYO_IO_BUF_SIZE);
+	if (r == BINYO_ERR) return BINYO_ERR;
+	if (r == BINYO_IO_EOF) break;
+	offset -= r;
+    }
+    return BINYO_OK;
+}
+
+static void
+int_codec_in_mark(binyo_instream *instream)
+{
+    krypt_instream_codec *in;
+
+    if (!instream) return;
+    int_safe_cast_in(in, instream);
+    binyo_instream_mark(in->inner);
+}
+
+static void
+int_codec_in_free(binyo_instream *instream)
+{
+    krypt_instream_codec *in;
+
+    if (!instream) return;
+    int_safe_cast_in(in, instream);
+    binyo_instream_free(in->inner);
+    krypt_codec_free(in->codec);
+    if (in->buf)
+	xfree(in->buf);
+}
+
+binyo_outstream *
+krypt_outstream_new_codec(binyo_outstream *inner, krypt_codec *codec)
+{
+    krypt_outstream_codec *out;
+
+    out = ALLOC(krypt_outstream_codec);
+    memset(out, 0, sizeof(krypt_outstream_codec));
+    out->methods = &krypt_interface_codec_out;
+    out->inner = inner;
+    out->codec = codec;
+    return (binyo_outstream *) out;
+}
+
+static ssize_t
+int_codec_write(binyo_outstream *outstream, uint8_t *buf, size_t len)
+{
+    krypt_outstream_codec *out;
+    krypt_codec *codec;
+    size_t off = 0, chunk;
+    ssize_t w;
+
+    int_safe_cast_out(out, outstream);
+    codec = out->codec;
+
+    if (out->finished) {
+	krypt_error_add("Stream has already been finished");
+	return BINYO_ERR;
+    }
+    if (len > SSIZE_MAX) {
+	krypt_error_add("Buffer too large: %ld", len);
+	return BINYO_ERR;
+    }
+
+    int_codec_ensure_buf(&out->buf, &out->buf_size, codec->methods->max(codec, BINYO_IO_BUF_SIZE));
+    while (off < len) {
+	chunk = len - off < BINYO_IO_BUF_SIZE ? len - off : BINYO_IO_BUF_SIZE;
+	w = codec->methods->update(codec, out->buf, buf + off, chunk);
+	if (w == KRYPT_ERR) return BINYO_ERR;
+	if (w > 0 && binyo_outstream_write(out->inner, out->buf, (size_t) w) == BINYO_ERR)
+	    return BINYO_ERR;
+	off += chunk;
+    }
+    return (ssize_t) len;
+}
+
+/*
+ * Writes the output the codec still holds back (e.g. a final Base64
+ * quantum) to the inner stream. No more data may be written afterwards.
+ */
+int
+krypt_outstream_codec_finish(binyo_outstream *outstream)
+{
+    krypt_outstream_codec *out;
+    krypt_codec *codec;
+    ssize_t w;
+
+    int_safe_cast_out(out, outstream);
+    codec = out->codec;
+    if (out->finished) return KRYPT_OK;
+
+    out->finished = 1;
+    int_codec_ensure_buf(&out->buf, &out->buf_size, codec->methods->max(codec, 0));
+    w = codec->methods->final(codec, out->buf);
+    if (w == KRYPT_ERR) return KRYPT_ERR;
+    if (w > 0 && binyo_outstream_write(out->inner, out->buf, (size_t) w) == BINYO_ERR)
+	return KRYPT_ERR;
+    return KRYPT_OK;
+}
+
+static void
+int_codec_out_mark(binyo_outstream *outstream)
+{
+    krypt_outstream_codec *out;
+
+    if (!outstream) return;
+    int_safe_cast_out(out, outstream);
+    binyo_outstream_mark(out->inner);
+}
+
+static void
+int_codec_out_free(binyo_outstream *outstream)
+{
+    krypt_outstream_codec *out;
+
+    if (!outstream) return;
+    int_safe_cast_out(out, outstream);
+    binyo_outstream_free(out->inner);
+    krypt_codec_free(out->codec);
+    if (out->buf)
+	xfree(out->buf);
+}
+
+/*
+ * Ruby-level IO filters (e.g. Krypt::Base64::Encoder) on top of the codec
+ * streams. A filter wraps an IO and either reads from it or writes to it,
+ * the direction is fixed by the first call to +read+ or +write+.
+ */
+
+typedef struct krypt_io_filter_st {
+    VALUE io;
+    VALUE error_class;
+    rb_encoding *enc;
+    krypt_codec *codec;
+    binyo_instream *in;
+    binyo_outstream *out;
+    int closed;
+} krypt_io_filter;
+
+static ID sKrypt_ID_CLOSE;
+
+static void
+int_io_filter_mark(krypt_io_filter *filter)
+{
+    if (!filter) return;
+    rb_gc_mark(filter->io);
+    rb_gc_mark(filter->error_class);
+    if (filter->in)
+	binyo_instream_mark(filter->in);
+    if (filter->out)
+	binyo_outstream_mark(filter->out);
+}
+
+static void
+int_io_filter_free_streams(krypt_io_filter *filter)
+{
+    if (filter->in)
+	binyo_instream_free(filter->in);
+    else if (filter->out)
+	binyo_outstream_free(filter->out);
+    else
+	krypt_codec_free(filter->codec);
+    filter->in = NULL;
+    filter->out = NULL;
+    filter->codec = NULL;
+}
+
+static void
+int_io_filter_free(krypt_io_filter *filter)
+{
+    if (!filter) return;
+    int_io_filter_free_streams(filter);
+    xfree(filter);
+}
+
+#define int_io_filter_get(obj, filter) 				\
+do { 								\
+    Data_Get_Struct((obj), krypt_io_filter, (filter));  	\
+    if ((filter) && (filter)->closed) {				\
+	rb_raise(rb_eIOError, "closed stream");			\
+    }								\
+    if (!(filter) || !(filter)->codec) { 			\
+	rb_raise(eKryptError, "Uninitialized filter");		\
+    } 								\
+} while (0)
+
+static VALUE
+int_io_filter_alloc(VALUE klass)
+{
+    krypt_io_filter *filter;
+
+    filter = ALLOC(krypt_io_filter);
+    memset(filter, 0, sizeof(krypt_io_filter));
+    filter->io = Qnil;
+    filter->error_class = Qnil;
+    return Data_Wrap_Struct(klass, int_io_filter_mark, int_io_filter_free, filter);
+}
+
+/*
+ * To be called from the +initialize+ of a filter class. The filter takes
+ * ownership of +codec+, errors are raised as +error_class+ and Strings
+ * returned by +read+ are associated with +enc+.
+ */
+void
+krypt_io_filter_init(VALUE self, VALUE io, krypt_codec *codec, VALUE error_class, rb_encoding *enc)
+{
+    krypt_io_filter *filter;
+
+    Data_Get_Struct(self, krypt_io_filter, filter);
+    int_io_filter_free_streams(filter);
+    filter->io = io;
+    filter->error_class = error_class;
+    filter->enc = enc;
+    filter->codec = codec;
+    filter->closed = 0;
+}
+
+static binyo_instream *
+int_io_filter_get_in(krypt_io_filter *filter)
+{
+    binyo_instream *inner;
+
+    if (filter->in) return filter->in;
+    if (filter->out)
+	rb_raise(rb_eIOError, "not opened for reading");
+
+    if (!(inner = krypt_instream_new_value(filter->io))) {
+	StringValue(filter->io);
+	/* the stream outlives this call, the caller may change the String meanwhile */
+	filter->io = rb_str_new_frozen(filter->io);
+	inner = binyo_instream_new_bytes((uint8_t *) RSTRING_PTR(filter->io), RSTRING_LEN(filter->io));
+    }
+    filter->in = krypt_instream_new_codec(inner, filter->codec);
+    return filter->in;
+}
+
+static binyo_outstream *
+int_io_filter_get_out(krypt_io_filter *filter)
+{
+    binyo_outstream *inner;
+
+    if (filter->out) return filter->out;
+    if (filter->in)
+	rb_raise(rb_eIOError, "not opened for writing");
+
+    if (!(inner = binyo_outstream_new_value(filter->io)))
+	krypt_error_raise(filter->error_class, "Error while trying to access the stream");
+    filter->out = krypt_outstream_new_codec(inner, filter->codec);
+    return filter->out;
+}
+
+static VALUE
+int_io_filter_read_all(krypt_io_filter *filter, binyo_instream *in)
+{
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    VALUE ret = rb_str_new(0, 0);
+    ssize_t r;
+
+    while ((r = binyo_instream_read(in, buf, BINYO_IO_BUF_SIZE)) != BINYO_IO_EOF) {
+	if (r == BINYO_ERR)
+	    krypt_error_raise(filter->error_class, "Error while reading from the stream");
+	rb_str_buf_cat(ret, (const char *) buf, r);
+    }
+    return ret;
+}
+
+/**
+ * call-seq:
+ *    filter.read([len=nil]) -> String or nil
+ *
+ * Reads from the underlying IO and returns the processed data. Without
+ * +len+, everything until the end of the IO is read. With +len+, at most
+ * +len+ bytes are returned, or nil once the end of the IO was reached.
+ */
+static VALUE
+krypt_io_filter_read(int argc, VALUE *argv, VALUE self)
+{
+    krypt_io_filter *filter;
+    binyo_instream *in;
+    VALUE vlen = Qnil;
+    VALUE ret;
+    long len;
+    ssize_t r;
+
+    rb_scan_args(argc, argv, "01", &vlen);
+
+    int_io_filter_get(self, filter);
+    in = int_io_filter_get_in(filter);
+
+    if (NIL_P(vlen)) {
+	ret = int_io_filter_read_all(filter, in);
+    }
+    else {
+	len = NUM2LONG(vlen);
+	if (len < 0)
+	    rb_raise(rb_eArgError, "negative length %ld given", len);
+	ret = rb_str_new(0, len);
+	if (len == 0)
+	    return ret;
+	r = binyo_instream_read(in, (uint8_t *) RSTRING_PTR(ret), (size_t) len);
+	if (r == BINYO_ERR)
+	    krypt_error_raise(filter->error_class, "Error while reading from the stream");
+	if (r == BINYO_IO_EOF)
+	    return Qnil;
+	rb_str_set_len(ret, r);
+    }
+
+    rb_enc_associate(ret, filter->enc);
+    return ret;
+}
+
+/**
+ * call-seq:
+ *    filter.write(data) -> Integer
+ *
+ * Processes +data+ and writes the result to the underlying IO. Output
+ * that depends on subsequent input is held back until the next +write+
+ * or until the filter is closed. Returns the number of bytes of +data+.
+ */
+static VALUE
+krypt_io_filter_write(VALUE self, VALUE data)
+{
+    krypt_io_filter *filter;
+    binyo_outstream *out;
+
+    int_io_filter_get(self, filter);
+    out = int_io_filter_get_out(filter);
+
+    StringValue(data);
+    if (binyo_outstream_write(out, (uint8_t *) RSTRING_PTR(data), RSTRING_LEN(data)) == BINYO_ERR)
+	krypt_error_raise(filter->error_class, "Error while writing to the stream");
+    RB_GC_GUARD(data);
+    return LONG2NUM(RSTRING_LEN(data));
+}
+
+/**
+ * call-seq:
+ *    filter << data -> filter
+ *
+ * Same as +write+, but returns the filter itself.
+ */
+static VALUE
+krypt_io_filter_append(VALUE self, VALUE data)
+{
+    krypt_io_filter_write(self, data);
+    return self;
+}
+
+/**
+ * call-seq:
+ *    filter.close -> nil
+ *
+ * If the filter was written to, the remaining output is written to the
+ * underlying IO. Afterwards, the IO is closed if it responds to +close+.
+ */
+static VALUE
+krypt_io_filter_close(VALUE self)
+{
+    krypt_io_filter *filter;
+    int result = KRYPT_OK;
+
+    int_io_filter_get(self, filter);
+    if (filter->out)
+	result = krypt_outstream_codec_finish(filter->out);
+    int_io_filter_free_streams(filter);
+    filter->closed = 1;
+    if (result == KRYPT_ERR)
+	krypt_error_raise(filter->error_class, "Error while writing to the stream");
+
+    if (rb_respond_to(filter->io, sKrypt_ID_CLOSE))
+	rb_funcall(filter->io, sKrypt_ID_CLOSE, 0);
+    return Qnil;
+}
+
+/*
+ * Defines the allocator and the IO methods shared by all filters on
+ * +klass+, which remains responsible for +initialize+.
+ */
+void
+krypt_io_filter_define(VALUE klass)
+{
+    rb_define_alloc_func(klass, int_io_filter_alloc);
+    rb_define_method(klass, "read", krypt_io_filter_read, -1);
+    rb_define_method(klass, "write", krypt_io_filter_write, 1);
+    rb_define_method(klass, "<<", krypt_io_filter_append, 1);
+    rb_define_method(klass, "close", krypt_io_filter_close, 0);
+}
+
+void
+Init_krypt_io_codec(void)
+{
+    sKrypt_ID_CLOSE = rb_intern("close");
+}
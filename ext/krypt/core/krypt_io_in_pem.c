@@ -32,26 +32,38 @@ enum krypt_pem_state {
     HEADER = 0,
     CONTENT,
     FOOTER,
+    SKIP,
     DONE
 };
 
-#define KRYPT_LINE_BUF_SIZE 256
-
-typedef struct krypt_pem_parse_ctx_st {
-    char *line;
-    size_t len;
-    size_t off;
-    char *name;
-} krypt_pem_parse_ctx;
+/*
+ * The input is scanned in large blocks rather than line by line. Marker
+ * lines are located with memchr, the Base64 body in between is handed to
+ * the streaming Base64 decoder in one piece per block, line breaks
+ * included, as the decoder skips them anyway. Lines are not limited in
+ * length, the scan buffer grows if a marker line does not fit.
+ */
+#define KRYPT_PEM_SCAN_SIZE 65536
 
 typedef struct krypt_b64_buffer_st {
     binyo_instream *inner;
-    uint8_t *buffer;
+    uint8_t *scan;		/* raw input */
+    size_t scan_cap;
+    size_t scan_len;
+    size_t scan_off;
+    int inner_eof;
+    int skip_line;		/* the rest of the current line is irrelevant */
+    int line_start;		/* scan_off is at the beginning of a line */
+    krypt_codec *decoder;
+    uint8_t *buffer;		/* decoded output */
+    size_t cap;
     size_t len;
     size_t off;
     enum krypt_pem_state state;
     char *name;
     int eof;
+    krypt_pem_filter_cb filter;
+    void *filter_arg;
 } krypt_b64_buffer;
 
 typedef struct krypt_instream_pem_st {
@@ -85,6 +97,7 @@ int_krypt_b64_buffer_new(binyo_instream *original)
     memset(ret, 0, sizeof(krypt_b64_buffer));
     ret->inner = original;
     ret->state = HEADER;
+    ret->line_start = 1;
     return ret;
 }
 
@@ -131,10 +144,13 @@ int_pem_free_inner(krypt_instream_pem *in)
     krypt_b64_buffer *b64;
 
     b64 = in->buffer;
+    if (b64->scan)
+	xfree(b64->scan);
     if (b64->buffer)
 	xfree(b64->buffer);
     if (b64->name)
 	xfree(b64->name);
+    krypt_codec_free(b64->decoder);
     xfree(b64);
 }
 
@@ -191,7 +207,10 @@ krypt_pem_get_last_name(binyo_instream *instream, uint8_t **out, size_t *outlen)
     return BINYO_OK;
 }
 
-
+/*
+ * Prepares the stream for reading the next PEM element. Input that was
+ * already scanned is kept.
+ */
 void
 krypt_pem_continue_stream(binyo_instream *instream)
 {
@@ -208,144 +227,256 @@ krypt_pem_continue_stream(binyo_instream *instream)
     if (b64->name)
 	xfree(b64->name);
     b64->name = NULL;
-    if (b64->buffer)
-	xfree(b64->buffer);
-    b64->buffer = NULL;
+    krypt_codec_free(b64->decoder);
+    b64->decoder = NULL;
 }
 
+/*
+ * Installs a callback that decides by their label which elements are
+ * decoded. Elements that are rejected are skipped over without decoding
+ * their Base64 body.
+ */
+void
+krypt_pem_set_filter(binyo_instream *instream, krypt_pem_filter_cb filter, void *arg)
+{
+    krypt_instream_pem *in;
+
+    if (!instream) return;
+    int_safe_cast(in, instream);
+    in->buffer->filter = filter;
+    in->buffer->filter_arg = arg;
+}
 
 static int
-int_match_header(krypt_pem_parse_ctx *ctx)
+int_match_header(uint8_t *line, size_t len, char **name)
 {
-    if (ctx->len == KRYPT_LINE_BUF_SIZE)
+    if (len < 16 || memcmp(line, "-----BEGIN ", 11) != 0)
+	return BINYO_ERR;
+    if (memcmp(line + len - 5, "-----", 5) != 0)
 	return BINYO_ERR;
-    if (strncmp(ctx->line, "-----BEGIN ", 11) == 0) {
-	size_t len;
-	len = ctx->len;
-	if (strncmp(ctx->line + len - 5, "-----", 5) != 0)
+    *name = ALLOC_N(char, len - 11 - 4);
+    memcpy(*name, line + 11, len - 11 - 5);
+    (*name)[len - 11 - 5] = '\0';
+    return BINYO_OK;
+}
+
+static int
+int_match_footer(uint8_t *line, size_t len, char *name)
+{
+    size_t namelen = strlen(name);
+
+    if (len != 9 + namelen + 5 || memcmp(line, "-----END ", 9) != 0)
+	return BINYO_ERR;
+    if (memcmp(line + len - 5, "-----", 5) != 0)
+	return BINYO_ERR;
+    if (memcmp(line + 9, name, namelen) != 0)
+	return BINYO_ERR;
+    return BINYO_OK;
+}
+
+/* Reads more input, growing the scan buffer only if it is full */
+static int
+int_scan_refill(krypt_b64_buffer *in)
+{
+    ssize_t r;
+
+    if (in->scan_off > 0) {
+	memmove(in->scan, in->scan + in->scan_off, in->scan_len - in->scan_off);
+	in->scan_len -= in->scan_off;
+	in->scan_off = 0;
+    }
+    if (!in->scan) {
+	in->scan_cap = KRYPT_PEM_SCAN_SIZE;
+	in->scan = ALLOC_N(uint8_t, in->scan_cap);
+    }
+    else if (in->scan_len == in->scan_cap) {
+	in->scan_cap *= 2;
+	REALLOC_N(in->scan, uint8_t, in->scan_cap);
+    }
+
+    r = binyo_instream_read(in->inner, in->scan + in->scan_len, in->scan_cap - in->scan_len);
+    if (r == BINYO_ERR) return BINYO_ERR;
+    if (r == BINYO_IO_EOF)
+	in->inner_eof = 1;
+    else
+	in->scan_len += r;
+    return BINYO_OK;
+}
+
+/*
+ * Returns the next line that could be a marker line, i.e. that begins
+ * with '-' or is empty, without the line terminator. Other lines are
+ * skipped without being buffered as a whole.
+ */
+static int
+int_scan_line(krypt_b64_buffer *in, uint8_t **line, size_t *linelen)
+{
+    uint8_t *p, *nl;
+    size_t avail;
+
+    while (1) {
+	p = in->scan + in->scan_off;
+	avail = in->scan_len - in->scan_off;
+
+	if (avail > 0) {
+	    nl = memchr(p, '\n', avail);
+	    if (in->skip_line) {
+		if (nl) {
+		    in->scan_off += nl - p + 1;
+		    in->skip_line = 0;
+		    continue;
+		}
+		in->scan_off = in->scan_len;
+	    }
+	    else if (nl || in->inner_eof) {
+		*line = p;
+		*linelen = nl ? (size_t) (nl - p) : avail;
+		in->scan_off += nl ? *linelen + 1 : avail;
+		if (*linelen > 0 && p[*linelen - 1] == '\r')
+		    (*linelen)--;
+		return BINYO_OK;
+	    }
+	    else if (p[0] != '-') {
+		in->skip_line = 1;
+		in->scan_off = in->scan_len;
+	    }
+	}
+
+	if (in->inner_eof)
+	    return BINYO_IO_EOF;
+	if (int_scan_refill(in) == BINYO_ERR)
 	    return BINYO_ERR;
-	ctx->name = ALLOC_N(char, len - 11 - 4);
-	memcpy(ctx->name, ctx->line + 11, len - 11 - 5);
-	ctx->name[len - 11 - 5] = '\0';
-	return BINYO_OK;
     }
-    return BINYO_ERR;
 }
 
 static int
-int_match_footer(krypt_pem_parse_ctx *ctx)
+int_b64_decode_into(krypt_b64_buffer *in, uint8_t *bytes, size_t len, int final)
 {
-    char *name = ctx->name;
+    krypt_codec *codec = in->decoder;
+    size_t needed;
+    ssize_t w;
+
+    needed = in->len + codec->methods->max(codec, len);
+    if (needed > in->cap) {
+	in->cap = needed < BINYO_IO_BUF_SIZE ? BINYO_IO_BUF_SIZE : needed;
+	if (in->buffer)
+	    REALLOC_N(in->buffer, uint8_t, in->cap);
+	else
+	    in->buffer = ALLOC_N(uint8_t, in->cap);
+    }
 
-    if (ctx->len == KRYPT_LINE_BUF_SIZE)
+    if (final)
+	w = codec->methods->final(codec, in->buffer + in->len);
+    else
+	w = codec->methods->update(codec, in->buffer + in->len, bytes, len);
+    if (w == KRYPT_ERR) {
+	krypt_error_add("Could not decode Base64 data");
 	return BINYO_ERR;
-    if (strncmp(ctx->line, "-----END ", 9) == 0) {
-	size_t len;
-	len = ctx->len;
-	if (strncmp(ctx->line + len - 5, "-----", 5) != 0)
-	    return BINYO_ERR;
-	if (strncmp(ctx->line + 9, name, len - 9 - 5) == 0)
-	    return BINYO_OK;
     }
-    return BINYO_ERR;
+    in->len += w;
+    return BINYO_OK;
 }
 
+/*
+ * Decodes the body up to the next line that begins with '-', as far as
+ * it is available in the scan buffer. Input that ends before the footer
+ * line is an error, bytes decoded until then have already been returned.
+ */
 static int
-int_b64_fill(krypt_b64_buffer *in)
+int_b64_fill_content(krypt_b64_buffer *in)
 {
-    binyo_outstream *out;
-    size_t total = 0;
-    ssize_t linelen;
-    char linebuf[KRYPT_LINE_BUF_SIZE]; 
+    uint8_t *p, *nl, *end;
+    size_t avail;
 
-    if (in->buffer) {
-	xfree(in->buffer);
-        in->buffer = NULL;
+    if (in->scan_off == in->scan_len) {
+	if (in->inner_eof) {
+	    krypt_error_add("PEM data ended prematurely");
+	    return BINYO_ERR;
+	}
+	return int_scan_refill(in);
     }
 
-    out = binyo_outstream_new_bytes_size(BINYO_IO_BUF_SIZE + KRYPT_LINE_BUF_SIZE);
-    linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
+    p = in->scan + in->scan_off;
+    avail = in->scan_len - in->scan_off;
 
-    while (in->state != DONE && total < BINYO_IO_BUF_SIZE && linelen != BINYO_IO_EOF) {
-	if (linelen == BINYO_ERR) return BINYO_ERR;
+    if (in->line_start && p[0] == '-') {
+	in->state = FOOTER;
+	return int_b64_decode_into(in, NULL, 0, 1);
+    }
 
-	if (linelen == 0) {
-	    linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
-	    continue;
-	}
+    end = p + avail;
+    nl = p;
+    while ((nl = memchr(nl, '\n', end - nl)) != NULL && nl + 1 < end && nl[1] != '-')
+	nl++;
 
-	switch (in->state) {
-	    case HEADER:
-		if (linebuf[0] == '-') {
-		    krypt_pem_parse_ctx linectx;
-		    linectx.line = linebuf;
-		    linectx.len = linelen;
-		    linectx.off = 0;
-		    if (int_match_header(&linectx) == BINYO_OK) {
-			in->name = linectx.name;
-			in->state = CONTENT;
-		    }
-		}
-		linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
-		break;
-	    case CONTENT:
-		if (linebuf[0] == '-') {
-		    in->state = FOOTER;
-		}
-		else {
-		    if (krypt_base64_buffer_decode_to(out, (uint8_t *) linebuf, 0, linelen) == KRYPT_ERR) {
-			krypt_error_add("Could not decode Base64 data");
-			return BINYO_ERR;
-		    }
-		    total += linelen;
-		    if (total < BINYO_IO_BUF_SIZE)
-			linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
-		}
-		break;
-	    case FOOTER:
-		if (linebuf[0] == '-') {
-		    krypt_pem_parse_ctx linectx;
-		    linectx.line = linebuf;
-		    linectx.len = linelen;
-		    linectx.off = 0;
-		    linectx.name = in->name;
-		    if (int_match_footer(&linectx) == BINYO_OK)
-			in->state = DONE;
-		    else
-			linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
-		}
-		else {
-		    linelen = binyo_instream_gets(in->inner, linebuf, KRYPT_LINE_BUF_SIZE);
-		}
-		break;
-	    default:
-		break;
-	}
+    if (nl && nl + 1 < end) {
+	avail = nl + 1 - p;
+	in->line_start = 1;
+    }
+    else {
+	in->line_start = (p[avail - 1] == '\n');
     }
 
-    if (linelen == BINYO_ERR) return BINYO_ERR;
+    in->scan_off += avail;
+    return int_b64_decode_into(in, p, avail, 0);
+}
 
-    if (in->state == DONE || linelen == BINYO_IO_EOF)
-	in->eof = 1;
+static int
+int_b64_fill(krypt_b64_buffer *in)
+{
+    uint8_t *line;
+    size_t linelen;
+    int result;
 
-    if (linelen == BINYO_IO_EOF && in->state != DONE) {
-	binyo_outstream_free(out);
-	switch (in->state) {
-	    case HEADER:
-		in->len = in->off = 0;
+    in->off = 0;
+    in->len = 0;
+
+    while (in->len == 0 && in->state != DONE) {
+	if (in->state == CONTENT) {
+	    if (int_b64_fill_content(in) == BINYO_ERR) return BINYO_ERR;
+	    continue;
+	}
+
+	result = int_scan_line(in, &line, &linelen);
+	if (result == BINYO_ERR) return BINYO_ERR;
+	if (result == BINYO_IO_EOF) {
+	    if (in->state == HEADER) {
 		in->eof = 1;
 		return BINYO_OK;
-	    case CONTENT:
-		krypt_error_add("PEM data ended prematurely");
-		return BINYO_ERR;
-	    default:
-		krypt_error_add("Could not find matching PEM footer");
-		return BINYO_ERR;
+	    }
+	    krypt_error_add("Could not find matching PEM footer");
+	    return BINYO_ERR;
+	}
+
+	if (linelen == 0 || line[0] != '-')
+	    continue;
+
+	if (in->state == HEADER) {
+	    if (int_match_header(line, linelen, &in->name) == BINYO_OK) {
+		if (in->filter && !in->filter(in->name, strlen(in->name), in->filter_arg)) {
+		    in->state = SKIP;
+		}
+		else {
+		    in->state = CONTENT;
+		    in->line_start = 1;
+		    in->decoder = krypt_base64_decoder_new();
+		}
+	    }
+	}
+	else if (int_match_footer(line, linelen, in->name) == BINYO_OK) {
+	    if (in->state == SKIP) {
+		xfree(in->name);
+		in->name = NULL;
+		in->state = HEADER;
+	    }
+	    else {
+		in->state = DONE;
+	    }
 	}
     }
 
-    in->off = 0;
-    in->len = binyo_outstream_bytes_get_bytes_free(out, &in->buffer);
+    if (in->state == DONE)
+	in->eof = 1;
     return BINYO_OK;
 }
 
@@ -394,4 +525,3 @@ int_pem_read(binyo_instream *instream, uint8_t *buf, size_t len)
     int_safe_cast(in, instream);
     return int_b64_read(in->buffer, buf, len);
 }
-
@@ -0,0 +1,302 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+#if defined(HAVE_RB_IO_WAIT)
+
+#include <fcntl.h>
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+#include <ruby/fiber/scheduler.h>
+#endif
+
+/*
+ * An instream over IO-like objects that never blocks the native thread
+ * on its own: reads are issued with read_nonblock and whenever no data
+ * is available yet, we wait on the IO through rb_io_wait. Under a Fiber
+ * scheduler this suspends only the current fiber, otherwise the thread
+ * waits with the GVL released just like a regular blocking read would.
+ */
+typedef struct krypt_instream_io_wait_st {
+    binyo_instream_interface *methods;
+    VALUE io;
+} krypt_instream_io_wait;
+
+#define int_safe_cast(out, in)		binyo_safe_cast_instream((out), (in), KRYPT_INSTREAM_TYPE_IO_WAIT, krypt_instream_io_wait)
+
+static ID sKrypt_ID_READ_NONBLOCK, sKrypt_ID_SELECT;
+static VALUE sKrypt_ID_WAIT_READABLE, sKrypt_ID_WAIT_WRITABLE, sKrypt_ID_EXCEPTION;
+/* {exception: false}, frozen and shared by all streams */
+static VALUE sKrypt_IO_WAIT_OPTS;
+
+static krypt_instream_io_wait* int_io_wait_alloc(void);
+static ssize_t int_io_wait_read(binyo_instream *in, uint8_t *buf, size_t len);
+static ssize_t int_io_wait_gets(binyo_instream *in, char *line, size_t len);
+static int int_io_wait_seek(binyo_instream *in, off_t offset, int whence);
+static void int_io_wait_mark(binyo_instream *in);
+static void int_io_wait_free(binyo_instream *in);
+
+static binyo_instream_interface krypt_interface_io_wait = {
+    KRYPT_INSTREAM_TYPE_IO_WAIT,
+    int_io_wait_read,
+    NULL,
+    int_io_wait_gets,
+    int_io_wait_seek,
+    int_io_wait_mark,
+    int_io_wait_free
+};
+
+static int
+int_fd_is_nonblocking(VALUE io)
+{
+    int fd, flags;
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+    fd = rb_io_descriptor(io);
+#else
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    fd = fptr->fd;
+#endif
+    if (fd < 0) return 0;
+    if ((flags = fcntl(fd, F_GETFL)) == -1) return 0;
+    return (flags & O_NONBLOCK) != 0;
+}
+
+/*
+ * Real IO instances qualify if they are in non-blocking mode or if a
+ * Fiber scheduler is active (the scheduler puts them in non-blocking
+ * mode anyway). Other IO-like objects such as SSL sockets qualify only
+ * under a scheduler and only if they support read_nonblock.
+ */
+int
+krypt_io_wait_applicable(VALUE io)
+{
+    int scheduled = 0;
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+    scheduled = !NIL_P(rb_fiber_scheduler_current());
+#endif
+    if (TYPE(io) == T_FILE)
+	return scheduled || int_fd_is_nonblocking(io);
+    if (TYPE(io) == T_STRING)
+	return 0;
+    return scheduled && rb_respond_to(io, sKrypt_ID_READ_NONBLOCK);
+}
+
+binyo_instream *
+krypt_instream_new_io_wait(VALUE io)
+{
+    krypt_instream_io_wait *in;
+
+    in = int_io_wait_alloc();
+    in->io = io;
+    return (binyo_instream *) in;
+}
+
+static krypt_instream_io_wait*
+int_io_wait_alloc(void)
+{
+    krypt_instream_io_wait *ret;
+    ret = ALLOC(krypt_instream_io_wait);
+    memset(ret, 0, sizeof(krypt_instream_io_wait));
+    ret->methods = &krypt_interface_io_wait;
+    return ret;
+}
+
+static void
+int_io_wait_for(krypt_instream_io_wait *in, VALUE what)
+{
+    if (TYPE(in->io) == T_FILE) {
+	int events = what == sKrypt_ID_WAIT_READABLE ? RUBY_IO_READABLE : RUBY_IO_WRITABLE;
+	rb_io_wait(in->io, INT2FIX(events), Qnil);
+    }
+    else {
+	VALUE ios = rb_ary_new3(1, in->io);
+	if (what == sKrypt_ID_WAIT_READABLE)
+	    rb_funcall(rb_cIO, sKrypt_ID_SELECT, 1, ios);
+	else
+	    rb_funcall(rb_cIO, sKrypt_ID_SELECT, 2, Qnil, ios);
+    }
+}
+
+static ssize_t
+int_io_wait_read(binyo_instream *instream, uint8_t *buf, size_t len)
+{
+    krypt_instream_io_wait *in;
+    VALUE args[2];
+    VALUE ret;
+    long rlen;
+
+    int_safe_cast(in, instream);
+
+    if (!buf) return BINYO_ERR;
+    /* read_nonblock(0) returns "" forever */
+    if (len == 0) return 0;
+    if (len > LONG_MAX) len = LONG_MAX;
+
+    /* no outbuf: the stream is not marked while it is in use, so it
+     * must not hold the only reference to any object */
+    args[0] = LONG2NUM((long) len);
+    args[1] = sKrypt_IO_WAIT_OPTS;
+
+    while (1) {
+	ret = rb_funcallv_kw(in->io, sKrypt_ID_READ_NONBLOCK, 2, args, RB_PASS_KEYWORDS);
+	if (NIL_P(ret))
+	    return BINYO_IO_EOF;
+	if (ret == sKrypt_ID_WAIT_READABLE || ret == sKrypt_ID_WAIT_WRITABLE) {
+	    int_io_wait_for(in, ret);
+	    continue;
+	}
+	if (TYPE(ret) != T_STRING) {
+	    krypt_error_add("read_nonblock returned an unexpected value");
+	    return BINYO_ERR;
+	}
+	rlen = RSTRING_LEN(ret);
+	if (rlen == 0)
+	    continue;
+	if ((size_t) rlen > len) {
+	    krypt_error_add("read_nonblock returned more bytes than requested");
+	    return BINYO_ERR;
+	}
+	memcpy(buf, RSTRING_PTR(ret), rlen);
+	RB_GC_GUARD(ret);
+	return (ssize_t) rlen;
+    }
+}
+
+/*
+ * Lines are read byte by byte - we must not consume anything beyond
+ * the line terminator because the IO is shared with the caller.
+ */
+static ssize_t
+int_io_wait_gets(binyo_instream *instream, char *line, size_t len)
+{
+    size_t total = 0;
+    ssize_t r;
+    uint8_t c;
+
+    if (!line) return BINYO_ERR;
+
+    while (total < len) {
+	r = int_io_wait_read(instream, &c, 1);
+	if (r == BINYO_ERR) return BINYO_ERR;
+	if (r == BINYO_IO_EOF) {
+	    if (total == 0) return BINYO_IO_EOF;
+	    break;
+	}
+	if (c == '\n') break;
+	line[total++] = (char) c;
+    }
+
+    if (total > 0 && line[total - 1] == '\r')
+	total--;
+    return (ssize_t) total;
+}
+
+/*
+ * Sockets cannot seek, but skipping forward is all the parser ever
+ * needs, so relative seeks are served by reading and discarding.
+ */
+static int
+int_io_wait_seek(binyo_instream *instream, off_t offset, int whence)
+{
+    uint8_t buf[BINYO_IO_BUF_SIZE];
+    ssize_t r;
+
+    if (whence != SEEK_CUR || offset < 0) {
+	krypt_error_add("Only forward relative seeks are supported on non-blocking streams");
+	return BINYO_ERR;
+    }
+
+    while (offset > 0) {
+	size_t to_read = offset < BINYO_IO_BUF_SIZE ? (size_t) offset : BINYO_IO_BUF_SIZE;
+	r = int_io_wait_read(instream, buf, to_read);
+	if (r == BINYO_ERR) return BINYO_ERR;
+	if (r == BINYO_IO_EOF) {
+	    krypt_error_add("Premature end of stream while skipping");
+	    return BINYO_ERR;
+	}
+	offset -= r;
+    }
+
+    return BINYO_OK;
+}
+
+static void
+int_io_wait_mark(binyo_instream *instream)
+{
+    krypt_instream_io_wait *in;
+
+    if (!instream) return;
+    int_safe_cast(in, instream);
+    rb_gc_mark(in->io);
+}
+
+static void
+int_io_wait_free(binyo_instream *instream)
+{
+    /* the IO is garbage-collected */
+}
+
+void
+Init_krypt_io_wait(void)
+{
+    sKrypt_ID_READ_NONBLOCK = rb_intern("read_nonblock");
+    sKrypt_ID_SELECT = rb_intern("select");
+    sKrypt_ID_WAIT_READABLE = ID2SYM(rb_intern("wait_readable"));
+    sKrypt_ID_WAIT_WRITABLE = ID2SYM(rb_intern("wait_writable"));
+    sKrypt_ID_EXCEPTION = ID2SYM(rb_intern("exception"));
+
+    sKrypt_IO_WAIT_OPTS = rb_hash_new();
+    rb_hash_aset(sKrypt_IO_WAIT_OPTS, sKrypt_ID_EXCEPTION, Qfalse);
+    rb_obj_freeze(sKrypt_IO_WAIT_OPTS);
+    rb_gc_register_mark_object(sKrypt_IO_WAIT_OPTS);
+}
+
+#else /* !HAVE_RB_IO_WAIT */
+
+int
+krypt_io_wait_applicable(VALUE io)
+{
+    return 0;
+}
+
+binyo_instream *
+krypt_instream_new_io_wait(VALUE io)
+{
+    return binyo_instream_new_value(io);
+}
+
+void
+Init_krypt_io_wait(void)
+{
+    /* no scheduler support on this Ruby */
+}
+
+#endif /* HAVE_RB_IO_WAIT */
+
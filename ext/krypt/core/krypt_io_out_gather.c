@@ -0,0 +1,420 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+#if defined(HAVE_SYS_UIO_H)
+#include <sys/uio.h>
+#endif
+#include <errno.h>
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#include <ruby/thread.h>
+#endif
+
+/*
+ * An outstream that accumulates the pieces of an encoding and hands them
+ * to the underlying IO in as few calls as possible. Small and transient
+ * writes are copied into an arena, large buffers that stay alive until
+ * the next flush (cached encodings of ASN1Data) are merely referenced,
+ * and buffers whose ownership is passed on are freed after flushing.
+ * Real IOs in blocking mode are flushed with writev(2) while the GVL is
+ * released, anything else (including any IO while a Fiber scheduler is
+ * active) receives a single IO#write of the joined pieces.
+ */
+
+#define KRYPT_GATHER_FLUSH_SIZE	65536
+#define KRYPT_GATHER_MAX_VECS	1024
+#define KRYPT_GATHER_REF_MIN	256
+
+enum krypt_gather_vec_type {
+    ARENA = 0,
+    REF,
+    OWNED
+};
+
+typedef struct krypt_gather_vec_st {
+    enum krypt_gather_vec_type type;
+    uint8_t *bytes;	/* NULL for ARENA, offset is used instead */
+    size_t off;
+    size_t len;
+} krypt_gather_vec;
+
+typedef struct krypt_outstream_gather_st {
+    binyo_outstream_interface *methods;
+    VALUE io;
+    VALUE owners;
+    krypt_gather_vec *vecs;
+    size_t num_vecs;
+    uint8_t *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t pending;
+} krypt_outstream_gather;
+
+#define int_safe_cast(out, in)		binyo_safe_cast_outstream((out), (in), KRYPT_OUTSTREAM_TYPE_GATHER, krypt_outstream_gather)
+
+static ID sKrypt_ID_WRITE;
+
+static krypt_outstream_gather* int_gather_alloc(void);
+static ssize_t int_gather_write(binyo_outstream *out, uint8_t *buf, size_t len);
+static void int_gather_mark(binyo_outstream *out);
+static void int_gather_free(binyo_outstream *out);
+
+static binyo_outstream_interface krypt_interface_gather = {
+    KRYPT_OUTSTREAM_TYPE_GATHER,
+    int_gather_write,
+    NULL,
+    int_gather_mark,
+    int_gather_free
+};
+
+/*
+ * +owners+ must be kept alive by the caller (e.g. with RB_GC_GUARD) for
+ * as long as the stream is in use, it holds the objects whose buffers
+ * were passed to krypt_outstream_write_ref.
+ * Returns NULL if +io+ cannot be written to.
+ */
+binyo_outstream *
+krypt_outstream_new_gather(VALUE io, VALUE owners)
+{
+    krypt_outstream_gather *out;
+
+    if (TYPE(io) != T_FILE && !rb_respond_to(io, sKrypt_ID_WRITE))
+	return NULL;
+
+    out = int_gather_alloc();
+    out->io = io;
+    out->owners = owners;
+    out->vecs = ALLOC_N(krypt_gather_vec, KRYPT_GATHER_MAX_VECS);
+    out->arena_cap = BINYO_IO_BUF_SIZE;
+    out->arena = ALLOC_N(uint8_t, out->arena_cap);
+    return (binyo_outstream *) out;
+}
+
+static krypt_outstream_gather*
+int_gather_alloc(void)
+{
+    krypt_outstream_gather *ret;
+    ret = ALLOC(krypt_outstream_gather);
+    memset(ret, 0, sizeof(krypt_outstream_gather));
+    ret->methods = &krypt_interface_gather;
+    return ret;
+}
+
+static void
+int_gather_reset(krypt_outstream_gather *out)
+{
+    size_t i;
+
+    for (i=0; i < out->num_vecs; i++) {
+	if (out->vecs[i].type == OWNED)
+	    xfree(out->vecs[i].bytes);
+    }
+    out->num_vecs = 0;
+    out->arena_len = 0;
+    out->pending = 0;
+    if (!NIL_P(out->owners))
+	rb_ary_clear(out->owners);
+}
+
+#define int_vec_ptr(out, v)	((v)->type == ARENA ? (out)->arena + (v)->off : (v)->bytes)
+
+#if defined(HAVE_WRITEV)
+static int
+int_gather_get_fd(VALUE io)
+{
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+    return rb_io_descriptor(io);
+#else
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return fptr->fd;
+#endif
+}
+
+struct int_writev_args {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    ssize_t ret;
+    int err;
+};
+
+static void *
+int_writev_nogvl(void *arg)
+{
+    struct int_writev_args *args = (struct int_writev_args *) arg;
+
+    args->ret = writev(args->fd, args->iov, args->iovcnt);
+    args->err = errno;
+    return NULL;
+}
+
+/*
+ * The pieces are xmalloc'ed memory or the cached encodings of the objects
+ * in +owners+, none of it moves while the GVL is released.
+ */
+static ssize_t
+int_gather_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    struct int_writev_args args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_thread_call_without_gvl(int_writev_nogvl, &args, RUBY_UBF_IO, NULL);
+#else
+    int_writev_nogvl(&args);
+#endif
+    errno = args.err;
+    return args.ret;
+}
+
+static int
+int_gather_flush_writev(krypt_outstream_gather *out)
+{
+    struct iovec iov[KRYPT_GATHER_MAX_VECS];
+    struct iovec *cur = iov;
+    size_t i, remaining = out->num_vecs;
+    int fd;
+    ssize_t w;
+
+    rb_io_flush(out->io); /* anything buffered by Ruby must go first */
+    fd = int_gather_get_fd(out->io);
+
+    for (i=0; i < out->num_vecs; i++) {
+	iov[i].iov_base = int_vec_ptr(out, &out->vecs[i]);
+	iov[i].iov_len = out->vecs[i].len;
+    }
+
+    while (remaining > 0) {
+	w = int_gather_writev(fd, cur, (int) remaining);
+	if (w < 0) {
+	    if (errno == EINTR) {
+		/* may raise, callers free the stream in an ensure clause */
+		rb_thread_check_ints();
+		continue;
+	    }
+	    krypt_error_add("Error while writing: %s", strerror(errno));
+	    return KRYPT_ERR;
+	}
+	while (remaining > 0 && (size_t) w >= cur->iov_len) {
+	    w -= cur->iov_len;
+	    cur++;
+	    remaining--;
+	}
+	if (remaining > 0) {
+	    cur->iov_base = (uint8_t *) cur->iov_base + w;
+	    cur->iov_len -= w;
+	}
+    }
+
+    return KRYPT_OK;
+}
+#endif
+
+static int
+int_gather_flush_joined(krypt_outstream_gather *out)
+{
+    VALUE str;
+    uint8_t *p;
+    size_t i;
+
+    str = rb_str_new(NULL, (long) out->pending);
+    p = (uint8_t *) RSTRING_PTR(str);
+    for (i=0; i < out->num_vecs; i++) {
+	krypt_gather_vec *v = &out->vecs[i];
+	memcpy(p, int_vec_ptr(out, v), v->len);
+	p += v->len;
+    }
+    rb_funcall(out->io, sKrypt_ID_WRITE, 1, str);
+    return KRYPT_OK;
+}
+
+/*
+ * Writes everything that was collected so far to the underlying IO.
+ * Must be called before the stream is freed, freeing it discards all
+ * pending data.
+ */
+int
+krypt_outstream_gather_flush(binyo_outstream *outstream)
+{
+    krypt_outstream_gather *out;
+    int ret;
+
+    int_safe_cast(out, outstream);
+
+    if (out->num_vecs == 0) return KRYPT_OK;
+
+#if defined(HAVE_WRITEV)
+    /* non-blocking and scheduled IOs are left to IO#write, which waits properly */
+    if (TYPE(out->io) == T_FILE && !krypt_io_wait_applicable(out->io))
+	ret = int_gather_flush_writev(out);
+    else
+#endif
+	ret = int_gather_flush_joined(out);
+
+    int_gather_reset(out);
+    return ret;
+}
+
+static int
+int_gather_check_flush(krypt_outstream_gather *out, size_t len)
+{
+    if (out->num_vecs == KRYPT_GATHER_MAX_VECS ||
+	out->pending + len > KRYPT_GATHER_FLUSH_SIZE) {
+	return krypt_outstream_gather_flush((binyo_outstream *) out);
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_gather_push(krypt_outstream_gather *out, enum krypt_gather_vec_type type, uint8_t *bytes, size_t off, size_t len)
+{
+    krypt_gather_vec *v;
+
+    v = &out->vecs[out->num_vecs++];
+    v->type = type;
+    v->bytes = bytes;
+    v->off = off;
+    v->len = len;
+    out->pending += len;
+    return KRYPT_OK;
+}
+
+static ssize_t
+int_gather_write(binyo_outstream *outstream, uint8_t *buf, size_t len)
+{
+    krypt_outstream_gather *out;
+    krypt_gather_vec *last;
+
+    int_safe_cast(out, outstream);
+
+    if (len == 0) return 0;
+    if (len > SSIZE_MAX) return BINYO_ERR;
+    if (int_gather_check_flush(out, len) == KRYPT_ERR) return BINYO_ERR;
+
+    if (out->arena_len + len > out->arena_cap) {
+	size_t cap = out->arena_cap;
+	while (cap < out->arena_len + len)
+	    cap *= 2;
+	REALLOC_N(out->arena, uint8_t, cap);
+	out->arena_cap = cap;
+    }
+    memcpy(out->arena + out->arena_len, buf, len);
+
+    /* coalesce with the previous copy if it ends where this one starts */
+    last = out->num_vecs ? &out->vecs[out->num_vecs - 1] : NULL;
+    if (last && last->type == ARENA && last->off + last->len == out->arena_len) {
+	last->len += len;
+	out->pending += len;
+    }
+    else if (int_gather_push(out, ARENA, NULL, out->arena_len, len) == KRYPT_ERR) {
+	return BINYO_ERR;
+    }
+    out->arena_len += len;
+    return (ssize_t) len;
+}
+
+/*
+ * Writes +len+ bytes that remain valid as long as +owner+ is alive. On a
+ * gather stream, larger buffers are referenced instead of copied and
+ * +owner+ is retained until the next flush, other streams simply copy.
+ */
+int
+krypt_outstream_write_ref(binyo_outstream *outstream, uint8_t *bytes, size_t len, VALUE owner)
+{
+    krypt_outstream_gather *out;
+
+    if (outstream->methods->type != KRYPT_OUTSTREAM_TYPE_GATHER || len < KRYPT_GATHER_REF_MIN || NIL_P(owner)) {
+	if (binyo_outstream_write(outstream, bytes, len) == BINYO_ERR) return KRYPT_ERR;
+	return KRYPT_OK;
+    }
+
+    int_safe_cast(out, outstream);
+    if (int_gather_check_flush(out, len) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_gather_push(out, REF, bytes, 0, len) == KRYPT_ERR) return KRYPT_ERR;
+    rb_ary_push(out->owners, owner);
+    return KRYPT_OK;
+}
+
+/*
+ * Writes +len+ bytes allocated with xmalloc and takes ownership of them,
+ * +bytes+ must not be accessed by the caller afterwards.
+ */
+int
+krypt_outstream_write_owned(binyo_outstream *outstream, uint8_t *bytes, size_t len)
+{
+    krypt_outstream_gather *out;
+    int ret = KRYPT_OK;
+
+    if (outstream->methods->type != KRYPT_OUTSTREAM_TYPE_GATHER || len < KRYPT_GATHER_REF_MIN) {
+	if (binyo_outstream_write(outstream, bytes, len) == BINYO_ERR) ret = KRYPT_ERR;
+	xfree(bytes);
+	return ret;
+    }
+
+    int_safe_cast(out, outstream);
+    if (int_gather_check_flush(out, len) == KRYPT_ERR ||
+	int_gather_push(out, OWNED, bytes, 0, len) == KRYPT_ERR) {
+	xfree(bytes);
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static void
+int_gather_mark(binyo_outstream *outstream)
+{
+    krypt_outstream_gather *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    rb_gc_mark(out->io);
+    rb_gc_mark(out->owners);
+}
+
+static void
+int_gather_free(binyo_outstream *outstream)
+{
+    krypt_outstream_gather *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    int_gather_reset(out);
+    xfree(out->vecs);
+    xfree(out->arena);
+}
+
+void
+Init_krypt_io_gather(void)
+{
+    sKrypt_ID_WRITE = rb_intern("write");
+}
+
@@ -0,0 +1,217 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+/*
+ * Writes a single PEM element: the header line is emitted on the first
+ * write, the data is Base64 encoded into lines of 64 characters as it
+ * arrives and krypt_outstream_pem_finish closes the element with the
+ * footer line. Memory usage does not depend on the size of the payload.
+ */
+
+typedef struct krypt_outstream_pem_st {
+    binyo_outstream_interface *methods;
+    binyo_outstream *inner;
+    krypt_codec *codec;
+    char *label;
+    size_t label_len;
+    uint8_t *buf;
+    size_t buf_size;
+    int started;
+    int finished;
+} krypt_outstream_pem;
+
+#define int_safe_cast(out, in)	binyo_safe_cast_outstream((out), (in), KRYPT_OUTSTREAM_TYPE_PEM, krypt_outstream_pem)
+
+static const char krypt_pem_begin[] = "-----BEGIN ";
+static const char krypt_pem_end[] = "-----END ";
+static const char krypt_pem_dashes[] = "-----\n";
+
+static ssize_t int_pem_write(binyo_outstream *out, uint8_t *buf, size_t len);
+static void int_pem_mark(binyo_outstream *out);
+static void int_pem_free(binyo_outstream *out);
+
+static binyo_outstream_interface krypt_interface_pem_out = {
+    KRYPT_OUTSTREAM_TYPE_PEM,
+    int_pem_write,
+    NULL,
+    int_pem_mark,
+    int_pem_free
+};
+
+binyo_outstream *
+krypt_outstream_new_pem(binyo_outstream *inner, const char *label, size_t label_len)
+{
+    krypt_outstream_pem *out;
+
+    out = ALLOC(krypt_outstream_pem);
+    memset(out, 0, sizeof(krypt_outstream_pem));
+    out->methods = &krypt_interface_pem_out;
+    out->inner = inner;
+    out->codec = krypt_base64_encoder_new_pem();
+    out->label = ALLOC_N(char, label_len);
+    memcpy(out->label, label, label_len);
+    out->label_len = label_len;
+    return (binyo_outstream *) out;
+}
+
+static int
+int_pem_write_line(krypt_outstream_pem *out, const char *prefix, size_t prefix_len)
+{
+    size_t len = prefix_len + out->label_len + sizeof(krypt_pem_dashes) - 1;
+    uint8_t *line;
+    int ret;
+
+    line = ALLOC_N(uint8_t, len);
+    memcpy(line, prefix, prefix_len);
+    memcpy(line + prefix_len, out->label, out->label_len);
+    memcpy(line + prefix_len + out->label_len, krypt_pem_dashes, sizeof(krypt_pem_dashes) - 1);
+    ret = binyo_outstream_write(out->inner, line, len) == BINYO_ERR ? KRYPT_ERR : KRYPT_OK;
+    xfree(line);
+    return ret;
+}
+
+static int
+int_pem_start(krypt_outstream_pem *out)
+{
+    if (out->started) return KRYPT_OK;
+    out->started = 1;
+    return int_pem_write_line(out, krypt_pem_begin, sizeof(krypt_pem_begin) - 1);
+}
+
+static void
+int_pem_ensure_buf(krypt_outstream_pem *out, size_t needed)
+{
+    if (out->buf_size >= needed) return;
+    if (out->buf)
+	REALLOC_N(out->buf, uint8_t, needed);
+    else
+	out->buf = ALLOC_N(uint8_t, needed);
+    out->buf_size = needed;
+}
+
+static ssize_t
+int_pem_write(binyo_outstream *outstream, uint8_t *buf, size_t len)
+{
+    krypt_outstream_pem *out;
+    krypt_codec *codec;
+    size_t off = 0, chunk;
+    ssize_t w;
+
+    int_safe_cast(out, outstream);
+    codec = out->codec;
+
+    if (out->finished) {
+	krypt_error_add("PEM element has already been finished");
+	return BINYO_ERR;
+    }
+    if (len > SSIZE_MAX) {
+	krypt_error_add("Buffer too large: %ld", len);
+	return BINYO_ERR;
+    }
+    if (int_pem_start(out) == KRYPT_ERR) return BINYO_ERR;
+
+    int_pem_ensure_buf(out, codec->methods->max(codec, BINYO_IO_BUF_SIZE));
+    while (off < len) {
+	chunk = len - off < BINYO_IO_BUF_SIZE ? len - off : BINYO_IO_BUF_SIZE;
+	w = codec->methods->update(codec, out->buf, buf + off, chunk);
+	if (w == KRYPT_ERR) return BINYO_ERR;
+	if (w > 0 && binyo_outstream_write(out->inner, out->buf, (size_t) w) == BINYO_ERR)
+	    return BINYO_ERR;
+	off += chunk;
+    }
+    return (ssize_t) len;
+}
+
+/*
+ * Writes the remaining Base64 output and the footer line. An element
+ * that nothing was written to consists of header and footer only.
+ */
+int
+krypt_outstream_pem_finish(binyo_outstream *outstream)
+{
+    krypt_outstream_pem *out;
+    krypt_codec *codec;
+    ssize_t w;
+
+    int_safe_cast(out, outstream);
+    codec = out->codec;
+    if (out->finished) return KRYPT_OK;
+
+    if (int_pem_start(out) == KRYPT_ERR) return KRYPT_ERR;
+    out->finished = 1;
+    int_pem_ensure_buf(out, codec->methods->max(codec, 0));
+    w = codec->methods->final(codec, out->buf);
+    if (w == KRYPT_ERR) return KRYPT_ERR;
+    if (w > 0 && binyo_outstream_write(out->inner, out->buf, (size_t) w) == BINYO_ERR)
+	return KRYPT_ERR;
+    return int_pem_write_line(out, krypt_pem_end, sizeof(krypt_pem_end) - 1);
+}
+
+static void
+int_pem_mark(binyo_outstream *outstream)
+{
+    krypt_outstream_pem *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    binyo_outstream_mark(out->inner);
+}
+
+static void
+int_pem_free_own(krypt_outstream_pem *out)
+{
+    krypt_codec_free(out->codec);
+    xfree(out->label);
+    if (out->buf)
+	xfree(out->buf);
+}
+
+static void
+int_pem_free(binyo_outstream *outstream)
+{
+    krypt_outstream_pem *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    binyo_outstream_free(out->inner);
+    int_pem_free_own(out);
+}
+
+/* Frees the stream, but leaves the inner stream alone */
+void
+krypt_outstream_pem_free_wrapper(binyo_outstream *outstream)
+{
+    krypt_outstream_pem *out;
+
+    if (!outstream) return;
+    int_safe_cast(out, outstream);
+    int_pem_free_own(out);
+    xfree(out);
+}
@@ -28,6 +28,10 @@
 
 #include "krypt-core.h"
 
+#if defined(KRYPT_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 VALUE mKryptHelper;
 VALUE mKryptHelperString;
 
@@ -245,49 +249,221 @@ krypt_helper_string_buffer(VALUE self, VALUE size)
     return rb_str_buf_new(NUM2LONG(size));
 }
 
-static inline long
-int_check_and_get_len(VALUE s1, VALUE s2)
+/*
+ * XOR kernels, chosen according to the CPU features when the extension
+ * is loaded. Source and destination may be identical, but must not
+ * overlap otherwise.
+ */
+typedef void (*krypt_xor_fn)(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len);
+
+static krypt_xor_fn int_xor;
+
+static void
+int_xor_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len)
 {
-    long len = RSTRING_LEN(s1);
-    if (RSTRING_LEN(s2) != len) {
-	rb_raise(eKryptError, "String sizes don't match");
+    size_t wa, wb;
+
+    /* a machine word at a time, memcpy takes care of alignment */
+    while (len >= sizeof(size_t)) {
+	memcpy(&wa, a, sizeof(size_t));
+	memcpy(&wb, b, sizeof(size_t));
+	wa ^= wb;
+	memcpy(dst, &wa, sizeof(size_t));
+	dst += sizeof(size_t);
+	a += sizeof(size_t);
+	b += sizeof(size_t);
+	len -= sizeof(size_t);
     }
-    return len;
+    while (len-- > 0)
+	*dst++ = *a++ ^ *b++;
 }
 
-static inline void
-int_xor(char *source1, char *source2, char *target, long len)
+#if defined(KRYPT_X86_SIMD)
+KRYPT_TARGET("ssse3") static void
+int_xor_ssse3(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len)
 {
-    int i;
-    for (i = 0; i < len; i++) {
-	target[i] = source1[i] ^ source2[i];
+    __m128i va, vb;
+
+    while (len >= 16) {
+	va = _mm_loadu_si128((const __m128i *) a);
+	vb = _mm_loadu_si128((const __m128i *) b);
+	_mm_storeu_si128((__m128i *) dst, _mm_xor_si128(va, vb));
+	dst += 16;
+	a += 16;
+	b += 16;
+	len -= 16;
     }
+    int_xor_scalar(dst, a, b, len);
 }
 
+KRYPT_TARGET("avx2") static void
+int_xor_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len)
+{
+    __m256i va0, vb0, va1, vb1;
 
-static VALUE
-krypt_helper_string_xor(VALUE self, VALUE s1, VALUE s2)
+    while (len >= 64) {
+	va0 = _mm256_loadu_si256((const __m256i *) a);
+	vb0 = _mm256_loadu_si256((const __m256i *) b);
+	va1 = _mm256_loadu_si256((const __m256i *) (a + 32));
+	vb1 = _mm256_loadu_si256((const __m256i *) (b + 32));
+	_mm256_storeu_si256((__m256i *) dst, _mm256_xor_si256(va0, vb0));
+	_mm256_storeu_si256((__m256i *) (dst + 32), _mm256_xor_si256(va1, vb1));
+	dst += 64;
+	a += 64;
+	b += 64;
+	len -= 64;
+    }
+    int_xor_ssse3(dst, a, b, len);
+}
+#endif /* KRYPT_X86_SIMD */
+
+/* Sets +dst+ to the XOR of +a+ and +b+, all of them +len+ bytes long */
+void
+krypt_xor(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len)
 {
-    long len = int_check_and_get_len(s1, s2);
-    char *result = ALLOCA_N(char, len);
+    int_xor(dst, a, b, len);
+}
 
-    int_xor(RSTRING_PTR(s1), RSTRING_PTR(s2), result, len);
-    return rb_str_new(result, len);
+/* Checks that +argc+ >= +min+ Strings of equal length were given */
+static long
+int_xor_check_args(int argc, VALUE *argv, int min)
+{
+    long len;
+    int i;
+
+    if (argc < min)
+	rb_raise(rb_eArgError, "wrong number of arguments (%d for %d+)", argc, min);
+    for (i=0; i < argc; i++)
+	StringValue(argv[i]);
+    len = RSTRING_LEN(argv[0]);
+    for (i=1; i < argc; i++) {
+	if (RSTRING_LEN(argv[i]) != len)
+	    rb_raise(eKryptError, "String sizes don't match");
+    }
+    return len;
 }
 
-static VALUE
-krypt_helper_string_xor_bang(VALUE self, VALUE s1, VALUE s2)
+static uint8_t *
+int_xor_target(VALUE str)
 {
-    long len = int_check_and_get_len(s1, s2);
 #ifndef HAVE_RB_STR_PTR_READONLY
-    char *result = RSTRING_PTR(s1);
+    rb_str_modify(str);
+    return (uint8_t *) RSTRING_PTR(str);
 #else
 /* Rubinius: We use RUBY_READ_ONLY_STRING, so we can't write to the
    RSTRING_PTR directly */
-   char *result = rb_str_ptr(s1);
+    return (uint8_t *) rb_str_ptr(str);
+#endif
+}
+
+/*
+ * The first step reads argv[0] and argv[1] at the position it writes,
+ * so only these may be the target itself. Any other overlap would read
+ * bytes that have already been overwritten.
+ */
+static int
+int_xor_aliased(const uint8_t *target, int argc, VALUE *argv, long len)
+{
+    const uint8_t *p;
+    int i;
+
+    for (i=0; i < argc; i++) {
+	p = (const uint8_t *) RSTRING_PTR(argv[i]);
+	if (i < 2 && p == target)
+	    continue;
+	if (p < target + len && target < p + len)
+	    return 1;
+    }
+    return 0;
+}
+
+/* XORs all of +argv+ into +target+, which may also be one of the operands */
+static void
+int_xor_all(uint8_t *target, int argc, VALUE *argv, long len)
+{
+    uint8_t *acc = target;
+    int i;
+
+    if (len > 0 && int_xor_aliased(target, argc, argv, len))
+	acc = ALLOC_N(uint8_t, len);
+    int_xor(acc, (uint8_t *) RSTRING_PTR(argv[0]), (uint8_t *) RSTRING_PTR(argv[1]), len);
+    for (i=2; i < argc; i++)
+	int_xor(acc, acc, (uint8_t *) RSTRING_PTR(argv[i]), len);
+    if (acc != target) {
+	memcpy(target, acc, len);
+	xfree(acc);
+    }
+}
+
+/*
+ * call-seq:
+ *    Krypt::Helper::String.xor(s1, s2, ...) -> String
+ *
+ * Returns a new String containing the XOR of all arguments, which must
+ * be Strings of equal length.
+ */
+static VALUE
+krypt_helper_string_xor(int argc, VALUE *argv, VALUE self)
+{
+    long len = int_xor_check_args(argc, argv, 2);
+    VALUE ret;
+
+    ret = rb_str_new(0, len);
+    int_xor_all((uint8_t *) RSTRING_PTR(ret), argc, argv, len);
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    Krypt::Helper::String.xor!(s1, s2, ...) -> s1
+ *
+ * Like Krypt::Helper::String.xor, but stores the result in +s1+.
+ */
+static VALUE
+krypt_helper_string_xor_bang(int argc, VALUE *argv, VALUE self)
+{
+    long len = int_xor_check_args(argc, argv, 2);
+
+    int_xor_all(int_xor_target(argv[0]), argc, argv, len);
+    return argv[0];
+}
+
+/*
+ * call-seq:
+ *    Krypt::Helper::String.xor_into(buffer, s1, s2, ...) -> buffer
+ *
+ * Stores the XOR of +s1+, +s2+, ... in +buffer+, which is resized to
+ * their length, e.g. to reuse one buffer for the keystream blocks of a
+ * mode of operation. +buffer+ may be any of the operands.
+ */
+static VALUE
+krypt_helper_string_xor_into(int argc, VALUE *argv, VALUE self)
+{
+    VALUE buffer;
+    long len;
+
+    if (argc < 1)
+	rb_raise(rb_eArgError, "wrong number of arguments (0 for 3+)");
+    len = int_xor_check_args(argc - 1, argv + 1, 2);
+    buffer = argv[0];
+    StringValue(buffer);
+    rb_str_modify(buffer);
+    if (RSTRING_LEN(buffer) != len)
+	rb_str_resize(buffer, len);
+    int_xor_all(int_xor_target(buffer), argc - 1, argv + 1, len);
+    return buffer;
+}
+
+static void
+int_select_kernels(void)
+{
+    int_xor = int_xor_scalar;
+#if defined(KRYPT_X86_SIMD)
+    if (krypt_cpu_has(KRYPT_CPU_AVX2))
+	int_xor = int_xor_avx2;
+    else if (krypt_cpu_has(KRYPT_CPU_SSSE3))
+	int_xor = int_xor_ssse3;
 #endif
-    int_xor(result, RSTRING_PTR(s2), result, len);
-    return s1;
 }
 
 void Init_krypt_helper(void)
@@ -307,7 +483,10 @@ void Init_krypt_helper(void)
     mKryptHelperString = rb_define_module_under(mKryptHelper, "String");
 
     rb_define_module_function(mKryptHelperString, "buffer", krypt_helper_string_buffer, 1);
-    rb_define_module_function(mKryptHelperString, "xor", krypt_helper_string_xor, 2);
-    rb_define_module_function(mKryptHelperString, "xor!", krypt_helper_string_xor_bang, 2);
+    rb_define_module_function(mKryptHelperString, "xor", krypt_helper_string_xor, -1);
+    rb_define_module_function(mKryptHelperString, "xor!", krypt_helper_string_xor_bang, -1);
+    rb_define_module_function(mKryptHelperString, "xor_into", krypt_helper_string_xor_into, -1);
+
+    int_select_kernels();
 }
 
@@ -37,12 +37,26 @@ do {											\
     if (!rb_block_given_p())								\
     	return rb_funcall((enumerable), rb_intern("enum_for"), 1, ID2SYM((id)));	\
 } while (0) 
+#define KRYPT_RETURN_ENUMERATOR_ARGS(obj, id, argc, argv)				\
+do {											\
+    if (!rb_block_given_p()) {								\
+	VALUE krypt_enum_args = rb_ary_new4((argc), (argv));				\
+	rb_ary_unshift(krypt_enum_args, ID2SYM((id)));					\
+    	return rb_funcall2((obj), rb_intern("enum_for"),				\
+			   RARRAY_LENINT(krypt_enum_args), RARRAY_PTR(krypt_enum_args));\
+    }											\
+} while (0)
 #else
 #define KRYPT_RETURN_ENUMERATOR(enumerable, id)						\
 do {											\
     if(!rb_block_given_p())								\
     	RETURN_ENUMERATOR((enumerable), 0, 0);						\
 } while (0)
+#define KRYPT_RETURN_ENUMERATOR_ARGS(obj, id, argc, argv)				\
+do {											\
+    if(!rb_block_given_p())								\
+    	RETURN_ENUMERATOR((obj), (argc), (argv));					\
+} while (0)
 #endif
 
 #ifndef HAVE_RB_STR_ENCODE
@@ -60,6 +74,8 @@ extern VALUE mKryptHelperString;
 
 void Init_krypt_helper(void);
 
+void krypt_xor(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t len);
+
 int krypt_asn1_encode_bignum(VALUE bignum, uint8_t **out, size_t *len);
 int krypt_asn1_decode_bignum(uint8_t *bytes, size_t len, VALUE *out);
 
@@ -27,9 +27,12 @@
  */
 
 #include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+#include "krypt_asn1_template-internal.h"
 
 VALUE mKryptPEM;
 VALUE eKryptPEMError;
+VALUE cKryptPEMWriter;
 
 static int
 int_consume_stream(binyo_instream *in, VALUE *vout)
@@ -78,6 +81,11 @@ int_consume_stream(binyo_instream *in, VALUE *vout)
  * the current element (e.g. 'CERTIFICATE') and +i+ the index of the current
  * element starting with 0. 
  *
+ * Anything outside of the BEGIN and END lines is ignored. If +data+ ends
+ * within an element, i.e. before its matching END line, a PEMError is
+ * raised; elements that were complete before have already been passed to
+ * +block+ at that point.
+ *
  * === Example: Decoding a simple certificate file
  *
  *   File.open("certificate.pem", "rb") do |f|
@@ -133,6 +141,633 @@ error:
     return Qnil;
 }
 
+typedef struct krypt_pem_each_ctx_st {
+    binyo_instream *in;
+    VALUE only;
+} krypt_pem_each_ctx;
+
+static ID sKrypt_ID_ONLY;
+
+static int
+int_pem_label_allowed(const char *name, size_t len, void *arg)
+{
+    VALUE only = (VALUE) arg;
+    VALUE label;
+    long i;
+
+    for (i=0; i < RARRAY_LEN(only); i++) {
+	label = rb_ary_entry(only, i);
+	if ((size_t) RSTRING_LEN(label) == len && memcmp(RSTRING_PTR(label), name, len) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+static VALUE
+int_pem_each_labels(VALUE opts)
+{
+    VALUE only, ret;
+    long i;
+
+    if (NIL_P(opts))
+	return Qnil;
+    Check_Type(opts, T_HASH);
+    only = rb_hash_aref(opts, ID2SYM(sKrypt_ID_ONLY));
+    if (NIL_P(only))
+	return Qnil;
+
+    ret = rb_ary_new();
+    only = rb_Array(only);
+    for (i=0; i < RARRAY_LEN(only); i++) {
+	VALUE label = rb_ary_entry(only, i);
+	rb_ary_push(ret, rb_String(label));
+    }
+    return ret;
+}
+
+static VALUE
+int_pem_each_yield(VALUE arg)
+{
+    krypt_pem_each_ctx *ctx = (krypt_pem_each_ctx *) arg;
+    VALUE der, vname;
+    uint8_t *name;
+    size_t len;
+    size_t i = 0;
+    int result;
+
+    while ((result = int_consume_stream(ctx->in, &der)) == KRYPT_OK) {
+	if (NIL_P(der))
+	    break;
+	if (krypt_pem_get_last_name(ctx->in, &name, &len) == BINYO_ERR)
+	    krypt_error_raise(eKryptPEMError, "Error while decoding PEM data");
+	vname = rb_str_new((const char *) name, len);
+	xfree(name);
+	krypt_pem_continue_stream(ctx->in);
+	/* nothing refers to der after yielding, it can be collected as soon
+	 * as the block is done with it */
+	rb_yield_values(3, der, vname, SIZET2NUM(i++));
+    }
+    if (result == KRYPT_ERR)
+	krypt_error_raise(eKryptPEMError, "Error while decoding PEM data");
+    return Qnil;
+}
+
+static VALUE
+int_pem_each_ensure(VALUE arg)
+{
+    krypt_pem_each_ctx *ctx = (krypt_pem_each_ctx *) arg;
+    binyo_instream_free(ctx->in);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *      Krypt::PEM.each(data, [only: labels]) { |der, name, i| block } -> nil
+ *      Krypt::PEM.each(data, [only: labels]) -> Enumerator
+ *
+ * +data+ may be anything that is accepted by Krypt::PEM.decode.
+ *
+ * Decodes the elements of +data+ one at a time and yields them along with
+ * their label (e.g. 'CERTIFICATE') and their index, starting with 0.
+ * Unlike Krypt::PEM.decode, the elements are not collected, so memory
+ * usage does not grow with the number of elements.
+ *
+ * If +only+ is given, a label or an Array of labels, elements with other
+ * labels are skipped without decoding their contents. The index counts
+ * the elements that are yielded.
+ *
+ * Returns an Enumerator if no block is given. Truncated input raises a
+ * PEMError once the incomplete element is reached, as with
+ * Krypt::PEM.decode.
+ *
+ * === Example: Loading only the certificates of a mixed bundle
+ *
+ *   File.open("bundle.pem", "rb") do |f|
+ *     Krypt::PEM.each(f, only: "CERTIFICATE") do |der, name, i|
+ *       store.add(der)
+ *     end
+ *   end
+ */
+static VALUE
+krypt_pem_each(int argc, VALUE *argv, VALUE self)
+{
+    VALUE pem, opts = Qnil;
+    krypt_pem_each_ctx ctx;
+
+    rb_scan_args(argc, argv, "11", &pem, &opts);
+    KRYPT_RETURN_ENUMERATOR_ARGS(self, sKrypt_ID_EACH, argc, argv);
+
+    ctx.only = int_pem_each_labels(opts);
+    ctx.in = krypt_instream_new_pem(krypt_instream_new_value_pem(pem));
+    if (!NIL_P(ctx.only))
+	krypt_pem_set_filter(ctx.in, int_pem_label_allowed, (void *) ctx.only);
+
+    rb_ensure(int_pem_each_yield, (VALUE) &ctx, int_pem_each_ensure, (VALUE) &ctx);
+    RB_GC_GUARD(ctx.only);
+    return Qnil;
+}
+
+/*
+ * Bulk decoding: the boundaries of all elements are determined in a
+ * single pass over the complete input, then the bodies are decoded (and
+ * optionally checked) on native threads with the GVL released. Each
+ * element is decoded into its own preallocated slice of a shared arena.
+ */
+
+/* keep the thread start-up cost in proportion to the work */
+#define KRYPT_PEM_BULK_BYTES_PER_THREAD	(64 * 1024)
+
+typedef struct krypt_pem_entry_st {
+    const uint8_t *name;
+    size_t name_len;
+    const uint8_t *body;
+    size_t body_len;
+    uint8_t *der;
+    size_t der_len;
+    int invalid;
+} krypt_pem_entry;
+
+typedef struct krypt_pem_bulk_st {
+    VALUE pem;
+    VALUE only;
+    const uint8_t *data;
+    size_t len;
+    uint8_t *owned;
+    krypt_pem_entry *entries;
+    size_t num;
+    size_t cap;
+    uint8_t *arena;
+    int nthreads;
+    int validate;
+    VALUE names;
+} krypt_pem_bulk;
+
+static ID sKrypt_ID_THREADS;
+static ID sKrypt_ID_VALIDATE;
+
+/* Returns the line at +*off+ without its terminator and advances +*off+ */
+static int
+int_pem_bulk_line(krypt_pem_bulk *bulk, size_t *off, const uint8_t **line, size_t *linelen)
+{
+    const uint8_t *p, *nl;
+
+    if (*off >= bulk->len) return 0;
+    p = bulk->data + *off;
+    nl = memchr(p, '\n', bulk->len - *off);
+    *linelen = nl ? (size_t) (nl - p) : bulk->len - *off;
+    *off += nl ? *linelen + 1 : *linelen;
+    if (*linelen > 0 && p[*linelen - 1] == '\r')
+	(*linelen)--;
+    *line = p;
+    return 1;
+}
+
+/* Returns the offset of the next line beginning with '-' or the end of the data */
+static size_t
+int_pem_bulk_body_end(krypt_pem_bulk *bulk, size_t off)
+{
+    const uint8_t *p, *nl, *end;
+
+    if (off >= bulk->len || bulk->data[off] == '-') return off;
+    p = bulk->data + off;
+    end = bulk->data + bulk->len;
+    while ((nl = memchr(p, '\n', end - p)) != NULL && nl + 1 < end && nl[1] != '-')
+	p = nl + 1;
+    return nl && nl + 1 < end ? (size_t) (nl + 1 - bulk->data) : bulk->len;
+}
+
+static void
+int_pem_bulk_push(krypt_pem_bulk *bulk, const uint8_t *name, size_t name_len, const uint8_t *body, size_t body_len)
+{
+    krypt_pem_entry *entry;
+
+    if (bulk->num == bulk->cap) {
+	bulk->cap = bulk->cap ? bulk->cap * 2 : 64;
+	if (bulk->entries)
+	    REALLOC_N(bulk->entries, krypt_pem_entry, bulk->cap);
+	else
+	    bulk->entries = ALLOC_N(krypt_pem_entry, bulk->cap);
+    }
+    entry = &bulk->entries[bulk->num++];
+    memset(entry, 0, sizeof(krypt_pem_entry));
+    entry->name = name;
+    entry->name_len = name_len;
+    entry->body = body;
+    entry->body_len = body_len;
+}
+
+/*
+ * Locates the elements with the same rules the PEM stream applies: lines
+ * outside of elements that do not form a header are ignored, a body ends
+ * with the first line beginning with '-' and the footer has to repeat the
+ * label of the header.
+ */
+static int
+int_pem_bulk_scan(krypt_pem_bulk *bulk)
+{
+    const uint8_t *line, *name, *body;
+    size_t off = 0, linelen, name_len, body_len;
+    int found;
+
+    while (int_pem_bulk_line(bulk, &off, &line, &linelen)) {
+	if (linelen < 16 || memcmp(line, "-----BEGIN ", 11) != 0 || memcmp(line + linelen - 5, "-----", 5) != 0)
+	    continue;
+	name = line + 11;
+	name_len = linelen - 16;
+	body = bulk->data + off;
+	body_len = int_pem_bulk_body_end(bulk, off) - off;
+	off += body_len;
+
+	found = 0;
+	while (!found && int_pem_bulk_line(bulk, &off, &line, &linelen)) {
+	    found = linelen == 14 + name_len && memcmp(line, "-----END ", 9) == 0 &&
+		    memcmp(line + 9, name, name_len) == 0 && memcmp(line + linelen - 5, "-----", 5) == 0;
+	}
+	if (!found) {
+	    krypt_error_add("Could not find matching PEM footer");
+	    return KRYPT_ERR;
+	}
+	if (!NIL_P(bulk->only) && !int_pem_label_allowed((const char *) name, name_len, (void *) bulk->only))
+	    continue;
+	int_pem_bulk_push(bulk, name, name_len, body, body_len);
+    }
+    return KRYPT_OK;
+}
+
+static void
+int_pem_bulk_decode(size_t i, void *arg)
+{
+    krypt_pem_bulk *bulk = (krypt_pem_bulk *) arg;
+    krypt_pem_entry *entry = &bulk->entries[i];
+
+    if (krypt_base64_decode_into(entry->der, krypt_base64_decode_max(entry->body_len),
+			         entry->body, entry->body_len, &entry->der_len) == KRYPT_ERR)
+	entry->invalid = 1;
+    else if (bulk->validate && krypt_asn1_check_der(entry->der, entry->der_len) == KRYPT_ERR)
+	entry->invalid = 1;
+}
+
+static VALUE
+int_pem_bulk_run(VALUE arg)
+{
+    krypt_pem_bulk *bulk = (krypt_pem_bulk *) arg;
+    binyo_instream *in;
+    krypt_pem_entry *entry;
+    size_t i, total = 0, max;
+    VALUE ary;
+
+    if ((in = krypt_instream_new_value(bulk->pem))) {
+	if (krypt_instream_read_all(in, &bulk->owned, &bulk->len) == KRYPT_ERR)
+	    krypt_error_raise(eKryptPEMError, "Error while reading PEM data");
+	bulk->data = bulk->owned;
+    }
+    else {
+	bulk->pem = krypt_to_pem_if_possible(bulk->pem);
+	StringValue(bulk->pem);
+	/* a frozen copy can not change while the GVL is released */
+	bulk->pem = rb_str_new_frozen(bulk->pem);
+	bulk->data = (const uint8_t *) RSTRING_PTR(bulk->pem);
+	bulk->len = RSTRING_LEN(bulk->pem);
+    }
+
+    if (int_pem_bulk_scan(bulk) == KRYPT_ERR)
+	krypt_error_raise(eKryptPEMError, "Error while decoding PEM data");
+
+    for (i=0; i < bulk->num; i++) {
+	max = krypt_base64_decode_max(bulk->entries[i].body_len);
+	if (total > SIZE_MAX - max)
+	    rb_raise(eKryptPEMError, "PEM data too large");
+	total += max;
+    }
+    bulk->arena = ALLOC_N(uint8_t, total ? total : 1);
+    for (i=0, total=0; i < bulk->num; i++) {
+	bulk->entries[i].der = bulk->arena + total;
+	total += krypt_base64_decode_max(bulk->entries[i].body_len);
+    }
+
+    if ((size_t) bulk->nthreads > total / KRYPT_PEM_BULK_BYTES_PER_THREAD + 1)
+	bulk->nthreads = (int) (total / KRYPT_PEM_BULK_BYTES_PER_THREAD + 1);
+    krypt_parallel_for(bulk->num, bulk->nthreads, int_pem_bulk_decode, bulk);
+
+    ary = rb_ary_new2(bulk->num);
+    for (i=0; i < bulk->num; i++) {
+	entry = &bulk->entries[i];
+	if (entry->invalid)
+	    rb_raise(eKryptPEMError, "PEM element %ld is not a valid DER encoding", (long) i);
+	rb_ary_push(ary, rb_str_new((const char *) entry->der, entry->der_len));
+	if (!NIL_P(bulk->names))
+	    rb_ary_push(bulk->names, rb_str_new((const char *) entry->name, entry->name_len));
+    }
+    return ary;
+}
+
+static VALUE
+int_pem_bulk_ensure(VALUE arg)
+{
+    krypt_pem_bulk *bulk = (krypt_pem_bulk *) arg;
+
+    if (bulk->owned)
+	xfree(bulk->owned);
+    if (bulk->entries)
+	xfree(bulk->entries);
+    if (bulk->arena)
+	xfree(bulk->arena);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *      Krypt::PEM.decode_bulk(data, [threads: n, validate: bool, only: labels]) -> Array
+ *      Krypt::PEM.decode_bulk(data, [opts]) { |der, name, i| block } -> Array
+ *
+ * +data+ may be anything that is accepted by Krypt::PEM.decode, and the
+ * result is the same: the DER encodings of the elements in input order,
+ * each passed to +block+ along with its label and index if one is given.
+ *
+ * Intended for large bundles, e.g. trust stores with many thousand
+ * certificates: +data+ is read completely, the elements are located in a
+ * single pass and then decoded concurrently on up to +threads+ native
+ * threads (by default one per processor), without holding the GVL.
+ *
+ * If +validate+ is true, every element must be a single, well-formed DER
+ * value, otherwise a PEMError is raised. +only+ restricts the elements to
+ * the given label(s), as with Krypt::PEM.each.
+ *
+ * === Example: Loading a trust store
+ *
+ *   ders = Krypt::PEM.decode_bulk(File.binread("ca-bundle.pem"),
+ *                                 only: "CERTIFICATE", validate: true)
+ */
+static VALUE
+krypt_pem_decode_bulk(int argc, VALUE *argv, VALUE self)
+{
+    VALUE pem, opts = Qnil, threads, ary;
+    krypt_pem_bulk bulk;
+    long i;
+
+    rb_scan_args(argc, argv, "11", &pem, &opts);
+
+    memset(&bulk, 0, sizeof(krypt_pem_bulk));
+    bulk.pem = pem;
+    bulk.only = int_pem_each_labels(opts);
+    bulk.names = rb_block_given_p() ? rb_ary_new() : Qnil;
+    bulk.nthreads = krypt_thread_count_default();
+    if (!NIL_P(opts)) {
+	threads = rb_hash_aref(opts, ID2SYM(sKrypt_ID_THREADS));
+	if (!NIL_P(threads))
+	    bulk.nthreads = NUM2INT(threads);
+	if (bulk.nthreads < 1)
+	    rb_raise(rb_eArgError, "threads must be positive");
+	bulk.validate = RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_VALIDATE)));
+    }
+
+    ary = rb_ensure(int_pem_bulk_run, (VALUE) &bulk, int_pem_bulk_ensure, (VALUE) &bulk);
+    if (!NIL_P(bulk.names)) {
+	for (i=0; i < RARRAY_LEN(ary); i++)
+	    rb_yield_values(3, rb_ary_entry(ary, i), rb_ary_entry(bulk.names, i), LONG2NUM(i));
+    }
+    RB_GC_GUARD(bulk.pem);
+    RB_GC_GUARD(bulk.only);
+    RB_GC_GUARD(bulk.names);
+    return ary;
+}
+
+/*
+ * Writes the DER encoding of +obj+ to +out+. ASN1Data and template values
+ * are encoded straight to the stream, reusing their cached encoding if
+ * they have one. Any other object is converted with +to_der+ if it
+ * responds to it and is treated as a String otherwise.
+ */
+static int
+int_pem_write_value(binyo_outstream *out, VALUE obj)
+{
+    if (rb_obj_is_kind_of(obj, cKryptASN1Data))
+	return krypt_asn1_data_encode(out, obj);
+    if (rb_obj_is_kind_of(obj, mKryptASN1Template))
+	return krypt_asn1_template_encode_to(out, obj);
+
+    obj = krypt_to_der_if_possible(obj);
+    StringValue(obj);
+    if (binyo_outstream_write(out, (uint8_t *) RSTRING_PTR(obj), RSTRING_LEN(obj)) == BINYO_ERR)
+	return KRYPT_ERR;
+    RB_GC_GUARD(obj);
+    return KRYPT_OK;
+}
+
+/*
+ * Labels are written verbatim into the header and footer lines, so they
+ * must neither break the line nor run into the dashes that delimit it.
+ */
+static void
+int_pem_check_label(VALUE label)
+{
+    const char *p = RSTRING_PTR(label);
+    long i, len = RSTRING_LEN(label), dashes = 0;
+
+    for (i = 0; i < len; i++) {
+	if (p[i] == '\n' || p[i] == '\r')
+	    rb_raise(rb_eArgError, "PEM label must not contain line breaks");
+	dashes = p[i] == '-' ? dashes + 1 : 0;
+	if (dashes == 5)
+	    rb_raise(rb_eArgError, "PEM label must not contain '-----'");
+    }
+    if (len > 0 && (p[0] == '-' || p[len - 1] == '-'))
+	rb_raise(rb_eArgError, "PEM label must not begin or end with '-'");
+}
+
+/*
+ *  call-seq:
+ *      Krypt::PEM.encode(data, label) -> String
+ *
+ * Returns the PEM encoding of +data+, using +label+ (e.g. 'CERTIFICATE')
+ * for the header and footer lines. The Base64 body is broken into lines
+ * of 64 characters. An ArgumentError is raised if +label+ contains a line
+ * break or '-----', or if it begins or ends with '-'.
+ *
+ * +data+ may be a DER-encoded String, an ASN1Data or an ASN.1 template
+ * instance, or any object responding to +to_der+. ASN1Data and template
+ * values are encoded without creating their DER String first.
+ *
+ * === Example
+ *
+ *   pem = Krypt::PEM.encode(cert, "CERTIFICATE")
+ */
+static VALUE
+krypt_pem_encode(VALUE self, VALUE data, VALUE label)
+{
+    binyo_outstream *bytes, *out;
+    uint8_t *str;
+    size_t len;
+    int result;
+    VALUE ret;
+
+    StringValue(label);
+    int_pem_check_label(label);
+    bytes = binyo_outstream_new_bytes_size(BINYO_IO_BUF_SIZE);
+    out = krypt_outstream_new_pem(bytes, RSTRING_PTR(label), RSTRING_LEN(label));
+
+    result = int_pem_write_value(out, data);
+    if (result == KRYPT_OK)
+	result = krypt_outstream_pem_finish(out);
+    krypt_outstream_pem_free_wrapper(out);
+    if (result == KRYPT_ERR) {
+	binyo_outstream_free(bytes);
+	krypt_error_raise(eKryptPEMError, "Error while encoding PEM data");
+    }
+
+    len = binyo_outstream_bytes_get_bytes_free(bytes, &str);
+    ret = rb_str_new((const char *) str, len);
+    xfree(str);
+    return ret;
+}
+
+typedef struct krypt_pem_writer_st {
+    VALUE io;
+    binyo_outstream *out;
+} krypt_pem_writer;
+
+static ID sKrypt_ID_CLOSE;
+
+static void
+int_pem_writer_mark(krypt_pem_writer *writer)
+{
+    if (!writer) return;
+    rb_gc_mark(writer->io);
+    if (writer->out)
+	binyo_outstream_mark(writer->out);
+}
+
+static void
+int_pem_writer_free(krypt_pem_writer *writer)
+{
+    if (!writer) return;
+    if (writer->out)
+	binyo_outstream_free(writer->out);
+    xfree(writer);
+}
+
+#define int_pem_writer_get(obj, writer) 			\
+do { 								\
+    Data_Get_Struct((obj), krypt_pem_writer, (writer));  	\
+    if (!(writer) || !(writer)->out) { 				\
+	rb_raise(rb_eIOError, "closed stream");			\
+    } 								\
+} while (0)
+
+static VALUE
+krypt_pem_writer_alloc(VALUE klass)
+{
+    krypt_pem_writer *writer;
+
+    writer = ALLOC(krypt_pem_writer);
+    writer->io = Qnil;
+    writer->out = NULL;
+    return Data_Wrap_Struct(klass, int_pem_writer_mark, int_pem_writer_free, writer);
+}
+
+/*
+ *  call-seq:
+ *      Krypt::PEM::Writer.new(io, label) -> Writer
+ *
+ * Creates a Writer that writes a single PEM element labeled +label+ to
+ * +io+, which must respond to +write+. The header line is written with
+ * the first chunk of data, the footer line by Writer#finish or
+ * Writer#close. +label+ is checked as with Krypt::PEM.encode.
+ *
+ * === Example: Exporting a bundle of certificates
+ *
+ *   File.open("bundle.pem", "wb") do |f|
+ *     certs.each do |cert|
+ *       Krypt::PEM::Writer.new(f, "CERTIFICATE").write(cert).finish
+ *     end
+ *   end
+ */
+static VALUE
+krypt_pem_writer_initialize(VALUE self, VALUE io, VALUE label)
+{
+    krypt_pem_writer *writer;
+    binyo_outstream *inner;
+
+    Data_Get_Struct(self, krypt_pem_writer, writer);
+    StringValue(label);
+    int_pem_check_label(label);
+    if (!(inner = binyo_outstream_new_value(io)))
+	krypt_error_raise(eKryptPEMError, "Error while creating the stream");
+    if (writer->out)
+	binyo_outstream_free(writer->out);
+    writer->io = io;
+    writer->out = krypt_outstream_new_pem(inner, RSTRING_PTR(label), RSTRING_LEN(label));
+    return self;
+}
+
+/*
+ *  call-seq:
+ *      writer.write(data) -> self
+ *      writer << data -> self
+ *
+ * Appends +data+ to the body of the PEM element. +data+ may be anything
+ * that is accepted by Krypt::PEM.encode, consecutive calls are encoded as
+ * if their data had been concatenated.
+ */
+static VALUE
+krypt_pem_writer_write(VALUE self, VALUE data)
+{
+    krypt_pem_writer *writer;
+
+    int_pem_writer_get(self, writer);
+    if (int_pem_write_value(writer->out, data) == KRYPT_ERR)
+	krypt_error_raise(eKryptPEMError, "Error while writing PEM data");
+    return self;
+}
+
+static void
+int_pem_writer_finish(krypt_pem_writer *writer)
+{
+    int result;
+
+    result = krypt_outstream_pem_finish(writer->out);
+    binyo_outstream_free(writer->out);
+    writer->out = NULL;
+    if (result == KRYPT_ERR)
+	krypt_error_raise(eKryptPEMError, "Error while writing PEM data");
+}
+
+/*
+ *  call-seq:
+ *      writer.finish -> io
+ *
+ * Writes the remaining data and the footer line, leaving the underlying
+ * IO open so that further elements can be written to it. Returns the IO.
+ */
+static VALUE
+krypt_pem_writer_finish(VALUE self)
+{
+    krypt_pem_writer *writer;
+
+    int_pem_writer_get(self, writer);
+    int_pem_writer_finish(writer);
+    return writer->io;
+}
+
+/*
+ *  call-seq:
+ *      writer.close -> nil
+ *
+ * Like Writer#finish, but afterwards closes the underlying IO if it
+ * responds to +close+.
+ */
+static VALUE
+krypt_pem_writer_close(VALUE self)
+{
+    krypt_pem_writer *writer;
+
+    int_pem_writer_get(self, writer);
+    int_pem_writer_finish(writer);
+    if (rb_respond_to(writer->io, sKrypt_ID_CLOSE))
+	rb_funcall(writer->io, sKrypt_ID_CLOSE, 0);
+    return Qnil;
+}
+
 void
 Init_krypt_pem(void)
 {
@@ -157,9 +792,22 @@ Init_krypt_pem(void)
      *   File.open("data.der", "wb") do |f|
      *     f.print(Krypt::PEM.decode(pem))
      *   end
+     *
+     * === Converting from DER to PEM
+     *
+     *   der = File.binread("data.der")
+     *   File.write("data.pem", Krypt::PEM.encode(der, "CERTIFICATE"))
      */
     mKryptPEM = rb_define_module_under(mKrypt, "PEM");
     rb_define_module_function(mKryptPEM, "decode", krypt_pem_decode, 1);
+    rb_define_module_function(mKryptPEM, "each", krypt_pem_each, -1);
+    rb_define_module_function(mKryptPEM, "decode_bulk", krypt_pem_decode_bulk, -1);
+    rb_define_module_function(mKryptPEM, "encode", krypt_pem_encode, 2);
+
+    sKrypt_ID_ONLY = rb_intern("only");
+    sKrypt_ID_THREADS = rb_intern("threads");
+    sKrypt_ID_VALIDATE = rb_intern("validate");
+    sKrypt_ID_CLOSE = rb_intern("close");
 
     /* Document-class: Krypt::PEM::PEMError
      *
@@ -167,5 +815,17 @@ Init_krypt_pem(void)
      * from a stream with PEM data.
      */
     eKryptPEMError = rb_define_class_under(mKryptPEM, "PEMError", eKryptError);
+
+    /* Document-class: Krypt::PEM::Writer
+     *
+     * Streams a single PEM element to an IO, see Writer.new.
+     */
+    cKryptPEMWriter = rb_define_class_under(mKryptPEM, "Writer", rb_cObject);
+    rb_define_alloc_func(cKryptPEMWriter, krypt_pem_writer_alloc);
+    rb_define_method(cKryptPEMWriter, "initialize", krypt_pem_writer_initialize, 2);
+    rb_define_method(cKryptPEMWriter, "write", krypt_pem_writer_write, 1);
+    rb_define_method(cKryptPEMWriter, "<<", krypt_pem_writer_write, 1);
+    rb_define_method(cKryptPEMWriter, "finish", krypt_pem_writer_finish, 0);
+    rb_define_method(cKryptPEMWriter, "close", krypt_pem_writer_close, 0);
 }
 
@@ -0,0 +1,145 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+
+#if defined(KRYPT_NATIVE_THREADS)
+#include <pthread.h>
+#include <ruby/thread.h>
+#endif
+
+#if defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+
+/*
+ * Returns the number of threads to use if the caller did not ask for a
+ * specific number: one per online processor, at most KRYPT_THREADS_MAX.
+ */
+int
+krypt_thread_count_default(void)
+{
+#if defined(KRYPT_NATIVE_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) return 1;
+    if (n > KRYPT_THREADS_MAX) return KRYPT_THREADS_MAX;
+    return (int) n;
+#else
+    return 1;
+#endif
+}
+
+#if defined(KRYPT_NATIVE_THREADS)
+typedef struct krypt_parallel_st {
+    krypt_parallel_fn fn;
+    void *arg;
+    size_t n;
+    size_t next;
+    size_t batch;
+    int nthreads;
+    pthread_mutex_t lock;
+} krypt_parallel;
+
+/* Workers take batches of indices until all of them have been handed out */
+static void *
+int_parallel_worker(void *arg)
+{
+    krypt_parallel *job = (krypt_parallel *) arg;
+    size_t i, end;
+
+    while (1) {
+	pthread_mutex_lock(&job->lock);
+	i = job->next;
+	end = job->n - i < job->batch ? job->n : i + job->batch;
+	job->next = end;
+	pthread_mutex_unlock(&job->lock);
+
+	if (i == end) break;
+	for (; i < end; i++)
+	    job->fn(i, job->arg);
+    }
+    return NULL;
+}
+
+static void *
+int_parallel_run(void *arg)
+{
+    krypt_parallel *job = (krypt_parallel *) arg;
+    pthread_t threads[KRYPT_THREADS_MAX];
+    int i, started = 0;
+
+    /* the calling thread is worker number one */
+    for (i=1; i < job->nthreads; i++) {
+	if (pthread_create(&threads[started], NULL, int_parallel_worker, job) != 0)
+	    break;
+	started++;
+    }
+    int_parallel_worker(job);
+    for (i=0; i < started; i++)
+	pthread_join(threads[i], NULL);
+    return NULL;
+}
+#endif
+
+/*
+ * Calls +fn+ for every index in [0, n) on up to +nthreads+ native threads
+ * and returns once all calls have finished. The order of the calls is
+ * unspecified, so +fn+ should only write to state owned by its index.
+ */
+void
+krypt_parallel_for(size_t n, int nthreads, krypt_parallel_fn fn, void *arg)
+{
+#if defined(KRYPT_NATIVE_THREADS)
+    krypt_parallel job;
+
+    if (n == 0) return;
+    if (nthreads > KRYPT_THREADS_MAX)
+	nthreads = KRYPT_THREADS_MAX;
+    if (nthreads < 1 || (size_t) nthreads > n)
+	nthreads = nthreads < 1 ? 1 : (int) n;
+
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    job.next = 0;
+    job.nthreads = nthreads;
+    /* small batches balance the load, but each one costs a lock */
+    job.batch = n / ((size_t) nthreads * 16);
+    if (job.batch == 0)
+	job.batch = 1;
+    pthread_mutex_init(&job.lock, NULL);
+    rb_thread_call_without_gvl(int_parallel_run, &job, NULL, NULL);
+    pthread_mutex_destroy(&job.lock);
+#else
+    size_t i;
+
+    for (i=0; i < n; i++)
+	fn(i, arg);
+#endif
+}
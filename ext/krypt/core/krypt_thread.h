@@ -0,0 +1,49 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if !defined(_KRYPT_THREAD_H_)
+#define _KRYPT_THREAD_H_
+
+/*
+ * Native worker threads for CPU-bound batch jobs. The work runs with the
+ * GVL released, so the callbacks must neither call into Ruby nor use
+ * Ruby's allocator (ALLOC, xfree) or krypt_error_add. Without pthreads or
+ * rb_thread_call_without_gvl, the work is done sequentially.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define KRYPT_NATIVE_THREADS 1
+#endif
+
+#define KRYPT_THREADS_MAX	64
+
+typedef void (*krypt_parallel_fn)(size_t i, void *arg);
+
+int krypt_thread_count_default(void);
+void krypt_parallel_for(size_t n, int nthreads, krypt_parallel_fn fn, void *arg);
+
+#endif /* _KRYPT_THREAD_H_ */
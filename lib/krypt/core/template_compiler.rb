@@ -0,0 +1,247 @@
+=begin
+
+= Info
+
+krypt-core API - C implementation
+
+Copyright (C) 2011-2013
+Hiroshi Nakamura <nahi@ruby-lang.org>
+Martin Bosslet <martin.bosslet@gmail.com>
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+=end
+
+require 'fileutils'
+
+module Krypt::ASN1::Template
+
+  #
+  # Generates plans for SEQUENCE and SET Templates ahead of time. A plan is
+  # a C function that locates the elements belonging to each field of a
+  # Template in straight-line code, with tags and field order compiled in.
+  # The parser then no longer matches and reads the fields one by one, each
+  # field is only read when it is first accessed. The plans are written as
+  # the sources of a companion extension that registers them with
+  # krypt-core when loaded through Template.load_plans.
+  #
+  # Plans are generated from Template.plan_signature. Each plan is only
+  # used as long as its Template has the signature it was generated from,
+  # so a stale extension never changes how anything is parsed.
+  #
+  # No encoders are generated. A parsed Template that was not changed is
+  # encoded by copying its original encoding, and for everything else the
+  # encoder spends its time on the values, not on the schema.
+  #
+  # This is a build-time tool, it is not loaded by krypt itself:
+  #
+  #   require 'krypt/core/template_compiler'
+  #
+  class Compiler
+    PLAN_VERSION = '1'
+
+    Field = Struct.new(:name, :optional, :matcher)
+
+    attr_reader :name, :templates
+
+    #
+    # Plans are generated for +templates+ and for all Templates they
+    # refer to. +name+ is the name of the extension.
+    #
+    def initialize(name, *templates)
+      @name = name
+      @templates = []
+      templates.flatten.each { |t| collect(t) }
+    end
+
+    #
+    # Writes the C source and an extconf.rb for the extension to +dir+.
+    #
+    def write(dir)
+      FileUtils.mkdir_p(dir)
+      File.write(File.join(dir, "#{@name}.c"), generate)
+      File.write(File.join(dir, 'extconf.rb'), extconf)
+    end
+
+    def generate
+      plans = []
+      @templates.each do |t|
+        signature = t.plan_signature
+        plans << [t, signature] if signature
+      end
+
+      out = "/* Generated by Krypt::ASN1::Template::Compiler - do not edit. */\n\n"
+      out << "#include <ruby.h>\n\n"
+      out << "/* from krypt_asn1_template.h */\n"
+      out << "typedef long (*krypt_asn1_template_plan_fn)(const uint8_t *bytes, size_t len, long *fields, size_t *offsets);\n"
+      out << "int krypt_asn1_template_register_plan(VALUE klass, const char *signature, krypt_asn1_template_plan_fn plan);\n\n"
+      out << NEXT_ELEMENT
+      plans.each_with_index { |(t, signature), i| out << plan(i, t, signature) }
+      out << "void\nInit_#{@name}(void)\n{\n"
+      plans.each_with_index do |(t, signature), i|
+        out << "    if (krypt_asn1_template_register_plan(rb_path2class(\"#{t.name}\"), #{c_string(signature)}, int_plan_#{i}) < 0)\n"
+        out << "\trb_warn(\"#{t.name} has changed, it is parsed without a plan\");\n"
+      end
+      out << "}\n"
+    end
+
+    private
+
+    def collect(template)
+      return if @templates.include?(template)
+      unless template.is_a?(Class) && template.include?(Krypt::ASN1::Template)
+        raise ArgumentError, "#{template.inspect} is not a Template"
+      end
+      raise ArgumentError, "Plans need named Templates" unless template.name
+      @templates << template
+      collect_types(template.instance_variable_get(:@definition))
+    end
+
+    def collect_types(definition)
+      (definition[:layout] || []).each do |field|
+        type = field[:type]
+        collect(type) if type.is_a?(Class) && type.include?(Krypt::ASN1::Template)
+        collect_types(field) if field[:layout]
+      end
+    end
+
+    def parse_signature(signature)
+      version, *entries = signature.split(';')
+      raise ArgumentError, "Unsupported plan version #{version}" unless version == PLAN_VERSION
+      entries.map do |entry|
+        name, optional, matcher = entry.split(',', 3)
+        Field.new(name, optional == 'o', matcher)
+      end
+    end
+
+    NEXT_ELEMENT = <<-EOS
+/*
+ * Moves +off+ past the next element, which starts at +start+, and returns
+ * 1, or 0 at the end of the contents. Returns -1 for anything the generic parser must handle:
+ * multi-byte tags, indefinite lengths and values that are cut short.
+ */
+static int
+int_next(const uint8_t *p, size_t len, size_t *off, size_t *start, size_t *content, uint8_t *id)
+{
+    size_t i = *off, l, n;
+
+    if (i == len) return 0;
+    *start = i;
+    *id = p[i++];
+    if ((*id & 0x1f) == 0x1f || i == len) return -1;
+    l = p[i++];
+    if (l & 0x80) {
+\tn = l & 0x7f;
+\tif (n == 0 || n > sizeof(size_t) || n > len - i) return -1;
+\tfor (l = 0; n > 0; --n)
+\t    l = (l << 8) | p[i++];
+    }
+    if (l > len - i) return -1;
+    *content = i;
+    *off = i + l;
+    return 1;
+}
+
+    EOS
+
+    def plan(index, template, signature)
+      out = "/* #{template.name} */\n"
+      out << "static long\nint_plan_#{index}(const uint8_t *p, size_t len, long *fields, size_t *offsets)\n{\n"
+      out << "    size_t next = 0, start = 0, content = 0;\n"
+      out << "    long n = 0;\n"
+      out << "    uint8_t id = 0;\n"
+      out << "    int more;\n\n"
+      out << "    /* empty contents are left to the generic parser */\n"
+      out << "    if ((more = int_next(p, len, &next, &start, &content, &id)) <= 0) return -1;\n"
+      parse_signature(signature).each_with_index do |field, i|
+        out << "\n    /* #{field.name} */\n"
+        case field.matcher
+        when 'x'
+          if field.optional
+            out << "    if (more) return -1;\n"
+            next
+          end
+          out << "    return -1;\n}\n\n"
+          return out
+        when 'a'
+          if field.optional
+            out << "    if (more) {\n" << assign(i, "\t") << "    }\n"
+          else
+            out << "    if (!more) return -1;\n" << assign(i, '    ')
+          end
+        else
+          cond = condition(field.matcher)
+          if field.optional
+            out << "    if (more && #{cond}) {\n" << assign(i, "\t") << "    }\n"
+          else
+            out << "    if (!more || !#{cond}) return -1;\n" << assign(i, '    ')
+          end
+        end
+      end
+      out << "\n    if (more) return -1;\n"
+      out << "    return n;\n}\n\n"
+    end
+
+    def assign(i, indent)
+      "#{indent}offsets[n] = start;\n" \
+      "#{indent}fields[n++] = #{i};\n" \
+      "#{indent}if ((more = int_next(p, len, &next, &start, &content, &id)) < 0) return -1;\n"
+    end
+
+    # explicitly tagged CHOICEs also check the tag of the inner element
+    def condition(matcher)
+      outer, inner = matcher.split('>', 2)
+      return alternatives(outer, 'id') unless inner
+      "(#{alternatives(outer, 'id')} && content < next && #{alternatives(inner, 'p[content]')})"
+    end
+
+    def alternatives(ids, var)
+      conds = ids.split('|').map { |id| id_condition(id, var) }
+      "(#{conds.join(' || ')})"
+    end
+
+    # 'p' ignores the constructed bit, 'c' requires it to be set
+    def id_condition(id, var)
+      octet = id[1..-1].to_i(16)
+      case id[0]
+      when 'p' then format('(%s & 0xdf) == 0x%02x', var, octet)
+      when 'c' then format('%s == 0x%02x', var, octet | 0x20)
+      else raise ArgumentError, "Unknown matcher #{id}"
+      end
+    end
+
+    def c_string(str)
+      '"' + str.gsub(/["\\]/) { |c| "\\#{c}" } + '"'
+    end
+
+    def extconf
+      <<-EOS
+# Generated by Krypt::ASN1::Template::Compiler - do not edit.
+require 'mkmf'
+
+# krypt_asn1_template_register_plan is resolved from kryptcore at load time
+$LDFLAGS << ' -Wl,-undefined,dynamic_lookup' if RUBY_PLATFORM =~ /darwin/
+
+create_makefile('#{@name}')
+      EOS
+    end
+  end
+
+end